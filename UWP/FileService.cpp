@@ -467,6 +467,7 @@ static task<int> GetFileStatus(StorageFile ^file,
 			       FileRequestParams *params,
 			       FileStatus *status)
 {
+	status->volume = 0;
 	status->ctime = (file->DateCreated.UniversalTime - TIME_SHIFT) / 10000000;
 	auto t = create_task(file->GetBasicPropertiesAsync())
 		.then([status](FileProperties::BasicProperties ^props) {
@@ -501,6 +502,7 @@ static task<int> GetFolderStatus(StorageFolder ^folder,
 				 FileStatus *status)
 {
 	status->type = FILE_TYPE_DIRECTORY;
+	status->volume = 0;
 	status->ctime = folder->DateCreated.UniversalTime + TIME_SHIFT;
 	auto t = create_task(folder->GetBasicPropertiesAsync())
 		.then([status](FileProperties::BasicProperties ^props) {
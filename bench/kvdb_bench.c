@@ -0,0 +1,382 @@
+﻿/* ***************************************************************************
+ * kvdb_bench.c -- benchmark for the key-value database backends
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * kvdb_bench.c -- 键值数据库后端的性能测试
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#include "build.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvdb.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(LCFINDER_USE_MMAPDB)
+#define KVDB_BACKEND_NAME "mmapdb"
+#elif defined(LCFINDER_USE_LEVELDB)
+#define KVDB_BACKEND_NAME "leveldb"
+#else
+#define KVDB_BACKEND_NAME "unqlite"
+#endif
+
+#define DEFAULT_DB_PATH		"kvdb-bench.db"
+#define DEFAULT_FILE_COUNT	20000
+#define DEFAULT_THUMB_COUNT	500
+#define DEFAULT_READ_COUNT	2000
+#define THUMB_MIN_SIZE		(20 * 1024)
+#define THUMB_MAX_SIZE		(200 * 1024)
+#define KEY_MAX_LEN		256
+
+typedef struct BenchOptionsRec_ {
+	const char *path;
+	size_t files;
+	size_t thumbs;
+	size_t reads;
+	int keep;
+} BenchOptionsRec, *BenchOptions;
+
+/** 一项测试的结果，记录每次操作的耗时 */
+typedef struct BenchResultRec_ {
+	const char *name;
+	size_t count;
+	size_t bytes;
+	int64_t total_time;
+	int64_t *times;
+} BenchResultRec, *BenchResult;
+
+static uint32_t bench_seed = 0x9e3779b9;
+
+static uint32_t Bench_Random(void)
+{
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 17;
+	bench_seed ^= bench_seed << 5;
+	return bench_seed;
+}
+
+/** 获取当前时间，单位为纳秒 */
+static int64_t Bench_GetTime(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (int64_t)(count.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static int BenchResult_Init(BenchResult r, const char *name, size_t count)
+{
+	r->name = name;
+	r->count = 0;
+	r->bytes = 0;
+	r->total_time = 0;
+	r->times = malloc(sizeof(int64_t) * (count > 0 ? count : 1));
+	return r->times ? 0 : -1;
+}
+
+static void BenchResult_Add(BenchResult r, int64_t start, size_t bytes)
+{
+	int64_t t = Bench_GetTime() - start;
+
+	r->times[r->count++] = t;
+	r->total_time += t;
+	r->bytes += bytes;
+}
+
+static int CompareTime(const void *a, const void *b)
+{
+	int64_t t1 = *(const int64_t*)a;
+	int64_t t2 = *(const int64_t*)b;
+
+	return t1 < t2 ? -1 : (t1 > t2 ? 1 : 0);
+}
+
+static double BenchResult_GetPercentile(BenchResult r, double p)
+{
+	size_t i;
+
+	if (r->count < 1) {
+		return 0;
+	}
+	i = (size_t)(p * (r->count - 1) + 0.5);
+	return r->times[i] / 1000.0;
+}
+
+static void BenchResult_Print(BenchResult r)
+{
+	double seconds = r->total_time / 1000000000.0;
+	double ops = seconds > 0 ? r->count / seconds : 0;
+	double mbps = seconds > 0 ? r->bytes / seconds / 1048576.0 : 0;
+
+	qsort(r->times, r->count, sizeof(int64_t), CompareTime);
+	printf("%-16s %8lu %12.0f %10.1f %10.1f %10.1f\n", r->name,
+	       (unsigned long)r->count, ops, BenchResult_GetPercentile(r, 0.5),
+	       BenchResult_GetPercentile(r, 0.99), mbps);
+	free(r->times);
+	r->times = NULL;
+}
+
+static size_t GetFileKey(char *key, size_t i)
+{
+	return (size_t)snprintf(key, KEY_MAX_LEN,
+				"/home/user/Pictures/%03lu/IMG_%06lu.jpg",
+				(unsigned long)(i / 200), (unsigned long)i);
+}
+
+static size_t GetThumbKey(char *key, size_t i)
+{
+	return (size_t)snprintf(key, KEY_MAX_LEN, "%lu:%03lu/IMG_%06lu.jpg",
+				(unsigned long)(i % 8), (unsigned long)(i / 200),
+				(unsigned long)i);
+}
+
+/** 文件列表缓存：大量小键值，值为文件的创建时间和修改时间 */
+static void Bench_WriteFiles(kvdb_t *db, BenchOptions opts)
+{
+	size_t i, keylen;
+	uint32_t times[2];
+	int64_t start;
+	char key[KEY_MAX_LEN];
+	BenchResultRec r;
+
+	if (BenchResult_Init(&r, "fileset-write", opts->files) != 0) {
+		return;
+	}
+	for (i = 0; i < opts->files; ++i) {
+		keylen = GetFileKey(key, i);
+		times[0] = Bench_Random();
+		times[1] = times[0] + i;
+		start = Bench_GetTime();
+		kvdb_put(db, key, keylen, times, sizeof(times));
+		BenchResult_Add(&r, start, keylen + sizeof(times));
+	}
+	BenchResult_Print(&r);
+}
+
+/** 缩略图：值的大小在 20KB 到 200KB 之间 */
+static void Bench_WriteThumbs(kvdb_t *db, BenchOptions opts)
+{
+	size_t i, keylen, size;
+	int64_t start;
+	char key[KEY_MAX_LEN];
+	unsigned char *value;
+	BenchResultRec r;
+
+	value = malloc(THUMB_MAX_SIZE);
+	if (!value || BenchResult_Init(&r, "thumb-write",
+				       opts->thumbs) != 0) {
+		free(value);
+		return;
+	}
+	for (i = 0; i < THUMB_MAX_SIZE; ++i) {
+		value[i] = (unsigned char)Bench_Random();
+	}
+	for (i = 0; i < opts->thumbs; ++i) {
+		keylen = GetThumbKey(key, i);
+		size = THUMB_MIN_SIZE +
+		       Bench_Random() % (THUMB_MAX_SIZE - THUMB_MIN_SIZE);
+		start = Bench_GetTime();
+		kvdb_put(db, key, keylen, value, size);
+		BenchResult_Add(&r, start, keylen + size);
+	}
+	kvdb_sync(db);
+	BenchResult_Print(&r);
+	free(value);
+}
+
+/** 随机读取缩略图，分别测试复制值和直接访问视图两种方式 */
+static void Bench_ReadThumbs(kvdb_t *db, BenchOptions opts)
+{
+	size_t i, keylen, vallen;
+	int64_t start;
+	void *value;
+	const void *view;
+	kvdb_txn_t *txn;
+	char key[KEY_MAX_LEN];
+	BenchResultRec r;
+
+	if (opts->thumbs < 1) {
+		return;
+	}
+	if (BenchResult_Init(&r, "thumb-read", opts->reads) != 0) {
+		return;
+	}
+	for (i = 0; i < opts->reads; ++i) {
+		keylen = GetThumbKey(key, Bench_Random() % opts->thumbs);
+		start = Bench_GetTime();
+		value = kvdb_get(db, key, keylen, &vallen);
+		BenchResult_Add(&r, start, value ? vallen : 0);
+		free(value);
+	}
+	BenchResult_Print(&r);
+	if (BenchResult_Init(&r, "thumb-read-view", opts->reads) != 0) {
+		return;
+	}
+	for (i = 0; i < opts->reads; ++i) {
+		keylen = GetThumbKey(key, Bench_Random() % opts->thumbs);
+		start = Bench_GetTime();
+		txn = kvdb_txn_begin(db);
+		view = kvdb_get_view(txn, key, keylen, &vallen);
+		kvdb_txn_end(txn);
+		BenchResult_Add(&r, start, view ? vallen : 0);
+	}
+	BenchResult_Print(&r);
+}
+
+/** 遍历全部记录，每个记录的耗时为移动游标并读取键值的时间 */
+static void Bench_Iterate(kvdb_t *db, BenchOptions opts)
+{
+	int ret;
+	size_t keylen, vallen;
+	int64_t start;
+	kvdb_cursor_t *cur;
+	BenchResultRec r;
+
+	if (BenchResult_Init(&r, "iterate", opts->files + opts->thumbs) != 0) {
+		return;
+	}
+	cur = kvdb_cursor_open(db);
+	if (!cur) {
+		free(r.times);
+		return;
+	}
+	start = Bench_GetTime();
+	ret = kvdb_cursor_seek(cur, NULL, 0);
+	while (ret == 0 && r.count < opts->files + opts->thumbs) {
+		kvdb_cursor_key(cur, &keylen);
+		kvdb_cursor_value(cur, &vallen);
+		BenchResult_Add(&r, start, keylen + vallen);
+		start = Bench_GetTime();
+		ret = kvdb_cursor_next(cur);
+	}
+	kvdb_cursor_close(cur);
+	BenchResult_Print(&r);
+}
+
+static void PrintUsage(void)
+{
+	printf("usage: kvdb-bench [options]\n"
+	       "  -p <path>   database path (default: %s)\n"
+	       "  -f <count>  number of fileset entries (default: %d)\n"
+	       "  -t <count>  number of thumbnails (default: %d)\n"
+	       "  -r <count>  number of random reads (default: %d)\n"
+	       "  -k          keep the database after the benchmark\n",
+	       DEFAULT_DB_PATH, DEFAULT_FILE_COUNT, DEFAULT_THUMB_COUNT,
+	       DEFAULT_READ_COUNT);
+}
+
+static int ParseOptions(BenchOptions opts, int argc, char **argv)
+{
+	int i;
+
+	opts->path = DEFAULT_DB_PATH;
+	opts->files = DEFAULT_FILE_COUNT;
+	opts->thumbs = DEFAULT_THUMB_COUNT;
+	opts->reads = DEFAULT_READ_COUNT;
+	opts->keep = 0;
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-k") == 0) {
+			opts->keep = 1;
+			continue;
+		}
+		if (i + 1 >= argc || argv[i][0] != '-') {
+			return -1;
+		}
+		switch (argv[i][1]) {
+		case 'p':
+			opts->path = argv[++i];
+			break;
+		case 'f':
+			opts->files = strtoul(argv[++i], NULL, 10);
+			break;
+		case 't':
+			opts->thumbs = strtoul(argv[++i], NULL, 10);
+			break;
+		case 'r':
+			opts->reads = strtoul(argv[++i], NULL, 10);
+			break;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	kvdb_t *db;
+	int64_t size;
+	BenchOptionsRec opts;
+
+	if (ParseOptions(&opts, argc, argv) != 0) {
+		PrintUsage();
+		return 1;
+	}
+	kvdb_destroy_db(opts.path);
+	db = kvdb_open(opts.path);
+	if (!db) {
+		fprintf(stderr, "cannot open database: %s\n", opts.path);
+		return 1;
+	}
+	/* 与缩略图数据库的设置保持一致 */
+	kvdb_set_durability(db, KVDB_DURABILITY_GROUP);
+	printf("backend: %s\n\n", KVDB_BACKEND_NAME);
+	printf("%-16s %8s %12s %10s %10s %10s\n", "workload", "ops",
+	       "ops/sec", "p50(us)", "p99(us)", "MB/s");
+	Bench_WriteFiles(db, &opts);
+	Bench_WriteThumbs(db, &opts);
+	Bench_ReadThumbs(db, &opts);
+	Bench_Iterate(db, &opts);
+	kvdb_close(db);
+	if (kvdb_get_db_size(opts.path, &size) == 0) {
+		printf("\ndisk size: %.2f MB\n", size / 1048576.0);
+	}
+	if (!opts.keep) {
+		kvdb_destroy_db(opts.path);
+	}
+	return 0;
+}
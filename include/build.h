@@ -53,12 +53,8 @@
 #define LCFINDER_VER_REVISION	1
 #define LCFINDER_VER_TYPE	VERSION_BETA
 
-#define LCFINDER_USE_UNQLITE
-
 #ifdef _WIN32
 #	define PLATFORM_WIN32
-#	undef LCFINDER_USE_UNQLITE
-#	define LCFINDER_USE_LEVELDB
 // 如果需要编译成 Windows XP 系统上能跑的版本的话
 //#define PLATFORM_WIN32_DESKTOP_XP
 #	if (WINAPI_PARTITION_PC_APP == 1)
@@ -70,6 +66,31 @@
 #	define PLATFORM_LINUX
 #endif
 
+// 如果需要使用基于内存映射的数据库来存储缩略图的话
+//#define LCFINDER_USE_MMAPDB
+
+// 未通过编译参数指定数据库引擎时，Windows 上用 LevelDB，其它平台用 UnQLite
+#if !defined(LCFINDER_USE_UNQLITE) && !defined(LCFINDER_USE_LEVELDB) && \
+    !defined(LCFINDER_USE_MMAPDB)
+#	ifdef _WIN32
+#		define LCFINDER_USE_LEVELDB
+#	else
+#		define LCFINDER_USE_UNQLITE
+#	endif
+#endif
+
+// 使用 libjpeg 直接解码 JPEG 缩略图，以便在解码时缩小图像
+// LCUI 在 Linux 上本身就依赖 libjpeg，Windows 上需自行链接 jpeg.lib 后再启用
+#if defined(PLATFORM_LINUX) && !defined(LCFINDER_USE_LIBJPEG)
+#	define LCFINDER_USE_LIBJPEG
+#endif
+
+// 使用 libpng 逐行解码 PNG 缩略图，以便在解码时缩小图像
+// LCUI 在 Linux 上本身就依赖 libpng，Windows 上需自行链接 libpng.lib 后再启用
+#if defined(PLATFORM_LINUX) && !defined(LCFINDER_USE_LIBPNG)
+#	define LCFINDER_USE_LIBPNG
+#endif
+
 enum VersionType {
 	VERSION_RELEASE,
 	VERSION_RC,
@@ -0,0 +1,81 @@
+﻿/* ***************************************************************************
+ * exif.h -- EXIF information reader for JPEG files.
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * exif.h -- JPEG 文件的 EXIF 信息读取
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#ifndef LCFINDER_EXIF_H
+#define LCFINDER_EXIF_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <LCUI_Build.h>
+#include <LCUI/types.h>
+
+/** JPEG 文件的 EXIF 信息 */
+typedef struct ExifInfoRec_ {
+	unsigned width;			/**< 图像的宽度，取自 SOF 段 */
+	unsigned height;		/**< 图像的高度 */
+	int orientation;		/**< 方向，取值为 1 ~ 8，没有记录时为 1 */
+	unsigned char *thumb;		/**< 内嵌缩略图的 JPEG 数据，没有时为 NULL */
+	size_t thumb_size;		/**< 内嵌缩略图的数据大小 */
+	unsigned thumb_width;		/**< 内嵌缩略图的宽度 */
+	unsigned thumb_height;		/**< 内嵌缩略图的高度 */
+} ExifInfoRec, *ExifInfo;
+
+/**
+ * 从文件的当前位置读取 JPEG 文件的 EXIF 信息
+ * 只读取图像数据之前的几个段，不会解码图像
+ * @returns 不是 JPEG 文件或文件头已损坏时返回 -1
+ */
+int Exif_Read(FILE *fp, ExifInfo info);
+
+/**
+ * 从文件的当前位置读取 JPEG 文件的尺寸和方向，不读取内嵌的缩略图
+ * 每个 APP1 段最多只读取前 4KB，其余的段直接跳过
+ */
+int Exif_ReadHeader(FILE *fp, ExifInfo info);
+
+void Exif_Destroy(ExifInfo info);
+
+/** 方向是否为旋转了 90 度的，这时显示的宽高与存储的宽高相反 */
+#define Exif_IsTransposed(ORIENTATION) ((ORIENTATION) >= 5)
+
+/** 按照 EXIF 方向旋转或翻转图像，使它以正确的方向显示 */
+int Exif_ApplyOrientation(LCUI_Graph *graph, int orientation);
+
+/** 解码内嵌的缩略图，并按照 EXIF 方向调整 */
+int Exif_ReadThumbnail(ExifInfo info, LCUI_Graph *out);
+
+#endif
@@ -47,12 +47,14 @@ typedef enum {
 } SyncTaskState;
 
 typedef struct FileCacheInfoRec_ {
-	wchar_t *path;		/**< 文件路径 */
+	char *path;		/**< 文件路径，UTF-8 编码 */
 	unsigned int ctime;	/**< 创建时间 */
 	unsigned int mtime;	/**< 修改时间 */
+	unsigned int width;	/**< 图片宽度，扫描时未读取到尺寸则为 0 */
+	unsigned int height;	/**< 图片高度 */
 } FileCacheInfoRec, *FileCacheInfo;
 
- /** 文件状态信息 */
+/** 文件状态信息，旧版本的 kvdb 格式的缓存以它作为值 */
 typedef struct FileCacheTimeRec_ {
 	unsigned int ctime;	/**< 创建时间 */
 	unsigned int mtime;	/**< 修改时间 */
@@ -69,6 +71,7 @@ typedef struct SyncTaskRec_ {
 	unsigned long int added_files;		/**< 当前缓存的新增的文件数量 */
 	unsigned long int changed_files;	/**< 当前缓存的已修改的文件数量 */
 	unsigned long int deleted_files;	/**< 当前缓存的删除的文件数量 */
+	int offline;				/**< 源文件夹所在的卷是否不可用 */
 } SyncTaskRec, *SyncTask;
 
 typedef void(*FileInfoHanlder)(void*, const FileCacheInfo);
@@ -78,15 +81,45 @@ SyncTask SyncTask_New(const char *data_dir, const char *scan_dir);
 /** 新建同步任务 */
 SyncTask SyncTask_NewW(const wchar_t *data_dir, const wchar_t *scan_dir);
 
-/** 添加文件至缓存 */
-int SyncTask_AddFileW(SyncTask t, const wchar_t *path,
-		      unsigned int ctime, unsigned int mtime);
+/**
+ * 添加文件至缓存，文件路径为 UTF-8 编码
+ * @returns 文件是新增的或有改动时返回 1，未改动时返回 0，出错时返回 -1
+ */
+int SyncTask_AddFile(SyncTask t, const char *path,
+		     unsigned int ctime, unsigned int mtime);
 
-/** 打开缓存 */
+/** 记录扫描时读取到的图片尺寸，在遍历新增和有改动的文件时提供 */
+void SyncTask_SetImageSize(SyncTask t, const char *path,
+			   unsigned int width, unsigned int height);
+
+/** 以可写的方式打开缓存，path 为 NULL 时打开默认的缓存 */
 int SyncTask_OpenCacheW(SyncTask t, const wchar_t *path);
 
-/** 从缓存中删除一个文件记录 */
-int SyncTask_DeleteFileW(SyncTask t, const wchar_t *filepath);
+/**
+ * 标记目录已完成扫描，它的文件和子目录均已添加至缓存
+ * 已完成扫描的目录会被记录到检查点中，同步中断后可从检查点恢复
+ */
+void SyncTask_SetDirSynced(SyncTask t, const char *dirpath);
+
+/** 判断目录是否已在上次被中断的同步中完成扫描 */
+int SyncTask_IsDirSynced(SyncTask t, const char *dirpath);
+
+/**
+ * 设置源文件夹所在卷的标识号
+ * 如果与上次同步时的不一致，且本次没有扫描到任何文件，则说明源文件夹所在的
+ * 卷已被卸载，结束同步时会将任务标记为离线。
+ * @param[in] volume 卷的标识号，为 0 时表示未知
+ */
+void SyncTask_SetVolume(SyncTask t, unsigned long volume);
+
+/**
+ * 将任务标记为离线
+ * 离线的任务会丢弃本次扫描的结果，不产生任何变更，缓存也保持不变。
+ */
+void SyncTask_SetOffline(SyncTask t);
+
+/** 从缓存中删除一个文件记录，文件路径为 UTF-8 编码 */
+int SyncTask_DeleteFile(SyncTask t, const char *filepath);
 
 /** 清除缓存 */
 void SyncTask_ClearCache(SyncTask t);
@@ -106,10 +139,10 @@ int SyncTask_InChangedFiles(SyncTask t, FileInfoHanlder func, void *func_data);
 /** 遍历每个已删除的文件 */
 int SyncTask_InDeletedFiles(SyncTask t, FileInfoHanlder func, void *func_data);
 
-/** 开始同步文件列表 */
+/** 开始同步文件列表，如果存在上次中断时保存的检查点则从检查点恢复 */
 int SyncTask_Start(SyncTask t);
 
-/** 结束同步文件列表 */
+/** 结束同步文件列表，并统计各类变更的文件数量 */
 void SyncTask_Finish(SyncTask t);
 
 /** 提交变更后文件列表至缓存数据库中 */
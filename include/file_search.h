@@ -108,13 +108,18 @@ int DB_GetDirs( DB_Dir **outlist );
 /** 添加一个标签 */
 DB_Tag DB_AddTag( const char *tagname );
 
-/** 添加一个文件记录 */
-void DB_AddFile( DB_Dir dir, const char *filepath, int ctime, int mtime );
+/** 添加一个文件记录，尺寸未知时为 0 */
+void DB_AddFile( DB_Dir dir, const char *filepath, int width, int height,
+		 int ctime, int mtime );
 
 /** 修改文件的时间信息 */
 void DB_UpdateFileTime( DB_Dir dir, const char *filepath,
 			int ctime, int mtime );
 
+/** 修改文件的尺寸 */
+void DB_UpdateFileSize( DB_Dir dir, const char *filepath,
+			int width, int height );
+
 /** 删除一个文件记录 */
 void DB_DeleteFile( const char *filepath );
 
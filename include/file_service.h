@@ -84,6 +84,7 @@ typedef struct FileStatus_ {
 	size_t size;
 	time_t ctime;
 	time_t mtime;
+	unsigned long volume;	/**< 所在卷的标识号，未知时为 0 */
 	FileImageStatus *image;
 } FileStatus;
 
@@ -0,0 +1,151 @@
+﻿/* ***************************************************************************
+ * file_snapshot.h -- sorted file list snapshot, used for file list changes detection.
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * file_snapshot.h -- 有序的文件列表快照，用于检测文件列表的变更。
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#ifndef LCFINDER_FILE_SNAPSHOT_H
+#define LCFINDER_FILE_SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <LCUI_Build.h>
+#include <LCUI/types.h>
+
+/** 快照格式的版本，版本 2 起文件列表快照的键为 UTF-8 编码的路径 */
+#define FILE_SNAPSHOT_VERSION	2
+
+/** 文件记录的标志 */
+enum FileSnapshotEntryFlag {
+	FILE_SNAPSHOT_DELETED = 1	/**< 已被删除 */
+};
+
+/** 文件变更类型 */
+typedef enum FileSnapshotDiffType_ {
+	FILE_SNAPSHOT_ADDED,
+	FILE_SNAPSHOT_CHANGED,
+	FILE_SNAPSHOT_REMOVED
+} FileSnapshotDiffType;
+
+/** 快照中的文件记录，键的内容紧随其后 */
+typedef struct FileSnapshotEntryRec_ {
+	uint32_t ctime;		/**< 创建时间 */
+	uint32_t mtime;		/**< 修改时间 */
+	uint32_t flags;		/**< 标志 */
+	uint32_t keylen;	/**< 键的长度 */
+} FileSnapshotEntryRec, *FileSnapshotEntry;
+
+#define FileSnapshotEntry_GetKey(E) \
+	((const char*)(E) + sizeof(FileSnapshotEntryRec))
+
+#ifdef LCFINDER_FILE_SNAPSHOT_C
+typedef struct FileSnapshotRec_* FileSnapshot;
+typedef struct FileSnapshotWriterRec_* FileSnapshotWriter;
+#else
+typedef void* FileSnapshot;
+typedef void* FileSnapshotWriter;
+#endif
+
+typedef void(*FileSnapshotDiffHandler)(void*, FileSnapshotDiffType,
+				       const FileSnapshotEntryRec*);
+
+/** 比较两个键，返回值的含义与 memcmp() 相同 */
+int FileSnapshot_CompareKey(const char *key1, size_t len1,
+			    const char *key2, size_t len2);
+
+/**
+ * 以内存映射的方式打开快照文件
+ * @param[in] writable 是否允许修改记录的标志
+ * @returns 文件不存在或格式无效时返回 NULL
+ */
+FileSnapshot FileSnapshot_Open(const char *path, LCUI_BOOL writable);
+
+void FileSnapshot_Close(FileSnapshot s);
+
+/** 检测文件是否为快照文件 */
+LCUI_BOOL FileSnapshot_Check(const char *path);
+
+/** 获取快照格式的版本 */
+unsigned int FileSnapshot_GetVersion(FileSnapshot s);
+
+/** 获取记录总数，包括已标记为删除的记录 */
+size_t FileSnapshot_GetCount(FileSnapshot s);
+
+/** 获取第 i 个记录，记录按键的升序排列 */
+const FileSnapshotEntryRec *FileSnapshot_GetEntry(FileSnapshot s, size_t i);
+
+/** 查找记录，找到则返回它的下标，否则返回 -1 */
+long FileSnapshot_Find(FileSnapshot s, const char *key, size_t keylen);
+
+/** 将记录标记为已删除，快照需以可写方式打开 */
+int FileSnapshot_Delete(FileSnapshot s, const char *key, size_t keylen);
+
+/**
+ * 对比两个快照，按键的顺序将每个差异交给 handler 处理
+ * @param[in] base 旧的快照，为 NULL 时视所有记录为新增的
+ * @param[in] snapshot 新的快照，为 NULL 时视所有记录为已删除的
+ * @returns 差异的数量
+ */
+size_t FileSnapshot_Diff(FileSnapshot base, FileSnapshot snapshot,
+			 FileSnapshotDiffHandler handler, void *data);
+
+/** 新建快照写入器，写入完成后快照将保存至 path */
+FileSnapshotWriter FileSnapshotWriter_Create(const char *path);
+
+/**
+ * 从之前保存的检查点恢复写入器
+ * @param[in] runs_size 检查点记录的有序段大小，之后写入的内容将被丢弃
+ */
+FileSnapshotWriter FileSnapshotWriter_Resume(const char *path,
+					     uint64_t runs_size);
+
+/**
+ * 将已添加的记录写入磁盘，以便在中断后恢复
+ * @param[out] runs_size 已写入磁盘的有序段大小
+ */
+int FileSnapshotWriter_Flush(FileSnapshotWriter w, uint64_t *runs_size);
+
+/** 删除写入器为 path 遗留的临时文件 */
+void FileSnapshotWriter_Discard(const char *path);
+
+/** 添加记录，记录无需有序。同一个键被多次添加时保留最后一次的记录 */
+int FileSnapshotWriter_Add(FileSnapshotWriter w, const char *key,
+			   size_t keylen, uint32_t ctime, uint32_t mtime);
+
+/** 排序并合并已添加的记录，生成快照文件 */
+int FileSnapshotWriter_Finish(FileSnapshotWriter w);
+
+/** 销毁写入器，若未完成写入且未保存过检查点则删除临时文件 */
+void FileSnapshotWriter_Destroy(FileSnapshotWriter w);
+
+#endif
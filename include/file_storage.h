@@ -68,6 +68,11 @@ int FileStorage_GetImage( int conn_id, const wchar_t *filename,
 			  HandlerOnGetProgress progress,
 			  void *data );
 
+/**
+ * 获取缩略图
+ * 失败时 callback 的缩略图参数为 NULL，若文件存在但无法解码，则文件状态参数
+ * 不为 NULL
+ */
 int FileStorage_GetThumbnail( int conn_id, const wchar_t *filename,
 			      int width, int height,
 			      HandlerOnGetThumbnail callback, void *data );
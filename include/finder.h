@@ -80,6 +80,8 @@ typedef struct FinderConfigRec_ {
 	int files_sort;			/**< 文件的排序方式 */
 	char encrypted_password[48];	/**< 加密后的密码 */
 	int scaling;			/**< 界面的缩放比例，100 ~ 200 */
+	int thumb_db_max_size;		/**< 缩略图缓存的空间上限，单位为 MB，0 表示不限制 */
+	int thumb_pregen;		/**< 是否在同步后为新图片预先生成缩略图 */
 } FinderConfigRec, *FinderConfig;
 
 typedef struct FinderLicenseRec_ {
@@ -104,9 +106,9 @@ typedef struct Finder_ {
 	wchar_t *data_dir;		/**< 数据文件夹 */
 	wchar_t *fileset_dir;		/**< 文件列表缓存所在文件夹 */
 	wchar_t *thumbs_dir;		/**< 缩略图数据库所在文件夹 */
-	wchar_t **thumb_paths;		/**< 缩略图数据库路径列表 */
 	ThumbCache thumb_cache;		/**< 缩略图数据缓存 */
-	Dict *thumb_dbs;		/**< 缩略图数据库记录，以源文件夹路径作为索引 */
+	ThumbDB thumb_db;		/**< 缩略图数据库，所有源文件夹共用 */
+	Dict *offline_dirs;		/**< 所在卷不可用的源文件夹，以路径作为索引 */
 	LCUI_EventTrigger trigger;	/**< 事件触发器 */
 	FinderConfigRec config;		/**< 当前配置 */
 	FinderLicenseRec license;	/**< 当前许可证状态信息 */
@@ -119,6 +121,28 @@ typedef struct Finder_ {
 
 typedef void( *LCFinder_EventHandler )(void*, void*);
 
+/** 文件同步的各个阶段 */
+enum FileSyncPhase {
+	SYNC_PHASE_LIST,	/**< 列出目录内容 */
+	SYNC_PHASE_STAT,	/**< 获取文件状态 */
+	SYNC_PHASE_DIFF,	/**< 合并并对比文件列表 */
+	SYNC_PHASE_DB,		/**< 将变更提交至文件数据库 */
+	SYNC_PHASE_CACHE,	/**< 提交文件列表缓存 */
+	SYNC_PHASE_TOTAL
+};
+
+/**
+ * 文件同步阶段的统计数据
+ * 列出目录和获取文件状态是并发进行的，它们的耗时是从开始至今的时长，其它
+ * 阶段的耗时是各个源文件夹的处理时长之和。
+ */
+typedef struct FileSyncPhaseStatsRec_ {
+	int64_t start_time;	/**< 开始时间 */
+	int64_t time;		/**< 耗时，单位为毫秒 */
+	size_t count;		/**< 已处理的数量 */
+	double rate;		/**< 平均每秒处理的数量 */
+} FileSyncPhaseStatsRec, *FileSyncPhaseStats;
+
 /** 文件同步状态记录 */
 typedef struct FileSyncStatusRec_ {
 	size_t task_i;
@@ -131,8 +155,15 @@ typedef struct FileSyncStatusRec_ {
 	size_t scaned_files;	/**< 已扫描的文件数量 */
 	size_t synced_files;	/**< 已同步的文件数量 */
 	size_t scaned_dirs;	/**< 已扫描的目录数量 */
+	size_t offline_dirs;	/**< 离线的源文件夹数量 */
 	SyncTask task;		/**< 当前正执行的任务 */
 	SyncTask *tasks;	/**< 所有任务 */
+	int64_t start_time;	/**< 同步的开始时间 */
+	double rate;		/**< 当前每秒处理的文件数量，取移动平均值 */
+	int64_t eta;		/**< 预计剩余时间，单位为毫秒，未知时为 -1 */
+	int64_t rate_time;	/**< 上次计算处理速度的时间 */
+	size_t rate_count;	/**< 上次计算处理速度时已处理的文件数量 */
+	FileSyncPhaseStatsRec phases[SYNC_PHASE_TOTAL];	/**< 各阶段的统计 */
 	void *data;
 	void( *callback )(void*);
 } FileSyncStatusRec, *FileSyncStatus;
@@ -148,14 +179,32 @@ int LCFinder_TriggerEvent( int event_id, void *data );
 /** 获取指定文件路径所处的源文件夹 */
 DB_Dir LCFinder_GetSourceDir( const char *filepath );
 
+/**
+ * 获取文件相对于源文件夹的路径，缩略图数据库以它作为文件的路径
+ * @returns 指向 filepath 中的一段，文件不在源文件夹中时返回 filepath
+ */
+const char *LCFinder_GetRelativePath( DB_Dir dir, const char *filepath );
+
 size_t LCFinder_GetSourceDirList( DB_Dir **outdirs );
 
+/** 判断源文件夹是否处于离线状态，即上次同步时它所在的卷不可用 */
+LCUI_BOOL LCFinder_IsDirOffline( DB_Dir dir );
+
 /** 获取缩略图数据库总大小 */
 int64_t LCFinder_GetThumbDBTotalSize( void );
 
-/** 清除缩略图数据库 */
+/** 清除缩略图数据库，清除在后台进行，完成后触发 EVENT_THUMBDB_DEL_DONE 事件 */
 void LCFinder_ClearThumbDB( void );
 
+/** 设置缩略图缓存的空间上限，单位为 MB，0 表示不限制 */
+void LCFinder_SetThumbDBMaxSize(int size);
+
+/** 启用或暂停在后台预先生成缩略图 */
+void LCFinder_SetThumbPregenEnabled(LCUI_BOOL enabled);
+
+/** 通知后台的缩略图生成器界面正在加载缩略图，让它暂停一会儿 */
+void LCFinder_YieldThumbPregen(void);
+
 void LCFinder_SyncFilesAsync( FileSyncStatus s );
 
 DB_Dir LCFinder_GetDir( const char *dirpath );
@@ -0,0 +1,57 @@
+﻿/* ***************************************************************************
+ * image_probe.h -- image header probe
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * image_probe.h -- 图片文件头探测
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+
+#ifndef LCFINDER_IMAGE_PROBE_H
+#define LCFINDER_IMAGE_PROBE_H
+
+#include <stdio.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+
+/**
+ * 从文件头中读取 JPEG、PNG 和 BMP 图片的尺寸，不解码图像，最多只读取几 KB
+ * JPEG 图片的尺寸已按 EXIF 方向调整，与缩略图显示时的宽高一致
+ * @returns 不是这几种格式或文件头已损坏时返回 -1
+ */
+int ImageProbe_ReadSize(FILE *fp, unsigned *width, unsigned *height);
+
+/** 打开文件并读取图片的尺寸 */
+int ImageProbe_GetSizeW(const wchar_t *path, unsigned *width,
+			unsigned *height);
+
+#endif
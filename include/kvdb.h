@@ -24,6 +24,27 @@
 #include <stddef.h>
 
 typedef struct kvdb_t kvdb_t;
+typedef struct kvdb_batch_t kvdb_batch_t;
+typedef struct kvdb_cursor_t kvdb_cursor_t;
+typedef struct kvdb_txn_t kvdb_txn_t;
+
+/**
+ * 写入的持久化模式
+ * SYNC: 每次写入都同步到磁盘
+ * GROUP: 单次写入不等待同步，由组提交线程将各个线程的写入合并到一次同步中，
+ * 累积 KVDB_GROUP_COMMIT_BYTES 字节或每隔 KVDB_GROUP_COMMIT_INTERVAL 毫秒同步
+ * 一次，批量写入在提交时同步。崩溃后打开数据库时会重放日志，数据保持一致，
+ * 最多丢失最近一个同步周期内的写入
+ * ASYNC: 从不主动同步，由系统决定何时写入磁盘，崩溃时可能丢失最近的写入
+ */
+typedef enum kvdb_durability_t {
+	KVDB_DURABILITY_SYNC,
+	KVDB_DURABILITY_GROUP,
+	KVDB_DURABILITY_ASYNC
+} kvdb_durability_t;
+
+#define KVDB_GROUP_COMMIT_INTERVAL 1000
+#define KVDB_GROUP_COMMIT_BYTES (4 << 20)
 
 typedef void(*kvdb_each_callback_t)(
 	const char*, size_t, const void*, size_t, void*
@@ -46,4 +67,115 @@ int kvdb_delete(kvdb_t *db, const char *key, size_t keylen);
 
 size_t kvdb_each(kvdb_t *db, kvdb_each_callback_t callback, void *privdata);
 
+void kvdb_set_durability(kvdb_t *db, kvdb_durability_t mode);
+
+/** 将之前的写入同步到磁盘 */
+int kvdb_sync(kvdb_t *db);
+
+/**
+ * 同步已到期的组提交写入
+ * 累积的写入达到 KVDB_GROUP_COMMIT_BYTES 字节或距上次同步已超过
+ * KVDB_GROUP_COMMIT_INTERVAL 毫秒时才同步，由组提交线程定期调用
+ */
+int kvdb_group_commit(kvdb_t *db);
+
+/** 将数据库交给组提交线程管理，供存储引擎在切换至 GROUP 模式时调用 */
+void kvdb_committer_add(kvdb_t *db);
+
+/** 停止管理数据库，供存储引擎在关闭数据库或切换模式时调用 */
+void kvdb_committer_remove(kvdb_t *db);
+
+/** 唤醒组提交线程，供存储引擎在累积的写入过多时调用 */
+void kvdb_committer_notify(void);
+
+/**
+ * 压缩数据库，回收已删除和已被覆盖的记录所占用的空间
+ * @returns 暂时无法压缩时返回 -EBUSY
+ */
+int kvdb_compact(kvdb_t *db);
+
+/**
+ * 开始读取事务
+ * 事务期间通过 kvdb_get_view() 获取的内容在事务结束前一直有效
+ */
+kvdb_txn_t *kvdb_txn_begin(kvdb_t *db);
+
+/** 结束读取事务，之前获取的内容随之失效 */
+void kvdb_txn_end(kvdb_txn_t *txn);
+
+/**
+ * 获取值的只读视图，无需调用者释放
+ * 内存映射后端直接返回指向映射区域的指针，不复制数据，其它后端会复制一份，
+ * 在事务结束时释放
+ */
+const void *kvdb_get_view(kvdb_txn_t *txn, const char *key, size_t keylen,
+			  size_t *vallen);
+
+/**
+ * 在同一事务中读取多个键的值
+ * 读取前会按键排序，vals 和 vallens 中的结果仍与 keys 的顺序对应，未找到的键
+ * 对应的值为 NULL
+ * @returns 找到的值的数量
+ */
+size_t kvdb_multi_get(kvdb_txn_t *txn, size_t count, const char **keys,
+		      const size_t *keylens, const void **vals,
+		      size_t *vallens);
+
+/** 开始批量写入，在提交前写入的内容对读取不可见 */
+kvdb_batch_t *kvdb_batch_begin(kvdb_t *db);
+
+int kvdb_batch_put(kvdb_batch_t *batch, const char *key, size_t keylen,
+		   const void *val, size_t vallen);
+
+int kvdb_batch_delete(kvdb_batch_t *batch, const char *key, size_t keylen);
+
+/** 以一次原子写入的方式提交批量写入，并释放 batch */
+int kvdb_batch_commit(kvdb_batch_t *batch);
+
+/** 放弃批量写入，并释放 batch */
+void kvdb_batch_discard(kvdb_batch_t *batch);
+
+/**
+ * 创建游标
+ * 游标按键的字节序遍历记录，但 UnQLite 的存储引擎是哈希表，键是无序的，它的
+ * 游标只能逐个过滤全部记录，遍历顺序也不确定。内存映射后端的索引也是哈希表，
+ * 每次定位都要收集并排序全部记录。因此游标只用于维护任务中的全量遍历。
+ */
+kvdb_cursor_t *kvdb_cursor_open(kvdb_t *db);
+
+void kvdb_cursor_close(kvdb_cursor_t *cur);
+
+/**
+ * 设置游标的遍历范围 [lower, upper)
+ * lower 或 upper 为 NULL 时表示该方向上没有限制
+ */
+int kvdb_cursor_set_range(kvdb_cursor_t *cur, const char *lower,
+			  size_t lowerlen, const char *upper, size_t upperlen);
+
+/** 设置游标只遍历以 prefix 开头的键 */
+int kvdb_cursor_set_prefix(kvdb_cursor_t *cur, const char *prefix,
+			   size_t len);
+
+/**
+ * 将游标移动到范围内第一个不小于 key 的记录
+ * key 为 NULL 时移动到范围内的第一个记录
+ * @returns 找到记录时返回 0
+ */
+int kvdb_cursor_seek(kvdb_cursor_t *cur, const char *key, size_t keylen);
+
+/** 移动到下一个记录，没有更多记录时返回 -1 */
+int kvdb_cursor_next(kvdb_cursor_t *cur);
+
+int kvdb_cursor_valid(kvdb_cursor_t *cur);
+
+/** 获取当前记录的键，返回的内容在游标移动或关闭后失效 */
+const char *kvdb_cursor_key(kvdb_cursor_t *cur, size_t *keylen);
+
+/** 获取当前记录的值，返回的内容在游标移动或关闭后失效 */
+const void *kvdb_cursor_value(kvdb_cursor_t *cur, size_t *vallen);
+
+/** 按字节序比较两个键，返回值的含义与 memcmp() 相同 */
+int kvdb_compare_key(const char *key1, size_t len1,
+		     const char *key2, size_t len2);
+
 #endif
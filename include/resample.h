@@ -0,0 +1,62 @@
+﻿/* ***************************************************************************
+ * resample.h -- Image resampling with box and Lanczos filters.
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * resample.h -- 基于盒式和 Lanczos 滤波器的图像重采样
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#ifndef LCFINDER_RESAMPLE_H
+#define LCFINDER_RESAMPLE_H
+
+#include <LCUI_Build.h>
+#include <LCUI/types.h>
+
+/** 重采样滤波器 */
+typedef enum ResampleFilter_ {
+	RESAMPLE_FILTER_BOX,		/**< 盒式滤波，即按面积取平均值，速度快 */
+	RESAMPLE_FILTER_LANCZOS3	/**< Lanczos-3 滤波，画质好，速度较慢 */
+} ResampleFilter;
+
+/**
+ * 缩放图像
+ * 先水平后垂直地分两次完成，支持 SSE2 和 AVX2 的 CPU 会自动使用对应的实现
+ * 只支持 RGB888 和 ARGB8888 格式，其它格式改用 Graph_ZoomBilinear() 缩放
+ * @param[in] keep_scale 是否保持宽高比，为 TRUE 时图像会缩放到目标尺寸以内
+ * @param[in] width 目标宽度，为 0 时按目标高度等比例缩放
+ * @param[in] height 目标高度，为 0 时按目标宽度等比例缩放
+ */
+int Resample_Zoom(const LCUI_Graph *graph, LCUI_Graph *buff,
+		  ResampleFilter filter, LCUI_BOOL keep_scale,
+		  unsigned width, unsigned height);
+
+#endif
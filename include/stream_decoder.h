@@ -0,0 +1,59 @@
+﻿/* ***************************************************************************
+ * stream_decoder.h -- streaming image decoder
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * stream_decoder.h -- 流式图像解码器
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#ifndef LCFINDER_STREAM_DECODER_H
+#define LCFINDER_STREAM_DECODER_H
+
+#include <stdio.h>
+#include <LCUI_Build.h>
+#include <LCUI/types.h>
+
+/**
+ * 以扫描线流式解码 PNG 和 BMP 文件，并在解码的同时缩小到目标尺寸以内
+ * 解码出的每一行像素直接按面积平均累加到目标图像中，内存占用只与图像宽度和
+ * 目标尺寸有关，与原图的高度无关。未压缩的 BMP 文件只读取采样用到的行。
+ * @param[in] width 目标宽度，为 0 时不限制
+ * @param[in] height 目标高度，为 0 时不限制
+ * @param[out] origin_width 原图的宽度
+ * @param[out] origin_height 原图的高度
+ * @returns 不是 PNG 或 BMP 文件、格式不支持或解码出错时返回 -1
+ */
+int StreamDecoder_ReadScaled(FILE *fp, unsigned width, unsigned height,
+			     unsigned *origin_width, unsigned *origin_height,
+			     LCUI_Graph *out);
+
+#endif
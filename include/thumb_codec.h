@@ -0,0 +1,66 @@
+﻿/* ***************************************************************************
+ * thumb_codec.h -- thumbnail pixel codec
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * thumb_codec.h -- 缩略图像素数据的编解码
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#ifndef LCFINDER_THUMB_CODEC_H
+#define LCFINDER_THUMB_CODEC_H
+
+#include <stddef.h>
+#include <LCUI_Build.h>
+#include <LCUI/types.h>
+
+/** 缩略图像素数据的编码方式 */
+enum ThumbEncoding {
+	THUMB_ENCODING_RAW,	/**< 未压缩的像素数据 */
+	THUMB_ENCODING_QOI	/**< 与 QOI 格式相同的压缩，不含文件头 */
+};
+
+/**
+ * 编码图像的像素数据，支持 RGB888 和 ARGB8888 格式
+ * RGB888 格式的图像采用有损编码，带透明度的图像采用无损编码
+ * @param[out] size 编码后的数据的大小
+ * @returns 编码后的数据，需由调用者释放。格式不支持或压缩后没有变小时返回
+ *  NULL，此时应保存未压缩的像素数据
+ */
+void *ThumbCodec_Encode(const LCUI_Graph *graph, size_t *size);
+
+/**
+ * 解码像素数据
+ * @param[in,out] graph 已按原尺寸和颜色类型创建好的图像
+ * @returns 数据不完整或已损坏时返回 -1
+ */
+int ThumbCodec_Decode(const void *data, size_t size, LCUI_Graph *graph);
+
+#endif
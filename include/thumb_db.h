@@ -53,6 +53,21 @@ typedef void* ThumbDBEngine;
 typedef struct ThumbDBEngineRec_* ThumbDBEngine;
 #endif
 
+/**
+ * 每个缩略图保存的级数
+ * 各级的尺寸依次为最大一级的 50%、75% 和 100%，分别对应 100%、150% 和 200%
+ * 的界面缩放比例
+ */
+#define THUMB_DB_LEVELS 3
+
+/** 图片缩略图的基准高度，界面缩放比例为 100% 时缩略图的高度不超过它 */
+#define THUMB_MAX_WIDTH		240
+/** 生成缩略图时的尺寸倍数，对应界面缩放比例的上限 200% */
+#define THUMB_MAX_SCALE		2
+
+/** ThumbDB_Load() 的返回值，表示文件之前无法生成缩略图 */
+#define THUMB_DB_FAILURE 1
+
 typedef struct ThumbDatakRec_ {
 	uint32_t modify_time;		/**< 修改时间 */
 	uint32_t origin_width;		/**< 原始宽度 */
@@ -60,20 +75,105 @@ typedef struct ThumbDatakRec_ {
 	LCUI_Graph graph;		/**< 缩略图数据 */
 } ThumbDataRec, *ThumbData;
 
-/** 新建一个缩略图数据库实例 */
-ThumbDB ThumbDB_Open(const char *filepath);
+/**
+ * 打开缩略图数据库
+ * 所有源文件夹共用一个数据库，它由固定数量的分片组成，分片文件的路径为
+ * "<path>.<分片序号>"
+ * 实例可以被多个线程同时使用，使用 LevelDB 或内存映射数据库时，载入缩略图的
+ * 线程之间互不阻塞；UnQLite 的每个分片只有一个句柄，读取仍会逐个进行
+ */
+ThumbDB ThumbDB_Open(const char *path);
 
 /** 销毁缩略图数据库实例 */
 void ThumbDB_Close(ThumbDB tdb);
 
-int ThumbDB_GetSize(const char *filepath, int64_t *size);
+int ThumbDB_GetSize(const char *path, int64_t *size);
+
+int ThumbDB_DestroyDB(const char *path);
+
+/**
+ * 清空缩略图数据库并删除它的文件
+ * 实例仍然有效，会等待正在读写的线程结束，其它线程可以继续使用它
+ */
+int ThumbDB_Clear(ThumbDB tdb);
+
+/** 删除旧版本中按源文件夹划分的缩略图数据库 */
+int ThumbDB_DestroyLegacyDB(const char *filepath);
+
+/**
+ * 从数据库中载入指定文件路径的缩略图数据
+ * 载入的是不小于指定尺寸的最小一级缩略图，若都不够大则载入最大的一级
+ * @param[in] dir_id 源文件夹的标识号
+ * @param[in] filepath 相对于源文件夹的路径
+ * @param[in] width 需要的最小宽度，为 0 时不限制
+ * @param[in] height 需要的最小高度，为 0 时不限制
+ * @returns 有失败记录时返回 THUMB_DB_FAILURE，data->modify_time 为失败时文件
+ *  的修改时间，data->graph 为无效的图像
+ */
+int ThumbDB_Load(ThumbDB tdb, int dir_id, const char *filepath,
+		 unsigned width, unsigned height, ThumbData data);
+
+/**
+ * 在一次读取事务中载入多个文件的缩略图数据
+ * 未找到的文件对应的 data[i].graph 为无效的图像，其中有失败记录的文件对应的
+ * data[i].modify_time 为失败时文件的修改时间，其余的为 0
+ * @returns 成功载入的数量
+ */
+size_t ThumbDB_LoadMany(ThumbDB tdb, int dir_id, unsigned width,
+			unsigned height, size_t count,
+			const char **filepaths, ThumbDataRec *data);
+
+/**
+ * 将缩略图数据保存至缓存中
+ * data->graph 作为最大的一级，较小的几级由它缩小得到
+ */
+int ThumbDB_Save(ThumbDB tdb, int dir_id, const char *filepath,
+		 ThumbData data);
+
+/**
+ * 记录文件无法生成缩略图，在文件被修改前无需再尝试
+ * 成功生成缩略图后，记录会被 ThumbDB_Save() 覆盖
+ */
+int ThumbDB_SaveFailure(ThumbDB tdb, int dir_id, const char *filepath,
+			uint32_t modify_time);
+
+typedef void(*ThumbDBFailureHandler)(int, const char*, uint32_t, void*);
+
+/**
+ * 遍历所有失败记录，用于诊断
+ * handler 的参数依次为源文件夹的标识号、相对于源文件夹的路径、失败时文件的
+ * 修改时间和 data
+ * @returns 失败记录的数量
+ */
+size_t ThumbDB_EachFailure(ThumbDB tdb, ThumbDBFailureHandler handler,
+			   void *data);
 
-int ThumbDB_DestroyDB(const char *filepath);
+/** 删除源文件夹的所有缩略图 */
+int ThumbDB_DeleteDir(ThumbDB tdb, int dir_id);
 
-/** 从数据库中载入指定文件路径的缩略图数据 */
-int ThumbDB_Load(ThumbDB tdb, const char *filepath, ThumbData data);
+/**
+ * 将文件夹内的缩略图按显示顺序打包
+ * 打包文件中的缩略图连续存放，ThumbDB_LoadMany() 会优先从中顺序读取，
+ * 无需在数据库中逐个查找。已有的打包文件与文件列表一致时不会重新打包，即使
+ * 其中缺少一些缩略图，文件夹内有缩略图被保存时打包文件才会被删除。没有可打包
+ * 的缩略图时也会生成空的打包文件，以免每次打开文件夹时都重新检查。
+ * @param[in] filepaths 同一文件夹内的文件路径，相对于源文件夹，按显示顺序排列
+ * @param[in] width 需要的最小宽度，含义与 ThumbDB_Load() 相同
+ * @param[in] height 需要的最小高度，含义与 ThumbDB_Load() 相同
+ * @param[in] running 为 FALSE 时中止打包，可以为 NULL
+ * @returns 打包的缩略图数量，无需打包时返回 0，出错时返回负数
+ */
+int ThumbDB_PackFolder(ThumbDB tdb, int dir_id, size_t count,
+		       const char **filepaths, unsigned width, unsigned height,
+		       const LCUI_BOOL *running);
 
-/** 将缩略图数据保存至缓存中 */
-int ThumbDB_Save(ThumbDB tdb, const char *filepath, ThumbData data);
+/**
+ * 维护数据库
+ * 保存缩略图的访问时间，若数据库的大小超出上限，则先删除打包文件，仍超出时
+ * 按最近最少使用的顺序淘汰缩略图，然后压缩数据库以回收空间
+ * @param[in] max_size 容量上限，单位为字节，小于等于 0 时不限制
+ * @returns 淘汰的缩略图数量，出错时返回负数
+ */
+int ThumbDB_Maintain(ThumbDB tdb, int64_t max_size);
 
 #endif
@@ -0,0 +1,99 @@
+﻿/* ***************************************************************************
+ * thumb_pack.h -- packed thumbnail file of a folder.
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * thumb_pack.h -- 文件夹的缩略图打包文件
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#ifndef LCFINDER_THUMB_PACK_H
+#define LCFINDER_THUMB_PACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <LCUI_Build.h>
+#include <LCUI/types.h>
+
+#ifdef LCFINDER_THUMB_PACK_C
+typedef struct ThumbPackRec_* ThumbPack;
+typedef struct ThumbPackWriterRec_* ThumbPackWriter;
+#else
+typedef void* ThumbPack;
+typedef void* ThumbPackWriter;
+#endif
+
+/** 打包文件的概况 */
+typedef struct ThumbPackInfoRec_ {
+	uint32_t list_hash;	/**< 文件列表的哈希值，列表或顺序变化时它也会变化 */
+	uint32_t count;		/**< 已打包的缩略图数量 */
+	uint32_t missing;	/**< 打包时数据库中还没有的缩略图数量 */
+} ThumbPackInfoRec, *ThumbPackInfo;
+
+/** 计算数据的哈希值 */
+uint32_t ThumbPack_Hash(uint32_t hash, const void *data, size_t len);
+
+/**
+ * 以内存映射的方式打开打包文件
+ * @returns 文件不存在或格式无效时返回 NULL
+ */
+ThumbPack ThumbPack_Open(const char *path);
+
+void ThumbPack_Close(ThumbPack pack);
+
+void ThumbPack_GetInfo(ThumbPack pack, ThumbPackInfo info);
+
+/**
+ * 查找缩略图数据
+ * @param[out] size 数据的大小
+ * @returns 指向映射内存的数据，在关闭打包文件前有效，未找到时返回 NULL
+ */
+const void *ThumbPack_Find(ThumbPack pack, const char *key, size_t keylen,
+			   size_t *size);
+
+/** 新建写入器，写入完成后打包文件将保存至 path */
+ThumbPackWriter ThumbPackWriter_Create(const char *path);
+
+/** 添加缩略图数据，数据按添加的顺序连续存放 */
+int ThumbPackWriter_Add(ThumbPackWriter w, const char *key, size_t keylen,
+			const void *data, size_t size);
+
+/**
+ * 写入索引并生成打包文件
+ * 在 Windows 上，已打开的同名打包文件需先关闭
+ */
+int ThumbPackWriter_Finish(ThumbPackWriter w, uint32_t list_hash,
+			   uint32_t missing);
+
+/** 销毁写入器，若未完成写入则删除临时文件 */
+void ThumbPackWriter_Destroy(ThumbPackWriter w);
+
+#endif
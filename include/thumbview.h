@@ -67,6 +67,15 @@ void ThumbView_SetCache( LCUI_Widget w, ThumbCache cache );
 /** 设置文件存储服务的连接标识符 */
 void ThumbView_SetStorage( LCUI_Widget w, int storage );
 
+/**
+ * 将文件夹内图片的缩略图按显示顺序打包，让滚动浏览时能顺序读取
+ * 图片较少时不打包。打包比较耗时，应在工作线程中调用
+ * @param[in] files 同一文件夹内的文件，按显示顺序排列
+ * @param[in] running 为 FALSE 时中止打包，可以为 NULL
+ */
+int ThumbView_PackFolder( LCUI_Widget w, DB_File *files, size_t count,
+			  const LCUI_BOOL *running );
+
 /** 启用缩略图滚动加载功能 */
 void ThumbView_EnableScrollLoading( LCUI_Widget w );
 
@@ -57,6 +57,7 @@
 #define ID_TXT_THUMB_DB_SIZE		"text-thumb-db-size"
 #define ID_TXT_CURRENT_LANGUAGE		"txt-current-language"
 #define ID_TXT_CURRENT_SCALING		"txt-current-scaling"
+#define ID_TXT_CURRENT_THUMB_DB_MAX_SIZE	"txt-current-thumb-db-max-size"
 #define ID_TXT_TRIAL_LICENSE		"txt-trial-license"
 #define ID_VIEW_PICTURE_TAGS		"picture-info-tags"
 #define ID_VIEW_PICTURE_LABELS		"picture-labels-current"
@@ -135,7 +136,9 @@
 #define ID_DROPDOWN_FOLDER_FILES_SORT	"dropdown-folder-files-sort"
 #define ID_DROPDOWN_SEARCH_FILES_SORT	"dropdown-search-files-sort"
 #define ID_DROPDOWN_SCALING		"dropdown-scaling"
+#define ID_DROPDOWN_THUMB_DB_MAX_SIZE	"dropdown-thumb-db-max-size"
 #define ID_SWITCH_PRIVATE_SPACE		"switch-private-space-open"
+#define ID_SWITCH_THUMB_PREGEN		"switch-thumb-pregen"
 
 /* xml 文件位置 */
 #define FILE_MAIN_VIEW		"assets/views/main.xml"
@@ -37,6 +37,7 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
@@ -45,6 +46,7 @@
 #include "i18n.h"
 #include "ui.h"
 #include "file_storage.h"
+#include "image_probe.h"
 #include <LCUI/font/charset.h>
 
 #define DEBUG
@@ -54,6 +56,14 @@
 #define STORAGE_FILE L"storage.db"
 
 #define THUMB_CACHE_SIZE (64 * 1024 * 1024)
+#define THUMB_DB_MAX_SIZE 1024
+/** 缩略图数据库的维护间隔，单位为毫秒 */
+#define THUMB_DB_MAINTAIN_INTERVAL 60000
+/** 界面加载过缩略图后，需空闲多久才继续在后台生成缩略图，单位为毫秒 */
+#define THUMB_PREGEN_IDLE_TIME 3000
+/** 在后台每生成一张缩略图后至少休息多久，单位为毫秒 */
+#define THUMB_PREGEN_MIN_INTERVAL 50
+#define UTF8_PATH_LEN (PATH_LEN * 4)
 
 #ifdef ASSERT
 #undef ASSERT
@@ -70,19 +80,43 @@ Finder finder;
 typedef struct DirStatusDataPackRec_ {
 	FileSyncStatus status;
 	DB_Dir dir;
+	size_t total;
+	LinkedList thumbs;	/**< 需要预先生成缩略图的文件 */
 } DirStatusDataPackRec, *DirStatusDataPack;
 
+/** 需要在后台预先生成缩略图的文件 */
+typedef struct ThumbPregenItemRec_ {
+	int dir_id;
+	uint_t modify_time;
+	char *fullpath;		/**< 完整路径，用于请求文件服务 */
+	const char *path;	/**< 相对于源文件夹的路径，指向 fullpath 中的一段 */
+} ThumbPregenItemRec, *ThumbPregenItem;
+
 typedef struct EventPackRec_ {
 	LCFinder_EventHandler handler;
 	void *data;
 } EventPackRec, *EventPack;
 
+/** 目录的扫描状态，用于确定目录及其子目录是否已全部扫描完 */
+typedef struct DirScanNodeRec_ {
+	char *path;			/**< UTF-8 编码的路径 */
+	size_t pending;			/**< 未完成扫描的子项数量 */
+	LCUI_BOOL failed;		/**< 是否有子项扫描失败 */
+	struct DirScanNodeRec_ *parent;
+} DirScanNodeRec, *DirScanNode;
+
 typedef struct FileSyncDataPackRec_ {
 	FileSyncStatus status;
 	wchar_t path[PATH_LEN];
 	size_t path_len;
+	char utf8_path[UTF8_PATH_LEN];	/**< UTF-8 编码的路径，用作缓存的键 */
+	size_t utf8_path_len;
+	DirScanNode node;		/**< 目录自身或文件所属目录的扫描状态 */
 } FileSyncDataPackRec, *FileSyncDataPack;
 
+/** 目录和文件的扫描回调在不同的线程上执行，需要用锁保护扫描状态 */
+static LCUI_Mutex scan_mutex;
+
 static void OnEvent(LCUI_Event e, void *arg)
 {
 	EventPack pack = e->data;
@@ -123,9 +157,17 @@ DB_Dir LCFinder_GetDir(const char *dirpath)
 	return NULL;
 }
 
-static wchar_t *LCFinder_CreateThumbDB(const char *dirpath)
+/** 获取缩略图数据库的路径 */
+static void LCFinder_GetThumbDBPath(char *path)
+{
+	LCUI_EncodeString(path, finder.thumbs_dir, PATH_LEN - 1,
+			  ENCODING_UTF8);
+	pathjoin(path, path, "thumbs");
+}
+
+/** 删除旧版本中为源文件夹单独创建的缩略图数据库 */
+static void LCFinder_RemoveLegacyThumbDB(const char *dirpath)
 {
-	ThumbDB db;
 	char dbpath[PATH_LEN], path[PATH_LEN], name[44];
 
 	strcpy(path, dirpath);
@@ -133,19 +175,13 @@ static wchar_t *LCFinder_CreateThumbDB(const char *dirpath)
 	LCUI_EncodeString(dbpath, finder.thumbs_dir, PATH_LEN - 1,
 			  ENCODING_UTF8);
 	pathjoin(dbpath, dbpath, name);
-	db = ThumbDB_Open(dbpath);
-	if (!db) {
-		return NULL;
-	}
-	Dict_Add(finder.thumb_dbs, path, db);
-	return DecodeUTF8(dbpath);
+	ThumbDB_DestroyLegacyDB(dbpath);
 }
 
 DB_Dir LCFinder_AddDir(const char *dirpath, const char *token, int visible)
 {
 	char *path;
 	size_t i, len;
-	wchar_t **paths;
 	DB_Dir dir, *dirs;
 
 	len = strlen(dirpath);
@@ -177,15 +213,8 @@ DB_Dir LCFinder_AddDir(const char *dirpath, const char *token, int visible)
 		finder.n_dirs -= 1;
 		return NULL;
 	}
-	paths = realloc(finder.thumb_paths, sizeof(wchar_t *) * finder.n_dirs);
-	if (!path) {
-		finder.n_dirs -= 1;
-		return NULL;
-	}
 	dirs[i] = dir;
-	paths[i] = LCFinder_CreateThumbDB(dir->path);
 	finder.dirs = dirs;
-	finder.thumb_paths = paths;
 	return dir;
 }
 
@@ -215,13 +244,11 @@ void LCFinder_DeleteDir(DB_Dir dir)
 		free(wtoken);
 	}
 	free(wpath);
-	/* 准备清除缩略图数据库 */
-	wpath = finder.thumb_paths[i];
-	finder.thumb_paths[i] = NULL;
-	Dict_Delete(finder.thumb_dbs, dir->path);
-#ifdef _WIN32
-	_wremove(wpath);
-#endif
+	Dict_Delete(finder.offline_dirs, dir->path);
+	/* 清除该源文件夹的缩略图 */
+	if (finder.thumb_db) {
+		ThumbDB_DeleteDir(finder.thumb_db, dir->id);
+	}
 	/* 删除数据库中的源文件夹记录 */
 	DB_DeleteDir(dir);
 	free(dir);
@@ -257,10 +284,7 @@ size_t LCFinder_DeleteFiles(char *const *files, size_t nfiles,
 			free(path);
 			path = NULL;
 		}
-		len = strlen(files[i]) + 1;
-		path = malloc(sizeof(wchar_t) * len);
-		LCUI_DecodeString(path, files[i], len, ENCODING_UTF8);
-		if (0 == SyncTask_DeleteFileW(task, path)) {
+		if (0 == SyncTask_DeleteFile(task, files[i])) {
 			DB_DeleteFile(files[i]);
 			MoveFileToTrash(files[i]);
 		}
@@ -274,39 +298,215 @@ size_t LCFinder_DeleteFiles(char *const *files, size_t nfiles,
 	return i;
 }
 
+/** 计算处理速度的最小时间间隔 */
+#define SYNC_RATE_INTERVAL	500
+/** 处理速度的平滑系数，越大则越偏向最近一段时间内的速度 */
+#define SYNC_RATE_ALPHA		0.3
+
+static const char *sync_phase_names[SYNC_PHASE_TOTAL] = {
+	"list", "stat", "diff", "db", "cache"
+};
+
+static void FileSyncStatus_ResetStats(FileSyncStatus s)
+{
+	int i;
+	s->rate = 0;
+	s->eta = -1;
+	s->rate_count = 0;
+	s->rate_time = LCUI_GetTime();
+	for (i = 0; i < SYNC_PHASE_TOTAL; ++i) {
+		s->phases[i].start_time = 0;
+		s->phases[i].time = 0;
+		s->phases[i].count = 0;
+		s->phases[i].rate = 0;
+	}
+}
+
+/** 标记并发阶段的开始，仅第一次调用有效 */
+static void FileSyncStatus_BeginPhase(FileSyncStatus s, int phase)
+{
+	if (s->phases[phase].start_time == 0) {
+		s->phases[phase].start_time = LCUI_GetTime();
+	}
+}
+
+/** 更新并发阶段的统计，耗时为从开始至今的时长 */
+static void FileSyncStatus_UpdatePhase(FileSyncStatus s, int phase,
+				       size_t count)
+{
+	FileSyncPhaseStats stats = &s->phases[phase];
+
+	stats->count = count;
+	stats->time = LCUI_GetTimeDelta(stats->start_time);
+	if (stats->time > 0) {
+		stats->rate = stats->count * 1000.0 / stats->time;
+	}
+}
+
+/** 累计阶段的耗时和处理数量 */
+static void FileSyncStatus_AddPhase(FileSyncStatus s, int phase,
+				    int64_t start_time, size_t count)
+{
+	FileSyncPhaseStats stats = &s->phases[phase];
+
+	stats->count += count;
+	stats->time += LCUI_GetTimeDelta(start_time);
+	if (stats->time > 0) {
+		stats->rate = stats->count * 1000.0 / stats->time;
+	}
+}
+
+/**
+ * 更新处理速度和预计剩余时间
+ * 速度取移动平均值，以免界面上显示的数字随单个文件的耗时剧烈跳动
+ * @param[in] count 已处理的文件数量
+ * @param[in] total 需处理的文件总数
+ */
+static void FileSyncStatus_UpdateRate(FileSyncStatus s, size_t count,
+				      size_t total)
+{
+	double rate;
+	int64_t delta = LCUI_GetTimeDelta(s->rate_time);
+
+	if (delta < SYNC_RATE_INTERVAL || count < s->rate_count) {
+		return;
+	}
+	rate = (count - s->rate_count) * 1000.0 / delta;
+	if (s->rate > 0) {
+		rate = SYNC_RATE_ALPHA * rate + (1 - SYNC_RATE_ALPHA) * s->rate;
+	}
+	s->rate = rate;
+	s->rate_count = count;
+	s->rate_time += delta;
+	if (rate > 0 && total >= count) {
+		s->eta = (int64_t)((total - count) * 1000.0 / rate);
+	} else {
+		s->eta = -1;
+	}
+}
+
+/**
+ * 输出同步过程的统计数据
+ * 如果设置了 LCFINDER_SYNC_TRACE 环境变量，则以 JSON Lines 格式将数据追加
+ * 到它指定的文件中，便于对比不同版本的同步性能
+ */
+static void FileSyncStatus_Report(FileSyncStatus s)
+{
+	int i;
+	FILE *fp;
+	const char *trace_file;
+	FileSyncPhaseStats stats;
+	int64_t time = LCUI_GetTimeDelta(s->start_time);
+
+	for (i = 0; i < SYNC_PHASE_TOTAL; ++i) {
+		stats = &s->phases[i];
+		LOG("[scanner] phase %s: %lldms, %lu items, %.1f items/s\n",
+		    sync_phase_names[i], (long long)stats->time,
+		    (unsigned long)stats->count, stats->rate);
+	}
+	LOG("[scanner] sync finished in %lldms\n", (long long)time);
+	trace_file = getenv("LCFINDER_SYNC_TRACE");
+	if (!trace_file || !trace_file[0]) {
+		return;
+	}
+	fp = fopen(trace_file, "a");
+	if (!fp) {
+		LOG("[scanner] cannot open trace file: %s\n", trace_file);
+		return;
+	}
+	for (i = 0; i < SYNC_PHASE_TOTAL; ++i) {
+		stats = &s->phases[i];
+		fprintf(fp, "{\"event\":\"phase\",\"phase\":\"%s\","
+			"\"time_ms\":%lld,\"count\":%lu,\"rate\":%.1f}\n",
+			sync_phase_names[i], (long long)stats->time,
+			(unsigned long)stats->count, stats->rate);
+	}
+	fprintf(fp, "{\"event\":\"sync\",\"time_ms\":%lld,\"dirs\":%lu,"
+		"\"files\":%lu,\"added\":%lu,\"changed\":%lu,"
+		"\"deleted\":%lu}\n", (long long)time,
+		(unsigned long)s->dirs, (unsigned long)s->files,
+		(unsigned long)s->added_files, (unsigned long)s->changed_files,
+		(unsigned long)s->deleted_files);
+	fclose(fp);
+}
+
+static void ThumbPregenItem_Destroy(void *data)
+{
+	ThumbPregenItem item = data;
+
+	free(item->fullpath);
+	free(item);
+}
+
+static void ThumbPregen_AddFile(LinkedList *list, DB_Dir dir,
+				const FileCacheInfo info)
+{
+	size_t len = strlen(info->path) + 1;
+	ThumbPregenItem item = NEW(ThumbPregenItemRec, 1);
+
+	if (!item) {
+		return;
+	}
+	item->fullpath = malloc(len * sizeof(char));
+	if (!item->fullpath) {
+		free(item);
+		return;
+	}
+	strncpy(item->fullpath, info->path, len);
+	/* 缩略图数据库以相对于源文件夹的路径作为键，与缩略图列表保持一致 */
+	item->path = LCFinder_GetRelativePath(dir, item->fullpath);
+	item->dir_id = dir->id;
+	item->modify_time = (uint_t)info->mtime;
+	LinkedList_Append(list, item);
+}
+
 static void SyncAddedFile(void *data, const FileCacheInfo info)
 {
-	char path[PATH_LEN];
 	DirStatusDataPack pack = data;
 	int ctime = (int)info->ctime;
 	int mtime = (int)info->mtime;
+	int width = (int)info->width;
+	int height = (int)info->height;
 	pack->status->synced_files += 1;
-	LCUI_EncodeString(path, info->path, PATH_LEN, ENCODING_UTF8);
-	DB_AddFile(pack->dir, path, ctime, mtime);
+	DB_AddFile(pack->dir, info->path, width, height, ctime, mtime);
+	ThumbPregen_AddFile(&pack->thumbs, pack->dir, info);
+	FileSyncStatus_UpdateRate(pack->status, pack->status->synced_files,
+				  pack->total);
 	// wprintf(L"sync: add file: %s, ctime: %d\n", wpath, ctime);
 }
 
 static void SyncChangedFile(void *data, const FileCacheInfo info)
 {
-	char path[PATH_LEN];
 	int ctime = (int)info->ctime;
 	int mtime = (int)info->mtime;
+	int width = (int)info->width;
+	int height = (int)info->height;
 	DirStatusDataPack pack = data;
 	pack->status->synced_files += 1;
-	LCUI_EncodeString(path, info->path, PATH_LEN, ENCODING_UTF8);
-	DB_UpdateFileTime(pack->dir, path, ctime, mtime);
+	DB_UpdateFileTime(pack->dir, info->path, ctime, mtime);
+	if (width > 0 && height > 0) {
+		DB_UpdateFileSize(pack->dir, info->path, width, height);
+	}
+	ThumbPregen_AddFile(&pack->thumbs, pack->dir, info);
+	FileSyncStatus_UpdateRate(pack->status, pack->status->synced_files,
+				  pack->total);
 }
 
 static void SyncDeletedFile(void *data, const FileCacheInfo info)
 {
-	char path[PATH_LEN];
 	DirStatusDataPack pack = data;
 	pack->status->synced_files += 1;
-	LCUI_EncodeString(path, info->path, PATH_LEN, ENCODING_UTF8);
-	DB_DeleteFile(path);
+	DB_DeleteFile(info->path);
+	FileSyncStatus_UpdateRate(pack->status, pack->status->synced_files,
+				  pack->total);
 	// wprintf(L"sync: delete file: %s\n", wpath);
 }
 
+LCUI_BOOL LCFinder_IsDirOffline(DB_Dir dir)
+{
+	return Dict_Find(finder.offline_dirs, dir->path) != NULL;
+}
+
 DB_Dir LCFinder_GetSourceDir(const char *filepath)
 {
 	size_t i;
@@ -320,6 +520,19 @@ DB_Dir LCFinder_GetSourceDir(const char *filepath)
 	return NULL;
 }
 
+const char *LCFinder_GetRelativePath(DB_Dir dir, const char *filepath)
+{
+	size_t len = strlen(dir->path);
+
+	if (strncmp(filepath, dir->path, len) != 0) {
+		return filepath;
+	}
+	if (filepath[len] == PATH_SEP) {
+		len += 1;
+	}
+	return filepath + len;
+}
+
 size_t LCFinder_GetSourceDirList(DB_Dir **outdirs)
 {
 	DB_Dir *dirs;
@@ -342,32 +555,25 @@ size_t LCFinder_GetSourceDirList(DB_Dir **outdirs)
 
 int64_t LCFinder_GetThumbDBTotalSize(void)
 {
-	size_t i;
-	int64_t sum_size, size;
-	char *path;
+	int64_t size;
+	char path[PATH_LEN];
 
-	for (i = 0, sum_size = 0; i < finder.n_dirs; ++i) {
-		if (!finder.thumb_paths[i]) {
-			continue;
-		}
-		path = EncodeANSI(finder.thumb_paths[i]);
-		if (!path) {
-			continue;
-		}
-		if (ThumbDB_GetSize(path, &size) == 0) {
-			sum_size += size;
-		}
-		free(path);
+	LCFinder_GetThumbDBPath(path);
+	if (ThumbDB_GetSize(path, &size) != 0) {
+		return 0;
 	}
-	return sum_size;
+	return size;
 }
 
 static void LCFinder_SwitchTask(FileSyncStatus s);
-static void LCFinder_ScanDir(FileSyncStatus s, const wchar_t *path);
+static void LCFinder_StartThumbPregen(LinkedList *files);
+static void LCFinder_ScanDir(FileSyncStatus s, const wchar_t *path,
+			     const char *utf8_path, DirScanNode parent);
 
 static void LCFinder_OnScanFinished(FileSyncStatus s)
 {
 	size_t i;
+	int64_t t, t_cache;
 	wchar_t *dirpath;
 	DirStatusDataPackRec pack;
 
@@ -375,17 +581,27 @@ static void LCFinder_OnScanFinished(FileSyncStatus s)
 	if (finder.n_dirs > 0) {
 		s->task_i += 1;
 		if (s->task) {
+			t = LCUI_GetTime();
+			SyncTask_Finish(s->task);
+			FileSyncStatus_AddPhase(s, SYNC_PHASE_DIFF, t,
+						s->task->total_files);
 			s->added_files += s->task->added_files;
 			s->deleted_files += s->task->deleted_files;
 			s->changed_files += s->task->changed_files;
-			SyncTask_Finish(s->task);
 		}
 		if (s->task_i < finder.n_dirs) {
 			LCFinder_SwitchTask(s);
 			return;
 		}
 	}
+	t = LCUI_GetTime();
 	DB_Begin();
+	s->rate = 0;
+	s->eta = -1;
+	s->rate_count = 0;
+	s->rate_time = t;
+	pack.total = s->added_files + s->changed_files + s->deleted_files;
+	LinkedList_Init(&pack.thumbs);
 	s->state = STATE_SAVING;
 	LOG("[scanner] start sync, folders count: %lu\n", finder.n_dirs);
 	for (i = 0; i < finder.n_dirs; ++i) {
@@ -396,17 +612,37 @@ static void LCFinder_OnScanFinished(FileSyncStatus s)
 		pack.status = s;
 		s->task = s->tasks[i];
 		dirpath = DecodeUTF8(pack.dir->path);
+		/* 保留离线文件夹的文件记录、标签和缩略图，等它重新可用 */
+		if (s->task->offline) {
+			LOG("[scanner] folder is offline: %ls\n", dirpath);
+			s->offline_dirs += 1;
+			Dict_Add(finder.offline_dirs, pack.dir->path, pack.dir);
+			SyncTask_Delete(s->task);
+			s->task = NULL;
+			free(dirpath);
+			continue;
+		}
+		Dict_Delete(finder.offline_dirs, pack.dir->path);
 		LOG("[scanner] sync files from folder: %ls\n", dirpath);
 		SyncTask_InAddedFiles(s->task, SyncAddedFile, &pack);
 		SyncTask_InDeletedFiles(s->task, SyncDeletedFile, &pack);
 		SyncTask_InChangedFiles(s->task, SyncChangedFile, &pack);
+		t_cache = LCUI_GetTime();
 		SyncTask_Commit(s->task);
+		FileSyncStatus_AddPhase(s, SYNC_PHASE_CACHE, t_cache,
+					s->task->total_files);
 		SyncTask_Delete(s->task);
 		s->task = NULL;
 		free(dirpath);
 	}
 	DB_Commit();
+	/* 文件数据库的耗时包括写入变更和提交事务，但不含提交缓存的耗时 */
+	FileSyncStatus_AddPhase(s, SYNC_PHASE_DB, t, s->synced_files);
+	s->phases[SYNC_PHASE_DB].time -= s->phases[SYNC_PHASE_CACHE].time;
 	LOG("[scanner] end sync\n");
+	LCFinder_StartThumbPregen(&pack.thumbs);
+	s->eta = 0;
+	FileSyncStatus_Report(s);
 	s->state = STATE_FINISHED;
 	s->task = NULL;
 	s->task_i = 0;
@@ -417,6 +653,76 @@ static void LCFinder_OnScanFinished(FileSyncStatus s)
 	}
 }
 
+static DirScanNode DirScanNode_Create(DirScanNode parent, const char *path)
+{
+	size_t len = strlen(path) + 1;
+	DirScanNode node = NEW(DirScanNodeRec, 1);
+
+	node->path = malloc(sizeof(char) * len);
+	strncpy(node->path, path, len);
+	/* 目录自身的文件列表也算作一个未完成的子项 */
+	node->pending = 1;
+	node->failed = FALSE;
+	node->parent = parent;
+	if (parent) {
+		LCUIMutex_Lock(&scan_mutex);
+		parent->pending += 1;
+		LCUIMutex_Unlock(&scan_mutex);
+	}
+	return node;
+}
+
+static void DirScanNode_AddPending(DirScanNode node)
+{
+	LCUIMutex_Lock(&scan_mutex);
+	node->pending += 1;
+	LCUIMutex_Unlock(&scan_mutex);
+}
+
+/**
+ * 完成目录中的一个子项的扫描
+ * 当目录的所有子项都已完成扫描时，将它记录到检查点中，然后通知上级目录
+ */
+static void DirScanNode_Done(DirScanNode node, SyncTask task, LCUI_BOOL ok)
+{
+	DirScanNode parent;
+
+	LCUIMutex_Lock(&scan_mutex);
+	while (node) {
+		if (!ok) {
+			node->failed = TRUE;
+		}
+		node->pending -= 1;
+		if (node->pending > 0) {
+			break;
+		}
+		ok = !node->failed;
+		if (ok) {
+			SyncTask_SetDirSynced(task, node->path);
+		}
+		parent = node->parent;
+		free(node->path);
+		free(node);
+		node = parent;
+	}
+	LCUIMutex_Unlock(&scan_mutex);
+}
+
+/**
+ * 从文件头中读取新增或有改动的图片的尺寸
+ * 有了尺寸，缩略图列表在缩略图载入前就能按正确的宽高比排版。在扫描阶段
+ * 读取，保存阶段写入数据库时就不必在事务中访问文件。
+ */
+static void ScanProbeImageSize(FileSyncDataPack pack)
+{
+	unsigned width = 0, height = 0;
+
+	if (ImageProbe_GetSizeW(pack->path, &width, &height) == 0) {
+		SyncTask_SetImageSize(pack->status->task, pack->utf8_path,
+				      width, height);
+	}
+}
+
 static void LCFinder_OnScanFile(FileStatus *status, void *data)
 {
 	unsigned int ctime, mtime;
@@ -427,9 +733,17 @@ static void LCFinder_OnScanFile(FileStatus *status, void *data)
 	}
 	ctime = (unsigned int)status->ctime;
 	mtime = (unsigned int)status->mtime;
-	SyncTask_AddFileW(pack->status->task, pack->path, ctime, mtime);
+	if (SyncTask_AddFile(pack->status->task, pack->utf8_path,
+			     ctime, mtime) > 0) {
+		ScanProbeImageSize(pack);
+	}
 finish:
+	DirScanNode_Done(pack->node, pack->status->task, TRUE);
 	pack->status->scaned_files += 1;
+	FileSyncStatus_UpdatePhase(pack->status, SYNC_PHASE_STAT,
+				   pack->status->scaned_files);
+	FileSyncStatus_UpdateRate(pack->status, pack->status->scaned_files,
+				  pack->status->files);
 	if (pack->status->scaned_dirs == pack->status->dirs &&
 	    pack->status->scaned_files == pack->status->files) {
 		LCFinder_OnScanFinished(pack->status);
@@ -437,7 +751,8 @@ finish:
 	free(pack);
 }
 
-static void LCFinder_ScanFile(FileSyncStatus s, const wchar_t *path)
+static void LCFinder_ScanFile(FileSyncStatus s, const wchar_t *path,
+			      const char *utf8_path, DirScanNode node)
 {
 	size_t len;
 	FileSyncDataPack pack;
@@ -448,9 +763,14 @@ static void LCFinder_ScanFile(FileSyncStatus s, const wchar_t *path)
 	if (path[len - 1] == PATH_SEP) {
 		pack->path[len - 1] = 0;
 	}
+	strncpy(pack->utf8_path, utf8_path, UTF8_PATH_LEN - 1);
+	pack->utf8_path_len = strlen(pack->utf8_path);
 	pack->status = s;
 	pack->path_len = len;
+	pack->node = node;
 	pack->status->files += 1;
+	FileSyncStatus_BeginPhase(s, SYNC_PHASE_STAT);
+	DirScanNode_AddPending(node);
 	FileStorage_GetStatus(finder.storage, pack->path, FALSE,
 			      LCFinder_OnScanFile, pack);
 }
@@ -460,11 +780,21 @@ static void LCFinder_OnScanDir(FileStatus *status, FileStream stream,
 {
 	char *p;
 	char buf[PATH_LEN];
-	size_t max_len;
+	size_t max_len, utf8_max_len;
 	wchar_t *name;
+	char *utf8_name;
 	wchar_t path[PATH_LEN];
+	char utf8_path[UTF8_PATH_LEN];
 	FileSyncDataPack pack = data;
 
+	/* 源文件夹不可用时不能认为其中的文件都已被删除 */
+	if (!pack->node->parent) {
+		if (!status || !stream) {
+			SyncTask_SetOffline(pack->status->task);
+		} else {
+			SyncTask_SetVolume(pack->status->task, status->volume);
+		}
+	}
 	if (!status || !stream) {
 		goto finish;
 	}
@@ -477,6 +807,16 @@ static void LCFinder_OnScanDir(FileStatus *status, FileStream stream,
 		path[pack->path_len + 1] = 0;
 		name += 1;
 	}
+	/* 目录列表中的文件名本身就是 UTF-8 编码的，直接拼接出缓存的键 */
+	utf8_path[UTF8_PATH_LEN - 1] = 0;
+	utf8_name = utf8_path + pack->utf8_path_len;
+	strncpy(utf8_path, pack->utf8_path, UTF8_PATH_LEN - 1);
+	if (utf8_path[pack->utf8_path_len - 1] != PATH_SEP) {
+		utf8_path[pack->utf8_path_len] = PATH_SEP;
+		utf8_path[pack->utf8_path_len + 1] = 0;
+		utf8_name += 1;
+	}
+	utf8_max_len = UTF8_PATH_LEN - (utf8_name - utf8_path) - 1;
 	while (1) {
 		p = FileStream_ReadLine(stream, buf, PATH_LEN - 1);
 		if (!p) {
@@ -485,15 +825,24 @@ static void LCFinder_OnScanDir(FileStatus *status, FileStream stream,
 		buf[PATH_LEN - 1] = 0;
 		buf[strlen(buf) - 1] = 0;
 		LCUI_DecodeString(name, buf + 1, max_len, ENCODING_UTF8);
+		strncpy(utf8_name, buf + 1, utf8_max_len);
 		if (buf[0] == 'd') {
-			LCFinder_ScanDir(pack->status, path);
+			/* 跳过上次同步中断前已完成扫描的目录 */
+			if (!SyncTask_IsDirSynced(pack->status->task,
+						  utf8_path)) {
+				LCFinder_ScanDir(pack->status, path,
+						 utf8_path, pack->node);
+			}
 			continue;
 		}
-		LCFinder_ScanFile(pack->status, path);
+		LCFinder_ScanFile(pack->status, path, utf8_path, pack->node);
 	}
 
 finish:
+	DirScanNode_Done(pack->node, pack->status->task, status && stream);
 	pack->status->scaned_dirs += 1;
+	FileSyncStatus_UpdatePhase(pack->status, SYNC_PHASE_LIST,
+				   pack->status->scaned_dirs);
 	if (pack->status->scaned_dirs == pack->status->dirs &&
 	    pack->status->scaned_files == pack->status->files) {
 		LCFinder_OnScanFinished(pack->status);
@@ -501,7 +850,8 @@ finish:
 	free(pack);
 }
 
-static void LCFinder_ScanDir(FileSyncStatus s, const wchar_t *path)
+static void LCFinder_ScanDir(FileSyncStatus s, const wchar_t *path,
+			     const char *utf8_path, DirScanNode parent)
 {
 	size_t len;
 	FileSyncDataPack pack;
@@ -515,7 +865,16 @@ static void LCFinder_ScanDir(FileSyncStatus s, const wchar_t *path)
 	pack->status = s;
 	pack->path[len] = 0;
 	pack->path_len = len;
+	len = min(strlen(utf8_path), UTF8_PATH_LEN - 1);
+	strncpy(pack->utf8_path, utf8_path, UTF8_PATH_LEN - 1);
+	if (len > 1 && utf8_path[len - 1] == PATH_SEP) {
+		len -= 1;
+	}
+	pack->utf8_path[len] = 0;
+	pack->utf8_path_len = len;
+	pack->node = DirScanNode_Create(parent, pack->utf8_path);
 	pack->status->dirs += 1;
+	FileSyncStatus_BeginPhase(s, SYNC_PHASE_LIST);
 	FileStorage_GetFile(finder.storage_for_scan, path, LCFinder_OnScanDir,
 			    pack);
 }
@@ -530,7 +889,12 @@ static void LCFinder_SwitchTask(FileSyncStatus s)
 		dir = finder.dirs[s->task_i];
 		path = DecodeUTF8(dir->path);
 		LOG("[scanner] task %lu started, path: %ls\n", s->task_i, path);
-		LCFinder_ScanDir(s, path);
+		if (SyncTask_IsDirSynced(s->task, dir->path)) {
+			free(path);
+			LCFinder_OnScanFinished(s);
+			return;
+		}
+		LCFinder_ScanDir(s, path, dir->path, NULL);
 		free(path);
 	} else {
 		LCFinder_OnScanFinished(s);
@@ -553,7 +917,11 @@ void LCFinder_SyncFilesAsync(FileSyncStatus s)
 	s->synced_files = 0;
 	s->scaned_files = 0;
 	s->scaned_dirs = 0;
+	s->offline_dirs = 0;
 	s->deleted_files = 0;
+	s->changed_files = 0;
+	s->start_time = LCUI_GetTime();
+	FileSyncStatus_ResetStats(s);
 	s->state = STATE_STARTED;
 	if (finder.n_dirs < 1) {
 		s->tasks = NULL;
@@ -696,6 +1064,7 @@ static int LCFinder_InitFileDB(void)
 	ASSERT(DB_Init(path) == 0);
 	finder.n_dirs = DB_GetDirs(&finder.dirs);
 	finder.n_tags = DB_GetTags(&finder.tags);
+	finder.offline_dirs = StrDict_Create(NULL, NULL);
 	free(path);
 	return 0;
 
@@ -717,6 +1086,8 @@ static void LCFinder_FreeFileDB(void)
 		DBTag_Release(finder.tags[i]);
 		finder.tags[i] = NULL;
 	}
+	StrDict_Release(finder.offline_dirs);
+	finder.offline_dirs = NULL;
 	DB_Exit();
 }
 
@@ -797,74 +1168,387 @@ static void LCFinder_FreeLanguage(void)
 	I18n_Clear();
 }
 
-static void ThumbDBDict_ValDel(void *privdata, void *val)
+static void OnWriteThumbFailure(int dir_id, const char *filepath,
+				uint32_t modify_time, void *data)
 {
-	ThumbDB_Close(val);
+	size_t i;
+	FILE *fp = data;
+	char path[PATH_LEN];
+
+	for (i = 0; i < finder.n_dirs; ++i) {
+		if (finder.dirs[i] && finder.dirs[i]->id == dir_id) {
+			pathjoin(path, finder.dirs[i]->path, filepath);
+			fprintf(fp, "%u\t%s\n", (unsigned)modify_time, path);
+			return;
+		}
+	}
+	/* 源文件夹已被移除，它的记录会在下次清理时删除 */
+	fprintf(fp, "%u\t%d:%s\n", (unsigned)modify_time, dir_id, filepath);
+}
+
+/**
+ * 列出无法生成缩略图的文件
+ * 如果设置了 LCFINDER_THUMB_FAILURES 环境变量，则将这些文件的修改时间和路径
+ * 写入它指定的文件中，便于排查缩略图无法显示的原因
+ */
+static void LCFinder_ReportThumbFailures(void)
+{
+	FILE *fp;
+	size_t n;
+	const char *report_file;
+
+	report_file = getenv("LCFINDER_THUMB_FAILURES");
+	if (!report_file || !report_file[0]) {
+		return;
+	}
+	fp = fopen(report_file, "w");
+	if (!fp) {
+		LOG("[thumbdb] cannot open report file: %s\n", report_file);
+		return;
+	}
+	n = ThumbDB_EachFailure(finder.thumb_db, OnWriteThumbFailure, fp);
+	fclose(fp);
+	LOG("[thumbdb] %lu files cannot be decoded, see %s\n",
+	    (unsigned long)n, report_file);
 }
 
 /** 初始化缩略图数据库 */
 static int LCFinder_InitThumbDB(void)
 {
 	size_t i;
-	wchar_t *path;
+	char path[PATH_LEN];
+
 	LOG("[thumbdb] init ...\n");
-	finder.thumb_dbs = StrDict_Create(NULL, ThumbDBDict_ValDel);
-	finder.thumb_paths = malloc(sizeof(wchar_t *) * finder.n_dirs);
-	if (!finder.thumb_dbs || !finder.thumb_paths) {
-		return -ENOMEM;
-	}
 	for (i = 0; i < finder.n_dirs; ++i) {
-		if (!finder.dirs[i]) {
-			continue;
+		if (finder.dirs[i]) {
+			LCFinder_RemoveLegacyThumbDB(finder.dirs[i]->path);
 		}
-		path = LCFinder_CreateThumbDB(finder.dirs[i]->path);
-		finder.thumb_paths[i] = path;
-		LOGW(L"[thumbdb] %d: %s\n", i, path);
 	}
+	LCFinder_GetThumbDBPath(path);
+	finder.thumb_db = ThumbDB_Open(path);
+	if (!finder.thumb_db) {
+		return -ENOMEM;
+	}
+	LOG("[thumbdb] %s\n", path);
+	LCFinder_ReportThumbFailures();
 	LOG("[thumbdb] init done\n");
 	return 0;
 }
 
+/**
+ * 缩略图数据库的维护线程
+ * 定期保存缩略图的访问时间，并在缓存超出空间上限时淘汰最久未访问的缩略图，
+ * 清除缓存也由它来做，以免界面线程等待正在进行的维护
+ */
+static struct ThumbDBMaintainerRec_ {
+	LCUI_BOOL is_running;
+	LCUI_BOOL clear_requested;	/**< 是否需要清除缩略图数据库 */
+	LCUI_Thread thread;
+	LCUI_Cond cond;
+	LCUI_Mutex mutex;		/**< 只保护以上的状态，维护期间不持有 */
+} thumb_maintainer;
+
+static void LCFinder_ThumbDBMaintainerThread(void *arg)
+{
+	int64_t max_size;
+	LCUI_BOOL clear;
+
+	LCUIMutex_Lock(&thumb_maintainer.mutex);
+	while (thumb_maintainer.is_running) {
+		if (!thumb_maintainer.clear_requested) {
+			LCUICond_TimedWait(&thumb_maintainer.cond,
+					   &thumb_maintainer.mutex,
+					   THUMB_DB_MAINTAIN_INTERVAL);
+		}
+		if (!thumb_maintainer.is_running || !finder.thumb_db) {
+			continue;
+		}
+		clear = thumb_maintainer.clear_requested;
+		thumb_maintainer.clear_requested = FALSE;
+		LCUIMutex_Unlock(&thumb_maintainer.mutex);
+		/* 数据库实例在退出前不会被替换，它自己的分片锁足以保护读写 */
+		if (clear) {
+			ThumbDB_Clear(finder.thumb_db);
+			LCFinder_TriggerEvent(EVENT_THUMBDB_DEL_DONE, NULL);
+		} else {
+			max_size = finder.config.thumb_db_max_size;
+			max_size *= 1024 * 1024;
+			ThumbDB_Maintain(finder.thumb_db, max_size);
+		}
+		LCUIMutex_Lock(&thumb_maintainer.mutex);
+	}
+	LCUIMutex_Unlock(&thumb_maintainer.mutex);
+	LCUIThread_Exit(NULL);
+}
+
+static void LCFinder_InitThumbDBMaintainer(void)
+{
+	LCUICond_Init(&thumb_maintainer.cond);
+	LCUIMutex_Init(&thumb_maintainer.mutex);
+	thumb_maintainer.is_running = TRUE;
+	thumb_maintainer.clear_requested = FALSE;
+	LCUIThread_Create(&thumb_maintainer.thread,
+			  LCFinder_ThumbDBMaintainerThread, NULL);
+}
+
+static void LCFinder_FreeThumbDBMaintainer(void)
+{
+	if (!thumb_maintainer.is_running) {
+		return;
+	}
+	LCUIMutex_Lock(&thumb_maintainer.mutex);
+	thumb_maintainer.is_running = FALSE;
+	LCUICond_Signal(&thumb_maintainer.cond);
+	LCUIMutex_Unlock(&thumb_maintainer.mutex);
+	LCUIThread_Join(thumb_maintainer.thread, NULL);
+	LCUICond_Destroy(&thumb_maintainer.cond);
+	LCUIMutex_Destroy(&thumb_maintainer.mutex);
+}
+
+void LCFinder_SetThumbDBMaxSize(int size)
+{
+	finder.config.thumb_db_max_size = max(size, 0);
+	LCFinder_SaveConfig();
+	/* 不等待正在进行的维护结束，以免阻塞界面，错过的通知会在下次超时后补上 */
+	LCUICond_Signal(&thumb_maintainer.cond);
+}
+
+/**
+ * 缩略图预生成器
+ * 同步完成后，在后台为新增和有改动的图片生成缩略图，以免第一次浏览新导入的
+ * 文件夹时要等待解码。每生成一张缩略图就休息相同的时长，以控制 CPU 和磁盘的
+ * 占用，界面在加载缩略图时它会暂停，等界面空闲后再继续。
+ */
+static struct ThumbPregenRec_ {
+	LCUI_BOOL is_running;
+	LCUI_BOOL has_result;		/**< 是否已收到缩略图请求的结果 */
+	int storage;			/**< 专用的文件服务连接，以免排在界面的请求前面 */
+	int64_t active_time;		/**< 界面最近一次加载缩略图的时间 */
+	LinkedList files;		/**< 待生成缩略图的文件 */
+	ThumbDataRec result;		/**< 缩略图请求的结果 */
+	LCUI_Thread thread;
+	LCUI_Cond cond;
+	LCUI_Mutex mutex;
+} thumb_pregen;
+
+static void OnPregenThumbnail(FileStatus *status, LCUI_Graph *thumb,
+			      void *data)
+{
+	LCUIMutex_Lock(&thumb_pregen.mutex);
+	thumb_pregen.has_result = TRUE;
+	Graph_Init(&thumb_pregen.result.graph);
+	thumb_pregen.result.modify_time = 0;
+	/* 文件无法解码时只记下它的修改时间 */
+	if (status && !thumb) {
+		thumb_pregen.result.modify_time = (uint_t)status->mtime;
+	} else if (thumb_pregen.is_running && status && status->image &&
+		   thumb) {
+		thumb_pregen.result.origin_width = status->image->width;
+		thumb_pregen.result.origin_height = status->image->height;
+		thumb_pregen.result.modify_time = (uint_t)status->mtime;
+		thumb_pregen.result.graph = *thumb;
+		/* 重置数据，避免被释放 */
+		Graph_Init(thumb);
+	}
+	LCUICond_Signal(&thumb_pregen.cond);
+	LCUIMutex_Unlock(&thumb_pregen.mutex);
+}
+
+/** 为文件生成缩略图，已有最新的缩略图或失败记录时跳过 */
+static void LCFinder_PregenThumb(ThumbPregenItem item)
+{
+	int ret = -1;
+	wchar_t *wpath;
+	ThumbDataRec tdata;
+
+	if (finder.thumb_db) {
+		ret = ThumbDB_Load(finder.thumb_db, item->dir_id, item->path,
+				   1, 1, &tdata);
+	}
+	if (ret == 0 || ret == THUMB_DB_FAILURE) {
+		Graph_Free(&tdata.graph);
+		if (tdata.modify_time == item->modify_time) {
+			return;
+		}
+	}
+	wpath = DecodeUTF8(item->fullpath);
+	LCUIMutex_Lock(&thumb_pregen.mutex);
+	thumb_pregen.has_result = FALSE;
+	thumb_pregen.result.modify_time = 0;
+	if (FileStorage_GetThumbnail(thumb_pregen.storage, wpath, 0,
+				     THUMB_MAX_WIDTH * THUMB_MAX_SCALE,
+				     OnPregenThumbnail, NULL) != 0) {
+		thumb_pregen.has_result = TRUE;
+		Graph_Init(&thumb_pregen.result.graph);
+	}
+	while (thumb_pregen.is_running && !thumb_pregen.has_result) {
+		LCUICond_Wait(&thumb_pregen.cond, &thumb_pregen.mutex);
+	}
+	tdata = thumb_pregen.result;
+	Graph_Init(&thumb_pregen.result.graph);
+	LCUIMutex_Unlock(&thumb_pregen.mutex);
+	free(wpath);
+	if (!Graph_IsValid(&tdata.graph)) {
+		if (tdata.modify_time == 0) {
+			return;
+		}
+		if (finder.thumb_db) {
+			ThumbDB_SaveFailure(finder.thumb_db, item->dir_id,
+					    item->path, tdata.modify_time);
+		}
+		return;
+	}
+	if (finder.thumb_db) {
+		ThumbDB_Save(finder.thumb_db, item->dir_id, item->path,
+			     &tdata);
+	}
+	Graph_Free(&tdata.graph);
+}
+
+/** 缓存已超出空间上限时，生成的缩略图只会挤掉用户看过的缩略图 */
+static LCUI_BOOL LCFinder_IsThumbDBFull(void)
+{
+	int64_t max_size = finder.config.thumb_db_max_size;
+
+	max_size *= 1024 * 1024;
+	return max_size > 0 && LCFinder_GetThumbDBTotalSize() >= max_size;
+}
+
+static void LCFinder_ThumbPregenThread(void *arg)
+{
+	int64_t t;
+	ThumbPregenItem item;
+
+	LCUIMutex_Lock(&thumb_pregen.mutex);
+	while (thumb_pregen.is_running) {
+		if (!finder.config.thumb_pregen ||
+		    thumb_pregen.files.length < 1) {
+			LCUICond_Wait(&thumb_pregen.cond, &thumb_pregen.mutex);
+			continue;
+		}
+		t = LCUI_GetTimeDelta(thumb_pregen.active_time);
+		if (t < THUMB_PREGEN_IDLE_TIME) {
+			LCUICond_TimedWait(&thumb_pregen.cond,
+					   &thumb_pregen.mutex,
+					   (unsigned)(THUMB_PREGEN_IDLE_TIME - t));
+			continue;
+		}
+		item = LinkedList_Get(&thumb_pregen.files, 0);
+		LinkedList_Delete(&thumb_pregen.files, 0);
+		LCUIMutex_Unlock(&thumb_pregen.mutex);
+		if (LCFinder_IsThumbDBFull()) {
+			LOG("[thumbdb] cache is full, stop generating\n");
+			ThumbPregenItem_Destroy(item);
+			LCUIMutex_Lock(&thumb_pregen.mutex);
+			LinkedList_ClearData(&thumb_pregen.files,
+					     ThumbPregenItem_Destroy);
+			continue;
+		}
+		t = LCUI_GetTime();
+		LCFinder_PregenThumb(item);
+		ThumbPregenItem_Destroy(item);
+		t = max(LCUI_GetTimeDelta(t), THUMB_PREGEN_MIN_INTERVAL);
+		LCUIMutex_Lock(&thumb_pregen.mutex);
+		if (thumb_pregen.is_running) {
+			LCUICond_TimedWait(&thumb_pregen.cond,
+					   &thumb_pregen.mutex, (unsigned)t);
+		}
+	}
+	LCUIMutex_Unlock(&thumb_pregen.mutex);
+	LCUIThread_Exit(NULL);
+}
+
+static void LCFinder_StartThumbPregen(LinkedList *files)
+{
+	if (!thumb_pregen.is_running) {
+		LinkedList_ClearData(files, ThumbPregenItem_Destroy);
+		return;
+	}
+	LCUIMutex_Lock(&thumb_pregen.mutex);
+	LOG("[thumbdb] %lu files are waiting for thumbnails\n",
+	    (unsigned long)(thumb_pregen.files.length + files->length));
+	LinkedList_Concat(&thumb_pregen.files, files);
+	LCUICond_Signal(&thumb_pregen.cond);
+	LCUIMutex_Unlock(&thumb_pregen.mutex);
+}
+
+void LCFinder_YieldThumbPregen(void)
+{
+	if (!thumb_pregen.is_running) {
+		return;
+	}
+	LCUIMutex_Lock(&thumb_pregen.mutex);
+	thumb_pregen.active_time = LCUI_GetTime();
+	LCUIMutex_Unlock(&thumb_pregen.mutex);
+}
+
+void LCFinder_SetThumbPregenEnabled(LCUI_BOOL enabled)
+{
+	finder.config.thumb_pregen = enabled;
+	LCFinder_SaveConfig();
+	LCUIMutex_Lock(&thumb_pregen.mutex);
+	LCUICond_Signal(&thumb_pregen.cond);
+	LCUIMutex_Unlock(&thumb_pregen.mutex);
+}
+
+static void LCFinder_InitThumbPregen(void)
+{
+	LCUICond_Init(&thumb_pregen.cond);
+	LCUIMutex_Init(&thumb_pregen.mutex);
+	LinkedList_Init(&thumb_pregen.files);
+	thumb_pregen.storage = FileStorage_Connect();
+	thumb_pregen.active_time = 0;
+	thumb_pregen.is_running = TRUE;
+	LCUIThread_Create(&thumb_pregen.thread, LCFinder_ThumbPregenThread,
+			  NULL);
+}
+
+static void LCFinder_FreeThumbPregen(void)
+{
+	if (!thumb_pregen.is_running) {
+		return;
+	}
+	LCUIMutex_Lock(&thumb_pregen.mutex);
+	thumb_pregen.is_running = FALSE;
+	LCUICond_Signal(&thumb_pregen.cond);
+	LCUIMutex_Unlock(&thumb_pregen.mutex);
+	LCUIThread_Join(thumb_pregen.thread, NULL);
+	FileStorage_Close(thumb_pregen.storage);
+	LinkedList_ClearData(&thumb_pregen.files, ThumbPregenItem_Destroy);
+	LCUICond_Destroy(&thumb_pregen.cond);
+	LCUIMutex_Destroy(&thumb_pregen.mutex);
+}
+
 /** 退出缩略图数据库 */
 static void LCFinder_FreeThumbDB(void)
 {
-	size_t i;
-	if (!finder.thumb_dbs) {
+	if (!finder.thumb_db) {
 		return;
 	}
 	LOG("[thumbdb] exit ..\n");
-	StrDict_Release(finder.thumb_dbs);
-	for (i = 0; i < finder.n_dirs; ++i) {
-		free(finder.thumb_paths[i]);
-		finder.thumb_paths[i] = NULL;
-	}
-	free(finder.thumb_paths);
-	finder.thumb_paths = NULL;
-	finder.thumb_dbs = NULL;
+	ThumbDB_Close(finder.thumb_db);
+	finder.thumb_db = NULL;
 	LOG("[thumbdb] exit done\n");
 }
 
-/** 清除缩略图数据库 */
+/**
+ * 清除缩略图数据库
+ * 清除操作交给维护线程在后台进行，完成后触发 EVENT_THUMBDB_DEL_DONE 事件。
+ * 数据库实例不会被替换，正在载入缩略图的线程可以继续使用它
+ */
 void LCFinder_ClearThumbDB(void)
 {
-	size_t i;
-	wchar_t *path;
-	char *apath;
-
-	Dict_Release(finder.thumb_dbs);
-	for (i = 0; i < finder.n_dirs; ++i) {
-		path = finder.thumb_paths[i];
-		apath = EncodeANSI(path);
-		finder.thumb_paths[i] = NULL;
-		ThumbDB_DestroyDB(apath);
-		free(path);
-		free(apath);
+	if (!thumb_maintainer.is_running) {
+		if (finder.thumb_db) {
+			ThumbDB_Clear(finder.thumb_db);
+		}
+		LCFinder_TriggerEvent(EVENT_THUMBDB_DEL_DONE, NULL);
+		return;
 	}
-	free(finder.thumb_paths);
-	finder.thumb_paths = NULL;
-	finder.thumb_dbs = NULL;
-	LCFinder_InitThumbDB();
-	LCFinder_TriggerEvent(EVENT_THUMBDB_DEL_DONE, NULL);
+	LCUIMutex_Lock(&thumb_maintainer.mutex);
+	thumb_maintainer.clear_requested = TRUE;
+	LCUICond_Signal(&thumb_maintainer.cond);
+	LCUIMutex_Unlock(&thumb_maintainer.mutex);
 }
 
 static int LCFinder_InitFileStorage(void)
@@ -943,11 +1627,14 @@ int LCFinder_LoadConfig(void)
 {
 	FILE *file;
 	char *path;
+	size_t size = 0;
 	FinderConfigRec config;
 	wchar_t wpath[PATH_LEN];
 	LCUI_BOOL has_error = TRUE;
 
 	finder.config.scaling = 100;
+	finder.config.thumb_db_max_size = THUMB_DB_MAX_SIZE;
+	finder.config.thumb_pregen = TRUE;
 	finder.config.encrypted_password[0] = 0;
 	finder.config.version.type = LCFINDER_VER_TYPE;
 	finder.config.version.major = LCFINDER_VER_MAJOR;
@@ -959,7 +1646,10 @@ int LCFinder_LoadConfig(void)
 	path = EncodeANSI(wpath);
 	file = fopen(path, "rb");
 	if (file) {
-		if (fread(&config, sizeof(config), 1, file) == 1 &&
+		/* 旧版本的配置文件中没有后来新增的配置项，它们保持默认值 */
+		config = finder.config;
+		size = fread(&config, 1, sizeof(config), file);
+		if (size >= offsetof(FinderConfigRec, thumb_db_max_size) &&
 		    strcmp(finder.config.head, config.head) == 0) {
 			has_error = FALSE;
 			finder.config = config;
@@ -969,7 +1659,10 @@ int LCFinder_LoadConfig(void)
 	if (finder.config.scaling < 100 || finder.config.scaling > 200) {
 		finder.config.scaling = 100;
 	}
-	if (has_error) {
+	if (finder.config.thumb_db_max_size < 0) {
+		finder.config.thumb_db_max_size = THUMB_DB_MAX_SIZE;
+	}
+	if (has_error || size < sizeof(config)) {
 		LCFinder_SaveConfig();
 	}
 	finder.open_private_space = FALSE;
@@ -1003,13 +1696,16 @@ int LCFinder_Init(int argc, char **argv)
 #endif
 	LCFinder_InitEvent();
 	LCFinder_InitLicense();
+	LCUIMutex_Init(&scan_mutex);
 	ASSERT(LCFinder_InitWorkDir() == 0);
 	ASSERT(LCFinder_LoadConfig() == 0);
 	ASSERT(LCFinder_InitLanguage() == 0);
 	ASSERT(LCFinder_InitFileDB() == 0);
 	ASSERT(LCFinder_InitThumbDB() == 0);
 	ASSERT(LCFinder_InitThumbCache() == 0);
+	LCFinder_InitThumbDBMaintainer();
 	ASSERT(LCFinder_InitFileStorage() == 0);
+	LCFinder_InitThumbPregen();
 	ASSERT(UI_Init(argc, argv) == 0);
 	finder.state = FINDER_STATE_ACTIVATED;
 	return 0;
@@ -1022,6 +1718,8 @@ error:
 void LCFinder_Exit(void)
 {
 	UI_Free();
+	LCFinder_FreeThumbPregen();
+	LCFinder_FreeThumbDBMaintainer();
 	LCFinder_FreeThumbDB();
 	LCFinder_FreeFileStorage();
 	LCFinder_FreeFileDB();
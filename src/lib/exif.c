@@ -0,0 +1,455 @@
+﻿/* ***************************************************************************
+ * exif.c -- EXIF information reader for JPEG files.
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * exif.c -- JPEG 文件的 EXIF 信息读取
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include <LCUI/image.h>
+#include "exif.h"
+
+#define JPEG_MARKER_SOI		0xd8
+#define JPEG_MARKER_EOI		0xd9
+#define JPEG_MARKER_SOS		0xda
+#define JPEG_MARKER_APP1	0xe1
+#define TIFF_TAG_ORIENTATION	0x0112
+#define TIFF_TAG_JPEG_OFFSET	0x0201
+#define TIFF_TAG_JPEG_LENGTH	0x0202
+
+/** 只读取文件头时，EXIF 数据最多读取的字节数，IFD0 通常位于最前面的几百字节内 */
+#define EXIF_HEADER_MAX_SIZE	4096
+
+/** 数据源，可以是文件，也可以是内存中的数据 */
+typedef struct ExifStreamRec_ {
+	FILE *fp;
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+	size_t exif_limit;	/**< 最多读取 EXIF 数据的字节数，为 0 时不限制 */
+} ExifStreamRec, *ExifStream;
+
+/** TIFF 格式的数据，EXIF 信息就是以这种格式存储的 */
+typedef struct TiffDataRec_ {
+	const unsigned char *data;
+	size_t size;
+	LCUI_BOOL little_endian;
+} TiffDataRec, *TiffData;
+
+static LCUI_BOOL ExifStream_Read(ExifStream s, void *buf, size_t size)
+{
+	if (s->fp) {
+		return fread(buf, 1, size, s->fp) == size;
+	}
+	if (size > s->size - s->pos) {
+		return FALSE;
+	}
+	memcpy(buf, s->data + s->pos, size);
+	s->pos += size;
+	return TRUE;
+}
+
+static LCUI_BOOL ExifStream_Skip(ExifStream s, size_t size)
+{
+	if (s->fp) {
+		return fseek(s->fp, (long)size, SEEK_CUR) == 0;
+	}
+	if (size > s->size - s->pos) {
+		return FALSE;
+	}
+	s->pos += size;
+	return TRUE;
+}
+
+static unsigned Tiff_Get16(TiffData tiff, size_t offset)
+{
+	const unsigned char *p = tiff->data + offset;
+
+	if (offset + 2 > tiff->size) {
+		return 0;
+	}
+	if (tiff->little_endian) {
+		return p[0] | (p[1] << 8);
+	}
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t Tiff_Get32(TiffData tiff, size_t offset)
+{
+	const unsigned char *p = tiff->data + offset;
+
+	if (offset + 4 > tiff->size) {
+		return 0;
+	}
+	if (tiff->little_endian) {
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/**
+ * 读取 IFD 中的标签
+ * @returns 下一个 IFD 的偏移量，没有时返回 0
+ */
+static uint32_t Tiff_ReadIFD(TiffData tiff, uint32_t offset, ExifInfo info,
+			     uint32_t *thumb_offset, uint32_t *thumb_length)
+{
+	unsigned i, count, tag;
+	size_t entry;
+
+	if (offset < 8 || offset + 2 > tiff->size) {
+		return 0;
+	}
+	count = Tiff_Get16(tiff, offset);
+	if (offset + 2 + count * 12 + 4 > tiff->size) {
+		return 0;
+	}
+	for (i = 0; i < count; ++i) {
+		entry = offset + 2 + i * 12;
+		tag = Tiff_Get16(tiff, entry);
+		/* 值不超过 4 个字节时直接存放在条目的最后 4 个字节中 */
+		switch (tag) {
+		case TIFF_TAG_ORIENTATION:
+			if (thumb_offset) {
+				break;
+			}
+			info->orientation = Tiff_Get16(tiff, entry + 8);
+			if (info->orientation < 1 || info->orientation > 8) {
+				info->orientation = 1;
+			}
+			break;
+		case TIFF_TAG_JPEG_OFFSET:
+			if (thumb_offset) {
+				*thumb_offset = Tiff_Get32(tiff, entry + 8);
+			}
+			break;
+		case TIFF_TAG_JPEG_LENGTH:
+			if (thumb_length) {
+				*thumb_length = Tiff_Get32(tiff, entry + 8);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return Tiff_Get32(tiff, offset + 2 + count * 12);
+}
+
+/** 解析 APP1 段中的 EXIF 信息，IFD0 记录了方向，IFD1 记录了缩略图的位置 */
+static void Exif_ParseTiff(const unsigned char *data, size_t size,
+			   ExifInfo info)
+{
+	TiffDataRec tiff;
+	uint32_t offset, thumb_offset = 0, thumb_length = 0;
+
+	if (size < 8 || (memcmp(data, "II", 2) != 0 &&
+			 memcmp(data, "MM", 2) != 0)) {
+		return;
+	}
+	tiff.data = data;
+	tiff.size = size;
+	tiff.little_endian = data[0] == 'I';
+	if (Tiff_Get16(&tiff, 2) != 42) {
+		return;
+	}
+	offset = Tiff_ReadIFD(&tiff, Tiff_Get32(&tiff, 4), info, NULL, NULL);
+	if (offset == 0) {
+		return;
+	}
+	Tiff_ReadIFD(&tiff, offset, info, &thumb_offset, &thumb_length);
+	if (thumb_offset == 0 || thumb_length == 0 || thumb_offset > size ||
+	    thumb_length > size - thumb_offset) {
+		return;
+	}
+	info->thumb = malloc(thumb_length);
+	if (info->thumb) {
+		memcpy(info->thumb, data + thumb_offset, thumb_length);
+		info->thumb_size = thumb_length;
+	}
+}
+
+static LCUI_BOOL Jpeg_IsSOF(int marker)
+{
+	/* 0xc4、0xc8 和 0xcc 分别是 DHT、JPG 和 DAC，不是帧的开始 */
+	return marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 &&
+	       marker != 0xc8 && marker != 0xcc;
+}
+
+/**
+ * 逐段读取 JPEG 数据，直到遇到 SOF 段
+ * @param[in] info 不为 NULL 时，解析遇到的 EXIF 信息
+ */
+static int Jpeg_ReadSegments(ExifStream s, unsigned *width, unsigned *height,
+			     ExifInfo info)
+{
+	size_t len, size;
+	unsigned char buf[5];
+	unsigned char *data;
+	int marker;
+
+	if (!ExifStream_Read(s, buf, 2) || buf[0] != 0xff ||
+	    buf[1] != JPEG_MARKER_SOI) {
+		return -1;
+	}
+	while (1) {
+		if (!ExifStream_Read(s, buf, 1)) {
+			return -1;
+		}
+		if (buf[0] != 0xff) {
+			continue;
+		}
+		do {
+			if (!ExifStream_Read(s, buf, 1)) {
+				return -1;
+			}
+		} while (buf[0] == 0xff);
+		marker = buf[0];
+		if (marker == JPEG_MARKER_SOS || marker == JPEG_MARKER_EOI) {
+			return -1;
+		}
+		/* 独立的标记没有长度字段 */
+		if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+			continue;
+		}
+		if (!ExifStream_Read(s, buf, 2)) {
+			return -1;
+		}
+		len = (buf[0] << 8) | buf[1];
+		if (len < 2) {
+			return -1;
+		}
+		len -= 2;
+		if (Jpeg_IsSOF(marker)) {
+			if (len < 5 || !ExifStream_Read(s, buf, 5)) {
+				return -1;
+			}
+			*height = (buf[1] << 8) | buf[2];
+			*width = (buf[3] << 8) | buf[4];
+			return 0;
+		}
+		if (info && !info->thumb && marker == JPEG_MARKER_APP1 &&
+		    len > 6) {
+			size = len;
+			if (s->exif_limit > 0 && size > s->exif_limit) {
+				size = s->exif_limit;
+			}
+			data = malloc(size);
+			if (!data) {
+				return -1;
+			}
+			if (!ExifStream_Read(s, data, size) ||
+			    !ExifStream_Skip(s, len - size)) {
+				free(data);
+				return -1;
+			}
+			if (memcmp(data, "Exif\0\0", 6) == 0) {
+				Exif_ParseTiff(data + 6, size - 6, info);
+			}
+			free(data);
+			continue;
+		}
+		if (!ExifStream_Skip(s, len)) {
+			return -1;
+		}
+	}
+	return -1;
+}
+
+int Exif_Read(FILE *fp, ExifInfo info)
+{
+	ExifStreamRec s = { 0 };
+
+	memset(info, 0, sizeof(ExifInfoRec));
+	info->orientation = 1;
+	s.fp = fp;
+	if (Jpeg_ReadSegments(&s, &info->width, &info->height, info) != 0) {
+		Exif_Destroy(info);
+		return -1;
+	}
+	if (!info->thumb) {
+		return 0;
+	}
+	s.fp = NULL;
+	s.data = info->thumb;
+	s.size = info->thumb_size;
+	if (Jpeg_ReadSegments(&s, &info->thumb_width, &info->thumb_height,
+			      NULL) != 0) {
+		free(info->thumb);
+		info->thumb = NULL;
+		info->thumb_size = 0;
+	}
+	return 0;
+}
+
+int Exif_ReadHeader(FILE *fp, ExifInfo info)
+{
+	ExifStreamRec s = { 0 };
+
+	memset(info, 0, sizeof(ExifInfoRec));
+	info->orientation = 1;
+	s.fp = fp;
+	s.exif_limit = EXIF_HEADER_MAX_SIZE;
+	if (Jpeg_ReadSegments(&s, &info->width, &info->height, info) != 0) {
+		Exif_Destroy(info);
+		return -1;
+	}
+	/* 截断的 EXIF 数据中可能恰好包含完整的缩略图，但这里用不到它 */
+	Exif_Destroy(info);
+	return 0;
+}
+
+void Exif_Destroy(ExifInfo info)
+{
+	if (info->thumb) {
+		free(info->thumb);
+	}
+	info->thumb = NULL;
+	info->thumb_size = 0;
+}
+
+int Exif_ApplyOrientation(LCUI_Graph *graph, int orientation)
+{
+	int x, y, sx, sy, width, height;
+	unsigned bpp;
+	LCUI_Graph buff;
+	const unsigned char *src;
+	unsigned char *dst;
+
+	if (orientation <= 1 || orientation > 8) {
+		return 0;
+	}
+	if (graph->color_type == LCUI_COLOR_TYPE_ARGB8888) {
+		bpp = 4;
+	} else if (graph->color_type == LCUI_COLOR_TYPE_RGB888) {
+		bpp = 3;
+	} else {
+		return -1;
+	}
+	width = graph->width;
+	height = graph->height;
+	Graph_Init(&buff);
+	buff.color_type = graph->color_type;
+	if (Exif_IsTransposed(orientation)) {
+		x = width;
+		width = height;
+		height = x;
+	}
+	if (Graph_Create(&buff, width, height) != 0) {
+		return -1;
+	}
+	/* 根据目标图像中的坐标计算它在原图像中的坐标 */
+	for (y = 0; y < height; ++y) {
+		dst = buff.bytes + y * buff.bytes_per_row;
+		for (x = 0; x < width; ++x, dst += bpp) {
+			switch (orientation) {
+			case 2: sx = width - 1 - x; sy = y; break;
+			case 3: sx = width - 1 - x; sy = height - 1 - y; break;
+			case 4: sx = x; sy = height - 1 - y; break;
+			case 5: sx = y; sy = x; break;
+			case 6: sx = y; sy = width - 1 - x; break;
+			case 7: sx = height - 1 - y; sy = width - 1 - x; break;
+			default: sx = height - 1 - y; sy = x; break;
+			}
+			src = graph->bytes + sy * graph->bytes_per_row +
+			      sx * bpp;
+			memcpy(dst, src, bpp);
+		}
+	}
+	Graph_Free(graph);
+	*graph = buff;
+	return 0;
+}
+
+static size_t ExifThumb_Read(void *data, void *buffer, size_t size)
+{
+	ExifStream s = data;
+
+	size = min(size, s->size - s->pos);
+	memcpy(buffer, s->data + s->pos, size);
+	s->pos += size;
+	return size;
+}
+
+static void ExifThumb_Skip(void *data, long offset)
+{
+	ExifStream s = data;
+
+	if (offset < 0 && (size_t)-offset > s->pos) {
+		s->pos = 0;
+	} else {
+		s->pos = min(s->size, s->pos + offset);
+	}
+}
+
+static void ExifThumb_Rewind(void *data)
+{
+	ExifStream s = data;
+
+	s->pos = 0;
+}
+
+int Exif_ReadThumbnail(ExifInfo info, LCUI_Graph *out)
+{
+	ExifStreamRec s = { 0 };
+	LCUI_ImageReaderRec reader = { 0 };
+
+	if (!info->thumb) {
+		return -1;
+	}
+	s.data = info->thumb;
+	s.size = info->thumb_size;
+	reader.stream_data = &s;
+	reader.fn_read = ExifThumb_Read;
+	reader.fn_skip = ExifThumb_Skip;
+	reader.fn_rewind = ExifThumb_Rewind;
+	Graph_Init(out);
+	if (LCUI_InitImageReader(&reader) != 0) {
+		return -1;
+	}
+	if (LCUI_SetImageReaderJump(&reader)) {
+		Graph_Free(out);
+		return -1;
+	}
+	if (LCUI_ReadImageHeader(&reader) != 0 ||
+	    LCUI_ReadImage(&reader, out) != 0) {
+		Graph_Free(out);
+		return -1;
+	}
+	return Exif_ApplyOrientation(out, info->orientation);
+}
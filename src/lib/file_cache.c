@@ -39,130 +39,175 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <LCUI_Build.h>
 #include <LCUI/LCUI.h>
+#include <LCUI/thread.h>
 #include <LCUI/font/charset.h>
 
 #include "kvdb.h"
 #include "common.h"
+#include "file_snapshot.h"
 #include "file_cache.h"
 
 #define MAX_PATH_LEN	2048
+/** 从该版本起，快照的键由 wchar_t 数组改为 UTF-8 编码的路径 */
+#define UTF8_KEY_VERSION	2
+/** 保存检查点的最小时间间隔，单位为毫秒 */
+#define CHECKPOINT_INTERVAL	30000
+/** 保存检查点所需的最少新增文件数量 */
+#define CHECKPOINT_MIN_FILES	1024
 #define WCSLEN(STR)	(sizeof( STR ) / sizeof( wchar_t ))
 #define GetDirStats(T)	(DirStats)(((char*)(T)) + sizeof(SyncTaskRec))
 
-typedef kvdb_t* FileCache;
-
 typedef struct FileInfoHanlderPackRec_ {
-	void *data;
+	int count;
+	SyncTask task;
+	FileSnapshotDiffType type;
 	FileInfoHanlder handler;
+	void *data;
 } FileInfoHanlderPackRec, *FileInfoHanlderPack;
 
+typedef struct ImageSizeRec_ {
+	unsigned int width;
+	unsigned int height;
+} ImageSizeRec, *ImageSize;
+
 /** 文件夹内的文件变更状态统计 */
 typedef struct DirStatsRec_ {
-	FileCache db;
-	Dict *files;		/**< 之前已缓存的文件列表 */
-	Dict *added_files;	/**< 新增的文件 */
-	Dict *changed_files;	/**< 已改变的文件 */
-	Dict *deleted_files;	/**< 删除的文件 */
+	FileSnapshot cache;		/**< 之前已缓存的文件列表 */
+	FileSnapshot snapshot;		/**< 本次扫描得到的文件列表 */
+	FileSnapshotWriter writer;	/**< 文件列表快照的写入器 */
+	LCUI_Mutex mutex;		/**< 扫描目录和文件的回调在不同线程上执行 */
+	Dict *synced_dirs;		/**< 从检查点中恢复的已完成扫描的目录 */
+	Dict *image_sizes;		/**< 扫描时读取到的新增和有改动的图片尺寸 */
+	FILE *checkpoint;		/**< 检查点文件 */
+	char *checkpoint_file;		/**< 检查点文件路径 */
+	size_t checkpoint_files;	/**< 自上个检查点以来新增的文件数量 */
+	int64_t checkpoint_time;	/**< 上个检查点的保存时间 */
+	char *volume_file;		/**< 记录源文件夹所在卷的标识号的文件 */
+	unsigned long volume;		/**< 本次扫描时源文件夹所在卷的标识号 */
+	LCUI_BOOL volume_changed;	/**< 所在卷的标识号是否与上次的不一致 */
 } DirStatsRec, *DirStats;
 
-static unsigned int Dict_KeyHash(const void *key)
+/** 删除缓存文件，兼容旧版本的 kvdb 格式的缓存 */
+static int FileCache_Destroy(const char *file)
 {
-	unsigned int hash = 5381;
-	const wchar_t *buf = key;
-
-	while (*buf) {
-		hash = ((hash << 5) + hash) + (*buf++);
+	if (remove(file) == 0) {
+		return 0;
 	}
-	return hash;
+	return kvdb_destroy_db(file);
 }
 
-static int Dict_KeyCompare(void *privdata, const void *key1, const void *key2)
+static void OnDeleteImageSize(void *privdata, void *data)
 {
-	if (wcscmp(key1, key2) == 0) {
-		return 1;
-	}
-	return 0;
+	free(data);
 }
 
-static void *Dict_KeyDup(void *privdata, const void *key)
+/** 清空扫描时记录的图片尺寸 */
+static void SyncTask_ResetImageSizes(SyncTask t)
 {
-	size_t len;
-	wchar_t *newkey;
-	len = wcslen(key) + 1;
-	newkey = malloc(len * sizeof(wchar_t));
-	if (!newkey) {
-		return NULL;
-	}
-	wcsncpy(newkey, key, len);
-	return newkey;
-}
+	DirStats ds = GetDirStats(t);
 
-static void Dict_KeyDestructor(void *privdata, void *key)
-{
-	free(key);
+	StrDict_Release(ds->image_sizes);
+	ds->image_sizes = StrDict_Create(NULL, OnDeleteImageSize);
 }
 
-static void FilesDict_ValDestructor(void *privdata, void *val)
+/** 将旧版本缓存中以 wchar_t 数组存储的键转换为 UTF-8 编码的路径 */
+static int FileCache_ImportFile(FileSnapshotWriter writer,
+				const char *key, size_t keylen,
+				unsigned int ctime, unsigned int mtime)
 {
-	free(val);
-}
-
-static DictType FilePathsDict = {
-	Dict_KeyHash,
-	Dict_KeyDup,
-	NULL,
-	Dict_KeyCompare,
-	Dict_KeyDestructor,
-	NULL
-};
-
-static DictType FilesDict = {
-	Dict_KeyHash,
-	Dict_KeyDup,
-	NULL,
-	Dict_KeyCompare,
-	Dict_KeyDestructor,
-	FilesDict_ValDestructor
-};
-
-static void FileCache_OnFetch(const char *key, size_t keylen,
-			      const void *val, size_t vallen, void *data)
-{
-	FileCacheInfo info;
-	FileCacheTime value = (FileCacheTime)val;
-	FileInfoHanlderPack pack = data;
-
-	info = malloc(sizeof(FileCacheInfoRec));
-	info->path = malloc(keylen + sizeof(wchar_t));
-	info->mtime = value->mtime;
-	info->ctime = value->ctime;
-
-	keylen /= sizeof(wchar_t);
-	wcsncpy(info->path, (const wchar_t*)key, keylen);
-	info->path[keylen] = 0;
+	size_t len;
+	char path[MAX_PATH_LEN];
+	wchar_t wpath[MAX_PATH_LEN];
 
-	pack->handler(pack->data, info);
+	len = keylen / sizeof(wchar_t);
+	if (len >= MAX_PATH_LEN) {
+		return -1;
+	}
+	memcpy(wpath, key, len * sizeof(wchar_t));
+	wpath[len] = 0;
+	LCUI_EncodeString(path, wpath, MAX_PATH_LEN, ENCODING_UTF8);
+	path[MAX_PATH_LEN - 1] = 0;
+	return FileSnapshotWriter_Add(writer, path, strlen(path),
+				      ctime, mtime);
 }
 
-size_t FileCache_ReadAll(FileCache cache, FileInfoHanlder handler, void *data)
+static void FileCache_OnImport(const char *key, size_t keylen,
+			       const void *val, size_t vallen, void *data)
 {
-	FileInfoHanlderPackRec pack = { data, handler };
-	return kvdb_each(cache, FileCache_OnFetch, &pack);
+	FileCacheTime time = (FileCacheTime)val;
+
+	if (vallen == sizeof(FileCacheTimeRec)) {
+		FileCache_ImportFile(data, key, keylen,
+				     time->ctime, time->mtime);
+	}
 }
 
-int FileCache_Put(FileCache cache, const wchar_t *path, FileCacheTime time)
+/** 导入旧版本快照中的文件记录 */
+static void FileCache_ImportSnapshot(FileSnapshotWriter writer,
+				     FileSnapshot snapshot)
 {
-	return kvdb_put(cache, (const char*)path,
-			wcslen(path) * sizeof(wchar_t), (char*)time,
-			sizeof(FileCacheTimeRec));
+	size_t i, n;
+	const FileSnapshotEntryRec *entry;
+
+	n = FileSnapshot_GetCount(snapshot);
+	for (i = 0; i < n; ++i) {
+		entry = FileSnapshot_GetEntry(snapshot, i);
+		if (entry->flags & FILE_SNAPSHOT_DELETED) {
+			continue;
+		}
+		FileCache_ImportFile(writer, FileSnapshotEntry_GetKey(entry),
+				     entry->keylen, entry->ctime,
+				     entry->mtime);
+	}
 }
 
-int FileCache_Delete(FileCache cache, const wchar_t *path)
+/** 将旧版本的 kvdb 格式或以 wchar_t 为键的缓存转换为新版本的快照 */
+static int FileCache_Upgrade(const char *file)
 {
-	return kvdb_delete(cache, (const char*)path,
-			   wcslen(path) * sizeof(wchar_t));
+	int ret;
+	size_t len;
+	kvdb_t *db;
+	char *tmpfile;
+	const char suffix[] = ".upgrade";
+	FileSnapshot snapshot;
+	FileSnapshotWriter writer;
+
+	len = strlen(file) + sizeof(suffix);
+	tmpfile = malloc(len * sizeof(char));
+	if (!tmpfile) {
+		return -ENOMEM;
+	}
+	snprintf(tmpfile, len, "%s%s", file, suffix);
+	writer = FileSnapshotWriter_Create(tmpfile);
+	if (!writer) {
+		free(tmpfile);
+		return -ENOMEM;
+	}
+	snapshot = FileSnapshot_Open(file, FALSE);
+	if (snapshot) {
+		FileCache_ImportSnapshot(writer, snapshot);
+		FileSnapshot_Close(snapshot);
+	} else {
+		db = kvdb_open(file);
+		if (!db) {
+			FileSnapshotWriter_Destroy(writer);
+			free(tmpfile);
+			return -1;
+		}
+		kvdb_each(db, FileCache_OnImport, writer);
+		kvdb_close(db);
+	}
+	ret = FileSnapshotWriter_Finish(writer);
+	FileSnapshotWriter_Destroy(writer);
+	if (ret == 0) {
+		FileCache_Destroy(file);
+		ret = rename(tmpfile, file);
+	}
+	free(tmpfile);
+	return ret;
 }
 
 SyncTask SyncTask_New(const char *data_dir, const char *scan_dir)
@@ -182,18 +227,20 @@ SyncTask SyncTask_NewW(const wchar_t *data_dir, const wchar_t *scan_dir)
 {
 	SyncTask t;
 	DirStats ds;
+	char *tmpfile;
 	wchar_t name[44];
 	size_t max_len, len1, len2;
 	const wchar_t suffix[] = L".tmp";
+	const char checkpoint_suffix[] = ".ckpt";
+	const char volume_suffix[] = ".vol";
 
 	t = malloc(sizeof(SyncTaskRec) + sizeof(DirStatsRec));
 	ds = GetDirStats(t);
 	len1 = wcslen(data_dir) + 1;
 	len2 = wcslen(scan_dir) + 1;
-	ds->files = Dict_Create(&FilesDict, NULL);
-	ds->added_files = Dict_Create(&FilesDict, NULL);
-	ds->changed_files = Dict_Create(&FilePathsDict, NULL);
-	ds->deleted_files = Dict_Create(&FilePathsDict, NULL);
+	ds->cache = NULL;
+	ds->snapshot = NULL;
+	ds->writer = NULL;
 	t->data_dir = malloc(sizeof(wchar_t) * len1);
 	t->scan_dir = malloc(sizeof(wchar_t) * len2);
 	wcsncpy(t->data_dir, data_dir, len1);
@@ -205,6 +252,26 @@ SyncTask SyncTask_NewW(const wchar_t *data_dir, const wchar_t *scan_dir)
 	wcsncpy(t->tmpfile, t->data_dir, len1);
 	wpathjoin(t->file, data_dir, name);
 	swprintf(t->tmpfile, max_len, L"%ls%ls", t->file, suffix);
+	tmpfile = EncodeANSI(t->tmpfile);
+	max_len = strlen(tmpfile) + sizeof(checkpoint_suffix);
+	ds->checkpoint_file = malloc(max_len * sizeof(char));
+	snprintf(ds->checkpoint_file, max_len, "%s%s",
+		 tmpfile, checkpoint_suffix);
+	ds->checkpoint = NULL;
+	ds->checkpoint_files = 0;
+	ds->checkpoint_time = 0;
+	ds->synced_dirs = StrDict_Create(NULL, NULL);
+	ds->image_sizes = StrDict_Create(NULL, OnDeleteImageSize);
+	LCUIMutex_Init(&ds->mutex);
+	free(tmpfile);
+	tmpfile = EncodeANSI(t->file);
+	max_len = strlen(tmpfile) + sizeof(volume_suffix);
+	ds->volume_file = malloc(max_len * sizeof(char));
+	snprintf(ds->volume_file, max_len, "%s%s", tmpfile, volume_suffix);
+	ds->volume = 0;
+	ds->volume_changed = FALSE;
+	free(tmpfile);
+	t->offline = FALSE;
 	t->state = STATE_NONE;
 	t->changed_files = 0;
 	t->deleted_files = 0;
@@ -215,10 +282,15 @@ SyncTask SyncTask_NewW(const wchar_t *data_dir, const wchar_t *scan_dir)
 
 void SyncTask_ClearCache(SyncTask t)
 {
+	DirStats ds = GetDirStats(t);
 	char *file = EncodeANSI(t->file);
 	char *tmpfile = EncodeANSI(t->tmpfile);
-	kvdb_destroy_db(file);
-	kvdb_destroy_db(tmpfile);
+	SyncTask_CloseCache(t);
+	FileCache_Destroy(file);
+	FileSnapshotWriter_Discard(tmpfile);
+	remove(ds->checkpoint_file);
+	remove(ds->volume_file);
+	remove(tmpfile);
 	free(file);
 	free(tmpfile);
 }
@@ -226,6 +298,25 @@ void SyncTask_ClearCache(SyncTask t)
 void SyncTask_Delete(SyncTask t)
 {
 	DirStats ds = GetDirStats(t);
+	SyncTask_CloseCache(t);
+	if (ds->snapshot) {
+		FileSnapshot_Close(ds->snapshot);
+		ds->snapshot = NULL;
+	}
+	/* 保留检查点和已写入的有序段，以便下次同步时恢复 */
+	if (ds->checkpoint) {
+		fclose(ds->checkpoint);
+		ds->checkpoint = NULL;
+	}
+	if (ds->writer) {
+		FileSnapshotWriter_Destroy(ds->writer);
+		ds->writer = NULL;
+	}
+	StrDict_Release(ds->synced_dirs);
+	StrDict_Release(ds->image_sizes);
+	LCUIMutex_Destroy(&ds->mutex);
+	free(ds->checkpoint_file);
+	free(ds->volume_file);
 	free(t->scan_dir);
 	free(t->data_dir);
 	free(t->file);
@@ -234,164 +325,528 @@ void SyncTask_Delete(SyncTask t)
 	t->tmpfile = NULL;
 	t->scan_dir = NULL;
 	t->data_dir = NULL;
-	Dict_Release(ds->files);
-	Dict_Release(ds->added_files);
-	Dict_Release(ds->changed_files);
-	Dict_Release(ds->deleted_files);
 	free(t);
 }
 
-static int FileDict_ForEach(Dict *d, FileInfoHanlder func, void *data)
+static void SyncTask_OnDiff(void *data, FileSnapshotDiffType type,
+			    const FileSnapshotEntryRec *entry)
 {
-	int count = 0;
-	DictEntry *entry;
-	DictIterator *iter = Dict_GetIterator(d);
-	while ((entry = Dict_Next(iter))) {
-		func(data, DictEntry_GetVal(entry));
-		++count;
+	ImageSize size;
+	FileCacheInfoRec info;
+	char path[MAX_PATH_LEN];
+	FileInfoHanlderPack pack = data;
+	DirStats ds = GetDirStats(pack->task);
+
+	if (type != pack->type || entry->keylen >= MAX_PATH_LEN) {
+		return;
 	}
-	Dict_ReleaseIterator(iter);
-	return count;
+	memcpy(path, FileSnapshotEntry_GetKey(entry), entry->keylen);
+	path[entry->keylen] = 0;
+	info.path = path;
+	info.ctime = entry->ctime;
+	info.mtime = entry->mtime;
+	info.width = 0;
+	info.height = 0;
+	if (type != FILE_SNAPSHOT_REMOVED) {
+		size = Dict_FetchValue(ds->image_sizes, path);
+		if (size) {
+			info.width = size->width;
+			info.height = size->height;
+		}
+	}
+	pack->handler(pack->data, &info);
+	pack->count += 1;
 }
 
-int SyncTask_InAddedFiles(SyncTask t, FileInfoHanlder func, void *func_data)
+/** 对比缓存和本次扫描得到的文件列表，遍历指定类型的变更 */
+static int SyncTask_ForEachDiff(SyncTask t, FileSnapshotDiffType type,
+				FileInfoHanlder func, void *func_data)
 {
+	FileInfoHanlderPackRec pack;
 	DirStats ds = GetDirStats(t);
-	return FileDict_ForEach(ds->added_files, func, func_data);
+
+	/* 没有完整的扫描结果时，不能认为缓存中的文件已被删除 */
+	if (!ds->snapshot) {
+		return 0;
+	}
+	pack.count = 0;
+	pack.task = t;
+	pack.type = type;
+	pack.data = func_data;
+	pack.handler = func;
+	FileSnapshot_Diff(ds->cache, ds->snapshot, SyncTask_OnDiff, &pack);
+	return pack.count;
+}
+
+int SyncTask_InAddedFiles(SyncTask t, FileInfoHanlder func, void *func_data)
+{
+	return SyncTask_ForEachDiff(t, FILE_SNAPSHOT_ADDED, func, func_data);
 }
 
 int SyncTask_InChangedFiles(SyncTask t, FileInfoHanlder func, void *func_data)
 {
-	DirStats ds = GetDirStats(t);
-	return FileDict_ForEach(ds->changed_files, func, func_data);
+	return SyncTask_ForEachDiff(t, FILE_SNAPSHOT_CHANGED, func, func_data);
 }
 
 int SyncTask_InDeletedFiles(SyncTask t, FileInfoHanlder func, void *func_data)
 {
+	return SyncTask_ForEachDiff(t, FILE_SNAPSHOT_REMOVED, func, func_data);
+}
+
+/** 载入缓存，如果是旧版本的缓存则先将它转换为新版本的快照 */
+static int SyncTask_LoadCache(SyncTask t, const char *file,
+			      LCUI_BOOL writable)
+{
+	struct stat buf;
 	DirStats ds = GetDirStats(t);
-	return FileDict_ForEach(ds->deleted_files, func, func_data);
+
+	SyncTask_CloseCache(t);
+	if (stat(file, &buf) != 0) {
+		return -ENOENT;
+	}
+	if (FileSnapshot_Check(file)) {
+		ds->cache = FileSnapshot_Open(file, writable);
+		if (!ds->cache) {
+			return -1;
+		}
+		if (FileSnapshot_GetVersion(ds->cache) >= UTF8_KEY_VERSION) {
+			return 0;
+		}
+		SyncTask_CloseCache(t);
+	}
+	LOG("[file cache] upgrade cache: %s\n", file);
+	if (FileCache_Upgrade(file) != 0) {
+		LOG("[file cache] cannot upgrade cache: %s\n", file);
+		return -1;
+	}
+	ds->cache = FileSnapshot_Open(file, writable);
+	if (!ds->cache) {
+		return -1;
+	}
+	return 0;
 }
 
 int SyncTask_OpenCacheW(SyncTask t, const wchar_t *path)
 {
-	DirStats ds;
-	char *dbfile;
+	int ret;
+	char *file;
 
-	ds = GetDirStats(t);
 	path = path ? path : t->file;
-	dbfile = EncodeANSI(path);
-	ds->db = kvdb_open(dbfile);
-	free(dbfile);
-	if (!ds->db) {
+	file = EncodeANSI(path);
+	ret = SyncTask_LoadCache(t, file, TRUE);
+	free(file);
+	return ret;
+}
+
+void SyncTask_CloseCache(SyncTask t)
+{
+	DirStats ds = GetDirStats(t);
+	if (ds->cache) {
+		FileSnapshot_Close(ds->cache);
+		ds->cache = NULL;
+	}
+}
+
+/**
+ * 保存检查点
+ * 检查点文件中的目录记录在之后的 R 记录写入后才生效，R 记录保存了已写入
+ * 磁盘的有序段的大小，恢复时之后的内容会被丢弃。
+ */
+static int SyncTask_SaveCheckpoint(SyncTask t)
+{
+	uint64_t size;
+	DirStats ds = GetDirStats(t);
+
+	if (!ds->checkpoint || !ds->writer) {
+		return -1;
+	}
+	if (FileSnapshotWriter_Flush(ds->writer, &size) != 0) {
+		LOG("[file cache] cannot save checkpoint: %s\n",
+		    ds->checkpoint_file);
+		return -1;
+	}
+	fprintf(ds->checkpoint, "R %llu\n", (unsigned long long)size);
+	if (fflush(ds->checkpoint) != 0) {
 		return -1;
 	}
+	ds->checkpoint_files = 0;
+	ds->checkpoint_time = LCUI_GetTime();
 	return 0;
 }
 
-void SyncTask_CloseCache(SyncTask t)
+static void SyncTask_AutoSaveCheckpoint(SyncTask t)
 {
 	DirStats ds = GetDirStats(t);
-	kvdb_close(ds->db);
+
+	if (ds->checkpoint_files >= CHECKPOINT_MIN_FILES &&
+	    LCUI_GetTimeDelta(ds->checkpoint_time) >= CHECKPOINT_INTERVAL) {
+		SyncTask_SaveCheckpoint(t);
+	}
 }
 
-static void SyncTask_OnLoadFile(void *data, const FileCacheInfo info)
+/** 载入检查点，恢复已完成扫描的目录列表，并丢弃未生效的记录 */
+static int SyncTask_LoadCheckpoint(SyncTask t, uint64_t *runs_size)
 {
-	DirStats ds = data;
-	Dict_Add(ds->files, info->path, info);
-	Dict_Add(ds->deleted_files, info->path, info);
+	FILE *fp;
+	long end = -1;
+	size_t len;
+	DictEntry *entry;
+	DictIterator *iter;
+	unsigned long long size = 0;
+	char line[MAX_PATH_LEN + 4];
+	DirStats ds = GetDirStats(t);
+
+	fp = fopen(ds->checkpoint_file, "rb");
+	if (!fp) {
+		return -ENOENT;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		len = strlen(line);
+		if (len > 2 && line[len - 1] == '\n' &&
+		    line[0] == 'R' && sscanf(line + 2, "%llu", &size) == 1) {
+			*runs_size = size;
+			end = ftell(fp);
+		}
+	}
+	rewind(fp);
+	while (end > 0 && ftell(fp) < end && fgets(line, sizeof(line), fp)) {
+		len = strlen(line);
+		if (len > 2 && line[len - 1] == '\n' && line[0] == 'D') {
+			line[len - 1] = 0;
+			Dict_Add(ds->synced_dirs, line + 2, NULL);
+		}
+	}
+	fclose(fp);
+	if (end < 0) {
+		return -1;
+	}
+	fp = fopen(ds->checkpoint_file, "wb");
+	if (!fp) {
+		return -1;
+	}
+	iter = Dict_GetIterator(ds->synced_dirs);
+	while ((entry = Dict_Next(iter))) {
+		fprintf(fp, "D %s\n", (char*)DictEntry_GetKey(entry));
+	}
+	Dict_ReleaseIterator(iter);
+	fprintf(fp, "R %llu\n", size);
+	fclose(fp);
+	return 0;
 }
 
-/** 从缓存记录中载入文件列表 */
-static size_t SyncTask_LoadCache(SyncTask t)
+void SyncTask_SetDirSynced(SyncTask t, const char *dirpath)
 {
-	size_t count;
-	DirStats ds;
+	DirStats ds = GetDirStats(t);
 
-	ds = GetDirStats(t);
-	SyncTask_OpenCacheW(t, t->file);
-	count = FileCache_ReadAll(ds->db, SyncTask_OnLoadFile, ds);
-	t->deleted_files = count;
-	SyncTask_CloseCache(t);
-	return count;
+	LCUIMutex_Lock(&ds->mutex);
+	if (ds->checkpoint && t->state == STATE_STARTED) {
+		fprintf(ds->checkpoint, "D %s\n", dirpath);
+		SyncTask_AutoSaveCheckpoint(t);
+	}
+	LCUIMutex_Unlock(&ds->mutex);
 }
 
-int SyncTask_AddFileW(SyncTask t, const wchar_t *path,
-		      unsigned int ctime, unsigned int mtime)
+int SyncTask_IsDirSynced(SyncTask t, const char *dirpath)
 {
+	DirStats ds = GetDirStats(t);
+	return Dict_Find(ds->synced_dirs, dirpath) ? 1 : 0;
+}
+
+int SyncTask_AddFile(SyncTask t, const char *path,
+		     unsigned int ctime, unsigned int mtime)
+{
+	long i;
 	size_t len;
-	FileCacheInfo info;
-	FileCacheTimeRec time;
+	int ret = 0;
+	const FileSnapshotEntryRec *entry = NULL;
 	DirStats ds = GetDirStats(t);
 
 	if (t->state != STATE_STARTED) {
 		return -1;
 	}
-	len = wcslen(path);
-	/* 若该文件路径存在于之前的缓存中，说明未被删除，否则将之
-	 * 视为新增的文件。
+	len = strlen(path);
+	LCUIMutex_Lock(&ds->mutex);
+	if (FileSnapshotWriter_Add(ds->writer, path, len, ctime, mtime) != 0) {
+		LCUIMutex_Unlock(&ds->mutex);
+		return -1;
+	}
+	ds->checkpoint_files += 1;
+	SyncTask_AutoSaveCheckpoint(t);
+	LCUIMutex_Unlock(&ds->mutex);
+	/* 在之前的缓存中二分查找该文件，以统计同步进度。找到则说明未被
+	 * 删除，否则将之视为新增的文件。扫描结束后会重新统计准确的数量。
 	 */
-	info = Dict_FetchValue(ds->files, path);
-	if (info) {
-		if (ctime != info->ctime || mtime != info->mtime) {
-			info->ctime = ctime;
-			info->mtime = mtime;
-			Dict_Add(ds->changed_files, info->path, info);
-			DEBUG_MSG("changed file: %ls\n", path);
+	if (ds->cache) {
+		i = FileSnapshot_Find(ds->cache, path, len);
+		if (i >= 0) {
+			entry = FileSnapshot_GetEntry(ds->cache, i);
+		}
+	}
+	if (entry && !(entry->flags & FILE_SNAPSHOT_DELETED)) {
+		if (ctime != entry->ctime || mtime != entry->mtime) {
+			DEBUG_MSG("changed file: %s\n", path);
 			++t->changed_files;
+			ret = 1;
 		} else {
-			DEBUG_MSG("unchanged file: %ls\n", path);
+			DEBUG_MSG("unchanged file: %s\n", path);
+		}
+		if (t->deleted_files > 0) {
+			--t->deleted_files;
 		}
-		Dict_Delete(ds->deleted_files, path);
-		--t->deleted_files;
 	} else {
-		info = NEW(FileCacheInfoRec, 1);
-		info->path = NEW(wchar_t, len + 1);
-		wcsncpy(info->path, path, len + 1);
-		info->ctime = ctime;
-		info->mtime = mtime;
-		Dict_Add(ds->added_files, info->path, info);
-		DEBUG_MSG("added file: %ls\n", path);
+		DEBUG_MSG("added file: %s\n", path);
 		++t->added_files;
+		ret = 1;
 	}
-	time.ctime = info->ctime;
-	time.mtime = info->mtime;
-	FileCache_Put(ds->db, path, &time);
 	++t->total_files;
+	return ret;
+}
+
+void SyncTask_SetImageSize(SyncTask t, const char *path,
+			   unsigned int width, unsigned int height)
+{
+	ImageSize size;
+	DirStats ds = GetDirStats(t);
+
+	LCUIMutex_Lock(&ds->mutex);
+	size = Dict_FetchValue(ds->image_sizes, path);
+	if (!size) {
+		size = malloc(sizeof(ImageSizeRec));
+		if (!size) {
+			LCUIMutex_Unlock(&ds->mutex);
+			return;
+		}
+		Dict_Add(ds->image_sizes, (void*)path, size);
+	}
+	size->width = width;
+	size->height = height;
+	LCUIMutex_Unlock(&ds->mutex);
+}
+
+/** 读取上次同步时记录的卷标识号，没有记录时返回 0 */
+static unsigned long SyncTask_LoadVolume(SyncTask t)
+{
+	FILE *fp;
+	unsigned long volume = 0;
+	DirStats ds = GetDirStats(t);
+
+	fp = fopen(ds->volume_file, "r");
+	if (!fp) {
+		return 0;
+	}
+	if (fscanf(fp, "%lu", &volume) != 1) {
+		volume = 0;
+	}
+	fclose(fp);
+	return volume;
+}
+
+static int SyncTask_SaveVolume(SyncTask t)
+{
+	FILE *fp;
+	DirStats ds = GetDirStats(t);
+
+	fp = fopen(ds->volume_file, "w");
+	if (!fp) {
+		return -1;
+	}
+	fprintf(fp, "%lu\n", ds->volume);
+	fclose(fp);
 	return 0;
 }
 
-int SyncTask_DeleteFileW(SyncTask t, const wchar_t *filepath)
+void SyncTask_SetVolume(SyncTask t, unsigned long volume)
 {
+	unsigned long last_volume;
 	DirStats ds = GetDirStats(t);
-	return FileCache_Delete(ds->db, filepath);
+
+	ds->volume = volume;
+	ds->volume_changed = FALSE;
+	if (volume == 0) {
+		return;
+	}
+	last_volume = SyncTask_LoadVolume(t);
+	if (last_volume != 0 && last_volume != volume) {
+		LOG("[file cache] volume changed: %lu -> %lu\n",
+		    last_volume, volume);
+		ds->volume_changed = TRUE;
+	}
+}
+
+/** 丢弃本次扫描的结果，包括检查点和已写入的有序段 */
+static void SyncTask_DiscardScan(SyncTask t)
+{
+	char *tmpfile;
+	DirStats ds = GetDirStats(t);
+
+	if (ds->writer) {
+		FileSnapshotWriter_Destroy(ds->writer);
+		ds->writer = NULL;
+	}
+	if (ds->snapshot) {
+		FileSnapshot_Close(ds->snapshot);
+		ds->snapshot = NULL;
+	}
+	if (ds->checkpoint) {
+		fclose(ds->checkpoint);
+		ds->checkpoint = NULL;
+	}
+	SyncTask_ResetImageSizes(t);
+	tmpfile = EncodeANSI(t->tmpfile);
+	FileSnapshotWriter_Discard(tmpfile);
+	remove(ds->checkpoint_file);
+	remove(tmpfile);
+	free(tmpfile);
+}
+
+void SyncTask_SetOffline(SyncTask t)
+{
+	DirStats ds = GetDirStats(t);
+
+	LCUIMutex_Lock(&ds->mutex);
+	t->offline = TRUE;
+	t->state = STATE_FINISHED;
+	SyncTask_DiscardScan(t);
+	LCUIMutex_Unlock(&ds->mutex);
+}
+
+int SyncTask_DeleteFile(SyncTask t, const char *filepath)
+{
+	int ret;
+	DirStats ds = GetDirStats(t);
+
+	/* 文件不在缓存中时无需删除 */
+	if (!ds->cache) {
+		return 0;
+	}
+	ret = FileSnapshot_Delete(ds->cache, filepath, strlen(filepath));
+	if (ret == -ENOENT) {
+		return 0;
+	}
+	return ret;
 }
 
 int SyncTask_Start(SyncTask t)
 {
-	SyncTask_LoadCache(t);
-	if (0 != SyncTask_OpenCacheW(t, t->tmpfile)) {
+	uint64_t runs_size;
+	char *file, *tmpfile;
+	DirStats ds = GetDirStats(t);
+
+	file = EncodeANSI(t->file);
+	tmpfile = EncodeANSI(t->tmpfile);
+	SyncTask_LoadCache(t, file, FALSE);
+	/* 如果上次同步被中断，则从检查点恢复 */
+	if (SyncTask_LoadCheckpoint(t, &runs_size) == 0) {
+		ds->writer = FileSnapshotWriter_Resume(tmpfile, runs_size);
+	}
+	if (ds->writer) {
+		LOG("[file cache] resume from checkpoint, %lu folders "
+		    "already scanned\n", Dict_Size(ds->synced_dirs));
+		ds->checkpoint = fopen(ds->checkpoint_file, "ab");
+	} else {
+		StrDict_Release(ds->synced_dirs);
+		ds->synced_dirs = StrDict_Create(NULL, NULL);
+		ds->writer = FileSnapshotWriter_Create(tmpfile);
+		ds->checkpoint = fopen(ds->checkpoint_file, "wb");
+	}
+	free(tmpfile);
+	free(file);
+	if (!ds->writer) {
 		return -1;
 	}
+	ds->checkpoint_files = 0;
+	ds->checkpoint_time = LCUI_GetTime();
+	SyncTask_ResetImageSizes(t);
+	if (ds->cache) {
+		t->deleted_files = FileSnapshot_GetCount(ds->cache);
+	}
 	t->state = STATE_STARTED;
 	return 0;
 }
 
+static void SyncTask_OnCount(void *data, FileSnapshotDiffType type,
+			     const FileSnapshotEntryRec *entry)
+{
+	SyncTask t = data;
+
+	switch (type) {
+	case FILE_SNAPSHOT_ADDED: ++t->added_files; break;
+	case FILE_SNAPSHOT_CHANGED: ++t->changed_files; break;
+	case FILE_SNAPSHOT_REMOVED: ++t->deleted_files; break;
+	default: break;
+	}
+}
+
 void SyncTask_Finish(SyncTask t)
 {
+	int ret;
+	char *tmpfile;
+	DirStats ds = GetDirStats(t);
+
 	t->state = STATE_FINISHED;
-	SyncTask_CloseCache(t);
+	t->added_files = 0;
+	t->changed_files = 0;
+	t->deleted_files = 0;
+	if (t->offline || !ds->writer) {
+		return;
+	}
+	ret = FileSnapshotWriter_Finish(ds->writer);
+	FileSnapshotWriter_Destroy(ds->writer);
+	ds->writer = NULL;
+	/* 有序段已合并，检查点不再有效 */
+	if (ds->checkpoint) {
+		fclose(ds->checkpoint);
+		ds->checkpoint = NULL;
+	}
+	remove(ds->checkpoint_file);
+	if (ret != 0) {
+		return;
+	}
+	tmpfile = EncodeANSI(t->tmpfile);
+	ds->snapshot = FileSnapshot_Open(tmpfile, FALSE);
+	free(tmpfile);
+	if (!ds->snapshot) {
+		return;
+	}
+	FileSnapshot_Diff(ds->cache, ds->snapshot, SyncTask_OnCount, t);
+	/*
+	 * 卷已更换且扫描不到任何文件，多半是卷未挂载时扫描到了空的挂载点目录。
+	 * 能扫描到文件时，即使它们全是新的，也说明源文件夹已被移到了新的卷上，
+	 * 这时正常同步并在提交后记下新的卷，否则它会一直被当作离线的。
+	 */
+	if (ds->volume_changed && t->deleted_files > 0 &&
+	    FileSnapshot_GetCount(ds->snapshot) == 0) {
+		LOG("[file cache] volume is unavailable, keep the cache\n");
+		t->offline = TRUE;
+		t->added_files = 0;
+		t->changed_files = 0;
+		t->deleted_files = 0;
+		SyncTask_DiscardScan(t);
+	}
 }
 
 int SyncTask_Commit(SyncTask t)
 {
 	int ret;
-	char *file = EncodeANSI(t->file);
-	char *tmpfile = EncodeANSI(t->tmpfile);
+	char *file, *tmpfile;
+	DirStats ds = GetDirStats(t);
 
-	kvdb_destroy_db(file);
+	if (t->offline || !ds->snapshot) {
+		return -1;
+	}
+	/* 替换文件前需要先解除内存映射 */
+	FileSnapshot_Close(ds->snapshot);
+	ds->snapshot = NULL;
+	SyncTask_ResetImageSizes(t);
+	SyncTask_CloseCache(t);
+	file = EncodeANSI(t->file);
+	tmpfile = EncodeANSI(t->tmpfile);
+	FileCache_Destroy(file);
 	ret = rename(tmpfile, file);
 	if (ret != 0) {
 		_DEBUG_MSG("%s\n", strerror(errno));
+	} else if (ds->volume != 0) {
+		SyncTask_SaveVolume(t);
 	}
 	free(file);
 	free(tmpfile);
@@ -56,6 +56,7 @@ enum SQLCodeList {
 	SQL_ADD_FILE_TAG,
 	SQL_DEL_FILE_TAG,
 	SQL_SET_FILE_SIZE,
+	SQL_SET_FILE_SIZE_BY_PATH,
 	SQL_SET_FILE_SCORE,
 	SQL_SET_FILE_TIME,
 	SQL_SET_FILE_TIME_BY_PATH,
@@ -143,6 +144,9 @@ WHERE ftr.tid = t.id GROUP BY ftr.tid ORDER BY NAME ASC;";
 STATIC_STR sql_file_set_size = "\
 UPDATE file SET width = ?, height = ? WHERE id = ?;";
 
+STATIC_STR sql_file_set_size_by_path = "\
+UPDATE file SET width = ?, height = ? WHERE did = ? AND path = ?;";
+
 STATIC_STR sql_file_set_time = "\
 UPDATE file SET create_time = ?, modify_time = ? WHERE id = ?;";
 
@@ -157,7 +161,8 @@ STATIC_STR sql_file_del_tag = "\
 DELETE FROM file_tag_relation WHERE fid = ? AND tid = ?;";
 
 STATIC_STR sql_add_file = "\
-INSERT INTO file(did, path, create_time, modify_time) VALUES(?, ?, ?, ?);";
+INSERT INTO file(did, path, width, height, create_time, modify_time) \
+VALUES(?, ?, ?, ?, ?, ?);";
 
 STATIC_STR sql_get_file = "\
 SELECT f.id, f.did, f.score, f.path, f.width, f.height, f.create_time, \
@@ -246,6 +251,7 @@ int DB_Init(const char *dbpath)
 	self.sqls[SQL_ADD_FILE_TAG] = sql_file_add_tag;
 	self.sqls[SQL_DEL_FILE_TAG] = sql_file_del_tag;
 	self.sqls[SQL_SET_FILE_SIZE] = sql_file_set_size;
+	self.sqls[SQL_SET_FILE_SIZE_BY_PATH] = sql_file_set_size_by_path;
 	self.sqls[SQL_SET_FILE_SCORE] = sql_file_set_score;
 	self.sqls[SQL_SET_FILE_TIME_BY_PATH] = sql_file_set_time_by_path;
 	self.sqls[SQL_SET_FILE_TIME] = sql_file_set_time;
@@ -401,14 +407,17 @@ DB_Tag DB_AddTag(const char *tagname)
 	return tag;
 }
 
-void DB_AddFile(DB_Dir dir, const char *filepath, int ctime, int mtime)
+void DB_AddFile(DB_Dir dir, const char *filepath, int width, int height,
+		int ctime, int mtime)
 {
 	sqlite3_stmt *stmt = self.stmts[SQL_ADD_FILE];
 	sqlite3_reset(stmt);
 	sqlite3_bind_int(stmt, 1, dir->id);
 	sqlite3_bind_text(stmt, 2, filepath, -1, NULL);
-	sqlite3_bind_int(stmt, 3, ctime);
-	sqlite3_bind_int(stmt, 4, mtime);
+	sqlite3_bind_int(stmt, 3, width);
+	sqlite3_bind_int(stmt, 4, height);
+	sqlite3_bind_int(stmt, 5, ctime);
+	sqlite3_bind_int(stmt, 6, mtime);
 	sqlite3_step(stmt);
 }
 
@@ -423,6 +432,18 @@ void DB_UpdateFileTime(DB_Dir dir, const char *filepath, int ctime, int mtime)
 	sqlite3_step(stmt);
 }
 
+void DB_UpdateFileSize(DB_Dir dir, const char *filepath, int width,
+		       int height)
+{
+	sqlite3_stmt *stmt = self.stmts[SQL_SET_FILE_SIZE_BY_PATH];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int(stmt, 1, width);
+	sqlite3_bind_int(stmt, 2, height);
+	sqlite3_bind_int(stmt, 3, dir->id);
+	sqlite3_bind_text(stmt, 4, filepath, -1, NULL);
+	sqlite3_step(stmt);
+}
+
 void DB_DeleteFile(const char *filepath)
 {
 	sqlite3_stmt *stmt = self.stmts[SQL_DEL_FILE];
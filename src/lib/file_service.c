@@ -49,6 +49,15 @@
 #include "bridge.h"
 #include "common.h"
 #include "file_service.h"
+#include "exif.h"
+#include "jpeg_decoder.h"
+#include "stream_decoder.h"
+#include "image_probe.h"
+#include "resample.h"
+
+#ifdef PLATFORM_WIN32_DESKTOP
+#include <Windows.h>
+#endif
 
 #ifdef _WIN32
 #define _S_ISTYPE(mode, mask) (((mode)&_S_IFMT) == (mask))
@@ -59,6 +68,15 @@
 #undef LOG
 #define LOG DEBUG_MSG
 
+/**
+ * EXIF 内嵌缩略图的最小尺寸，以目标尺寸的百分比表示
+ * 与缩略图数据库中最小一级的比例相同，界面缩放比例为 100% 时仍然足够清晰
+ */
+#define EXIF_THUMB_MIN_SCALE 50
+
+/** 文件的修改时间距今不足这么多秒时，认为它可能还在写入中 */
+#define FILE_SETTLE_TIME 10
+
 typedef struct FileStreamRec_ {
 	LCUI_BOOL active;
 	LCUI_BOOL closed;
@@ -465,12 +483,22 @@ static int FileService_GetFileImageStatus(FileRequest *request,
 					  FileStreamChunk *chunk)
 {
 	int width, height;
+	unsigned probe_width, probe_height;
 	FileResponse *response = &chunk->response;
 #ifdef _WIN32
 	char *path = EncodeANSI(request->path);
 #else
 	char *path = EncodeUTF8(request->path);
 #endif
+	/* 常见格式的尺寸可直接从文件头中读出，其余的交给 LCUI */
+	if (ImageProbe_GetSizeW(request->path, &probe_width,
+				&probe_height) == 0) {
+		response->file.image = NEW(FileImageStatus, 1);
+		response->file.image->width = probe_width;
+		response->file.image->height = probe_height;
+		free(path);
+		return 0;
+	}
 	if (LCUI_GetImageSize(path, &width, &height) == 0) {
 		response->file.image = NEW(FileImageStatus, 1);
 		response->file.image->width = width;
@@ -501,6 +529,34 @@ static int GetStatusByErrorCode(int code)
 	return RESPONSE_STATUS_ERROR;
 }
 
+/**
+ * 获取文件所在卷的标识号
+ * Windows 上 st_dev 只是盘符序号，更换同一盘符的移动硬盘后它不会变化，所以
+ * 改用卷序列号。获取序列号的开销较大，仅对文件夹获取。
+ */
+static unsigned long FileService_GetVolume(const wchar_t *path,
+					   const struct stat *buf)
+{
+#ifdef PLATFORM_WIN32_DESKTOP
+	DWORD serial;
+	wchar_t root[MAX_PATH];
+
+	if (!S_ISDIR(buf->st_mode)) {
+		return 0;
+	}
+	if (!GetVolumePathNameW(path, root, MAX_PATH)) {
+		return 0;
+	}
+	if (!GetVolumeInformationW(root, NULL, 0, &serial,
+				   NULL, NULL, NULL, 0)) {
+		return 0;
+	}
+	return serial;
+#else
+	return (unsigned long)buf->st_dev;
+#endif
+}
+
 static int FileService_GetFileStatus(FileRequest *request,
 				     FileStreamChunk *chunk)
 {
@@ -513,6 +569,8 @@ static int FileService_GetFileStatus(FileRequest *request,
 		response->file.ctime = buf.st_ctime;
 		response->file.mtime = buf.st_mtime;
 		response->file.size = buf.st_size;
+		response->file.volume = FileService_GetVolume(request->path,
+							      &buf);
 		if (S_ISDIR(buf.st_mode)) {
 			response->file.type = FILE_TYPE_DIRECTORY;
 		} else {
@@ -596,12 +654,99 @@ static int FileService_GetFiles(Connection conn, FileRequest *request,
 	return 0;
 }
 
+/**
+ * 读取 JPEG 文件的 EXIF 信息，如果内嵌的缩略图足够大，则直接使用它
+ * 只要求它不小于目标尺寸的 EXIF_THUMB_MIN_SCALE%，例如 480 像素高的请求需要
+ * 至少 240 像素高的缩略图，相机常用的 160x120 的缩略图仍然不会被使用
+ * 请求的是完整的图像时只读取方向，读取完后文件会回到开头，以便继续解码
+ * @returns 成功载入内嵌的缩略图时返回 TRUE
+ */
+static LCUI_BOOL FileService_LoadExifThumbnail(FILE *fp,
+					       FileRequestParams *params,
+					       ExifInfo info, LCUI_Graph *thumb)
+{
+	unsigned width, height;
+	double ratio, thumb_ratio;
+
+	memset(info, 0, sizeof(ExifInfoRec));
+	info->orientation = 1;
+	if (!params->get_thumbnail) {
+		Exif_ReadHeader(fp, info);
+		fseek(fp, 0, SEEK_SET);
+		return FALSE;
+	}
+	if (Exif_Read(fp, info) != 0) {
+		fseek(fp, 0, SEEK_SET);
+		return FALSE;
+	}
+	fseek(fp, 0, SEEK_SET);
+	if (!info->thumb || info->width < 1 || info->height < 1 ||
+	    info->thumb_width < 1 || info->thumb_height < 1) {
+		return FALSE;
+	}
+	if (params->width < 1 && params->height < 1) {
+		return FALSE;
+	}
+	width = info->thumb_width;
+	height = info->thumb_height;
+	if (Exif_IsTransposed(info->orientation)) {
+		width = info->thumb_height;
+		height = info->thumb_width;
+	}
+	if ((params->width > 0 &&
+	     width * 100 < params->width * EXIF_THUMB_MIN_SCALE) ||
+	    (params->height > 0 &&
+	     height * 100 < params->height * EXIF_THUMB_MIN_SCALE)) {
+		return FALSE;
+	}
+	/* 有的相机会给缩略图加上黑边，宽高比与原图不同的缩略图不能用 */
+	ratio = 1.0 * info->width / info->height;
+	thumb_ratio = 1.0 * info->thumb_width / info->thumb_height;
+	if (thumb_ratio < ratio * 0.98 || thumb_ratio > ratio * 1.02) {
+		return FALSE;
+	}
+	if (Exif_ReadThumbnail(info, thumb) != 0) {
+		Graph_Init(thumb);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * 判断图片解码失败是否只是暂时的
+ * 内存不足、读取出错，或者文件在解码期间有变动、刚被修改过（例如还在复制中）
+ * 时，稍后重试可能会成功，不能把它当成无法解码的文件
+ * @param[in] err 图像读取器返回的错误码
+ */
+static LCUI_BOOL FileService_IsTransientFailure(FileRequest *request,
+						FileStatus *status, FILE *fp,
+						int err)
+{
+	struct stat buf;
+
+	if (err == -ENOMEM || ferror(fp)) {
+		return TRUE;
+	}
+	if (wgetfilestat(request->path, &buf) != 0) {
+		return TRUE;
+	}
+	if ((size_t)buf.st_size != status->size ||
+	    buf.st_mtime != status->mtime) {
+		return TRUE;
+	}
+	return time(NULL) - buf.st_mtime < FILE_SETTLE_TIME;
+}
+
 static int FileService_GetFile(Connection conn, FileRequest *request,
 			       FileStreamChunk *chunk)
 {
 	int ret;
 	char *path;
 	FILE *fp;
+	unsigned width, height;
+	unsigned origin_width, origin_height;
+	LCUI_BOOL exif_thumb;
+	ExifInfoRec exif;
 	LCUI_Graph img;
 	LCUI_ImageReaderRec reader = { 0 };
 	FileResponse *response = &chunk->response;
@@ -623,49 +768,96 @@ static int FileService_GetFile(Connection conn, FileRequest *request,
 		response->status = RESPONSE_STATUS_NOT_FOUND;
 		return -1;
 	}
-	LCUI_SetImageReaderForFile(&reader, fp);
-	reader.fn_prog = request->params.progress;
-	reader.prog_arg = request->params.progress_arg;
-	if (LCUI_InitImageReader(&reader) != 0) {
-		goto load_image_falied;
-	}
-	if (LCUI_SetImageReaderJump(&reader)) {
-		goto load_image_falied;
+	exif_thumb = FileService_LoadExifThumbnail(fp, params, &exif, &img);
+	width = params->width;
+	height = params->height;
+	/* 图像会在最后按 EXIF 方向调整，在此之前它的宽高与目标尺寸相反 */
+	if (Exif_IsTransposed(exif.orientation)) {
+		width = params->height;
+		height = params->width;
 	}
-	if (LCUI_ReadImageHeader(&reader) != 0) {
-		goto load_image_falied;
-	}
-	response->file.image = NEW(FileImageStatus, 1);
-	response->file.image->width = reader.header.width;
-	response->file.image->height = reader.header.height;
-	if (LCUI_ReadImage(&reader, &img) != 0) {
-		goto load_image_falied;
+	if (exif_thumb) {
+		LOG("[file service] use exif thumbnail\n");
+		response->file.image = NEW(FileImageStatus, 1);
+		response->file.image->width = exif.width;
+		response->file.image->height = exif.height;
+	} else if (params->get_thumbnail && exif.width > 0 &&
+		   JPEGDecoder_ReadScaled(fp, width, height, &origin_width,
+					  &origin_height, &img) == 0) {
+		response->file.image = NEW(FileImageStatus, 1);
+		response->file.image->width = origin_width;
+		response->file.image->height = origin_height;
+	} else if (params->get_thumbnail &&
+		   StreamDecoder_ReadScaled(fp, width, height, &origin_width,
+					    &origin_height, &img) == 0) {
+		response->file.image = NEW(FileImageStatus, 1);
+		response->file.image->width = origin_width;
+		response->file.image->height = origin_height;
+	} else {
+		fseek(fp, 0, SEEK_SET);
+		LCUI_SetImageReaderForFile(&reader, fp);
+		reader.fn_prog = request->params.progress;
+		reader.prog_arg = request->params.progress_arg;
+		ret = LCUI_InitImageReader(&reader);
+		if (ret != 0) {
+			goto load_image_falied;
+		}
+		if (LCUI_SetImageReaderJump(&reader)) {
+			ret = -1;
+			goto load_image_falied;
+		}
+		ret = LCUI_ReadImageHeader(&reader);
+		if (ret != 0) {
+			goto load_image_falied;
+		}
+		response->file.image = NEW(FileImageStatus, 1);
+		response->file.image->width = reader.header.width;
+		response->file.image->height = reader.header.height;
+		ret = LCUI_ReadImage(&reader, &img);
+		if (ret != 0) {
+			goto load_image_falied;
+		}
 	}
 	fclose(fp);
+	Exif_Destroy(&exif);
 	LOG("[file service] load image success, size: (%d, %d)\n", img.width,
 	    img.height);
+	/* 图像会按 EXIF 方向调整，所以图片的尺寸也应以调整后的为准 */
+	if (Exif_IsTransposed(exif.orientation)) {
+		origin_width = response->file.image->width;
+		response->file.image->width = response->file.image->height;
+		response->file.image->height = origin_width;
+	}
 	Connection_WriteChunk(conn, chunk);
 	if (!params->get_thumbnail) {
+		Exif_ApplyOrientation(&img, exif.orientation);
 		chunk->type = DATA_CHUNK_IMAGE;
 		chunk->image = img;
 		return 0;
 	}
 	Graph_Init(&chunk->thumb);
-	if ((params->width > 0 && img.width > (int)params->width) ||
-	    (params->height > 0 && img.height > (int)params->height)) {
-		/* FIXME: 大图的缩小效果并不好，需要改进 */
-		Graph_ZoomBilinear(&img, &chunk->thumb, TRUE, params->width,
-				   params->height);
+	if ((width > 0 && img.width > (int)width) ||
+	    (height > 0 && img.height > (int)height)) {
+		Resample_Zoom(&img, &chunk->thumb, RESAMPLE_FILTER_LANCZOS3,
+			      TRUE, width, height);
 		Graph_Free(&img);
 	} else {
 		chunk->thumb = img;
 	}
+	Exif_ApplyOrientation(&chunk->thumb, exif.orientation);
 	chunk->type = DATA_CHUNK_THUMB;
 	return 0;
 
 load_image_falied:
 	LOG("[file service] load image failed\n");
-	response->status = RESPONSE_STATUS_NOT_ACCEPTABLE;
+	/* 只有确实无法解码的文件才返回 406，调用者会记录下来，不再尝试解码 */
+	if (FileService_IsTransientFailure(request, &response->file, fp,
+					   ret)) {
+		response->status = RESPONSE_STATUS_ERROR;
+	} else {
+		response->status = RESPONSE_STATUS_NOT_ACCEPTABLE;
+	}
+	Exif_Destroy(&exif);
 	Graph_Free(&img);
 	fclose(fp);
 	return -1;
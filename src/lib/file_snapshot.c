@@ -0,0 +1,922 @@
+﻿/* ***************************************************************************
+ * file_snapshot.c -- sorted file list snapshot, used for file list changes detection.
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * file_snapshot.c -- 有序的文件列表快照，用于检测文件列表的变更。
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#define LCFINDER_FILE_SNAPSHOT_C
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "build.h"
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include "file_snapshot.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define FILE_SNAPSHOT_MAGIC	"LCFSNAP"
+#define RUN_BUFFER_SIZE		(8 * 1024 * 1024)
+#define COPY_BUFFER_SIZE	65536
+#define ALIGN4(N)		(((N) + 3) & ~(size_t)3)
+#define ENTRY_SIZE(KEYLEN)	(sizeof(FileSnapshotEntryRec) + ALIGN4(KEYLEN))
+
+/** 内存映射文件 */
+typedef struct MappedFileRec_ {
+	char *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+} MappedFileRec, *MappedFile;
+
+/**
+ * 快照文件头
+ * 文件头之后是按键的升序排列的记录，末尾是记录的偏移量索引
+ */
+typedef struct FileSnapshotHeaderRec_ {
+	char magic[8];			/**< 标识 */
+	uint32_t version;		/**< 版本 */
+	uint32_t header_size;		/**< 文件头的大小，方便日后扩展 */
+	uint64_t count;			/**< 记录数量 */
+	uint64_t index_offset;		/**< 索引的偏移量 */
+} FileSnapshotHeaderRec, *FileSnapshotHeader;
+
+/** 有序段的头部信息，段内的记录紧随其后 */
+typedef struct FileSnapshotRunRec_ {
+	uint64_t count;			/**< 记录数量 */
+	uint64_t size;			/**< 记录所占的字节数 */
+} FileSnapshotRunRec, *FileSnapshotRun;
+
+typedef struct FileSnapshotRec_ {
+	MappedFileRec file;
+	FileSnapshotHeader header;
+	const uint64_t *index;
+	size_t count;
+} FileSnapshotRec;
+
+/** 有序段的读取游标 */
+typedef struct RunCursorRec_ {
+	const char *pos;
+	uint64_t remain;
+} RunCursorRec, *RunCursor;
+
+/** 快照的输出上下文 */
+typedef struct SnapshotOutputRec_ {
+	FILE *fp;
+	FILE *index;
+	uint64_t offset;
+	uint64_t count;
+	const FileSnapshotEntryRec *last;
+} SnapshotOutputRec, *SnapshotOutput;
+
+typedef struct FileSnapshotWriterRec_ {
+	char *path;			/**< 快照文件路径 */
+	char *runs_path;		/**< 有序段的临时文件路径 */
+	char *index_path;		/**< 索引的临时文件路径 */
+	FILE *runs;			/**< 有序段的临时文件 */
+	uint64_t runs_size;		/**< 已写入有序段的字节数 */
+	LCUI_BOOL keep_runs;		/**< 是否保留有序段，用于恢复写入 */
+	char *buffer;			/**< 记录缓冲区 */
+	size_t buffer_size;		/**< 缓冲区已用的大小 */
+	FileSnapshotEntry *entries;	/**< 缓冲区内的记录列表，用于排序 */
+	size_t n_entries;
+	size_t max_entries;
+	LCUI_BOOL finished;
+} FileSnapshotWriterRec;
+
+#ifdef _WIN32
+
+static int MappedFile_Open(MappedFile mf, const char *path,
+			   LCUI_BOOL writable)
+{
+	LARGE_INTEGER size;
+	DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE;
+	DWORD access = GENERIC_READ;
+	DWORD protect = PAGE_READONLY;
+	DWORD map_access = FILE_MAP_READ;
+#ifdef PLATFORM_WIN32_PC_APP
+	wchar_t wpath[MAX_PATH];
+#endif
+
+	if (writable) {
+		access |= GENERIC_WRITE;
+		protect = PAGE_READWRITE;
+		map_access = FILE_MAP_WRITE;
+	}
+#ifdef PLATFORM_WIN32_PC_APP
+	MultiByteToWideChar(CP_ACP, 0, path, -1, wpath, MAX_PATH);
+	mf->file = CreateFile2(wpath, access, share, OPEN_EXISTING, NULL);
+#else
+	mf->file = CreateFileA(path, access, share, NULL, OPEN_EXISTING,
+			       FILE_ATTRIBUTE_NORMAL, NULL);
+#endif
+	if (mf->file == INVALID_HANDLE_VALUE) {
+		return -ENOENT;
+	}
+	if (!GetFileSizeEx(mf->file, &size) || size.QuadPart < 1) {
+		CloseHandle(mf->file);
+		return -EINVAL;
+	}
+	mf->size = (size_t)size.QuadPart;
+#ifdef PLATFORM_WIN32_PC_APP
+	mf->mapping = CreateFileMappingFromApp(mf->file, NULL, protect,
+					       0, NULL);
+#else
+	mf->mapping = CreateFileMappingA(mf->file, NULL, protect, 0, 0, NULL);
+#endif
+	if (!mf->mapping) {
+		CloseHandle(mf->file);
+		return -EIO;
+	}
+#ifdef PLATFORM_WIN32_PC_APP
+	mf->data = MapViewOfFileFromApp(mf->mapping, map_access, 0, 0);
+#else
+	mf->data = MapViewOfFile(mf->mapping, map_access, 0, 0, 0);
+#endif
+	if (!mf->data) {
+		CloseHandle(mf->mapping);
+		CloseHandle(mf->file);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void MappedFile_Close(MappedFile mf)
+{
+	UnmapViewOfFile(mf->data);
+	CloseHandle(mf->mapping);
+	CloseHandle(mf->file);
+	mf->data = NULL;
+	mf->size = 0;
+}
+
+#else
+
+static int MappedFile_Open(MappedFile mf, const char *path,
+			   LCUI_BOOL writable)
+{
+	struct stat buf;
+	int prot = PROT_READ;
+
+	mf->fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (mf->fd < 0) {
+		return -errno;
+	}
+	if (fstat(mf->fd, &buf) != 0 || buf.st_size < 1) {
+		close(mf->fd);
+		return -EINVAL;
+	}
+	if (writable) {
+		prot |= PROT_WRITE;
+	}
+	mf->size = (size_t)buf.st_size;
+	mf->data = mmap(NULL, mf->size, prot, MAP_SHARED, mf->fd, 0);
+	if (mf->data == MAP_FAILED) {
+		mf->data = NULL;
+		close(mf->fd);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void MappedFile_Close(MappedFile mf)
+{
+	munmap(mf->data, mf->size);
+	close(mf->fd);
+	mf->data = NULL;
+	mf->size = 0;
+}
+
+#endif
+
+/** 将文件缓冲区的内容写入磁盘 */
+static int SyncFile(FILE *fp)
+{
+	if (fflush(fp) != 0) {
+		return -EIO;
+	}
+#ifdef _WIN32
+	if (_commit(_fileno(fp)) != 0) {
+		return -EIO;
+	}
+#else
+	if (fsync(fileno(fp)) != 0) {
+		return -EIO;
+	}
+#endif
+	return 0;
+}
+
+static int64_t GetFileSize(FILE *fp)
+{
+	if (fseek(fp, 0, SEEK_END) != 0) {
+		return -1;
+	}
+#ifdef _WIN32
+	return _ftelli64(fp);
+#else
+	return (int64_t)ftello(fp);
+#endif
+}
+
+static int TruncateFile(FILE *fp, uint64_t size)
+{
+#ifdef _WIN32
+	return _chsize_s(_fileno(fp), (__int64)size) == 0 ? 0 : -EIO;
+#else
+	return ftruncate(fileno(fp), (off_t)size) == 0 ? 0 : -EIO;
+#endif
+}
+
+int FileSnapshot_CompareKey(const char *key1, size_t len1,
+			    const char *key2, size_t len2)
+{
+	int ret = memcmp(key1, key2, min(len1, len2));
+	if (ret != 0) {
+		return ret;
+	}
+	if (len1 == len2) {
+		return 0;
+	}
+	return len1 < len2 ? -1 : 1;
+}
+
+static int FileSnapshotEntry_Compare(const FileSnapshotEntryRec *e1,
+				     const FileSnapshotEntryRec *e2)
+{
+	return FileSnapshot_CompareKey(FileSnapshotEntry_GetKey(e1),
+				       e1->keylen,
+				       FileSnapshotEntry_GetKey(e2),
+				       e2->keylen);
+}
+
+/** 比较缓冲区内的记录，键相同时后添加的记录优先 */
+static int OnCompareEntries(const void *a, const void *b)
+{
+	int ret;
+	const FileSnapshotEntry e1 = *(const FileSnapshotEntry*)a;
+	const FileSnapshotEntry e2 = *(const FileSnapshotEntry*)b;
+
+	ret = FileSnapshotEntry_Compare(e1, e2);
+	if (ret != 0) {
+		return ret;
+	}
+	return e1 > e2 ? -1 : 1;
+}
+
+static LCUI_BOOL FileSnapshot_Verify(FileSnapshot s)
+{
+	uint64_t size;
+	FileSnapshotHeader header;
+
+	if (s->file.size < sizeof(FileSnapshotHeaderRec)) {
+		return FALSE;
+	}
+	header = (FileSnapshotHeader)s->file.data;
+	if (memcmp(header->magic, FILE_SNAPSHOT_MAGIC, 8) != 0 ||
+	    header->version > FILE_SNAPSHOT_VERSION ||
+	    header->header_size < sizeof(FileSnapshotHeaderRec) ||
+	    header->index_offset < header->header_size ||
+	    header->index_offset % sizeof(uint64_t) != 0) {
+		return FALSE;
+	}
+	size = header->index_offset + header->count * sizeof(uint64_t);
+	if (size > s->file.size) {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+FileSnapshot FileSnapshot_Open(const char *path, LCUI_BOOL writable)
+{
+	FileSnapshot s;
+
+	s = NEW(FileSnapshotRec, 1);
+	if (!s) {
+		return NULL;
+	}
+	if (MappedFile_Open(&s->file, path, writable) != 0) {
+		free(s);
+		return NULL;
+	}
+	if (!FileSnapshot_Verify(s)) {
+		LOG("[snapshot] invalid snapshot file: %s\n", path);
+		MappedFile_Close(&s->file);
+		free(s);
+		return NULL;
+	}
+	s->header = (FileSnapshotHeader)s->file.data;
+	s->index = (const uint64_t*)(s->file.data + s->header->index_offset);
+	s->count = (size_t)s->header->count;
+	return s;
+}
+
+void FileSnapshot_Close(FileSnapshot s)
+{
+	MappedFile_Close(&s->file);
+	free(s);
+}
+
+LCUI_BOOL FileSnapshot_Check(const char *path)
+{
+	FILE *fp;
+	FileSnapshotHeaderRec header;
+	LCUI_BOOL ok = FALSE;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		return FALSE;
+	}
+	if (fread(&header, sizeof(header), 1, fp) == 1) {
+		ok = memcmp(header.magic, FILE_SNAPSHOT_MAGIC, 8) == 0;
+	}
+	fclose(fp);
+	return ok;
+}
+
+unsigned int FileSnapshot_GetVersion(FileSnapshot s)
+{
+	return s->header->version;
+}
+
+size_t FileSnapshot_GetCount(FileSnapshot s)
+{
+	return s->count;
+}
+
+const FileSnapshotEntryRec *FileSnapshot_GetEntry(FileSnapshot s, size_t i)
+{
+	if (i >= s->count) {
+		return NULL;
+	}
+	return (const FileSnapshotEntryRec*)(s->file.data + s->index[i]);
+}
+
+long FileSnapshot_Find(FileSnapshot s, const char *key, size_t keylen)
+{
+	int ret;
+	size_t low = 0, high = s->count, mid;
+	const FileSnapshotEntryRec *entry;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		entry = FileSnapshot_GetEntry(s, mid);
+		ret = FileSnapshot_CompareKey(FileSnapshotEntry_GetKey(entry),
+					      entry->keylen, key, keylen);
+		if (ret == 0) {
+			return (long)mid;
+		}
+		if (ret < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return -1;
+}
+
+int FileSnapshot_Delete(FileSnapshot s, const char *key, size_t keylen)
+{
+	long i;
+	FileSnapshotEntry entry;
+
+	i = FileSnapshot_Find(s, key, keylen);
+	if (i < 0) {
+		return -ENOENT;
+	}
+	entry = (FileSnapshotEntry)FileSnapshot_GetEntry(s, i);
+	entry->flags |= FILE_SNAPSHOT_DELETED;
+	return 0;
+}
+
+/** 获取下一个有效记录的下标 */
+static size_t FileSnapshot_Next(FileSnapshot s, size_t i)
+{
+	const FileSnapshotEntryRec *entry;
+
+	for (; s && i < s->count; ++i) {
+		entry = FileSnapshot_GetEntry(s, i);
+		if (!(entry->flags & FILE_SNAPSHOT_DELETED)) {
+			break;
+		}
+	}
+	return i;
+}
+
+size_t FileSnapshot_Diff(FileSnapshot base, FileSnapshot snapshot,
+			 FileSnapshotDiffHandler handler, void *data)
+{
+	int ret;
+	size_t i, j, n1, n2, count = 0;
+	const FileSnapshotEntryRec *e1, *e2;
+
+	n1 = base ? base->count : 0;
+	n2 = snapshot ? snapshot->count : 0;
+	i = FileSnapshot_Next(base, 0);
+	j = FileSnapshot_Next(snapshot, 0);
+	while (i < n1 || j < n2) {
+		if (i >= n1) {
+			ret = 1;
+		} else if (j >= n2) {
+			ret = -1;
+		} else {
+			e1 = FileSnapshot_GetEntry(base, i);
+			e2 = FileSnapshot_GetEntry(snapshot, j);
+			ret = FileSnapshotEntry_Compare(e1, e2);
+		}
+		if (ret < 0) {
+			e1 = FileSnapshot_GetEntry(base, i);
+			handler(data, FILE_SNAPSHOT_REMOVED, e1);
+			i = FileSnapshot_Next(base, i + 1);
+			++count;
+			continue;
+		}
+		if (ret > 0) {
+			e2 = FileSnapshot_GetEntry(snapshot, j);
+			handler(data, FILE_SNAPSHOT_ADDED, e2);
+			j = FileSnapshot_Next(snapshot, j + 1);
+			++count;
+			continue;
+		}
+		if (e1->ctime != e2->ctime || e1->mtime != e2->mtime) {
+			handler(data, FILE_SNAPSHOT_CHANGED, e2);
+			++count;
+		}
+		i = FileSnapshot_Next(base, i + 1);
+		j = FileSnapshot_Next(snapshot, j + 1);
+	}
+	return count;
+}
+
+static char *StrDupWithSuffix(const char *str, const char *suffix)
+{
+	size_t len = strlen(str) + strlen(suffix) + 1;
+	char *newstr = malloc(len * sizeof(char));
+	if (newstr) {
+		snprintf(newstr, len, "%s%s", str, suffix);
+	}
+	return newstr;
+}
+
+FileSnapshotWriter FileSnapshotWriter_Create(const char *path)
+{
+	ASSIGN(w, FileSnapshotWriter);
+	if (!w) {
+		return NULL;
+	}
+	w->runs = NULL;
+	w->runs_size = 0;
+	w->keep_runs = FALSE;
+	w->entries = NULL;
+	w->n_entries = 0;
+	w->max_entries = 0;
+	w->buffer_size = 0;
+	w->finished = FALSE;
+	w->path = StrDupWithSuffix(path, "");
+	w->runs_path = StrDupWithSuffix(path, ".runs");
+	w->index_path = StrDupWithSuffix(path, ".idx");
+	w->buffer = malloc(RUN_BUFFER_SIZE);
+	if (!w->path || !w->runs_path || !w->index_path || !w->buffer) {
+		FileSnapshotWriter_Destroy(w);
+		return NULL;
+	}
+	return w;
+}
+
+void FileSnapshotWriter_Destroy(FileSnapshotWriter w)
+{
+	if (w->runs) {
+		fclose(w->runs);
+		w->runs = NULL;
+	}
+	if (!w->finished && !w->keep_runs && w->runs_path) {
+		remove(w->runs_path);
+	}
+	free(w->path);
+	free(w->runs_path);
+	free(w->index_path);
+	free(w->buffer);
+	free(w->entries);
+	free(w);
+}
+
+/** 将缓冲区内的记录排序后作为一个有序段写入临时文件 */
+static int FileSnapshotWriter_FlushRun(FileSnapshotWriter w)
+{
+	size_t i;
+	FileSnapshotRunRec run;
+
+	if (w->n_entries < 1) {
+		return 0;
+	}
+	if (!w->runs) {
+		w->runs = fopen(w->runs_path, "wb");
+		if (!w->runs) {
+			LOG("[snapshot] cannot open file: %s\n", w->runs_path);
+			return -EIO;
+		}
+	}
+	qsort(w->entries, w->n_entries, sizeof(FileSnapshotEntry),
+	      OnCompareEntries);
+	run.count = w->n_entries;
+	run.size = w->buffer_size;
+	if (fwrite(&run, sizeof(run), 1, w->runs) != 1) {
+		return -EIO;
+	}
+	for (i = 0; i < w->n_entries; ++i) {
+		if (fwrite(w->entries[i], ENTRY_SIZE(w->entries[i]->keylen),
+			   1, w->runs) != 1) {
+			return -EIO;
+		}
+	}
+	w->runs_size += sizeof(run) + w->buffer_size;
+	w->n_entries = 0;
+	w->buffer_size = 0;
+	return 0;
+}
+
+FileSnapshotWriter FileSnapshotWriter_Resume(const char *path,
+					     uint64_t runs_size)
+{
+	FileSnapshotWriter w;
+
+	w = FileSnapshotWriter_Create(path);
+	if (!w) {
+		return NULL;
+	}
+	w->keep_runs = TRUE;
+	w->runs = fopen(w->runs_path, "r+b");
+	if (!w->runs) {
+		FileSnapshotWriter_Destroy(w);
+		return NULL;
+	}
+	/* 丢弃检查点之后写入的内容 */
+	if (GetFileSize(w->runs) < (int64_t)runs_size ||
+	    TruncateFile(w->runs, runs_size) != 0 ||
+	    fseek(w->runs, 0, SEEK_END) != 0) {
+		LOG("[snapshot] cannot resume from file: %s\n", w->runs_path);
+		fclose(w->runs);
+		w->runs = NULL;
+		FileSnapshotWriter_Destroy(w);
+		return NULL;
+	}
+	w->runs_size = runs_size;
+	return w;
+}
+
+int FileSnapshotWriter_Flush(FileSnapshotWriter w, uint64_t *runs_size)
+{
+	int ret;
+
+	if (w->finished) {
+		return -EINVAL;
+	}
+	ret = FileSnapshotWriter_FlushRun(w);
+	if (ret == 0 && w->runs) {
+		ret = SyncFile(w->runs);
+	}
+	if (ret != 0) {
+		return ret;
+	}
+	w->keep_runs = TRUE;
+	*runs_size = w->runs_size;
+	return 0;
+}
+
+void FileSnapshotWriter_Discard(const char *path)
+{
+	char *runs_path = StrDupWithSuffix(path, ".runs");
+	char *index_path = StrDupWithSuffix(path, ".idx");
+
+	if (runs_path) {
+		remove(runs_path);
+	}
+	if (index_path) {
+		remove(index_path);
+	}
+	free(runs_path);
+	free(index_path);
+}
+
+int FileSnapshotWriter_Add(FileSnapshotWriter w, const char *key,
+			   size_t keylen, uint32_t ctime, uint32_t mtime)
+{
+	int ret;
+	size_t size;
+	FileSnapshotEntry entry, *entries;
+
+	size = ENTRY_SIZE(keylen);
+	if (w->finished || size > RUN_BUFFER_SIZE) {
+		return -EINVAL;
+	}
+	if (w->buffer_size + size > RUN_BUFFER_SIZE) {
+		ret = FileSnapshotWriter_FlushRun(w);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	if (w->n_entries >= w->max_entries) {
+		size = w->max_entries > 0 ? w->max_entries * 2 : 1024;
+		entries = realloc(w->entries, size * sizeof(FileSnapshotEntry));
+		if (!entries) {
+			return -ENOMEM;
+		}
+		w->entries = entries;
+		w->max_entries = size;
+	}
+	entry = (FileSnapshotEntry)(w->buffer + w->buffer_size);
+	entry->ctime = ctime;
+	entry->mtime = mtime;
+	entry->flags = 0;
+	entry->keylen = (uint32_t)keylen;
+	memset((char*)FileSnapshotEntry_GetKey(entry) + keylen, 0,
+	       ALIGN4(keylen) - keylen);
+	memcpy((char*)FileSnapshotEntry_GetKey(entry), key, keylen);
+	w->entries[w->n_entries++] = entry;
+	w->buffer_size += ENTRY_SIZE(keylen);
+	return 0;
+}
+
+static int SnapshotOutput_Begin(SnapshotOutput out, FileSnapshotWriter w)
+{
+	FileSnapshotHeaderRec header = { 0 };
+
+	out->fp = fopen(w->path, "wb");
+	if (!out->fp) {
+		LOG("[snapshot] cannot open file: %s\n", w->path);
+		return -EIO;
+	}
+	out->index = fopen(w->index_path, "wb+");
+	if (!out->index) {
+		LOG("[snapshot] cannot open file: %s\n", w->index_path);
+		fclose(out->fp);
+		return -EIO;
+	}
+	if (fwrite(&header, sizeof(header), 1, out->fp) != 1) {
+		fclose(out->index);
+		fclose(out->fp);
+		return -EIO;
+	}
+	out->offset = sizeof(header);
+	out->count = 0;
+	out->last = NULL;
+	return 0;
+}
+
+static int SnapshotOutput_Write(SnapshotOutput out,
+				const FileSnapshotEntryRec *entry)
+{
+	size_t size = ENTRY_SIZE(entry->keylen);
+
+	/* 同一个文件被多次添加时只保留最后添加的记录，它排在最前面 */
+	if (out->last && FileSnapshotEntry_Compare(out->last, entry) == 0) {
+		return 0;
+	}
+	if (fwrite(entry, size, 1, out->fp) != 1 ||
+	    fwrite(&out->offset, sizeof(uint64_t), 1, out->index) != 1) {
+		return -EIO;
+	}
+	out->last = entry;
+	out->offset += size;
+	out->count += 1;
+	return 0;
+}
+
+static int SnapshotOutput_End(SnapshotOutput out, int ret)
+{
+	size_t n;
+	char buf[COPY_BUFFER_SIZE];
+	const char padding[sizeof(uint64_t)] = { 0 };
+	FileSnapshotHeaderRec header = { 0 };
+
+	if (ret != 0) {
+		goto exit;
+	}
+	/* 让索引按 8 字节对齐，以便直接通过内存映射读取 */
+	n = (size_t)(out->offset % sizeof(uint64_t));
+	if (n > 0) {
+		n = sizeof(uint64_t) - n;
+		if (fwrite(padding, 1, n, out->fp) != n) {
+			ret = -EIO;
+			goto exit;
+		}
+		out->offset += n;
+	}
+	strcpy(header.magic, FILE_SNAPSHOT_MAGIC);
+	header.version = FILE_SNAPSHOT_VERSION;
+	header.header_size = sizeof(header);
+	header.count = out->count;
+	header.index_offset = out->offset;
+	rewind(out->index);
+	while ((n = fread(buf, 1, COPY_BUFFER_SIZE, out->index)) > 0) {
+		if (fwrite(buf, 1, n, out->fp) != n) {
+			ret = -EIO;
+			goto exit;
+		}
+	}
+	rewind(out->fp);
+	if (fwrite(&header, sizeof(header), 1, out->fp) != 1) {
+		ret = -EIO;
+	}
+
+exit:
+	fclose(out->index);
+	if (fclose(out->fp) != 0 && ret == 0) {
+		ret = -EIO;
+	}
+	return ret;
+}
+
+/** 比较两个游标当前的记录，键相同时后写入的有序段优先 */
+static int RunCursor_Compare(RunCursor cursors, size_t a, size_t b)
+{
+	int ret;
+
+	ret = FileSnapshotEntry_Compare(
+	    (const FileSnapshotEntryRec*)cursors[a].pos,
+	    (const FileSnapshotEntryRec*)cursors[b].pos);
+	if (ret != 0) {
+		return ret;
+	}
+	return a > b ? -1 : 1;
+}
+
+static void RunHeap_SiftDown(size_t *heap, size_t n, size_t i,
+			     RunCursor cursors)
+{
+	size_t child, tmp;
+
+	while ((child = i * 2 + 1) < n) {
+		if (child + 1 < n &&
+		    RunCursor_Compare(cursors, heap[child + 1],
+				      heap[child]) < 0) {
+			child += 1;
+		}
+		if (RunCursor_Compare(cursors, heap[child], heap[i]) >= 0) {
+			break;
+		}
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/** 以多路归并的方式合并所有有序段，用最小堆选出键最小的记录 */
+static int FileSnapshotWriter_MergeRuns(FileSnapshotWriter w,
+					SnapshotOutput out)
+{
+	int ret = 0;
+	size_t i, k, n_cursors = 0, n;
+	size_t *heap = NULL;
+	MappedFileRec runs;
+	RunCursor cursors = NULL, c;
+	FileSnapshotRun run;
+	const char *p, *end;
+	const FileSnapshotEntryRec *entry;
+
+	if (MappedFile_Open(&runs, w->runs_path, FALSE) != 0) {
+		return SnapshotOutput_End(out, -EIO);
+	}
+	p = runs.data;
+	end = runs.data + runs.size;
+	while (p + sizeof(FileSnapshotRunRec) <= end) {
+		run = (FileSnapshotRun)p;
+		p += sizeof(FileSnapshotRunRec);
+		if (run->size > (uint64_t)(end - p)) {
+			ret = -EINVAL;
+			break;
+		}
+		c = realloc(cursors, sizeof(RunCursorRec) * (n_cursors + 1));
+		if (!c) {
+			ret = -ENOMEM;
+			break;
+		}
+		cursors = c;
+		cursors[n_cursors].pos = p;
+		cursors[n_cursors].remain = run->count;
+		n_cursors += 1;
+		p += run->size;
+	}
+	if (ret == 0 && n_cursors > 0) {
+		heap = malloc(sizeof(size_t) * n_cursors);
+		if (!heap) {
+			ret = -ENOMEM;
+		}
+	}
+	for (n = 0, i = 0; ret == 0 && i < n_cursors; ++i) {
+		if (cursors[i].remain > 0) {
+			heap[n++] = i;
+		}
+	}
+	for (i = n / 2; i > 0; --i) {
+		RunHeap_SiftDown(heap, n, i - 1, cursors);
+	}
+	while (ret == 0 && n > 0) {
+		k = heap[0];
+		entry = (const FileSnapshotEntryRec*)cursors[k].pos;
+		ret = SnapshotOutput_Write(out, entry);
+		cursors[k].pos += ENTRY_SIZE(entry->keylen);
+		cursors[k].remain -= 1;
+		if (cursors[k].remain < 1) {
+			heap[0] = heap[--n];
+		}
+		RunHeap_SiftDown(heap, n, 0, cursors);
+	}
+	ret = SnapshotOutput_End(out, ret);
+	MappedFile_Close(&runs);
+	free(cursors);
+	free(heap);
+	return ret;
+}
+
+int FileSnapshotWriter_Finish(FileSnapshotWriter w)
+{
+	int ret = 0;
+	size_t i;
+	SnapshotOutputRec out;
+
+	if (w->finished) {
+		return -EINVAL;
+	}
+	if (w->runs) {
+		ret = FileSnapshotWriter_FlushRun(w);
+		if (fclose(w->runs) != 0 && ret == 0) {
+			ret = -EIO;
+		}
+		w->runs = NULL;
+		if (ret == 0) {
+			ret = SnapshotOutput_Begin(&out, w);
+		}
+		if (ret == 0) {
+			ret = FileSnapshotWriter_MergeRuns(w, &out);
+		}
+		remove(w->runs_path);
+	} else {
+		/* 记录较少，全部在缓冲区内，直接排序后输出 */
+		if (w->n_entries > 0) {
+			qsort(w->entries, w->n_entries,
+			      sizeof(FileSnapshotEntry), OnCompareEntries);
+		}
+		ret = SnapshotOutput_Begin(&out, w);
+		if (ret == 0) {
+			for (i = 0; ret == 0 && i < w->n_entries; ++i) {
+				ret = SnapshotOutput_Write(&out,
+							   w->entries[i]);
+			}
+			ret = SnapshotOutput_End(&out, ret);
+		}
+	}
+	remove(w->index_path);
+	w->n_entries = 0;
+	w->buffer_size = 0;
+	w->finished = TRUE;
+	if (ret != 0) {
+		LOG("[snapshot] cannot write snapshot: %s\n", w->path);
+		remove(w->path);
+	}
+	return ret;
+}
@@ -150,6 +150,11 @@ static void OnResponse(FileResponse *response, void *data)
 				  pack->data);
 		break;
 	case HANDLER_ON_GET_THUMB:
+		/* 文件存在但无法解码，告诉调用者文件的状态，以便记录下来 */
+		if (response->status == RESPONSE_STATUS_NOT_ACCEPTABLE) {
+			pack->on_get_thumb(&response->file, NULL, pack->data);
+			break;
+		}
 		if (response->status != RESPONSE_STATUS_OK) {
 			pack->on_get_thumb(NULL, NULL, pack->data);
 			break;
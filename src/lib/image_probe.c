@@ -0,0 +1,156 @@
+﻿/* ***************************************************************************
+ * image_probe.c -- image header probe
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * image_probe.c -- 图片文件头探测
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include "common.h"
+#include "exif.h"
+#include "image_probe.h"
+
+#define PNG_HEADER_SIZE		24
+#define BMP_HEADER_SIZE		26
+#define BMP_CORE_HEADER_SIZE	12
+
+static uint32_t ReadUInt32BE(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint32_t ReadUInt32LE(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/** PNG 文件的第一个数据块必须是 IHDR，它记录了图像的宽高 */
+static int ImageProbe_ReadPNG(const unsigned char *buf, size_t size,
+			      unsigned *width, unsigned *height)
+{
+	static const unsigned char signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+
+	if (size < PNG_HEADER_SIZE || memcmp(buf, signature, 8) != 0 ||
+	    memcmp(buf + 12, "IHDR", 4) != 0) {
+		return -1;
+	}
+	*width = ReadUInt32BE(buf + 16);
+	*height = ReadUInt32BE(buf + 20);
+	return 0;
+}
+
+/** BMP 文件头之后是信息头，旧版的 OS/2 格式用 16 位整数记录宽高 */
+static int ImageProbe_ReadBMP(const unsigned char *buf, size_t size,
+			      unsigned *width, unsigned *height)
+{
+	int32_t h;
+	uint32_t info_size;
+
+	if (size < BMP_HEADER_SIZE || buf[0] != 'B' || buf[1] != 'M') {
+		return -1;
+	}
+	info_size = ReadUInt32LE(buf + 14);
+	if (info_size == BMP_CORE_HEADER_SIZE) {
+		*width = buf[18] | (buf[19] << 8);
+		*height = buf[20] | (buf[21] << 8);
+		return 0;
+	}
+	if (info_size < 40) {
+		return -1;
+	}
+	/* 高度为负数时表示像素行是自上而下存储的 */
+	h = (int32_t)ReadUInt32LE(buf + 22);
+	*width = ReadUInt32LE(buf + 18);
+	*height = h < 0 ? (unsigned)(-(int64_t)h) : (unsigned)h;
+	return 0;
+}
+
+int ImageProbe_ReadSize(FILE *fp, unsigned *width, unsigned *height)
+{
+	size_t size;
+	ExifInfoRec exif;
+	unsigned char buf[PNG_HEADER_SIZE + 2];
+
+	size = fread(buf, 1, sizeof(buf), fp);
+	if (size >= 2 && buf[0] == 0xff && buf[1] == 0xd8) {
+		fseek(fp, 0, SEEK_SET);
+		if (Exif_ReadHeader(fp, &exif) != 0) {
+			return -1;
+		}
+		*width = exif.width;
+		*height = exif.height;
+		if (Exif_IsTransposed(exif.orientation)) {
+			*width = exif.height;
+			*height = exif.width;
+		}
+	} else if (ImageProbe_ReadPNG(buf, size, width, height) != 0 &&
+		   ImageProbe_ReadBMP(buf, size, width, height) != 0) {
+		return -1;
+	}
+	if (*width < 1 || *height < 1) {
+		return -1;
+	}
+	return 0;
+}
+
+int ImageProbe_GetSizeW(const wchar_t *path, unsigned *width,
+			unsigned *height)
+{
+	int ret;
+	FILE *fp;
+#ifdef _WIN32
+	char *file = EncodeANSI(path);
+#else
+	char *file = EncodeUTF8(path);
+#endif
+
+	if (!file) {
+		return -1;
+	}
+	fp = fopen(file, "rb");
+	free(file);
+	if (!fp) {
+		return -1;
+	}
+	ret = ImageProbe_ReadSize(fp, width, height);
+	fclose(fp);
+	return ret;
+}
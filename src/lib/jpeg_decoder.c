@@ -0,0 +1,173 @@
+﻿/* ***************************************************************************
+ * jpeg_decoder.c -- JPEG decoder with scaled decoding support.
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * jpeg_decoder.c -- 支持缩小解码的 JPEG 解码器
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include "build.h"
+#include "jpeg_decoder.h"
+
+#ifdef LCFINDER_USE_LIBJPEG
+
+#include <jpeglib.h>
+
+typedef struct JPEGErrorRec_ {
+	struct jpeg_error_mgr base;
+	jmp_buf env;
+} JPEGErrorRec, *JPEGError;
+
+static void JPEGDecoder_OnError(j_common_ptr cinfo)
+{
+	JPEGError err = (JPEGError)cinfo->err;
+	char msg[JMSG_LENGTH_MAX];
+
+	err->base.format_message(cinfo, msg);
+	LOG("[jpeg decoder] %s\n", msg);
+	longjmp(err->env, 1);
+}
+
+static void JPEGDecoder_OnMessage(j_common_ptr cinfo, int level)
+{
+	/* 忽略警告，损坏的数据会在出错时处理 */
+}
+
+/** 计算缩小比例的分母，取值为 1、2、4 或 8 */
+static unsigned JPEGDecoder_GetScaleDenom(unsigned origin_width,
+					  unsigned origin_height,
+					  unsigned width, unsigned height)
+{
+	unsigned denom;
+	double scale = 1.0;
+
+	/* 缩略图会按比例缩放到目标尺寸以内，只需覆盖缩放后的尺寸 */
+	if (width > 0 && height > 0) {
+		scale = min(1.0 * width / origin_width,
+			    1.0 * height / origin_height);
+	} else if (width > 0) {
+		scale = 1.0 * width / origin_width;
+	} else if (height > 0) {
+		scale = 1.0 * height / origin_height;
+	}
+	for (denom = 8; denom > 1; denom /= 2) {
+		if (1.0 / denom >= scale) {
+			break;
+		}
+	}
+	return denom;
+}
+
+int JPEGDecoder_ReadScaled(FILE *fp, unsigned width, unsigned height,
+			   unsigned *origin_width, unsigned *origin_height,
+			   LCUI_Graph *out)
+{
+	JPEGErrorRec err;
+	JSAMPROW row;
+#ifndef JCS_EXTENSIONS
+	unsigned x;
+	unsigned char *p, tmp;
+#endif
+	struct jpeg_decompress_struct cinfo;
+
+	Graph_Init(out);
+	cinfo.err = jpeg_std_error(&err.base);
+	err.base.error_exit = JPEGDecoder_OnError;
+	err.base.emit_message = JPEGDecoder_OnMessage;
+	if (setjmp(err.env)) {
+		jpeg_destroy_decompress(&cinfo);
+		Graph_Free(out);
+		return -1;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, fp);
+	jpeg_read_header(&cinfo, TRUE);
+	/* CMYK 和 YCCK 格式无法转换成 RGB，交给 LCUI 处理 */
+	if (cinfo.jpeg_color_space != JCS_GRAYSCALE &&
+	    cinfo.jpeg_color_space != JCS_YCbCr &&
+	    cinfo.jpeg_color_space != JCS_RGB) {
+		jpeg_destroy_decompress(&cinfo);
+		return -1;
+	}
+	*origin_width = cinfo.image_width;
+	*origin_height = cinfo.image_height;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = JPEGDecoder_GetScaleDenom(
+	    cinfo.image_width, cinfo.image_height, width, height);
+#ifdef JCS_EXTENSIONS
+	cinfo.out_color_space = JCS_EXT_BGR;
+#else
+	cinfo.out_color_space = JCS_RGB;
+#endif
+	jpeg_start_decompress(&cinfo);
+	out->color_type = LCUI_COLOR_TYPE_RGB888;
+	if (Graph_Create(out, cinfo.output_width, cinfo.output_height) != 0) {
+		jpeg_destroy_decompress(&cinfo);
+		return -1;
+	}
+	while (cinfo.output_scanline < cinfo.output_height) {
+		row = out->bytes + cinfo.output_scanline * out->bytes_per_row;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+#ifndef JCS_EXTENSIONS
+		/* LCUI 的像素按 BGR 的顺序存储 */
+		for (x = 0, p = row; x < cinfo.output_width; ++x, p += 3) {
+			tmp = p[0];
+			p[0] = p[2];
+			p[2] = tmp;
+		}
+#endif
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	DEBUG_MSG("[jpeg decoder] decode %ux%u at 1/%u, output %ux%u\n",
+		  *origin_width, *origin_height, cinfo.scale_denom,
+		  out->width, out->height);
+	return 0;
+}
+
+#else
+
+int JPEGDecoder_ReadScaled(FILE *fp, unsigned width, unsigned height,
+			   unsigned *origin_width, unsigned *origin_height,
+			   LCUI_Graph *out)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,221 @@
+﻿/* ***************************************************************************
+ * kvdb.c -- key-value database, common code shared by all backends
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/thread.h>
+#include "kvdb.h"
+
+/** 组提交线程的唤醒间隔，同步的时间误差不超过这个值 */
+#define COMMITTER_INTERVAL (KVDB_GROUP_COMMIT_INTERVAL / 4)
+
+/**
+ * 组提交线程
+ * 所有 GROUP 模式的数据库共用一个线程，它定期检查各个数据库，同步已到期的
+ * 写入，写入者无需等待同步
+ */
+typedef struct kvdb_committer_t {
+	int initialized;
+	int running;
+	LCUI_Thread thread;
+	LCUI_Mutex mutex;
+	LCUI_Cond cond;
+	kvdb_t **dbs;
+	size_t length;
+} kvdb_committer_t;
+
+typedef struct kvdb_key_ref_t {
+	const char *key;
+	size_t keylen;
+	size_t index;
+} kvdb_key_ref_t;
+
+static kvdb_committer_t committer;
+
+int kvdb_compare_key(const char *key1, size_t len1,
+		     const char *key2, size_t len2)
+{
+	int ret;
+
+	ret = memcmp(key1, key2, len1 < len2 ? len1 : len2);
+	if (ret != 0) {
+		return ret;
+	}
+	if (len1 == len2) {
+		return 0;
+	}
+	return len1 < len2 ? -1 : 1;
+}
+
+int kvdb_cursor_set_prefix(kvdb_cursor_t *cur, const char *prefix,
+			   size_t len)
+{
+	int ret;
+	size_t upperlen;
+	char *upper;
+
+	if (!prefix || len < 1) {
+		return kvdb_cursor_set_range(cur, NULL, 0, NULL, 0);
+	}
+	upper = malloc(len);
+	if (!upper) {
+		return -1;
+	}
+	/* 上界是比所有以 prefix 开头的键都大的最小的键：去掉末尾的 0xff，
+	 * 然后将最后一个字节加一。如果全都是 0xff，则没有上界 */
+	memcpy(upper, prefix, len);
+	for (upperlen = len; upperlen > 0; --upperlen) {
+		if ((unsigned char)upper[upperlen - 1] != 0xff) {
+			upper[upperlen - 1] += 1;
+			break;
+		}
+	}
+	if (upperlen > 0) {
+		ret = kvdb_cursor_set_range(cur, prefix, len, upper, upperlen);
+	} else {
+		ret = kvdb_cursor_set_range(cur, prefix, len, NULL, 0);
+	}
+	free(upper);
+	return ret;
+}
+
+static int kvdb_key_ref_compare(const void *a, const void *b)
+{
+	const kvdb_key_ref_t *k1 = a;
+	const kvdb_key_ref_t *k2 = b;
+
+	return kvdb_compare_key(k1->key, k1->keylen, k2->key, k2->keylen);
+}
+
+size_t kvdb_multi_get(kvdb_txn_t *txn, size_t count, const char **keys,
+		      const size_t *keylens, const void **vals,
+		      size_t *vallens)
+{
+	size_t i, n = 0;
+	kvdb_key_ref_t *refs;
+
+	refs = malloc(sizeof(kvdb_key_ref_t) * (count > 0 ? count : 1));
+	if (!refs) {
+		return 0;
+	}
+	for (i = 0; i < count; ++i) {
+		refs[i].key = keys[i];
+		refs[i].keylen = keylens[i];
+		refs[i].index = i;
+	}
+	/* 按键的顺序读取，相邻的键通常位于同一数据块中，能减少磁盘的随机访问 */
+	qsort(refs, count, sizeof(kvdb_key_ref_t), kvdb_key_ref_compare);
+	for (i = 0; i < count; ++i) {
+		vals[refs[i].index] = kvdb_get_view(txn, refs[i].key,
+						    refs[i].keylen,
+						    &vallens[refs[i].index]);
+		if (vals[refs[i].index]) {
+			++n;
+		}
+	}
+	free(refs);
+	return n;
+}
+
+static void kvdb_committer_thread(void *arg)
+{
+	size_t i;
+
+	LCUIMutex_Lock(&committer.mutex);
+	while (committer.running) {
+		LCUICond_TimedWait(&committer.cond, &committer.mutex,
+				   COMMITTER_INTERVAL);
+		for (i = 0; i < committer.length; ++i) {
+			kvdb_group_commit(committer.dbs[i]);
+		}
+	}
+	LCUIMutex_Unlock(&committer.mutex);
+	LCUIThread_Exit(NULL);
+}
+
+void kvdb_committer_add(kvdb_t *db)
+{
+	size_t i;
+	kvdb_t **dbs;
+
+	/* 数据库通常由主线程打开，这里不考虑并发初始化 */
+	if (!committer.initialized) {
+		LCUIMutex_Init(&committer.mutex);
+		LCUICond_Init(&committer.cond);
+		committer.initialized = 1;
+	}
+	LCUIMutex_Lock(&committer.mutex);
+	for (i = 0; i < committer.length; ++i) {
+		if (committer.dbs[i] == db) {
+			LCUIMutex_Unlock(&committer.mutex);
+			return;
+		}
+	}
+	dbs = realloc(committer.dbs, sizeof(kvdb_t*) * (committer.length + 1));
+	if (!dbs) {
+		LCUIMutex_Unlock(&committer.mutex);
+		return;
+	}
+	dbs[committer.length++] = db;
+	committer.dbs = dbs;
+	if (!committer.running) {
+		committer.running = 1;
+		LCUIThread_Create(&committer.thread,
+				  kvdb_committer_thread, NULL);
+	}
+	LCUIMutex_Unlock(&committer.mutex);
+}
+
+void kvdb_committer_remove(kvdb_t *db)
+{
+	size_t i;
+	LCUI_Thread thread;
+
+	if (!committer.initialized) {
+		return;
+	}
+	/* 获得锁时组提交线程不在同步中，移除后不会再访问这个数据库 */
+	LCUIMutex_Lock(&committer.mutex);
+	for (i = 0; i < committer.length; ++i) {
+		if (committer.dbs[i] == db) {
+			committer.length -= 1;
+			committer.dbs[i] = committer.dbs[committer.length];
+			break;
+		}
+	}
+	if (committer.length > 0 || !committer.running) {
+		LCUIMutex_Unlock(&committer.mutex);
+		return;
+	}
+	committer.running = 0;
+	thread = committer.thread;
+	LCUICond_Signal(&committer.cond);
+	LCUIMutex_Unlock(&committer.mutex);
+	LCUIThread_Join(thread, NULL);
+}
+
+void kvdb_committer_notify(void)
+{
+	/* 不加锁，避免写入者等待正在进行的同步，错过的通知会在下次唤醒时补上 */
+	if (committer.initialized) {
+		LCUICond_Signal(&committer.cond);
+	}
+}
@@ -26,8 +26,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <leveldb/c.h>
 #include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/thread.h>
 #include <LCUI/util/dirent.h>
 
 #ifdef _WIN32
@@ -43,8 +47,41 @@ typedef struct kvdb_t {
 	leveldb_options_t *options;
 	leveldb_readoptions_t *roptions;
 	leveldb_writeoptions_t *woptions;
+	leveldb_writeoptions_t *woptions_sync;
+	kvdb_durability_t durability;
+	int64_t sync_time;
+	size_t pending;		/**< 上次同步后写入的字节数 */
+	int dirty;
+	LCUI_Mutex mutex;	/**< 保护组提交的状态，LevelDB 本身是线程安全的 */
 } kvdb_t;
 
+typedef struct kvdb_batch_t {
+	kvdb_t *db;
+	leveldb_writebatch_t *batch;
+} kvdb_batch_t;
+
+typedef struct kvdb_cursor_t {
+	kvdb_t *db;
+	leveldb_iterator_t *iter;
+	char *lower;
+	size_t lowerlen;
+	char *upper;
+	size_t upperlen;
+	int valid;
+} kvdb_cursor_t;
+
+typedef struct kvdb_view_t {
+	char *data;
+	struct kvdb_view_t *next;
+} kvdb_view_t;
+
+typedef struct kvdb_txn_t {
+	kvdb_t *db;
+	const leveldb_snapshot_t *snapshot;
+	leveldb_readoptions_t *roptions;
+	kvdb_view_t *views;
+} kvdb_txn_t;
+
 static leveldb_options_t *kvdb_options_create(void)
 {
 	leveldb_options_t *options = leveldb_options_create();
@@ -64,11 +101,18 @@ kvdb_t *kvdb_open(const char *name)
 
 	db->options = kvdb_options_create();
 	db->woptions = leveldb_writeoptions_create();
+	db->woptions_sync = leveldb_writeoptions_create();
 	db->roptions = leveldb_readoptions_create();
+	db->durability = KVDB_DURABILITY_SYNC;
+	db->sync_time = LCUI_GetTime();
+	db->pending = 0;
+	db->dirty = 0;
+	LCUIMutex_Init(&db->mutex);
 	leveldb_options_set_create_if_missing(db->options, 1);
 	leveldb_readoptions_set_fill_cache(db->roptions, 0);
 	leveldb_readoptions_set_verify_checksums(db->roptions, 1);
-	leveldb_writeoptions_set_sync(db->woptions, 1);
+	leveldb_writeoptions_set_sync(db->woptions, 0);
+	leveldb_writeoptions_set_sync(db->woptions_sync, 1);
 	db->db = leveldb_open(db->options, name, &err);
 	if (err) {
 		printf("[kvdb] error: %s\n", err);
@@ -80,8 +124,14 @@ kvdb_t *kvdb_open(const char *name)
 void kvdb_close(kvdb_t *db)
 {
 	assert(db && db->db);
+	kvdb_committer_remove(db);
+	if (db->dirty && db->durability == KVDB_DURABILITY_GROUP) {
+		kvdb_sync(db);
+	}
+	LCUIMutex_Destroy(&db->mutex);
 	leveldb_readoptions_destroy(db->roptions);
 	leveldb_writeoptions_destroy(db->woptions);
+	leveldb_writeoptions_destroy(db->woptions_sync);
 	leveldb_options_destroy(db->options);
 	leveldb_close(db->db);
 	free(db);
@@ -133,6 +183,135 @@ int kvdb_get_db_size(const char *name, int64_t *size)
 	return 0;
 }
 
+/** 根据持久化模式选择本次写入的选项，size 为本次写入的字节数 */
+static leveldb_writeoptions_t *kvdb_get_woptions(kvdb_t *db, size_t size)
+{
+	if (db->durability == KVDB_DURABILITY_SYNC) {
+		return db->woptions_sync;
+	}
+	LCUIMutex_Lock(&db->mutex);
+	db->dirty = 1;
+	db->pending += size;
+	if (db->durability == KVDB_DURABILITY_GROUP &&
+	    db->pending >= KVDB_GROUP_COMMIT_BYTES) {
+		kvdb_committer_notify();
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	return db->woptions;
+}
+
+void kvdb_set_durability(kvdb_t *db, kvdb_durability_t mode)
+{
+	db->durability = mode;
+	if (mode == KVDB_DURABILITY_GROUP) {
+		kvdb_committer_add(db);
+	} else {
+		kvdb_committer_remove(db);
+	}
+}
+
+int kvdb_sync(kvdb_t *db)
+{
+	char *err = NULL;
+	leveldb_writebatch_t *batch;
+
+	LCUIMutex_Lock(&db->mutex);
+	if (!db->dirty) {
+		LCUIMutex_Unlock(&db->mutex);
+		return 0;
+	}
+	/* 先重置状态，同步期间的新写入会再次标记为未同步 */
+	db->dirty = 0;
+	db->pending = 0;
+	db->sync_time = LCUI_GetTime();
+	LCUIMutex_Unlock(&db->mutex);
+	/* 写入一个空的批次，让 LevelDB 同步日志文件，之前未同步的写入随之一起
+	 * 持久化，崩溃后 LevelDB 打开数据库时会重放日志 */
+	batch = leveldb_writebatch_create();
+	leveldb_write(db->db, db->woptions_sync, batch, &err);
+	leveldb_writebatch_destroy(batch);
+	if (err) {
+		printf("[kvdb] error: %s\n", err);
+		leveldb_free(err);
+		return -1;
+	}
+	return 0;
+}
+
+int kvdb_group_commit(kvdb_t *db)
+{
+	LCUI_BOOL due;
+
+	LCUIMutex_Lock(&db->mutex);
+	due = db->pending >= KVDB_GROUP_COMMIT_BYTES ||
+	      LCUI_GetTimeDelta(db->sync_time) >= KVDB_GROUP_COMMIT_INTERVAL;
+	LCUIMutex_Unlock(&db->mutex);
+	return due ? kvdb_sync(db) : 0;
+}
+
+int kvdb_compact(kvdb_t *db)
+{
+	leveldb_compact_range(db->db, NULL, 0, NULL, 0);
+	return 0;
+}
+
+kvdb_batch_t *kvdb_batch_begin(kvdb_t *db)
+{
+	kvdb_batch_t *batch = malloc(sizeof(kvdb_batch_t));
+
+	if (!batch) {
+		return NULL;
+	}
+	batch->db = db;
+	batch->batch = leveldb_writebatch_create();
+	return batch;
+}
+
+int kvdb_batch_put(kvdb_batch_t *batch, const char *key, size_t keylen,
+		   const void *val, size_t vallen)
+{
+	leveldb_writebatch_put(batch->batch, key, keylen, val, vallen);
+	return 0;
+}
+
+int kvdb_batch_delete(kvdb_batch_t *batch, const char *key, size_t keylen)
+{
+	leveldb_writebatch_delete(batch->batch, key, keylen);
+	return 0;
+}
+
+int kvdb_batch_commit(kvdb_batch_t *batch)
+{
+	char *err = NULL;
+	kvdb_t *db = batch->db;
+	leveldb_writeoptions_t *woptions = db->woptions_sync;
+
+	if (db->durability == KVDB_DURABILITY_ASYNC) {
+		woptions = kvdb_get_woptions(db, 0);
+	} else {
+		/* 同步写入会让之前未同步的写入一起持久化 */
+		LCUIMutex_Lock(&db->mutex);
+		db->dirty = 0;
+		db->pending = 0;
+		db->sync_time = LCUI_GetTime();
+		LCUIMutex_Unlock(&db->mutex);
+	}
+	leveldb_write(db->db, woptions, batch->batch, &err);
+	kvdb_batch_discard(batch);
+	if (err) {
+		printf("[kvdb] error: %s\n", err);
+		leveldb_free(err);
+		return -1;
+	}
+	return 0;
+}
+
+void kvdb_batch_discard(kvdb_batch_t *batch)
+{
+	leveldb_writebatch_destroy(batch->batch);
+	free(batch);
+}
+
 void *kvdb_get(kvdb_t *db, const char *key, size_t keylen, size_t *vallen)
 {
 	char *err = NULL;
@@ -149,7 +328,8 @@ int kvdb_put(kvdb_t *db, const char *key, size_t keylen,
 	     const void *val, size_t vallen)
 {
 	char *err = NULL;
-	leveldb_put(db->db, db->woptions, key, keylen, val, vallen, &err);
+	leveldb_put(db->db, kvdb_get_woptions(db, keylen + vallen), key,
+		    keylen, val, vallen, &err);
 	if (err) {
 		printf("[kvdb] error: %s\n", err);
 		return -1;
@@ -160,14 +340,194 @@ int kvdb_put(kvdb_t *db, const char *key, size_t keylen,
 int kvdb_delete(kvdb_t *db, const char *key, size_t keylen)
 {
 	char *err = NULL;
-	leveldb_delete(db->db, db->woptions, key, keylen, &err);
+	leveldb_delete(db->db, kvdb_get_woptions(db, keylen), key, keylen,
+		       &err);
+	if (err) {
+		printf("[kvdb] error: %s\n", err);
+		return -1;
+	}
+	return 0;
+}
+
+kvdb_txn_t *kvdb_txn_begin(kvdb_t *db)
+{
+	kvdb_txn_t *txn = malloc(sizeof(kvdb_txn_t));
+
+	if (!txn) {
+		return NULL;
+	}
+	txn->db = db;
+	txn->views = NULL;
+	txn->snapshot = leveldb_create_snapshot(db->db);
+	txn->roptions = leveldb_readoptions_create();
+	leveldb_readoptions_set_snapshot(txn->roptions, txn->snapshot);
+	return txn;
+}
+
+void kvdb_txn_end(kvdb_txn_t *txn)
+{
+	kvdb_view_t *view;
+
+	while (txn->views) {
+		view = txn->views;
+		txn->views = view->next;
+		leveldb_free(view->data);
+		free(view);
+	}
+	leveldb_readoptions_destroy(txn->roptions);
+	leveldb_release_snapshot(txn->db->db, txn->snapshot);
+	free(txn);
+}
+
+/** LevelDB 不提供指向内部数据的指针，只能复制一份，在事务结束时释放 */
+const void *kvdb_get_view(kvdb_txn_t *txn, const char *key, size_t keylen,
+			  size_t *vallen)
+{
+	char *err = NULL;
+	kvdb_view_t *view;
+	char *value = leveldb_get(txn->db->db, txn->roptions, key,
+				  keylen, vallen, &err);
 	if (err) {
 		printf("[kvdb] error: %s\n", err);
+		leveldb_free(err);
+		return NULL;
+	}
+	if (!value) {
+		return NULL;
+	}
+	view = malloc(sizeof(kvdb_view_t));
+	if (!view) {
+		leveldb_free(value);
+		return NULL;
+	}
+	view->data = value;
+	view->next = txn->views;
+	txn->views = view;
+	return value;
+}
+
+kvdb_cursor_t *kvdb_cursor_open(kvdb_t *db)
+{
+	kvdb_cursor_t *cur = malloc(sizeof(kvdb_cursor_t));
+
+	if (!cur) {
+		return NULL;
+	}
+	cur->db = db;
+	cur->iter = leveldb_create_iterator(db->db, db->roptions);
+	cur->lower = NULL;
+	cur->upper = NULL;
+	cur->lowerlen = 0;
+	cur->upperlen = 0;
+	cur->valid = 0;
+	return cur;
+}
+
+void kvdb_cursor_close(kvdb_cursor_t *cur)
+{
+	leveldb_iter_destroy(cur->iter);
+	free(cur->lower);
+	free(cur->upper);
+	free(cur);
+}
+
+static char *kvdb_dup_key(const char *key, size_t keylen)
+{
+	char *buf;
+
+	if (!key) {
+		return NULL;
+	}
+	/* 空键也需要一个非空指针来表示有边界 */
+	buf = malloc(keylen > 0 ? keylen : 1);
+	if (buf && keylen > 0) {
+		memcpy(buf, key, keylen);
+	}
+	return buf;
+}
+
+int kvdb_cursor_set_range(kvdb_cursor_t *cur, const char *lower,
+			  size_t lowerlen, const char *upper, size_t upperlen)
+{
+	free(cur->lower);
+	free(cur->upper);
+	cur->lower = kvdb_dup_key(lower, lowerlen);
+	cur->upper = kvdb_dup_key(upper, upperlen);
+	cur->lowerlen = lowerlen;
+	cur->upperlen = upperlen;
+	cur->valid = 0;
+	if ((lower && !cur->lower) || (upper && !cur->upper)) {
+		return -1;
+	}
+	return 0;
+}
+
+/** 检查迭代器当前所在的记录是否在范围内 */
+static int kvdb_cursor_check(kvdb_cursor_t *cur)
+{
+	size_t keylen;
+	const char *key;
+
+	cur->valid = 0;
+	if (!leveldb_iter_valid(cur->iter)) {
 		return -1;
 	}
+	if (cur->upper) {
+		key = leveldb_iter_key(cur->iter, &keylen);
+		if (kvdb_compare_key(key, keylen, cur->upper,
+				     cur->upperlen) >= 0) {
+			return -1;
+		}
+	}
+	cur->valid = 1;
 	return 0;
 }
 
+int kvdb_cursor_seek(kvdb_cursor_t *cur, const char *key, size_t keylen)
+{
+	if (!key || (cur->lower && kvdb_compare_key(key, keylen, cur->lower,
+						    cur->lowerlen) < 0)) {
+		key = cur->lower;
+		keylen = cur->lowerlen;
+	}
+	if (key) {
+		leveldb_iter_seek(cur->iter, key, keylen);
+	} else {
+		leveldb_iter_seek_to_first(cur->iter);
+	}
+	return kvdb_cursor_check(cur);
+}
+
+int kvdb_cursor_next(kvdb_cursor_t *cur)
+{
+	if (!cur->valid) {
+		return -1;
+	}
+	leveldb_iter_next(cur->iter);
+	return kvdb_cursor_check(cur);
+}
+
+int kvdb_cursor_valid(kvdb_cursor_t *cur)
+{
+	return cur->valid;
+}
+
+const char *kvdb_cursor_key(kvdb_cursor_t *cur, size_t *keylen)
+{
+	if (!cur->valid) {
+		return NULL;
+	}
+	return leveldb_iter_key(cur->iter, keylen);
+}
+
+const void *kvdb_cursor_value(kvdb_cursor_t *cur, size_t *vallen)
+{
+	if (!cur->valid) {
+		return NULL;
+	}
+	return leveldb_iter_value(cur->iter, vallen);
+}
+
 size_t kvdb_each(kvdb_t *db, kvdb_each_callback_t callback, void *privdata)
 {
 	size_t count = 0;
@@ -0,0 +1,1418 @@
+﻿/* ***************************************************************************
+ * kvdb_mmap.c -- key-value database, based on a memory-mapped log file
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#define HAVE_THUMB_DB_ENGINE
+#include "build.h"
+#ifdef LCFINDER_USE_MMAPDB
+#include "kvdb.h"
+#include "thumb_db.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/thread.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * 数据文件由文件头和一系列记录组成，写入时只在末尾追加记录，旧的记录不会被
+ * 修改，因此读取时可以直接返回指向内存映射区域的指针，无需复制数据。内存中
+ * 的哈希表记录每个键的最新记录的位置，打开数据库时通过重放记录来重建它。
+ * 记录的键和值都按 8 字节对齐，返回的值可以直接当作结构体访问。
+ * 批量写入的记录除最后一个外都带有 RECORD_MORE 标志，重放时未完整写入的
+ * 批次会被丢弃。过期的记录占用的空间较多时，打开数据库时会重写数据文件。
+ * 索引是无序的，游标每次定位都要收集并排序全部记录，只适合维护任务中的
+ * 全量遍历，不适合频繁的范围查询。
+ */
+
+#define KVDB_MAGIC		"LCKVMAP"
+#define KVDB_VERSION		1
+#define MIN_MAP_SIZE		(1 << 20)
+#define MIN_SLOTS		64
+#define COMPACT_MIN_GARBAGE	(4 << 20)
+#define SLOT_EMPTY		0
+#define SLOT_REMOVED		1
+#define RECORD_DELETED		1
+#define RECORD_MORE		2
+#define FNV_OFFSET_BASIS	2166136261u
+#define FNV_PRIME		16777619u
+#define ALIGN8(N)		(((N) + 7) & ~(uint64_t)7)
+#define RECORD_SIZE(K, V)	(sizeof(kvdb_record_t) + ALIGN8(K) + ALIGN8(V))
+#define RECORD_KEY(R)		((const char*)(R) + sizeof(kvdb_record_t))
+#define RECORD_VALUE(R)		(RECORD_KEY(R) + ALIGN8((R)->keylen))
+
+typedef struct kvdb_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+} kvdb_header_t;
+
+typedef struct kvdb_record_t {
+	uint32_t checksum;
+	uint32_t flags;
+	uint32_t keylen;
+	uint32_t vallen;
+} kvdb_record_t;
+
+typedef struct kvdb_map_t {
+	char *data;
+	size_t size;
+	int refs;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+	struct kvdb_map_t *next;
+} kvdb_map_t;
+
+typedef struct kvdb_slot_t {
+	uint64_t offset;
+	uint32_t hash;
+	uint32_t reserved;
+} kvdb_slot_t;
+
+typedef struct kvdb_t {
+	char *path;
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int fd;
+#endif
+	uint64_t end;
+	uint64_t garbage;
+	kvdb_map_t *map;
+	kvdb_map_t *retired;
+	kvdb_slot_t *slots;
+	size_t nslots;
+	size_t count;
+	size_t used;
+	LCUI_Mutex mutex;
+	kvdb_durability_t durability;
+	int64_t sync_time;
+	uint64_t pending;	/**< 上次同步后写入的字节数 */
+	int dirty;
+	struct kvdb_t *next;	/**< 下一个已打开的数据库 */
+} kvdb_t;
+
+/** 已打开的数据库列表，用于获取数据库的实际大小 */
+static struct kvdb_list_t {
+	int initialized;
+	kvdb_t *head;
+	LCUI_Mutex mutex;
+} opened;
+
+typedef struct kvdb_map_ref_t {
+	kvdb_map_t *map;
+	struct kvdb_map_ref_t *next;
+} kvdb_map_ref_t;
+
+typedef struct kvdb_txn_t {
+	kvdb_t *db;
+	kvdb_map_t *map;
+	kvdb_map_ref_t *old_maps;
+} kvdb_txn_t;
+
+typedef struct kvdb_batch_op_t {
+	int is_delete;
+	char *key;
+	size_t keylen;
+	void *val;
+	size_t vallen;
+	struct kvdb_batch_op_t *next;
+} kvdb_batch_op_t;
+
+typedef struct kvdb_batch_t {
+	kvdb_t *db;
+	kvdb_batch_op_t *head;
+	kvdb_batch_op_t *tail;
+	size_t size;
+} kvdb_batch_t;
+
+typedef struct kvdb_cursor_entry_t {
+	const char *key;
+	size_t keylen;
+	const char *val;
+	size_t vallen;
+} kvdb_cursor_entry_t;
+
+typedef struct kvdb_cursor_t {
+	kvdb_txn_t *txn;
+	char *lower;
+	size_t lowerlen;
+	char *upper;
+	size_t upperlen;
+	kvdb_cursor_entry_t *entries;
+	size_t length;
+	size_t pos;
+} kvdb_cursor_t;
+
+static uint32_t kvdb_hash(uint32_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+
+	while (p < end) {
+		hash ^= *p++;
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static uint32_t kvdb_record_checksum(const kvdb_record_t *rec,
+				     const char *key, const void *val)
+{
+	uint32_t hash = FNV_OFFSET_BASIS;
+
+	hash = kvdb_hash(hash, &rec->flags, sizeof(uint32_t) * 3);
+	hash = kvdb_hash(hash, key, rec->keylen);
+	return kvdb_hash(hash, val, rec->vallen);
+}
+
+/** 在 buf 中写入一个记录，返回记录占用的大小 */
+static size_t kvdb_record_write(char *buf, uint32_t flags,
+				const char *key, size_t keylen,
+				const void *val, size_t vallen)
+{
+	size_t size = RECORD_SIZE(keylen, vallen);
+	kvdb_record_t *rec = (kvdb_record_t*)buf;
+
+	memset(buf, 0, size);
+	rec->flags = flags;
+	rec->keylen = (uint32_t)keylen;
+	rec->vallen = (uint32_t)vallen;
+	memcpy(buf + sizeof(kvdb_record_t), key, keylen);
+	if (vallen > 0) {
+		memcpy((char*)RECORD_VALUE(rec), val, vallen);
+	}
+	rec->checksum = kvdb_record_checksum(rec, key, val);
+	return size;
+}
+
+#ifdef _WIN32
+
+static int kvdb_file_open(kvdb_t *db, const char *path)
+{
+	DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE;
+	DWORD access = GENERIC_READ | GENERIC_WRITE;
+#ifdef PLATFORM_WIN32_PC_APP
+	wchar_t wpath[MAX_PATH];
+
+	MultiByteToWideChar(CP_ACP, 0, path, -1, wpath, MAX_PATH);
+	db->file = CreateFile2(wpath, access, share, OPEN_ALWAYS, NULL);
+#else
+	db->file = CreateFileA(path, access, share, NULL, OPEN_ALWAYS,
+			       FILE_ATTRIBUTE_NORMAL, NULL);
+#endif
+	if (db->file == INVALID_HANDLE_VALUE) {
+		return -ENOENT;
+	}
+	return 0;
+}
+
+static void kvdb_file_close(kvdb_t *db)
+{
+	CloseHandle(db->file);
+}
+
+static int64_t kvdb_file_size(kvdb_t *db)
+{
+	LARGE_INTEGER size;
+
+	if (!GetFileSizeEx(db->file, &size)) {
+		return -1;
+	}
+	return size.QuadPart;
+}
+
+static int kvdb_file_write(kvdb_t *db, const void *buf, size_t len,
+			   uint64_t offset)
+{
+	DWORD n;
+	OVERLAPPED ov = { 0 };
+	const char *p = buf;
+
+	while (len > 0) {
+		ov.Offset = (DWORD)(offset & 0xffffffff);
+		ov.OffsetHigh = (DWORD)(offset >> 32);
+		if (!WriteFile(db->file, p, (DWORD)min(len, 1 << 30),
+			       &n, &ov)) {
+			return -EIO;
+		}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+static int kvdb_file_sync(kvdb_t *db)
+{
+	return FlushFileBuffers(db->file) ? 0 : -EIO;
+}
+
+static int kvdb_file_truncate(kvdb_t *db, uint64_t size)
+{
+	LARGE_INTEGER pos;
+
+	pos.QuadPart = (LONGLONG)size;
+	if (!SetFilePointerEx(db->file, pos, NULL, FILE_BEGIN) ||
+	    !SetEndOfFile(db->file)) {
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * 映射数据文件
+ * Windows 上的映射区域不能超出文件大小，所以需要先扩大文件，多出的部分都是
+ * 0，不构成有效的记录，关闭时再截断
+ */
+static kvdb_map_t *kvdb_map_create(kvdb_t *db, size_t size)
+{
+	kvdb_map_t *map;
+	int64_t file_size = kvdb_file_size(db);
+
+	if (file_size < 0) {
+		return NULL;
+	}
+	if ((uint64_t)file_size < size && kvdb_file_truncate(db, size) != 0) {
+		return NULL;
+	}
+	map = malloc(sizeof(kvdb_map_t));
+	if (!map) {
+		return NULL;
+	}
+#ifdef PLATFORM_WIN32_PC_APP
+	map->mapping = CreateFileMappingFromApp(db->file, NULL, PAGE_READONLY,
+						size, NULL);
+#else
+	map->mapping = CreateFileMappingA(db->file, NULL, PAGE_READONLY,
+					  (DWORD)((uint64_t)size >> 32),
+					  (DWORD)(size & 0xffffffff), NULL);
+#endif
+	if (!map->mapping) {
+		free(map);
+		return NULL;
+	}
+#ifdef PLATFORM_WIN32_PC_APP
+	map->data = MapViewOfFileFromApp(map->mapping, FILE_MAP_READ, 0, size);
+#else
+	map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, size);
+#endif
+	if (!map->data) {
+		CloseHandle(map->mapping);
+		free(map);
+		return NULL;
+	}
+	map->size = size;
+	map->refs = 1;
+	map->next = NULL;
+	return map;
+}
+
+static void kvdb_map_destroy(kvdb_map_t *map)
+{
+	UnmapViewOfFile(map->data);
+	CloseHandle(map->mapping);
+	free(map);
+}
+
+#else
+
+static int kvdb_file_open(kvdb_t *db, const char *path)
+{
+	db->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (db->fd < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+static void kvdb_file_close(kvdb_t *db)
+{
+	close(db->fd);
+}
+
+static int64_t kvdb_file_size(kvdb_t *db)
+{
+	struct stat buf;
+
+	if (fstat(db->fd, &buf) != 0) {
+		return -1;
+	}
+	return buf.st_size;
+}
+
+static int kvdb_file_write(kvdb_t *db, const void *buf, size_t len,
+			   uint64_t offset)
+{
+	ssize_t n;
+	const char *p = buf;
+
+	while (len > 0) {
+		n = pwrite(db->fd, p, len, (off_t)offset);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		p += n;
+		len -= (size_t)n;
+		offset += (uint64_t)n;
+	}
+	return 0;
+}
+
+static int kvdb_file_sync(kvdb_t *db)
+{
+	return fsync(db->fd) == 0 ? 0 : -errno;
+}
+
+static int kvdb_file_truncate(kvdb_t *db, uint64_t size)
+{
+	return ftruncate(db->fd, (off_t)size) == 0 ? 0 : -errno;
+}
+
+/** 映射数据文件，映射区域可以超出文件大小，只要不访问超出的部分即可 */
+static kvdb_map_t *kvdb_map_create(kvdb_t *db, size_t size)
+{
+	kvdb_map_t *map = malloc(sizeof(kvdb_map_t));
+
+	if (!map) {
+		return NULL;
+	}
+	map->data = mmap(NULL, size, PROT_READ, MAP_SHARED, db->fd, 0);
+	if (map->data == MAP_FAILED) {
+		free(map);
+		return NULL;
+	}
+	map->size = size;
+	map->refs = 1;
+	map->next = NULL;
+	return map;
+}
+
+static void kvdb_map_destroy(kvdb_map_t *map)
+{
+	munmap(map->data, map->size);
+	free(map);
+}
+
+#endif
+
+static size_t kvdb_map_size(uint64_t size)
+{
+	size_t map_size = MIN_MAP_SIZE;
+
+	while (map_size < size) {
+		map_size *= 2;
+	}
+	return map_size;
+}
+
+static void kvdb_map_release(kvdb_t *db, kvdb_map_t *map)
+{
+	kvdb_map_t **prev;
+
+	map->refs -= 1;
+	if (map->refs > 0) {
+		return;
+	}
+	for (prev = &db->retired; *prev; prev = &(*prev)->next) {
+		if (*prev == map) {
+			*prev = map->next;
+			break;
+		}
+	}
+	kvdb_map_destroy(map);
+}
+
+/** 确保映射区域覆盖全部记录，旧的映射区域在没有读者引用后才解除映射 */
+static int kvdb_map_ensure(kvdb_t *db)
+{
+	kvdb_map_t *map;
+
+	if (db->map && db->end <= db->map->size) {
+		return 0;
+	}
+	map = kvdb_map_create(db, kvdb_map_size(db->end));
+	if (!map) {
+		return -ENOMEM;
+	}
+	if (db->map) {
+		db->map->next = db->retired;
+		db->retired = db->map;
+		kvdb_map_release(db, db->map);
+	}
+	db->map = map;
+	return 0;
+}
+
+static const kvdb_record_t *kvdb_record_at(const char *base, uint64_t offset)
+{
+	return (const kvdb_record_t*)(base + offset);
+}
+
+static long kvdb_index_find(kvdb_t *db, const char *base, const char *key,
+			    size_t keylen, uint32_t hash, size_t *insert_pos)
+{
+	size_t i, mask = db->nslots - 1;
+	long removed = -1;
+	kvdb_slot_t *slot;
+	const kvdb_record_t *rec;
+
+	/* 空数据库和压缩后没有记录的数据库都还没有索引 */
+	if (db->nslots == 0) {
+		return -1;
+	}
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		slot = &db->slots[i];
+		if (slot->offset == SLOT_EMPTY) {
+			if (insert_pos) {
+				*insert_pos = removed >= 0 ? (size_t)removed : i;
+			}
+			return -1;
+		}
+		if (slot->offset == SLOT_REMOVED) {
+			if (removed < 0) {
+				removed = (long)i;
+			}
+			continue;
+		}
+		if (slot->hash != hash) {
+			continue;
+		}
+		rec = kvdb_record_at(base, slot->offset);
+		if (rec->keylen == keylen &&
+		    memcmp(RECORD_KEY(rec), key, keylen) == 0) {
+			return (long)i;
+		}
+	}
+}
+
+static int kvdb_index_resize(kvdb_t *db, const char *base, size_t nslots)
+{
+	size_t i, pos;
+	const kvdb_record_t *rec;
+	kvdb_slot_t *old_slots = db->slots;
+	size_t old_nslots = db->nslots;
+
+	db->slots = calloc(nslots, sizeof(kvdb_slot_t));
+	if (!db->slots) {
+		db->slots = old_slots;
+		return -ENOMEM;
+	}
+	db->nslots = nslots;
+	db->used = db->count;
+	for (i = 0; i < old_nslots; ++i) {
+		if (old_slots[i].offset <= SLOT_REMOVED) {
+			continue;
+		}
+		rec = kvdb_record_at(base, old_slots[i].offset);
+		kvdb_index_find(db, base, RECORD_KEY(rec), rec->keylen,
+				old_slots[i].hash, &pos);
+		db->slots[pos] = old_slots[i];
+	}
+	free(old_slots);
+	return 0;
+}
+
+/** 将记录加入索引，同名的旧记录成为过期的记录 */
+static int kvdb_index_apply(kvdb_t *db, const char *base, uint64_t offset)
+{
+	long i;
+	size_t pos, nslots;
+	uint32_t hash;
+	const kvdb_record_t *old;
+	const kvdb_record_t *rec = kvdb_record_at(base, offset);
+
+	if ((db->used + 1) * 10 > db->nslots * 7) {
+		for (nslots = MIN_SLOTS; nslots < (db->count + 1) * 2;
+		     nslots *= 2);
+		if (kvdb_index_resize(db, base, nslots) != 0) {
+			return -ENOMEM;
+		}
+	}
+	hash = kvdb_hash(FNV_OFFSET_BASIS, RECORD_KEY(rec), rec->keylen);
+	i = kvdb_index_find(db, base, RECORD_KEY(rec), rec->keylen, hash,
+			    &pos);
+	if (i >= 0) {
+		old = kvdb_record_at(base, db->slots[i].offset);
+		db->garbage += RECORD_SIZE(old->keylen, old->vallen);
+		if (rec->flags & RECORD_DELETED) {
+			db->slots[i].offset = SLOT_REMOVED;
+			db->garbage += RECORD_SIZE(rec->keylen, 0);
+			db->count -= 1;
+		} else {
+			db->slots[i].offset = offset;
+		}
+		return 0;
+	}
+	if (rec->flags & RECORD_DELETED) {
+		db->garbage += RECORD_SIZE(rec->keylen, 0);
+		return 0;
+	}
+	if (db->slots[pos].offset == SLOT_EMPTY) {
+		db->used += 1;
+	}
+	db->slots[pos].offset = offset;
+	db->slots[pos].hash = hash;
+	db->count += 1;
+	return 0;
+}
+
+/** 检查 offset 处是否为完整有效的记录，是则返回记录大小，否则返回 0 */
+static size_t kvdb_record_check(const char *base, uint64_t offset,
+				uint64_t limit)
+{
+	uint64_t size;
+	const kvdb_record_t *rec;
+
+	if (offset + sizeof(kvdb_record_t) > limit) {
+		return 0;
+	}
+	rec = kvdb_record_at(base, offset);
+	size = RECORD_SIZE((uint64_t)rec->keylen, (uint64_t)rec->vallen);
+	if (offset + size > limit) {
+		return 0;
+	}
+	if (kvdb_record_checksum(rec, RECORD_KEY(rec),
+				 RECORD_VALUE(rec)) != rec->checksum) {
+		return 0;
+	}
+	return (size_t)size;
+}
+
+/** 重放数据文件中的记录，重建索引，返回有效内容的末尾位置 */
+static uint64_t kvdb_replay(kvdb_t *db, const char *base, uint64_t limit)
+{
+	size_t size;
+	uint64_t offset, batch_start, batch_end;
+
+	offset = batch_start = batch_end = ALIGN8(sizeof(kvdb_header_t));
+	while ((size = kvdb_record_check(base, offset, limit)) > 0) {
+		offset += size;
+		if (kvdb_record_at(base, offset - size)->flags & RECORD_MORE) {
+			continue;
+		}
+		/* 批次已完整写入，将它的所有记录加入索引 */
+		while (batch_start < offset) {
+			if (kvdb_index_apply(db, base, batch_start) != 0) {
+				return batch_end;
+			}
+			batch_start += kvdb_record_check(base, batch_start,
+							 limit);
+		}
+		batch_end = offset;
+	}
+	return batch_end;
+}
+
+static void kvdb_index_clear(kvdb_t *db)
+{
+	free(db->slots);
+	db->slots = NULL;
+	db->nslots = 0;
+	db->count = 0;
+	db->used = 0;
+	db->garbage = 0;
+}
+
+/** 将有效的记录写入临时文件 */
+static int kvdb_compact_write(kvdb_t *db, const char *base,
+			      const char *tmpfile)
+{
+	int ret = 0;
+	size_t i, len;
+	FILE *fp;
+	const kvdb_record_t *rec;
+	kvdb_header_t header = { KVDB_MAGIC, KVDB_VERSION, 0 };
+
+	fp = fopen(tmpfile, "wb");
+	if (!fp) {
+		return -EIO;
+	}
+	if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+		ret = -EIO;
+	}
+	for (i = 0; ret == 0 && i < db->nslots; ++i) {
+		if (db->slots[i].offset <= SLOT_REMOVED) {
+			continue;
+		}
+		rec = kvdb_record_at(base, db->slots[i].offset);
+		len = RECORD_SIZE(rec->keylen, rec->vallen);
+		if (fwrite(rec, len, 1, fp) != 1) {
+			ret = -EIO;
+		}
+	}
+	if (fclose(fp) != 0) {
+		ret = -EIO;
+	}
+	if (ret != 0) {
+		remove(tmpfile);
+	}
+	return ret;
+}
+
+/**
+ * 用临时文件替换数据文件
+ * Windows 上不能替换已打开或已映射的文件，所以调用前需解除映射
+ */
+static int kvdb_compact_replace(kvdb_t *db, const char *tmpfile)
+{
+	int ret = 0;
+
+	kvdb_file_close(db);
+#ifdef _WIN32
+	remove(db->path);
+#endif
+	if (rename(tmpfile, db->path) != 0) {
+		ret = -EIO;
+	}
+	if (kvdb_file_open(db, db->path) != 0) {
+		ret = -EIO;
+	}
+	return ret;
+}
+
+/** 载入数据文件：检查文件头，重放记录，截断未完整写入的内容 */
+static int kvdb_load(kvdb_t *db, int allow_compact)
+{
+	int ret = -ENOMEM;
+	size_t len;
+	char *tmpfile = NULL;
+	int64_t size;
+	kvdb_map_t *map;
+	kvdb_header_t header = { KVDB_MAGIC, KVDB_VERSION, 0 };
+
+	size = kvdb_file_size(db);
+	if (size < 0) {
+		return -EIO;
+	}
+	if (size < (int64_t)sizeof(kvdb_header_t)) {
+		if (kvdb_file_write(db, &header, sizeof(header), 0) != 0 ||
+		    kvdb_file_truncate(db, sizeof(header)) != 0) {
+			return -EIO;
+		}
+		db->end = sizeof(header);
+		return 0;
+	}
+	map = kvdb_map_create(db, (size_t)size);
+	if (!map) {
+		return -ENOMEM;
+	}
+	if (memcmp(map->data, KVDB_MAGIC, sizeof(header.magic)) != 0 ||
+	    ((kvdb_header_t*)map->data)->version > KVDB_VERSION) {
+		kvdb_map_destroy(map);
+		return -EINVAL;
+	}
+	db->end = kvdb_replay(db, map->data, (uint64_t)size);
+	if (allow_compact && db->garbage >= COMPACT_MIN_GARBAGE &&
+	    db->garbage > db->end / 2) {
+		len = strlen(db->path) + 9;
+		tmpfile = malloc(len);
+		if (tmpfile) {
+			snprintf(tmpfile, len, "%s.compact", db->path);
+			ret = kvdb_compact_write(db, map->data, tmpfile);
+		}
+		if (tmpfile && ret == 0) {
+			kvdb_map_destroy(map);
+			kvdb_index_clear(db);
+			ret = kvdb_compact_replace(db, tmpfile);
+			free(tmpfile);
+			return ret == 0 ? kvdb_load(db, FALSE) : ret;
+		}
+		free(tmpfile);
+	}
+	kvdb_map_destroy(map);
+	if ((uint64_t)size > db->end) {
+		return kvdb_file_truncate(db, db->end);
+	}
+	return 0;
+}
+
+kvdb_t *kvdb_open(const char *name)
+{
+	kvdb_t *db = calloc(1, sizeof(kvdb_t));
+
+	if (!db) {
+		return NULL;
+	}
+	db->path = strdup(name);
+	if (!db->path || kvdb_file_open(db, name) != 0) {
+		free(db->path);
+		free(db);
+		return NULL;
+	}
+	db->durability = KVDB_DURABILITY_SYNC;
+	db->sync_time = LCUI_GetTime();
+	if (kvdb_load(db, TRUE) != 0 || kvdb_map_ensure(db) != 0) {
+		printf("[kvdb] cannot load database: %s\n", name);
+		kvdb_index_clear(db);
+		kvdb_file_close(db);
+		free(db->path);
+		free(db);
+		return NULL;
+	}
+	LCUIMutex_Init(&db->mutex);
+	/* 数据库通常由主线程打开，这里不考虑并发初始化 */
+	if (!opened.initialized) {
+		LCUIMutex_Init(&opened.mutex);
+		opened.initialized = 1;
+	}
+	LCUIMutex_Lock(&opened.mutex);
+	db->next = opened.head;
+	opened.head = db;
+	LCUIMutex_Unlock(&opened.mutex);
+	return db;
+}
+
+void kvdb_close(kvdb_t *db)
+{
+	kvdb_t **prev;
+	kvdb_map_t *map;
+
+	LCUIMutex_Lock(&opened.mutex);
+	for (prev = &opened.head; *prev; prev = &(*prev)->next) {
+		if (*prev == db) {
+			*prev = db->next;
+			break;
+		}
+	}
+	LCUIMutex_Unlock(&opened.mutex);
+	kvdb_committer_remove(db);
+	if (db->dirty && db->durability == KVDB_DURABILITY_GROUP) {
+		kvdb_file_sync(db);
+	}
+	kvdb_map_release(db, db->map);
+	/* 正常情况下读者都已结束，这里只是防止泄漏 */
+	while (db->retired) {
+		map = db->retired;
+		db->retired = map->next;
+		kvdb_map_destroy(map);
+	}
+#ifdef _WIN32
+	kvdb_file_truncate(db, db->end);
+#endif
+	kvdb_file_close(db);
+	kvdb_index_clear(db);
+	LCUIMutex_Destroy(&db->mutex);
+	free(db->path);
+	free(db);
+}
+
+int kvdb_destroy_db(const char *name)
+{
+	return remove(name);
+}
+
+/**
+ * 获取数据库的大小
+ * Windows 上已打开的数据文件会被扩大到映射区域的大小，多出的部分不是有效
+ * 的内容，所以已打开的数据库以记录的末尾位置作为它的大小
+ */
+int kvdb_get_db_size(const char *name, int64_t *size)
+{
+	kvdb_t *db;
+	struct stat buf;
+
+	if (opened.initialized) {
+		LCUIMutex_Lock(&opened.mutex);
+		for (db = opened.head; db; db = db->next) {
+			if (strcmp(db->path, name) == 0) {
+				LCUIMutex_Lock(&db->mutex);
+				*size = (int64_t)db->end;
+				LCUIMutex_Unlock(&db->mutex);
+				break;
+			}
+		}
+		LCUIMutex_Unlock(&opened.mutex);
+		if (db) {
+			return 0;
+		}
+	}
+	if (stat(name, &buf) == 0) {
+		*size = buf.st_size;
+		return 0;
+	}
+	return -1;
+}
+
+void kvdb_set_durability(kvdb_t *db, kvdb_durability_t mode)
+{
+	db->durability = mode;
+	if (mode == KVDB_DURABILITY_GROUP) {
+		kvdb_committer_add(db);
+	} else {
+		kvdb_committer_remove(db);
+	}
+}
+
+/** 同步数据文件并重置组提交的状态，调用前需锁定数据库 */
+static int kvdb_flush(kvdb_t *db)
+{
+	db->dirty = 0;
+	db->pending = 0;
+	db->sync_time = LCUI_GetTime();
+	return kvdb_file_sync(db);
+}
+
+int kvdb_sync(kvdb_t *db)
+{
+	int ret = 0;
+
+	LCUIMutex_Lock(&db->mutex);
+	if (db->dirty) {
+		ret = kvdb_flush(db);
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	return ret;
+}
+
+int kvdb_group_commit(kvdb_t *db)
+{
+	int ret = 0;
+
+	LCUIMutex_Lock(&db->mutex);
+	if (db->dirty && (db->pending >= KVDB_GROUP_COMMIT_BYTES ||
+			  LCUI_GetTimeDelta(db->sync_time) >=
+			  KVDB_GROUP_COMMIT_INTERVAL)) {
+		ret = kvdb_flush(db);
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	return ret;
+}
+
+int kvdb_compact(kvdb_t *db)
+{
+	int ret = 0;
+	size_t len;
+	char *tmpfile;
+
+	LCUIMutex_Lock(&db->mutex);
+	if (db->garbage == 0) {
+		LCUIMutex_Unlock(&db->mutex);
+		return 0;
+	}
+#ifdef _WIN32
+	/* 映射中的文件不能被替换，等读者都结束后再压缩 */
+	if (db->retired || db->map->refs > 1) {
+		LCUIMutex_Unlock(&db->mutex);
+		return -EBUSY;
+	}
+#endif
+	len = strlen(db->path) + 9;
+	tmpfile = malloc(len);
+	if (!tmpfile) {
+		LCUIMutex_Unlock(&db->mutex);
+		return -ENOMEM;
+	}
+	snprintf(tmpfile, len, "%s.compact", db->path);
+	if (db->dirty) {
+		kvdb_flush(db);
+	}
+	ret = kvdb_compact_write(db, db->map->data, tmpfile);
+	if (ret == 0) {
+		/* 读者仍可继续访问旧的映射区域，直到它们的事务结束 */
+		db->map->next = db->retired;
+		db->retired = db->map;
+		kvdb_map_release(db, db->map);
+		db->map = NULL;
+		kvdb_index_clear(db);
+		ret = kvdb_compact_replace(db, tmpfile);
+		if (kvdb_load(db, FALSE) != 0 || kvdb_map_ensure(db) != 0) {
+			printf("[kvdb] cannot reload database: %s\n",
+			       db->path);
+			ret = -EIO;
+		}
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	free(tmpfile);
+	return ret;
+}
+
+/** 追加已编码的记录并更新索引，调用前需锁定数据库 */
+static int kvdb_write(kvdb_t *db, const char *buf, size_t len, int is_batch)
+{
+	int ret;
+	uint64_t offset, end = db->end;
+	const kvdb_record_t *rec;
+
+	ret = kvdb_file_write(db, buf, len, end);
+	if (ret != 0) {
+		return ret;
+	}
+	db->end += len;
+	ret = kvdb_map_ensure(db);
+	if (ret != 0) {
+		db->end = end;
+		return ret;
+	}
+	for (offset = end; offset < db->end; offset += RECORD_SIZE(
+		     rec->keylen, rec->vallen)) {
+		rec = kvdb_record_at(db->map->data, offset);
+		kvdb_index_apply(db, db->map->data, offset);
+	}
+	switch (db->durability) {
+	case KVDB_DURABILITY_GROUP:
+		if (is_batch) {
+			break;
+		}
+		/* 记录带有校验和，崩溃后重放时会丢弃未完整写入的记录 */
+		db->dirty = 1;
+		db->pending += len;
+		if (db->pending >= KVDB_GROUP_COMMIT_BYTES) {
+			kvdb_committer_notify();
+		}
+		return 0;
+	case KVDB_DURABILITY_ASYNC:
+		db->dirty = 1;
+		return 0;
+	case KVDB_DURABILITY_SYNC:
+	default:
+		break;
+	}
+	return kvdb_flush(db);
+}
+
+static int kvdb_write_record(kvdb_t *db, uint32_t flags, const char *key,
+			     size_t keylen, const void *val, size_t vallen)
+{
+	int ret;
+	char *buf;
+	size_t size = RECORD_SIZE(keylen, vallen);
+
+	buf = malloc(size);
+	if (!buf) {
+		return -ENOMEM;
+	}
+	kvdb_record_write(buf, flags, key, keylen, val, vallen);
+	LCUIMutex_Lock(&db->mutex);
+	ret = kvdb_write(db, buf, size, FALSE);
+	LCUIMutex_Unlock(&db->mutex);
+	free(buf);
+	return ret;
+}
+
+void *kvdb_get(kvdb_t *db, const char *key, size_t keylen, size_t *vallen)
+{
+	long i;
+	char *val = NULL;
+	const kvdb_record_t *rec;
+	uint32_t hash = kvdb_hash(FNV_OFFSET_BASIS, key, keylen);
+
+	LCUIMutex_Lock(&db->mutex);
+	i = kvdb_index_find(db, db->map->data, key, keylen, hash, NULL);
+	if (i >= 0) {
+		rec = kvdb_record_at(db->map->data, db->slots[i].offset);
+		val = malloc(rec->vallen + 1);
+		if (val) {
+			memcpy(val, RECORD_VALUE(rec), rec->vallen);
+			val[rec->vallen] = 0;
+			*vallen = rec->vallen;
+		}
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	return val;
+}
+
+int kvdb_put(kvdb_t *db, const char *key, size_t keylen,
+	     const void *val, size_t vallen)
+{
+	return kvdb_write_record(db, 0, key, keylen, val, vallen);
+}
+
+int kvdb_delete(kvdb_t *db, const char *key, size_t keylen)
+{
+	return kvdb_write_record(db, RECORD_DELETED, key, keylen, NULL, 0);
+}
+
+kvdb_txn_t *kvdb_txn_begin(kvdb_t *db)
+{
+	kvdb_txn_t *txn = malloc(sizeof(kvdb_txn_t));
+
+	if (!txn) {
+		return NULL;
+	}
+	txn->db = db;
+	txn->old_maps = NULL;
+	LCUIMutex_Lock(&db->mutex);
+	txn->map = db->map;
+	txn->map->refs += 1;
+	LCUIMutex_Unlock(&db->mutex);
+	return txn;
+}
+
+void kvdb_txn_end(kvdb_txn_t *txn)
+{
+	kvdb_map_ref_t *ref;
+	kvdb_t *db = txn->db;
+
+	LCUIMutex_Lock(&db->mutex);
+	kvdb_map_release(db, txn->map);
+	while (txn->old_maps) {
+		ref = txn->old_maps;
+		txn->old_maps = ref->next;
+		kvdb_map_release(db, ref->map);
+		free(ref);
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	free(txn);
+}
+
+/** 让事务引用最新的映射区域，调用前需锁定数据库 */
+static int kvdb_txn_refresh(kvdb_txn_t *txn)
+{
+	kvdb_map_ref_t *ref;
+	kvdb_t *db = txn->db;
+
+	if (txn->map == db->map) {
+		return 0;
+	}
+	/* 之前返回的指针仍指向旧的映射区域，在事务结束前不能解除映射 */
+	ref = malloc(sizeof(kvdb_map_ref_t));
+	if (!ref) {
+		return -ENOMEM;
+	}
+	ref->map = txn->map;
+	ref->next = txn->old_maps;
+	txn->old_maps = ref;
+	txn->map = db->map;
+	txn->map->refs += 1;
+	return 0;
+}
+
+const void *kvdb_get_view(kvdb_txn_t *txn, const char *key, size_t keylen,
+			  size_t *vallen)
+{
+	long i;
+	const char *val = NULL;
+	const kvdb_record_t *rec;
+	kvdb_t *db = txn->db;
+	uint32_t hash = kvdb_hash(FNV_OFFSET_BASIS, key, keylen);
+
+	LCUIMutex_Lock(&db->mutex);
+	if (kvdb_txn_refresh(txn) == 0) {
+		i = kvdb_index_find(db, txn->map->data, key, keylen, hash,
+				    NULL);
+		if (i >= 0) {
+			rec = kvdb_record_at(txn->map->data,
+					     db->slots[i].offset);
+			*vallen = rec->vallen;
+			val = RECORD_VALUE(rec);
+		}
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	return val;
+}
+
+kvdb_batch_t *kvdb_batch_begin(kvdb_t *db)
+{
+	kvdb_batch_t *batch = malloc(sizeof(kvdb_batch_t));
+
+	if (!batch) {
+		return NULL;
+	}
+	batch->db = db;
+	batch->head = NULL;
+	batch->tail = NULL;
+	batch->size = 0;
+	return batch;
+}
+
+static int kvdb_batch_append(kvdb_batch_t *batch, int is_delete,
+			     const char *key, size_t keylen,
+			     const void *val, size_t vallen)
+{
+	kvdb_batch_op_t *op;
+
+	op = malloc(sizeof(kvdb_batch_op_t) + keylen + vallen);
+	if (!op) {
+		return -ENOMEM;
+	}
+	op->is_delete = is_delete;
+	op->key = (char*)op + sizeof(kvdb_batch_op_t);
+	op->keylen = keylen;
+	op->val = op->key + keylen;
+	op->vallen = vallen;
+	op->next = NULL;
+	memcpy(op->key, key, keylen);
+	if (vallen > 0) {
+		memcpy(op->val, val, vallen);
+	}
+	if (batch->tail) {
+		batch->tail->next = op;
+	} else {
+		batch->head = op;
+	}
+	batch->tail = op;
+	batch->size += RECORD_SIZE(keylen, vallen);
+	return 0;
+}
+
+int kvdb_batch_put(kvdb_batch_t *batch, const char *key, size_t keylen,
+		   const void *val, size_t vallen)
+{
+	return kvdb_batch_append(batch, 0, key, keylen, val, vallen);
+}
+
+int kvdb_batch_delete(kvdb_batch_t *batch, const char *key, size_t keylen)
+{
+	return kvdb_batch_append(batch, 1, key, keylen, NULL, 0);
+}
+
+int kvdb_batch_commit(kvdb_batch_t *batch)
+{
+	int ret = 0;
+	char *buf, *p;
+	uint32_t flags;
+	kvdb_batch_op_t *op;
+
+	if (!batch->head) {
+		kvdb_batch_discard(batch);
+		return 0;
+	}
+	/* 将整个批次编码到一块连续的内存中，以一次写入完成 */
+	buf = malloc(batch->size);
+	if (!buf) {
+		kvdb_batch_discard(batch);
+		return -ENOMEM;
+	}
+	for (p = buf, op = batch->head; op; op = op->next) {
+		flags = op->is_delete ? RECORD_DELETED : 0;
+		if (op->next) {
+			flags |= RECORD_MORE;
+		}
+		p += kvdb_record_write(p, flags, op->key, op->keylen,
+				       op->val, op->vallen);
+	}
+	LCUIMutex_Lock(&batch->db->mutex);
+	ret = kvdb_write(batch->db, buf, batch->size, TRUE);
+	LCUIMutex_Unlock(&batch->db->mutex);
+	free(buf);
+	kvdb_batch_discard(batch);
+	return ret;
+}
+
+void kvdb_batch_discard(kvdb_batch_t *batch)
+{
+	kvdb_batch_op_t *op, *next;
+
+	for (op = batch->head; op; op = next) {
+		next = op->next;
+		free(op);
+	}
+	free(batch);
+}
+
+kvdb_cursor_t *kvdb_cursor_open(kvdb_t *db)
+{
+	kvdb_cursor_t *cur = malloc(sizeof(kvdb_cursor_t));
+
+	if (!cur) {
+		return NULL;
+	}
+	cur->txn = kvdb_txn_begin(db);
+	if (!cur->txn) {
+		free(cur);
+		return NULL;
+	}
+	cur->lower = NULL;
+	cur->upper = NULL;
+	cur->lowerlen = 0;
+	cur->upperlen = 0;
+	cur->entries = NULL;
+	cur->length = 0;
+	cur->pos = 0;
+	return cur;
+}
+
+void kvdb_cursor_close(kvdb_cursor_t *cur)
+{
+	kvdb_txn_end(cur->txn);
+	free(cur->entries);
+	free(cur->lower);
+	free(cur->upper);
+	free(cur);
+}
+
+static char *kvdb_dup_key(const char *key, size_t keylen)
+{
+	char *buf;
+
+	if (!key) {
+		return NULL;
+	}
+	buf = malloc(keylen > 0 ? keylen : 1);
+	if (buf && keylen > 0) {
+		memcpy(buf, key, keylen);
+	}
+	return buf;
+}
+
+int kvdb_cursor_set_range(kvdb_cursor_t *cur, const char *lower,
+			  size_t lowerlen, const char *upper, size_t upperlen)
+{
+	free(cur->lower);
+	free(cur->upper);
+	cur->lower = kvdb_dup_key(lower, lowerlen);
+	cur->upper = kvdb_dup_key(upper, upperlen);
+	cur->lowerlen = lowerlen;
+	cur->upperlen = upperlen;
+	cur->length = 0;
+	cur->pos = 0;
+	if ((lower && !cur->lower) || (upper && !cur->upper)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int kvdb_cursor_entry_compare(const void *a, const void *b)
+{
+	const kvdb_cursor_entry_t *e1 = a;
+	const kvdb_cursor_entry_t *e2 = b;
+
+	return kvdb_compare_key(e1->key, e1->keylen, e2->key, e2->keylen);
+}
+
+/**
+ * 收集范围内的记录并排序
+ * 索引是哈希表，只能逐个检查，每次定位的开销都是 O(NlogN)，所以游标只应在
+ * 维护任务中做全量遍历。排序后的遍历顺序与其它后端一致。
+ */
+int kvdb_cursor_seek(kvdb_cursor_t *cur, const char *key, size_t keylen)
+{
+	size_t i, n = 0;
+	kvdb_t *db = cur->txn->db;
+	const kvdb_record_t *rec;
+	kvdb_cursor_entry_t *entries, *e;
+
+	if (!key || (cur->lower && kvdb_compare_key(key, keylen, cur->lower,
+						    cur->lowerlen) < 0)) {
+		key = cur->lower;
+		keylen = cur->lowerlen;
+	}
+	cur->length = 0;
+	cur->pos = 0;
+	LCUIMutex_Lock(&db->mutex);
+	entries = realloc(cur->entries,
+			  sizeof(kvdb_cursor_entry_t) * (db->count + 1));
+	if (!entries || kvdb_txn_refresh(cur->txn) != 0) {
+		LCUIMutex_Unlock(&db->mutex);
+		if (entries) {
+			cur->entries = entries;
+		}
+		return -1;
+	}
+	cur->entries = entries;
+	for (i = 0; i < db->nslots; ++i) {
+		if (db->slots[i].offset <= SLOT_REMOVED) {
+			continue;
+		}
+		rec = kvdb_record_at(cur->txn->map->data, db->slots[i].offset);
+		e = &entries[n];
+		e->key = RECORD_KEY(rec);
+		e->keylen = rec->keylen;
+		if (key && kvdb_compare_key(e->key, e->keylen,
+					    key, keylen) < 0) {
+			continue;
+		}
+		if (cur->upper && kvdb_compare_key(e->key, e->keylen,
+						   cur->upper,
+						   cur->upperlen) >= 0) {
+			continue;
+		}
+		e->val = RECORD_VALUE(rec);
+		e->vallen = rec->vallen;
+		++n;
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	if (n > 1) {
+		qsort(entries, n, sizeof(kvdb_cursor_entry_t),
+		      kvdb_cursor_entry_compare);
+	}
+	cur->length = n;
+	return n > 0 ? 0 : -1;
+}
+
+int kvdb_cursor_next(kvdb_cursor_t *cur)
+{
+	if (cur->pos >= cur->length) {
+		return -1;
+	}
+	cur->pos += 1;
+	return cur->pos < cur->length ? 0 : -1;
+}
+
+int kvdb_cursor_valid(kvdb_cursor_t *cur)
+{
+	return cur->pos < cur->length;
+}
+
+const char *kvdb_cursor_key(kvdb_cursor_t *cur, size_t *keylen)
+{
+	if (cur->pos >= cur->length) {
+		return NULL;
+	}
+	*keylen = cur->entries[cur->pos].keylen;
+	return cur->entries[cur->pos].key;
+}
+
+const void *kvdb_cursor_value(kvdb_cursor_t *cur, size_t *vallen)
+{
+	if (cur->pos >= cur->length) {
+		return NULL;
+	}
+	*vallen = cur->entries[cur->pos].vallen;
+	return cur->entries[cur->pos].val;
+}
+
+size_t kvdb_each(kvdb_t *db, kvdb_each_callback_t callback, void *privdata)
+{
+	size_t count = 0;
+	size_t keylen, vallen;
+	const char *key;
+	const void *val;
+	kvdb_cursor_t *cur;
+
+	cur = kvdb_cursor_open(db);
+	if (!cur) {
+		return 0;
+	}
+	for (kvdb_cursor_seek(cur, NULL, 0); kvdb_cursor_valid(cur);
+	     kvdb_cursor_next(cur)) {
+		key = kvdb_cursor_key(cur, &keylen);
+		val = kvdb_cursor_value(cur, &vallen);
+		callback(key, keylen, val, vallen, privdata);
+		++count;
+	}
+	kvdb_cursor_close(cur);
+	return count;
+}
+#endif
@@ -31,14 +31,81 @@
 #include <unistd.h>
 #endif
 
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/thread.h>
 #include "unqlite.h"
 
-#define MAX_KEY_LEN 1024
+#define KEY_BUFFER_SIZE 256
+/**
+ * 异步模式下最多累积多少次未提交的写入
+ * UnQLite 的每次提交都会同步日志，无法关闭，所以异步模式只能减少提交的次数，
+ * 未提交的页面会一直占用内存，需要限制它的数量
+ */
+#define MAX_PENDING_WRITES 1024
 
+/**
+ * UnQLite 的句柄不能被多个线程同时使用，而组提交线程会在其它线程读写的同时
+ * 提交，所以访问句柄前都需要锁定。
+ * 这意味着同一个数据库的读取也是逐个进行的，缩略图数据库的共享锁在这里
+ * 不起作用，要让读取并行，需要给每个读取线程各开一个只读句柄。
+ */
 typedef struct kvdb_t {
 	unqlite *db;
+	kvdb_durability_t durability;
+	int64_t commit_time;
+	size_t pending;		/**< 未提交的写入次数 */
+	size_t pending_size;	/**< 未提交的写入的字节数 */
+	size_t cursors;		/**< 已打开的游标数量，有游标时不在后台提交 */
+	LCUI_Mutex mutex;
 } kvdb_t;
 
+typedef struct kvdb_batch_op_t {
+	int is_delete;
+	char *key;
+	size_t keylen;
+	void *val;
+	size_t vallen;
+	struct kvdb_batch_op_t *next;
+} kvdb_batch_op_t;
+
+typedef struct kvdb_batch_t {
+	kvdb_t *db;
+	kvdb_batch_op_t *head;
+	kvdb_batch_op_t *tail;
+} kvdb_batch_t;
+
+typedef struct kvdb_buffer_t {
+	char *data;
+	size_t len;
+	size_t size;
+} kvdb_buffer_t;
+
+typedef struct kvdb_cursor_t {
+	kvdb_t *db;
+	unqlite_kv_cursor *cur;
+	char *lower;
+	size_t lowerlen;
+	char *upper;
+	size_t upperlen;
+	char *start;
+	size_t startlen;
+	int valid;
+	int value_loaded;
+	kvdb_buffer_t key;
+	kvdb_buffer_t value;
+} kvdb_cursor_t;
+
+typedef struct kvdb_view_t {
+	struct kvdb_view_t *next;
+} kvdb_view_t;
+
+/** UnQLite 没有读取快照，事务只负责管理复制出来的值 */
+typedef struct kvdb_txn_t {
+	kvdb_t *db;
+	kvdb_view_t *views;
+} kvdb_txn_t;
+
 kvdb_t *kvdb_open(const char *name)
 {
 	kvdb_t *db = malloc(sizeof(kvdb_t));
@@ -47,13 +114,20 @@ kvdb_t *kvdb_open(const char *name)
 		free(db);
 		return NULL;
 	}
-
+	db->durability = KVDB_DURABILITY_SYNC;
+	db->commit_time = LCUI_GetTime();
+	db->pending = 0;
+	db->pending_size = 0;
+	db->cursors = 0;
+	LCUIMutex_Init(&db->mutex);
 	return db;
 }
 
 void kvdb_close(kvdb_t *db)
 {
+	kvdb_committer_remove(db);
 	unqlite_close(db->db);
+	LCUIMutex_Destroy(&db->mutex);
 	free(db);
 }
 
@@ -78,12 +152,15 @@ void *kvdb_get(kvdb_t *db, const char *key, size_t keylen, size_t *vallen)
 	void *val;
 	unqlite_int64 len = *vallen;
 
+	LCUIMutex_Lock(&db->mutex);
 	rc = unqlite_kv_fetch(db->db, key, keylen, NULL, &len);
 	if (rc != UNQLITE_OK) {
+		LCUIMutex_Unlock(&db->mutex);
 		return NULL;
 	}
 	val = malloc((size_t)len);
 	rc = unqlite_kv_fetch(db->db, key, keylen, val, &len);
+	LCUIMutex_Unlock(&db->mutex);
 	if (rc != UNQLITE_OK) {
 		free(val);
 		return NULL;
@@ -92,56 +169,538 @@ void *kvdb_get(kvdb_t *db, const char *key, size_t keylen, size_t *vallen)
 	return val;
 }
 
+kvdb_txn_t *kvdb_txn_begin(kvdb_t *db)
+{
+	kvdb_txn_t *txn = malloc(sizeof(kvdb_txn_t));
+
+	if (!txn) {
+		return NULL;
+	}
+	txn->db = db;
+	txn->views = NULL;
+	return txn;
+}
+
+void kvdb_txn_end(kvdb_txn_t *txn)
+{
+	kvdb_view_t *view;
+
+	while (txn->views) {
+		view = txn->views;
+		txn->views = view->next;
+		free(view);
+	}
+	free(txn);
+}
+
+const void *kvdb_get_view(kvdb_txn_t *txn, const char *key, size_t keylen,
+			  size_t *vallen)
+{
+	int rc;
+	kvdb_view_t *view;
+	unqlite_int64 len;
+	kvdb_t *db = txn->db;
+
+	LCUIMutex_Lock(&db->mutex);
+	rc = unqlite_kv_fetch(db->db, key, keylen, NULL, &len);
+	if (rc != UNQLITE_OK) {
+		LCUIMutex_Unlock(&db->mutex);
+		return NULL;
+	}
+	/* 值紧随视图的头部存放，只需分配一次内存 */
+	view = malloc(sizeof(kvdb_view_t) + (size_t)len);
+	if (!view) {
+		LCUIMutex_Unlock(&db->mutex);
+		return NULL;
+	}
+	rc = unqlite_kv_fetch(db->db, key, keylen, view + 1, &len);
+	LCUIMutex_Unlock(&db->mutex);
+	if (rc != UNQLITE_OK) {
+		free(view);
+		return NULL;
+	}
+	view->next = txn->views;
+	txn->views = view;
+	*vallen = (size_t)len;
+	return view + 1;
+}
+
+void kvdb_set_durability(kvdb_t *db, kvdb_durability_t mode)
+{
+	db->durability = mode;
+	if (mode == KVDB_DURABILITY_GROUP) {
+		kvdb_committer_add(db);
+	} else {
+		kvdb_committer_remove(db);
+	}
+}
+
+/**
+ * 提交之前的写入，调用前需锁定数据库
+ * 未提交的写入只存在于内存中，UnQLite 在提交时通过回滚日志保证数据文件的
+ * 一致性，崩溃后打开数据库时会回滚未完成的提交
+ */
+static int kvdb_commit(kvdb_t *db)
+{
+	if (db->pending < 1) {
+		return 0;
+	}
+	db->pending = 0;
+	db->pending_size = 0;
+	db->commit_time = LCUI_GetTime();
+	return unqlite_commit(db->db) == UNQLITE_OK ? 0 : -1;
+}
+
+int kvdb_sync(kvdb_t *db)
+{
+	int ret;
+
+	LCUIMutex_Lock(&db->mutex);
+	ret = kvdb_commit(db);
+	LCUIMutex_Unlock(&db->mutex);
+	return ret;
+}
+
+int kvdb_group_commit(kvdb_t *db)
+{
+	int ret = 0;
+
+	LCUIMutex_Lock(&db->mutex);
+	if (db->cursors < 1 && db->pending > 0 &&
+	    (db->pending_size >= KVDB_GROUP_COMMIT_BYTES ||
+	     LCUI_GetTimeDelta(db->commit_time) >=
+	     KVDB_GROUP_COMMIT_INTERVAL)) {
+		ret = kvdb_commit(db);
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	return ret;
+}
+
+int kvdb_compact(kvdb_t *db)
+{
+	/* UnQLite 会在之后的写入中重用已释放的页，文件不会缩小 */
+	return kvdb_sync(db);
+}
+
+/** 根据持久化模式决定是否提交之前的写入，调用前需锁定数据库 */
+static int kvdb_auto_commit(kvdb_t *db, size_t writes, size_t size)
+{
+	db->pending += writes;
+	db->pending_size += size;
+	switch (db->durability) {
+	case KVDB_DURABILITY_GROUP:
+		if (db->pending_size >= KVDB_GROUP_COMMIT_BYTES) {
+			kvdb_committer_notify();
+		}
+		return 0;
+	case KVDB_DURABILITY_ASYNC:
+		if (db->pending < MAX_PENDING_WRITES) {
+			return 0;
+		}
+		break;
+	case KVDB_DURABILITY_SYNC:
+	default:
+		break;
+	}
+	return kvdb_commit(db);
+}
+
 int kvdb_put(kvdb_t *db, const char *key, size_t keylen, const void *val,
 	     size_t vallen)
 {
+	int ret = -1;
+
+	LCUIMutex_Lock(&db->mutex);
 	if (unqlite_kv_store(db->db, key, keylen, val, vallen) == UNQLITE_OK) {
-		unqlite_commit(db->db);
+		ret = kvdb_auto_commit(db, 1, keylen + vallen);
 	}
-	return 0;
+	LCUIMutex_Unlock(&db->mutex);
+	return ret;
 }
 
 int kvdb_delete(kvdb_t *db, const char *key, size_t keylen)
 {
+	int ret = -1;
+
+	LCUIMutex_Lock(&db->mutex);
 	if (unqlite_kv_delete(db->db, key, keylen) == UNQLITE_OK) {
+		ret = kvdb_auto_commit(db, 1, keylen);
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	return ret;
+}
+
+kvdb_batch_t *kvdb_batch_begin(kvdb_t *db)
+{
+	kvdb_batch_t *batch = malloc(sizeof(kvdb_batch_t));
+
+	if (!batch) {
+		return NULL;
+	}
+	batch->db = db;
+	batch->head = NULL;
+	batch->tail = NULL;
+	return batch;
+}
+
+static int kvdb_batch_append(kvdb_batch_t *batch, int is_delete,
+			     const char *key, size_t keylen,
+			     const void *val, size_t vallen)
+{
+	kvdb_batch_op_t *op;
+
+	/* 键和值存放在同一块内存中 */
+	op = malloc(sizeof(kvdb_batch_op_t) + keylen + vallen);
+	if (!op) {
+		return -1;
+	}
+	op->is_delete = is_delete;
+	op->key = (char*)op + sizeof(kvdb_batch_op_t);
+	op->keylen = keylen;
+	op->val = op->key + keylen;
+	op->vallen = vallen;
+	op->next = NULL;
+	memcpy(op->key, key, keylen);
+	if (vallen > 0) {
+		memcpy(op->val, val, vallen);
+	}
+	if (batch->tail) {
+		batch->tail->next = op;
+	} else {
+		batch->head = op;
+	}
+	batch->tail = op;
+	return 0;
+}
+
+int kvdb_batch_put(kvdb_batch_t *batch, const char *key, size_t keylen,
+		   const void *val, size_t vallen)
+{
+	return kvdb_batch_append(batch, 0, key, keylen, val, vallen);
+}
+
+int kvdb_batch_delete(kvdb_batch_t *batch, const char *key, size_t keylen)
+{
+	return kvdb_batch_append(batch, 1, key, keylen, NULL, 0);
+}
+
+int kvdb_batch_commit(kvdb_batch_t *batch)
+{
+	int rc, ret;
+	size_t count = 0, size = 0;
+	kvdb_t *db = batch->db;
+	kvdb_batch_op_t *op;
+
+	LCUIMutex_Lock(&db->mutex);
+	/*
+	 * 回滚会丢弃整个未提交的事务，所以先提交之前的写入，以免批量写入失败时
+	 * 连同已经返回成功的写入一起丢弃
+	 */
+	if (kvdb_commit(db) != 0) {
+		LCUIMutex_Unlock(&db->mutex);
+		kvdb_batch_discard(batch);
+		return -1;
+	}
+	for (op = batch->head; op; op = op->next, ++count) {
+		size += op->keylen + op->vallen;
+		if (op->is_delete) {
+			rc = unqlite_kv_delete(db->db, op->key,
+					       (int)op->keylen);
+			if (rc == UNQLITE_NOTFOUND) {
+				rc = UNQLITE_OK;
+			}
+		} else {
+			rc = unqlite_kv_store(db->db, op->key, (int)op->keylen,
+					      op->val, op->vallen);
+		}
+		if (rc != UNQLITE_OK) {
+			break;
+		}
+	}
+	if (op) {
+		unqlite_rollback(db->db);
+		LCUIMutex_Unlock(&db->mutex);
+		kvdb_batch_discard(batch);
+		return -1;
+	}
+	kvdb_batch_discard(batch);
+	if (db->durability == KVDB_DURABILITY_ASYNC) {
+		ret = kvdb_auto_commit(db, count, size);
+	} else {
+		db->pending += count;
+		ret = kvdb_commit(db);
+	}
+	LCUIMutex_Unlock(&db->mutex);
+	return ret;
+}
+
+void kvdb_batch_discard(kvdb_batch_t *batch)
+{
+	kvdb_batch_op_t *op, *next;
+
+	for (op = batch->head; op; op = next) {
+		next = op->next;
+		free(op);
+	}
+	free(batch);
+}
+
+static int kvdb_buffer_reserve(kvdb_buffer_t *buf, size_t size)
+{
+	char *data;
+
+	if (size <= buf->size) {
 		return 0;
 	}
-	return -1;
+	if (size < KEY_BUFFER_SIZE) {
+		size = KEY_BUFFER_SIZE;
+	}
+	data = realloc(buf->data, size);
+	if (!data) {
+		return -1;
+	}
+	buf->data = data;
+	buf->size = size;
+	return 0;
 }
 
-size_t kvdb_each(kvdb_t *db, kvdb_each_callback_t callback, void *privdata)
+static char *kvdb_dup_key(const char *key, size_t keylen)
 {
-	int keylen;
-	char key[MAX_KEY_LEN];
-	char *val;
+	char *buf;
 
-	size_t count = 0;
-	unqlite_kv_cursor *cur;
-	unqlite_int64 vallen;
+	if (!key) {
+		return NULL;
+	}
+	buf = malloc(keylen > 0 ? keylen : 1);
+	if (buf && keylen > 0) {
+		memcpy(buf, key, keylen);
+	}
+	return buf;
+}
+
+kvdb_cursor_t *kvdb_cursor_open(kvdb_t *db)
+{
+	kvdb_cursor_t *cur = malloc(sizeof(kvdb_cursor_t));
+
+	if (!cur) {
+		return NULL;
+	}
+	LCUIMutex_Lock(&db->mutex);
+	if (unqlite_kv_cursor_init(db->db, &cur->cur) != UNQLITE_OK) {
+		LCUIMutex_Unlock(&db->mutex);
+		free(cur);
+		return NULL;
+	}
+	db->cursors += 1;
+	LCUIMutex_Unlock(&db->mutex);
+	cur->db = db;
+	cur->lower = NULL;
+	cur->upper = NULL;
+	cur->start = NULL;
+	cur->lowerlen = 0;
+	cur->upperlen = 0;
+	cur->startlen = 0;
+	cur->valid = 0;
+	cur->value_loaded = 0;
+	cur->key.data = NULL;
+	cur->key.len = cur->key.size = 0;
+	cur->value.data = NULL;
+	cur->value.len = cur->value.size = 0;
+	return cur;
+}
+
+void kvdb_cursor_close(kvdb_cursor_t *cur)
+{
+	LCUIMutex_Lock(&cur->db->mutex);
+	unqlite_kv_cursor_release(cur->db->db, cur->cur);
+	cur->db->cursors -= 1;
+	LCUIMutex_Unlock(&cur->db->mutex);
+	free(cur->key.data);
+	free(cur->value.data);
+	free(cur->lower);
+	free(cur->upper);
+	free(cur->start);
+	free(cur);
+}
+
+int kvdb_cursor_set_range(kvdb_cursor_t *cur, const char *lower,
+			  size_t lowerlen, const char *upper, size_t upperlen)
+{
+	free(cur->lower);
+	free(cur->upper);
+	cur->lower = kvdb_dup_key(lower, lowerlen);
+	cur->upper = kvdb_dup_key(upper, upperlen);
+	cur->lowerlen = lowerlen;
+	cur->upperlen = upperlen;
+	cur->valid = 0;
+	if ((lower && !cur->lower) || (upper && !cur->upper)) {
+		return -1;
+	}
+	return 0;
+}
+
+/** 读取当前记录的键，键的长度不受限制 */
+static int kvdb_cursor_load_key(kvdb_cursor_t *cur)
+{
+	int len = 0;
+
+	if (unqlite_kv_cursor_key(cur->cur, NULL, &len) != UNQLITE_OK ||
+	    kvdb_buffer_reserve(&cur->key, (size_t)len + 1) != 0) {
+		return -1;
+	}
+	len = (int)cur->key.size;
+	if (unqlite_kv_cursor_key(cur->cur, cur->key.data, &len) !=
+	    UNQLITE_OK) {
+		return -1;
+	}
+	cur->key.len = (size_t)len;
+	cur->key.data[len] = 0;
+	return 0;
+}
 
-	if (unqlite_kv_cursor_init(db->db, &cur) != UNQLITE_OK) {
+/** 键是否在游标的遍历范围内 */
+static int kvdb_cursor_match(kvdb_cursor_t *cur)
+{
+	const char *key = cur->key.data;
+	size_t keylen = cur->key.len;
+
+	if (cur->start && kvdb_compare_key(key, keylen, cur->start,
+					   cur->startlen) < 0) {
 		return 0;
 	}
-	if (unqlite_kv_cursor_first_entry(cur) != UNQLITE_OK) {
-		unqlite_kv_cursor_release(db->db, cur);
+	if (cur->lower && kvdb_compare_key(key, keylen, cur->lower,
+					   cur->lowerlen) < 0) {
 		return 0;
 	}
-	while (unqlite_kv_cursor_valid_entry(cur)) {
-		keylen = MAX_KEY_LEN;
-		vallen = 0;
+	if (cur->upper && kvdb_compare_key(key, keylen, cur->upper,
+					   cur->upperlen) >= 0) {
+		return 0;
+	}
+	return 1;
+}
+
+/** 从当前位置开始，跳过不在范围内的记录，调用前需锁定数据库 */
+static int kvdb_cursor_skip(kvdb_cursor_t *cur)
+{
+	cur->valid = 0;
+	cur->value_loaded = 0;
+	while (unqlite_kv_cursor_valid_entry(cur->cur)) {
+		if (kvdb_cursor_load_key(cur) != 0) {
+			return -1;
+		}
+		if (kvdb_cursor_match(cur)) {
+			cur->valid = 1;
+			return 0;
+		}
+		if (unqlite_kv_cursor_next_entry(cur->cur) != UNQLITE_OK) {
+			break;
+		}
+	}
+	return -1;
+}
+
+/**
+ * 游标和其它读写共用一个句柄，组提交线程也会在遍历期间提交，所以游标的每次
+ * 操作也需要锁定数据库。不在打开游标期间一直锁定，是因为遍历时可能还会读写
+ * 同一个数据库
+ */
+int kvdb_cursor_seek(kvdb_cursor_t *cur, const char *key, size_t keylen)
+{
+	int ret = -1;
+
+	/* 哈希表中的键是无序的，只能从头开始过滤 */
+	free(cur->start);
+	cur->start = kvdb_dup_key(key, keylen);
+	cur->startlen = keylen;
+	cur->valid = 0;
+	LCUIMutex_Lock(&cur->db->mutex);
+	if (unqlite_kv_cursor_first_entry(cur->cur) == UNQLITE_OK) {
+		ret = kvdb_cursor_skip(cur);
+	}
+	LCUIMutex_Unlock(&cur->db->mutex);
+	return ret;
+}
+
+int kvdb_cursor_next(kvdb_cursor_t *cur)
+{
+	int ret = -1;
+
+	if (!cur->valid) {
+		return -1;
+	}
+	LCUIMutex_Lock(&cur->db->mutex);
+	if (unqlite_kv_cursor_next_entry(cur->cur) == UNQLITE_OK) {
+		ret = kvdb_cursor_skip(cur);
+	} else {
+		cur->valid = 0;
+	}
+	LCUIMutex_Unlock(&cur->db->mutex);
+	return ret;
+}
+
+int kvdb_cursor_valid(kvdb_cursor_t *cur)
+{
+	return cur->valid;
+}
 
-		unqlite_kv_cursor_key(cur, key, &keylen);
-		unqlite_kv_cursor_data(cur, NULL, &vallen);
+const char *kvdb_cursor_key(kvdb_cursor_t *cur, size_t *keylen)
+{
+	if (!cur->valid) {
+		return NULL;
+	}
+	*keylen = cur->key.len;
+	return cur->key.data;
+}
+
+const void *kvdb_cursor_value(kvdb_cursor_t *cur, size_t *vallen)
+{
+	unqlite_int64 len = 0;
 
-		val = malloc((size_t)vallen);
-		unqlite_kv_cursor_data(cur, val, &vallen);
-		unqlite_kv_cursor_next_entry(cur);
+	if (!cur->valid) {
+		return NULL;
+	}
+	if (cur->value_loaded) {
+		*vallen = cur->value.len;
+		return cur->value.data;
+	}
+	LCUIMutex_Lock(&cur->db->mutex);
+	if (unqlite_kv_cursor_data(cur->cur, NULL, &len) != UNQLITE_OK ||
+	    kvdb_buffer_reserve(&cur->value, (size_t)len + 1) != 0 ||
+	    unqlite_kv_cursor_data(cur->cur, cur->value.data, &len) !=
+	    UNQLITE_OK) {
+		LCUIMutex_Unlock(&cur->db->mutex);
+		return NULL;
+	}
+	LCUIMutex_Unlock(&cur->db->mutex);
+	cur->value.len = (size_t)len;
+	cur->value_loaded = 1;
+	*vallen = cur->value.len;
+	return cur->value.data;
+}
 
-		callback(key, (size_t)keylen, val, (size_t)vallen, privdata);
+size_t kvdb_each(kvdb_t *db, kvdb_each_callback_t callback, void *privdata)
+{
+	size_t count = 0;
+	size_t keylen, vallen;
+	const char *key;
+	const void *val;
+	kvdb_cursor_t *cur;
 
+	cur = kvdb_cursor_open(db);
+	if (!cur) {
+		return 0;
+	}
+	for (kvdb_cursor_seek(cur, NULL, 0); kvdb_cursor_valid(cur);
+	     kvdb_cursor_next(cur)) {
+		key = kvdb_cursor_key(cur, &keylen);
+		val = kvdb_cursor_value(cur, &vallen);
+		if (!val) {
+			continue;
+		}
+		callback(key, keylen, val, vallen, privdata);
 		++count;
 	}
-	unqlite_kv_cursor_release(db->db, cur);
+	kvdb_cursor_close(cur);
 	return count;
 }
 #endif
@@ -0,0 +1,556 @@
+﻿/* ***************************************************************************
+ * resample.c -- Image resampling with box and Lanczos filters.
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * resample.c -- 基于盒式和 Lanczos 滤波器的图像重采样
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include "resample.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+#define RESAMPLE_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define RESAMPLE_TARGET_SSE2 __attribute__((target("sse2")))
+#define RESAMPLE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define RESAMPLE_TARGET_SSE2
+#define RESAMPLE_TARGET_AVX2
+#endif
+
+/** 权重的定点数精度，权重以 int16_t 存储，以便用 SIMD 指令成对地乘加 */
+#define RESAMPLE_PRECISION_BITS 14
+#define RESAMPLE_ONE (1 << RESAMPLE_PRECISION_BITS)
+#define RESAMPLE_HALF (1 << (RESAMPLE_PRECISION_BITS - 1))
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+typedef struct ResampleFilterRec_ {
+	double (*func)(double x);
+	double support;
+} ResampleFilterRec;
+
+/** 各个输出像素的采样范围和权重 */
+typedef struct ResampleCoeffsRec_ {
+	int size;		/**< 每个输出像素最多的采样数 */
+	int *bounds;		/**< 每个输出像素的采样起点和采样数 */
+	int16_t *weights;	/**< 每个输出像素的权重，每组 size 个 */
+} ResampleCoeffsRec, *ResampleCoeffs;
+
+/** 水平缩放一行像素 */
+typedef void (*ResampleRowFunc)(uint8_t *, const uint8_t *, int, int,
+				ResampleCoeffs);
+
+/** 将 n 行数据按权重合成一行，行与行之间相隔 stride 个字节 */
+typedef void (*ResampleColumnFunc)(uint8_t *, const uint8_t *, size_t,
+				   size_t, int, const int16_t *);
+
+static struct ResampleKernels {
+	LCUI_BOOL ready;
+	ResampleRowFunc row;
+	ResampleColumnFunc column;
+} kernels;
+
+static double Resample_Box(double x)
+{
+	if (x >= -0.5 && x < 0.5) {
+		return 1.0;
+	}
+	return 0.0;
+}
+
+static double Resample_Sinc(double x)
+{
+	if (x == 0.0) {
+		return 1.0;
+	}
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+static double Resample_Lanczos3(double x)
+{
+	if (x > -3.0 && x < 3.0) {
+		return Resample_Sinc(x) * Resample_Sinc(x / 3.0);
+	}
+	return 0.0;
+}
+
+static const ResampleFilterRec resample_filters[] = {
+	{ Resample_Box, 0.5 },
+	{ Resample_Lanczos3, 3.0 }
+};
+
+static void ResampleCoeffs_Destroy(ResampleCoeffs c)
+{
+	free(c->bounds);
+	free(c->weights);
+	c->bounds = NULL;
+	c->weights = NULL;
+}
+
+/** 计算从 in_size 个像素缩放到 out_size 个像素时各个输出像素的权重 */
+static int ResampleCoeffs_Init(ResampleCoeffs c, const ResampleFilterRec *f,
+			       int in_size, int out_size)
+{
+	int i, x, xmin, n, total, imax;
+	double center, w, ww, *k;
+	double scale = 1.0 * in_size / out_size;
+	/* 缩小时需按比例扩大滤波器的范围，否则会产生锯齿 */
+	double filter_scale = max(scale, 1.0);
+	double support = f->support * filter_scale;
+	int16_t *weights;
+
+	c->size = (int)ceil(support) * 2 + 1;
+	c->bounds = malloc(sizeof(int) * out_size * 2);
+	c->weights = calloc(out_size * c->size, sizeof(int16_t));
+	k = malloc(sizeof(double) * c->size);
+	if (!c->bounds || !c->weights || !k) {
+		ResampleCoeffs_Destroy(c);
+		free(k);
+		return -1;
+	}
+	for (i = 0; i < out_size; ++i) {
+		center = (i + 0.5) * scale;
+		xmin = max(0, (int)floor(center - support + 0.5));
+		n = min(in_size, (int)floor(center + support + 0.5)) - xmin;
+		n = min(n, c->size);
+		for (ww = 0, x = 0; x < n; ++x) {
+			w = f->func((x + xmin - center + 0.5) / filter_scale);
+			k[x] = w;
+			ww += w;
+		}
+		weights = c->weights + i * c->size;
+		if (n < 1 || ww == 0.0) {
+			xmin = min(in_size - 1, (int)center);
+			weights[0] = RESAMPLE_ONE;
+			c->bounds[i * 2] = xmin;
+			c->bounds[i * 2 + 1] = 1;
+			continue;
+		}
+		/* 转换成定点数后，把舍入误差补到最大的权重上，保证权重之和为 1 */
+		for (total = 0, imax = 0, x = 0; x < n; ++x) {
+			weights[x] = (int16_t)floor(k[x] / ww * RESAMPLE_ONE + 0.5);
+			total += weights[x];
+			if (weights[x] > weights[imax]) {
+				imax = x;
+			}
+		}
+		weights[imax] += RESAMPLE_ONE - total;
+		c->bounds[i * 2] = xmin;
+		c->bounds[i * 2 + 1] = n;
+	}
+	free(k);
+	return 0;
+}
+
+static uint8_t Resample_Clip(int value)
+{
+	if (value < 0) {
+		return 0;
+	}
+	if (value > 255) {
+		return 255;
+	}
+	return (uint8_t)value;
+}
+
+static void Resample_RowScalar(uint8_t *out, const uint8_t *in, int width,
+			       int bpp, ResampleCoeffs c)
+{
+	int i, x, ch, n, acc[4];
+	const uint8_t *p;
+	const int16_t *k;
+
+	for (i = 0; i < width; ++i, out += bpp) {
+		p = in + c->bounds[i * 2] * bpp;
+		n = c->bounds[i * 2 + 1];
+		k = c->weights + i * c->size;
+		for (ch = 0; ch < bpp; ++ch) {
+			acc[ch] = RESAMPLE_HALF;
+		}
+		for (x = 0; x < n; ++x, p += bpp) {
+			for (ch = 0; ch < bpp; ++ch) {
+				acc[ch] += p[ch] * k[x];
+			}
+		}
+		for (ch = 0; ch < bpp; ++ch) {
+			acc[ch] >>= RESAMPLE_PRECISION_BITS;
+			out[ch] = Resample_Clip(acc[ch]);
+		}
+	}
+}
+
+static void Resample_ColumnScalar(uint8_t *out, const uint8_t *in,
+				  size_t stride, size_t len, int n,
+				  const int16_t *k)
+{
+	int y, acc;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		acc = RESAMPLE_HALF;
+		for (y = 0; y < n; ++y) {
+			acc += in[y * stride + i] * k[y];
+		}
+		out[i] = Resample_Clip(acc >> RESAMPLE_PRECISION_BITS);
+	}
+}
+
+#ifdef RESAMPLE_X86
+
+/** 两个权重打包成一个 32 位整数，供 madd 指令将相邻的两个采样分别乘以它们 */
+#define Resample_PackWeights(K0, K1) \
+	((int)((uint16_t)(K0) | ((uint32_t)(uint16_t)(K1) << 16)))
+
+static RESAMPLE_TARGET_SSE2 __m128i Resample_LoadPixel(const uint8_t *p,
+						       int bpp)
+{
+	int value;
+
+	/* 用常量长度的 memcpy()，编译器才会将它优化成一次读取 */
+	if (bpp == 4) {
+		memcpy(&value, p, 4);
+	} else {
+		value = p[0] | (p[1] << 8) | (p[2] << 16);
+	}
+	return _mm_cvtsi32_si128(value);
+}
+
+static RESAMPLE_TARGET_SSE2 void Resample_RowSSE2(uint8_t *out,
+						  const uint8_t *in, int width,
+						  int bpp, ResampleCoeffs c)
+{
+	int i, x, n, value;
+	const uint8_t *p;
+	const int16_t *k;
+	__m128i sum, pix, zero = _mm_setzero_si128();
+
+	for (i = 0; i < width; ++i, out += bpp) {
+		p = in + c->bounds[i * 2] * bpp;
+		n = c->bounds[i * 2 + 1];
+		k = c->weights + i * c->size;
+		sum = _mm_set1_epi32(RESAMPLE_HALF);
+		/* 每次处理两个采样，它们的各个通道交错排列后与权重对相乘 */
+		for (x = 0; x + 1 < n; x += 2, p += bpp * 2) {
+			pix = _mm_unpacklo_epi8(Resample_LoadPixel(p, bpp),
+						Resample_LoadPixel(p + bpp, bpp));
+			pix = _mm_unpacklo_epi8(pix, zero);
+			sum = _mm_add_epi32(
+			    sum, _mm_madd_epi16(pix, _mm_set1_epi32(
+				Resample_PackWeights(k[x], k[x + 1]))));
+		}
+		if (x < n) {
+			pix = _mm_unpacklo_epi8(Resample_LoadPixel(p, bpp), zero);
+			pix = _mm_unpacklo_epi16(pix, zero);
+			sum = _mm_add_epi32(
+			    sum, _mm_madd_epi16(pix, _mm_set1_epi32(
+				Resample_PackWeights(k[x], 0))));
+		}
+		sum = _mm_srai_epi32(sum, RESAMPLE_PRECISION_BITS);
+		sum = _mm_packs_epi32(sum, sum);
+		sum = _mm_packus_epi16(sum, sum);
+		value = _mm_cvtsi128_si32(sum);
+		if (bpp == 4) {
+			memcpy(out, &value, 4);
+		} else {
+			out[0] = value & 0xff;
+			out[1] = (value >> 8) & 0xff;
+			out[2] = (value >> 16) & 0xff;
+		}
+	}
+}
+
+static RESAMPLE_TARGET_SSE2 void Resample_ColumnSSE2(uint8_t *out,
+						     const uint8_t *in,
+						     size_t stride, size_t len,
+						     int n, const int16_t *k)
+{
+	int y;
+	size_t i;
+	__m128i a, b, lo, hi, mmk, s0, s1, s2, s3;
+	__m128i zero = _mm_setzero_si128();
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		s0 = s1 = s2 = s3 = _mm_set1_epi32(RESAMPLE_HALF);
+		for (y = 0; y < n; y += 2) {
+			a = _mm_loadu_si128((const __m128i *)(in + y * stride + i));
+			if (y + 1 < n) {
+				b = _mm_loadu_si128(
+				    (const __m128i *)(in + (y + 1) * stride + i));
+				mmk = _mm_set1_epi32(
+				    Resample_PackWeights(k[y], k[y + 1]));
+			} else {
+				b = zero;
+				mmk = _mm_set1_epi32(Resample_PackWeights(k[y], 0));
+			}
+			lo = _mm_unpacklo_epi8(a, b);
+			hi = _mm_unpackhi_epi8(a, b);
+			s0 = _mm_add_epi32(s0, _mm_madd_epi16(
+			    _mm_unpacklo_epi8(lo, zero), mmk));
+			s1 = _mm_add_epi32(s1, _mm_madd_epi16(
+			    _mm_unpackhi_epi8(lo, zero), mmk));
+			s2 = _mm_add_epi32(s2, _mm_madd_epi16(
+			    _mm_unpacklo_epi8(hi, zero), mmk));
+			s3 = _mm_add_epi32(s3, _mm_madd_epi16(
+			    _mm_unpackhi_epi8(hi, zero), mmk));
+		}
+		s0 = _mm_srai_epi32(s0, RESAMPLE_PRECISION_BITS);
+		s1 = _mm_srai_epi32(s1, RESAMPLE_PRECISION_BITS);
+		s2 = _mm_srai_epi32(s2, RESAMPLE_PRECISION_BITS);
+		s3 = _mm_srai_epi32(s3, RESAMPLE_PRECISION_BITS);
+		s0 = _mm_packus_epi16(_mm_packs_epi32(s0, s1),
+				      _mm_packs_epi32(s2, s3));
+		_mm_storeu_si128((__m128i *)(out + i), s0);
+	}
+	Resample_ColumnScalar(out + i, in + i, stride, len - i, n, k);
+}
+
+/* AVX2 的解包和打包指令都在各自的 128 位通道内进行，两者相互抵消，结果无需重排 */
+static RESAMPLE_TARGET_AVX2 void Resample_ColumnAVX2(uint8_t *out,
+						     const uint8_t *in,
+						     size_t stride, size_t len,
+						     int n, const int16_t *k)
+{
+	int y;
+	size_t i;
+	__m256i a, b, lo, hi, mmk, s0, s1, s2, s3;
+	__m256i zero = _mm256_setzero_si256();
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		s0 = s1 = s2 = s3 = _mm256_set1_epi32(RESAMPLE_HALF);
+		for (y = 0; y < n; y += 2) {
+			a = _mm256_loadu_si256(
+			    (const __m256i *)(in + y * stride + i));
+			if (y + 1 < n) {
+				b = _mm256_loadu_si256(
+				    (const __m256i *)(in + (y + 1) * stride + i));
+				mmk = _mm256_set1_epi32(
+				    Resample_PackWeights(k[y], k[y + 1]));
+			} else {
+				b = zero;
+				mmk = _mm256_set1_epi32(
+				    Resample_PackWeights(k[y], 0));
+			}
+			lo = _mm256_unpacklo_epi8(a, b);
+			hi = _mm256_unpackhi_epi8(a, b);
+			s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(
+			    _mm256_unpacklo_epi8(lo, zero), mmk));
+			s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(
+			    _mm256_unpackhi_epi8(lo, zero), mmk));
+			s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(
+			    _mm256_unpacklo_epi8(hi, zero), mmk));
+			s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(
+			    _mm256_unpackhi_epi8(hi, zero), mmk));
+		}
+		s0 = _mm256_srai_epi32(s0, RESAMPLE_PRECISION_BITS);
+		s1 = _mm256_srai_epi32(s1, RESAMPLE_PRECISION_BITS);
+		s2 = _mm256_srai_epi32(s2, RESAMPLE_PRECISION_BITS);
+		s3 = _mm256_srai_epi32(s3, RESAMPLE_PRECISION_BITS);
+		s0 = _mm256_packus_epi16(_mm256_packs_epi32(s0, s1),
+					 _mm256_packs_epi32(s2, s3));
+		_mm256_storeu_si256((__m256i *)(out + i), s0);
+	}
+	Resample_ColumnSSE2(out + i, in + i, stride, len - i, n, k);
+}
+
+static LCUI_BOOL Resample_CPUHasSSE2(void)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	return TRUE;
+#elif defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static LCUI_BOOL Resample_CPUHasAVX2(void)
+{
+#if defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return FALSE;
+	}
+	__cpuid(info, 1);
+	/* 还需要操作系统支持保存 AVX 寄存器 */
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) ||
+	    (_xgetbv(0) & 6) != 6) {
+		return FALSE;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+/** 根据 CPU 支持的指令集选择实现，多个线程同时选择时结果也一样 */
+static void Resample_InitKernels(void)
+{
+	if (kernels.ready) {
+		return;
+	}
+	kernels.row = Resample_RowScalar;
+	kernels.column = Resample_ColumnScalar;
+#ifdef RESAMPLE_X86
+	if (Resample_CPUHasSSE2()) {
+		kernels.row = Resample_RowSSE2;
+		kernels.column = Resample_ColumnSSE2;
+		if (Resample_CPUHasAVX2()) {
+			kernels.column = Resample_ColumnAVX2;
+		}
+	}
+#endif
+	kernels.ready = TRUE;
+}
+
+static int Resample_Horizontal(const LCUI_Graph *graph, LCUI_Graph *buff,
+			       const ResampleFilterRec *f, int width)
+{
+	int y;
+	ResampleCoeffsRec c;
+
+	if (ResampleCoeffs_Init(&c, f, graph->width, width) != 0) {
+		return -1;
+	}
+	buff->color_type = graph->color_type;
+	if (Graph_Create(buff, width, graph->height) != 0) {
+		ResampleCoeffs_Destroy(&c);
+		return -1;
+	}
+	for (y = 0; y < graph->height; ++y) {
+		kernels.row(buff->bytes + y * buff->bytes_per_row,
+			    graph->bytes + y * graph->bytes_per_row, width,
+			    graph->bytes_per_row / graph->width, &c);
+	}
+	ResampleCoeffs_Destroy(&c);
+	return 0;
+}
+
+static int Resample_Vertical(const LCUI_Graph *graph, LCUI_Graph *buff,
+			     const ResampleFilterRec *f, int height)
+{
+	int y;
+	size_t len;
+	ResampleCoeffsRec c;
+
+	if (ResampleCoeffs_Init(&c, f, graph->height, height) != 0) {
+		return -1;
+	}
+	buff->color_type = graph->color_type;
+	if (Graph_Create(buff, graph->width, height) != 0) {
+		ResampleCoeffs_Destroy(&c);
+		return -1;
+	}
+	len = graph->width * (graph->bytes_per_row / graph->width);
+	for (y = 0; y < height; ++y) {
+		kernels.column(buff->bytes + y * buff->bytes_per_row,
+			       graph->bytes +
+				   c.bounds[y * 2] * graph->bytes_per_row,
+			       graph->bytes_per_row, len, c.bounds[y * 2 + 1],
+			       c.weights + y * c.size);
+	}
+	ResampleCoeffs_Destroy(&c);
+	return 0;
+}
+
+int Resample_Zoom(const LCUI_Graph *graph, LCUI_Graph *buff,
+		  ResampleFilter filter, LCUI_BOOL keep_scale,
+		  unsigned width, unsigned height)
+{
+	int ret;
+	double scale_x, scale_y;
+	LCUI_Graph tmp;
+	const ResampleFilterRec *f = &resample_filters[filter];
+
+	if (!Graph_IsValid(graph) || (width < 1 && height < 1)) {
+		return -1;
+	}
+	if (graph->color_type != LCUI_COLOR_TYPE_RGB888 &&
+	    graph->color_type != LCUI_COLOR_TYPE_ARGB8888) {
+		return Graph_ZoomBilinear(graph, buff, keep_scale, width,
+					  height);
+	}
+	scale_x = 1.0 * width / graph->width;
+	scale_y = 1.0 * height / graph->height;
+	if (width < 1) {
+		scale_x = scale_y;
+		width = (unsigned)(graph->width * scale_x + 0.5);
+	} else if (height < 1) {
+		scale_y = scale_x;
+		height = (unsigned)(graph->height * scale_y + 0.5);
+	} else if (keep_scale) {
+		scale_x = scale_y = min(scale_x, scale_y);
+		width = (unsigned)(graph->width * scale_x + 0.5);
+		height = (unsigned)(graph->height * scale_y + 0.5);
+	}
+	width = max(width, 1);
+	height = max(height, 1);
+	Resample_InitKernels();
+	Graph_Init(&tmp);
+	if ((int)width == graph->width) {
+		return Resample_Vertical(graph, buff, f, height);
+	}
+	if ((int)height == graph->height) {
+		return Resample_Horizontal(graph, buff, f, width);
+	}
+	if (Resample_Horizontal(graph, &tmp, f, width) != 0) {
+		return -1;
+	}
+	ret = Resample_Vertical(&tmp, buff, f, height);
+	Graph_Free(&tmp);
+	return ret;
+}
@@ -0,0 +1,472 @@
+﻿/* ***************************************************************************
+ * stream_decoder.c -- streaming image decoder
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * stream_decoder.c -- 流式图像解码器
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include "build.h"
+#include "stream_decoder.h"
+
+#ifdef LCFINDER_USE_LIBPNG
+#include <png.h>
+#endif
+
+#define BMP_HEADER_SIZE 54
+/** 未压缩的 BMP 文件中，每一行目标像素最多读取的原图行数 */
+#define BMP_MAX_SAMPLES 4
+
+/**
+ * 面积平均缩小器
+ * 把原图和目标图像都看作覆盖相同区域的网格，每个目标像素的值是它覆盖的原图
+ * 像素按重叠面积加权的平均值。坐标都乘以对方的尺寸，使得重叠面积都是整数。
+ * 只保存当前原图行水平缩小后的结果和当前目标行的累加值。
+ */
+typedef struct AreaScalerRec_ {
+	unsigned src_width;
+	unsigned src_height;
+	unsigned channels;
+	unsigned y;		/**< 已接收的原图行数 */
+	unsigned out_y;		/**< 正在累加的目标行 */
+	uint32_t *row;		/**< 当前原图行水平缩小后的结果 */
+	uint64_t *sums;		/**< 当前目标行的累加值 */
+	LCUI_Graph *out;
+} AreaScalerRec, *AreaScaler;
+
+/** 计算缩小后的尺寸，按比例缩放到目标尺寸以内，不放大 */
+static void StreamDecoder_GetSize(unsigned origin_width,
+				  unsigned origin_height, unsigned *width,
+				  unsigned *height)
+{
+	double scale = 1.0;
+
+	if (*width > 0 && *height > 0) {
+		scale = min(1.0 * *width / origin_width,
+			    1.0 * *height / origin_height);
+	} else if (*width > 0) {
+		scale = 1.0 * *width / origin_width;
+	} else if (*height > 0) {
+		scale = 1.0 * *height / origin_height;
+	}
+	if (scale >= 1.0) {
+		*width = origin_width;
+		*height = origin_height;
+		return;
+	}
+	*width = max(1, (unsigned)(origin_width * scale + 0.5));
+	*height = max(1, (unsigned)(origin_height * scale + 0.5));
+}
+
+/**
+ * 创建缩小器，out 需已按目标尺寸和颜色类型创建
+ * @param[in] channels 每个像素的字节数，须与 out 的颜色类型一致
+ */
+static AreaScaler AreaScaler_Create(unsigned src_width, unsigned src_height,
+				    unsigned channels, LCUI_Graph *out)
+{
+	size_t n = (size_t)out->width * channels;
+	AreaScaler s = NEW(AreaScalerRec, 1);
+
+	if (!s) {
+		return NULL;
+	}
+	s->src_width = src_width;
+	s->src_height = src_height;
+	s->channels = channels;
+	s->out = out;
+	s->row = malloc(n * sizeof(uint32_t));
+	s->sums = calloc(n, sizeof(uint64_t));
+	if (!s->row || !s->sums) {
+		free(s->row);
+		free(s->sums);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+static void AreaScaler_Destroy(AreaScaler s)
+{
+	free(s->row);
+	free(s->sums);
+	free(s);
+}
+
+/** 水平缩小一行原图像素，原图的一个像素最多跨越两个目标像素 */
+static void AreaScaler_ScaleRow(AreaScaler s, const unsigned char *src)
+{
+	unsigned x, c;
+	unsigned ch = s->channels;
+	uint32_t w, *p = s->row;
+	uint64_t pos = 0, end;
+	uint64_t dst_width = s->out->width;
+	uint64_t bound = s->src_width;
+
+	memset(s->row, 0, (size_t)s->out->width * ch * sizeof(uint32_t));
+	for (x = 0; x < s->src_width; ++x, src += ch) {
+		end = pos + dst_width;
+		w = (uint32_t)(min(end, bound) - pos);
+		for (c = 0; c < ch; ++c) {
+			p[c] += src[c] * w;
+		}
+		if (end >= bound) {
+			p += ch;
+			w = (uint32_t)(end - bound);
+			if (w > 0) {
+				for (c = 0; c < ch; ++c) {
+					p[c] += src[c] * w;
+				}
+			}
+			bound += s->src_width;
+		}
+		pos = end;
+	}
+}
+
+/** 输出已累加完的目标行 */
+static void AreaScaler_EmitRow(AreaScaler s)
+{
+	size_t i, n = (size_t)s->out->width * s->channels;
+	uint64_t total = (uint64_t)s->src_width * s->src_height;
+	unsigned char *dst = s->out->bytes + s->out_y * s->out->bytes_per_row;
+
+	for (i = 0; i < n; ++i) {
+		dst[i] = (unsigned char)((s->sums[i] + total / 2) / total);
+	}
+}
+
+/** 接收一行原图像素，像素的格式须与目标图像一致 */
+static void AreaScaler_PushRow(AreaScaler s, const unsigned char *src)
+{
+	size_t i, n = (size_t)s->out->width * s->channels;
+	uint64_t dst_height = s->out->height;
+	uint64_t pos = s->y * dst_height;
+	uint64_t end = pos + dst_height;
+	uint64_t bound = (uint64_t)(s->out_y + 1) * s->src_height;
+	uint64_t w = min(end, bound) - pos;
+
+	if (s->y >= s->src_height) {
+		return;
+	}
+	AreaScaler_ScaleRow(s, src);
+	for (i = 0; i < n; ++i) {
+		s->sums[i] += s->row[i] * w;
+	}
+	if (end >= bound) {
+		AreaScaler_EmitRow(s);
+		s->out_y += 1;
+		w = end - bound;
+		for (i = 0; i < n; ++i) {
+			s->sums[i] = s->row[i] * w;
+		}
+	}
+	s->y += 1;
+}
+
+/** 按原图尺寸和目标尺寸创建输出图像和缩小器 */
+static AreaScaler StreamDecoder_Begin(unsigned src_width, unsigned src_height,
+				      unsigned sample_height,
+				      unsigned channels, unsigned width,
+				      unsigned height, LCUI_Graph *out)
+{
+	AreaScaler s;
+
+	StreamDecoder_GetSize(src_width, src_height, &width, &height);
+	if (channels == 4) {
+		out->color_type = LCUI_COLOR_TYPE_ARGB8888;
+	} else {
+		out->color_type = LCUI_COLOR_TYPE_RGB888;
+	}
+	if (Graph_Create(out, width, height) != 0) {
+		return NULL;
+	}
+	s = AreaScaler_Create(src_width, sample_height, channels, out);
+	if (!s) {
+		Graph_Free(out);
+	}
+	return s;
+}
+
+static int StreamDecoder_ReadAt(FILE *fp, int64_t offset, void *buf,
+				size_t size)
+{
+#ifdef _WIN32
+	if (_fseeki64(fp, offset, SEEK_SET) != 0) {
+		return -1;
+	}
+	return fread(buf, 1, size, fp) == size ? 0 : -1;
+#else
+	/* pread() 不改变文件位置，无需先定位 */
+	return pread(fileno(fp), buf, size, (off_t)offset) ==
+	       (ssize_t)size ? 0 : -1;
+#endif
+}
+
+static uint32_t ReadUInt32LE(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * 解码未压缩的 24 位和 32 位 BMP 文件
+ * 每一行目标像素只读取均匀分布的几行原图像素，32 位 BMP 的第四个字节在
+ * BI_RGB 格式中不表示透明度，所以都输出 RGB888 格式的图像
+ */
+static int StreamDecoder_ReadBMP(FILE *fp, unsigned width, unsigned height,
+				 unsigned *origin_width,
+				 unsigned *origin_height, LCUI_Graph *out)
+{
+	int32_t src_height;
+	unsigned x, y, sy, bpp, samples;
+	unsigned src_width, rows, sample_height;
+	uint32_t offset, stride;
+	unsigned char *row, header[BMP_HEADER_SIZE];
+	LCUI_BOOL top_down = FALSE;
+	AreaScaler s;
+
+	if (StreamDecoder_ReadAt(fp, 0, header, BMP_HEADER_SIZE) != 0 ||
+	    header[0] != 'B' || header[1] != 'M' ||
+	    ReadUInt32LE(header + 14) < 40) {
+		return -1;
+	}
+	offset = ReadUInt32LE(header + 10);
+	src_width = ReadUInt32LE(header + 18);
+	src_height = (int32_t)ReadUInt32LE(header + 22);
+	bpp = header[28] | (header[29] << 8);
+	/* 只处理 BI_RGB 格式，其它格式交给 LCUI */
+	if (ReadUInt32LE(header + 30) != 0 || (bpp != 24 && bpp != 32)) {
+		return -1;
+	}
+	if (src_height < 0) {
+		top_down = TRUE;
+		src_height = -src_height;
+	}
+	rows = (unsigned)src_height;
+	if (src_width < 1 || rows < 1 || src_width > 0xffffff) {
+		return -1;
+	}
+	stride = ((src_width * bpp + 31) / 32) * 4;
+	StreamDecoder_GetSize(src_width, rows, &width, &height);
+	samples = max(1, min(BMP_MAX_SAMPLES, rows / height));
+	sample_height = rows > height * samples ? height * samples : rows;
+	s = StreamDecoder_Begin(src_width, rows, sample_height, 3,
+				width, height, out);
+	if (!s) {
+		return -1;
+	}
+	row = malloc(stride);
+	if (!row) {
+		AreaScaler_Destroy(s);
+		Graph_Free(out);
+		return -1;
+	}
+	for (y = 0; y < sample_height; ++y) {
+		/* 取每个采样区间的中间一行 */
+		sy = (unsigned)(((uint64_t)y * 2 + 1) * rows /
+				(sample_height * 2));
+		if (!top_down) {
+			sy = rows - 1 - sy;
+		}
+		if (StreamDecoder_ReadAt(fp, offset + (int64_t)sy * stride,
+					 row, src_width * bpp / 8) != 0) {
+			break;
+		}
+		if (bpp == 32) {
+			for (x = 0; x < src_width; ++x) {
+				memmove(row + x * 3, row + x * 4, 3);
+			}
+		}
+		AreaScaler_PushRow(s, row);
+	}
+	free(row);
+	AreaScaler_Destroy(s);
+	if (y < sample_height) {
+		Graph_Free(out);
+		return -1;
+	}
+	*origin_width = src_width;
+	*origin_height = rows;
+	return 0;
+}
+
+#ifdef LCFINDER_USE_LIBPNG
+
+static void StreamDecoder_OnPNGError(png_structp png, png_const_charp msg)
+{
+	LOG("[stream decoder] %s\n", msg);
+	png_longjmp(png, 1);
+}
+
+static void StreamDecoder_OnPNGWarning(png_structp png, png_const_charp msg)
+{
+	/* 忽略警告，损坏的数据会在出错时处理 */
+}
+
+/**
+ * 逐行解码 PNG 文件
+ * 隔行扫描的 PNG 需要解码完所有的遍才能得到完整的行，无法流式处理，
+ * 交给 LCUI 解码
+ */
+static int StreamDecoder_ReadPNG(FILE *fp, unsigned width, unsigned height,
+				 unsigned *origin_width,
+				 unsigned *origin_height, LCUI_Graph *out)
+{
+	png_structp png;
+	png_infop info = NULL;
+	png_uint_32 y, src_width, src_height;
+	int bit_depth, color_type, interlace;
+	unsigned channels;
+	unsigned char *volatile row = NULL;
+	AreaScaler volatile s = NULL;
+
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+				     StreamDecoder_OnPNGError,
+				     StreamDecoder_OnPNGWarning);
+	if (!png) {
+		return -1;
+	}
+	info = png_create_info_struct(png);
+	if (!info) {
+		png_destroy_read_struct(&png, NULL, NULL);
+		return -1;
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		if (s) {
+			AreaScaler_Destroy(s);
+			Graph_Free(out);
+		}
+		free(row);
+		png_destroy_read_struct(&png, &info, NULL);
+		return -1;
+	}
+	fseek(fp, 0, SEEK_SET);
+	png_init_io(png, fp);
+	png_read_info(png, info);
+	png_get_IHDR(png, info, &src_width, &src_height, &bit_depth,
+		     &color_type, &interlace, NULL, NULL);
+	if (interlace != PNG_INTERLACE_NONE) {
+		png_destroy_read_struct(&png, &info, NULL);
+		return -1;
+	}
+	/* 统一转换成 8 位的 BGR 或 BGRA 格式 */
+	png_set_strip_16(png);
+	png_set_packing(png);
+	if (color_type == PNG_COLOR_TYPE_PALETTE) {
+		png_set_palette_to_rgb(png);
+	}
+	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
+		png_set_expand_gray_1_2_4_to_8(png);
+	}
+	if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+		png_set_tRNS_to_alpha(png);
+	}
+	if (color_type == PNG_COLOR_TYPE_GRAY ||
+	    color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+		png_set_gray_to_rgb(png);
+	}
+	png_set_bgr(png);
+	png_read_update_info(png, info);
+	channels = png_get_channels(png, info);
+	if (channels != 3 && channels != 4) {
+		png_destroy_read_struct(&png, &info, NULL);
+		return -1;
+	}
+	row = malloc(png_get_rowbytes(png, info));
+	if (!row) {
+		png_destroy_read_struct(&png, &info, NULL);
+		return -1;
+	}
+	s = StreamDecoder_Begin(src_width, src_height, src_height, channels,
+				width, height, out);
+	if (!s) {
+		free(row);
+		png_destroy_read_struct(&png, &info, NULL);
+		return -1;
+	}
+	for (y = 0; y < src_height; ++y) {
+		png_read_row(png, row, NULL);
+		AreaScaler_PushRow(s, row);
+	}
+	AreaScaler_Destroy(s);
+	free(row);
+	png_destroy_read_struct(&png, &info, NULL);
+	*origin_width = src_width;
+	*origin_height = src_height;
+	return 0;
+}
+
+#else
+
+static int StreamDecoder_ReadPNG(FILE *fp, unsigned width, unsigned height,
+				 unsigned *origin_width,
+				 unsigned *origin_height, LCUI_Graph *out)
+{
+	return -1;
+}
+
+#endif
+
+int StreamDecoder_ReadScaled(FILE *fp, unsigned width, unsigned height,
+			     unsigned *origin_width, unsigned *origin_height,
+			     LCUI_Graph *out)
+{
+	unsigned char sig[8];
+	static const unsigned char png_sig[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+
+	Graph_Init(out);
+	if (StreamDecoder_ReadAt(fp, 0, sig, sizeof(sig)) != 0) {
+		return -1;
+	}
+	if (memcmp(sig, png_sig, sizeof(png_sig)) == 0) {
+		return StreamDecoder_ReadPNG(fp, width, height, origin_width,
+					     origin_height, out);
+	}
+	if (sig[0] == 'B' && sig[1] == 'M') {
+		return StreamDecoder_ReadBMP(fp, width, height, origin_width,
+					     origin_height, out);
+	}
+	return -1;
+}
@@ -0,0 +1,248 @@
+﻿/* ***************************************************************************
+ * thumb_codec.c -- thumbnail pixel codec
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * thumb_codec.c -- 缩略图像素数据的编解码
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/*
+ * 编码方式与 QOI (Quite OK Image Format) 相同，它只需遍历一次像素，编解码速度
+ * 接近内存复制。像素按内存中的顺序读取，LCUI 的像素为 BGR(A) 顺序，不影响压缩
+ * 效果。
+ * 不透明的图像采用有损编码：与前一个像素相差不超过 LOSSY_TOLERANCE 的像素视为
+ * 相同，以游程编码，照片中的噪点大多被合并掉，解码方式不变。游程中的像素都与
+ * 同一个已解码的像素比较，误差不会累积。
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include "thumb_codec.h"
+
+#define QOI_OP_INDEX	0x00
+#define QOI_OP_DIFF	0x40
+#define QOI_OP_LUMA	0x80
+#define QOI_OP_RUN	0xc0
+#define QOI_OP_RGB	0xfe
+#define QOI_OP_RGBA	0xff
+#define QOI_MASK_2	0xc0
+#define QOI_MAX_RUN	62
+#define LOSSY_TOLERANCE	2
+
+#define QOI_HASH(P) (((P).r * 3 + (P).g * 5 + (P).b * 7 + (P).a * 11) & 63)
+
+typedef struct QOIPixelRec_ {
+	unsigned char b, g, r, a;
+} QOIPixelRec;
+
+static LCUI_BOOL QOIPixel_IsClose(const QOIPixelRec *a, const QOIPixelRec *b,
+				  int tolerance)
+{
+	return a->a == b->a && abs(a->r - b->r) <= tolerance &&
+	       abs(a->g - b->g) <= tolerance && abs(a->b - b->b) <= tolerance;
+}
+
+static int ThumbCodec_GetChannels(const LCUI_Graph *graph)
+{
+	switch (graph->color_type) {
+	case LCUI_COLOR_TYPE_RGB888:
+		return 3;
+	case LCUI_COLOR_TYPE_ARGB8888:
+		return 4;
+	default:
+		break;
+	}
+	return 0;
+}
+
+void *ThumbCodec_Encode(const LCUI_Graph *graph, size_t *size)
+{
+	int x, y, run = 0, tolerance = 0;
+	int channels = ThumbCodec_GetChannels(graph);
+	size_t len = 0, max_len, raw_len;
+	unsigned char *out;
+	const unsigned char *row, *p;
+	signed char vr, vg, vb, vg_r, vg_b;
+	QOIPixelRec px, prev = { 0, 0, 0, 255 }, index[64];
+
+	if (channels < 1 || graph->width < 1 || graph->height < 1) {
+		return NULL;
+	}
+	raw_len = (size_t)graph->width * graph->height * channels;
+	max_len = (size_t)graph->width * graph->height * (channels + 1);
+	out = malloc(max_len);
+	if (!out) {
+		return NULL;
+	}
+	if (channels == 3) {
+		tolerance = LOSSY_TOLERANCE;
+	}
+	memset(index, 0, sizeof(index));
+	px = prev;
+	for (y = 0; y < graph->height; ++y) {
+		row = graph->bytes + (size_t)y * graph->bytes_per_row;
+		for (x = 0, p = row; x < graph->width; ++x, p += channels) {
+			px.b = p[0];
+			px.g = p[1];
+			px.r = p[2];
+			if (channels == 4) {
+				px.a = p[3];
+			}
+			if (QOIPixel_IsClose(&px, &prev, tolerance)) {
+				if (++run == QOI_MAX_RUN) {
+					out[len++] = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				out[len++] = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+			if (memcmp(&index[QOI_HASH(px)], &px, sizeof(px)) == 0) {
+				out[len++] = QOI_OP_INDEX | QOI_HASH(px);
+				prev = px;
+				continue;
+			}
+			index[QOI_HASH(px)] = px;
+			if (px.a != prev.a) {
+				out[len++] = QOI_OP_RGBA;
+				out[len++] = px.r;
+				out[len++] = px.g;
+				out[len++] = px.b;
+				out[len++] = px.a;
+				prev = px;
+				continue;
+			}
+			vr = (signed char)(px.r - prev.r);
+			vg = (signed char)(px.g - prev.g);
+			vb = (signed char)(px.b - prev.b);
+			vg_r = vr - vg;
+			vg_b = vb - vg;
+			if (vr > -3 && vr < 2 && vg > -3 && vg < 2 &&
+			    vb > -3 && vb < 2) {
+				out[len++] = QOI_OP_DIFF | (vr + 2) << 4 |
+					     (vg + 2) << 2 | (vb + 2);
+			} else if (vg_r > -9 && vg_r < 8 && vg > -33 &&
+				   vg < 32 && vg_b > -9 && vg_b < 8) {
+				out[len++] = QOI_OP_LUMA | (vg + 32);
+				out[len++] = (vg_r + 8) << 4 | (vg_b + 8);
+			} else {
+				out[len++] = QOI_OP_RGB;
+				out[len++] = px.r;
+				out[len++] = px.g;
+				out[len++] = px.b;
+			}
+			prev = px;
+		}
+	}
+	if (run > 0) {
+		out[len++] = QOI_OP_RUN | (run - 1);
+	}
+	if (len >= raw_len) {
+		free(out);
+		return NULL;
+	}
+	*size = len;
+	return out;
+}
+
+int ThumbCodec_Decode(const void *data, size_t size, LCUI_Graph *graph)
+{
+	int x, y, b1, b2, vg, run = 0;
+	int channels = ThumbCodec_GetChannels(graph);
+	size_t pos = 0;
+	unsigned char *row, *p;
+	const unsigned char *in = data;
+	QOIPixelRec px = { 0, 0, 0, 255 }, index[64];
+
+	if (channels < 1) {
+		return -1;
+	}
+	memset(index, 0, sizeof(index));
+	for (y = 0; y < graph->height; ++y) {
+		row = graph->bytes + (size_t)y * graph->bytes_per_row;
+		for (x = 0, p = row; x < graph->width; ++x, p += channels) {
+			if (run > 0) {
+				--run;
+			} else {
+				if (pos >= size) {
+					return -1;
+				}
+				b1 = in[pos++];
+				if (b1 == QOI_OP_RGB) {
+					if (pos + 3 > size) {
+						return -1;
+					}
+					px.r = in[pos++];
+					px.g = in[pos++];
+					px.b = in[pos++];
+				} else if (b1 == QOI_OP_RGBA) {
+					if (pos + 4 > size) {
+						return -1;
+					}
+					px.r = in[pos++];
+					px.g = in[pos++];
+					px.b = in[pos++];
+					px.a = in[pos++];
+				} else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+					px = index[b1];
+				} else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+					px.r += ((b1 >> 4) & 0x03) - 2;
+					px.g += ((b1 >> 2) & 0x03) - 2;
+					px.b += (b1 & 0x03) - 2;
+				} else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+					if (pos >= size) {
+						return -1;
+					}
+					b2 = in[pos++];
+					vg = (b1 & 0x3f) - 32;
+					px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+					px.g += vg;
+					px.b += vg - 8 + (b2 & 0x0f);
+				} else {
+					run = b1 & 0x3f;
+				}
+				index[QOI_HASH(px)] = px;
+			}
+			p[0] = px.b;
+			p[1] = px.g;
+			p[2] = px.r;
+			if (channels == 4) {
+				p[3] = px.a;
+			}
+		}
+	}
+	return 0;
+}
@@ -39,23 +39,100 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <LCUI_Build.h>
 #include <LCUI/LCUI.h>
 #include <LCUI/graph.h>
 #include <LCUI/thread.h>
+#include <LCUI/util/dirent.h>
 #include "kvdb.h"
 #include "thumb_db.h"
+#include "thumb_codec.h"
+#include "thumb_pack.h"
+#include "resample.h"
+
+#ifdef _WIN32
+#define PATH_SEP '\\'
+#else
+#define PATH_SEP '/'
+#endif
 
 #define THUMB_MAX_SIZE 8553600
-#define ThumbDB_Unlock(TDB) LCUIMutex_Unlock( &(TDB)->mutex )
+/** 数据块头部的标识，旧版本的数据块开头是宽度，不会是这么大的值 */
+#define THUMB_BLOCK_MAGIC 0x4254434cu
+#define THUMB_BLOCK_VERSION 1
+/** 多级缩略图数据块的版本号 */
+#define THUMB_PYRAMID_VERSION 2
+/** 失败记录的版本号 */
+#define THUMB_FAILURE_VERSION 3
+/** 分片数量，也是同时打开的数据库的数量 */
+#define THUMB_DB_SHARDS 4
+#define THUMB_KEY_MAX_LEN 1024
+/** 访问记录的键的前缀，它排在所有缩略图的键之前 */
+#define THUMB_ACCESS_PREFIX '!'
+/** 内存中暂存的访问记录超过这个数量时立即写入数据库 */
+#define THUMB_ACCESS_MAX_PENDING 4096
+/** 淘汰缩略图时将总大小降至容量上限的百分比，留出余量避免频繁淘汰 */
+#define THUMB_EVICT_TARGET 90
+/** 打包文件的路径为 "<path>.pack.<源文件夹标识号>.<文件夹的哈希值>" */
+#define THUMB_PACK_SUFFIX ".pack."
 #define ASSERT(X) if(!(X)) { return -1; }
 
-typedef struct ThumbDBRec_ {
+/**
+ * 所有源文件夹的缩略图都存放在同一个数据库中，键为 "<源文件夹标识号>:<路径>"，
+ * 按键的哈希值分散到多个分片中，每个分片有各自的锁，互不阻塞。
+ * 存储引擎本身是线程安全的，所以读取只需共享锁定分片，多个线程可以同时读取；
+ * 写入也只需共享锁定，但同一时间只允许一个线程写入；遍历、删除和压缩等维护
+ * 操作需要独占分片。
+ * 注意 UnQLite 引擎会在每次访问句柄时加锁，同一分片的读取仍是逐个进行的，
+ * 只有 LevelDB 和内存映射数据库能让多个线程同时读取。
+ * 每个缩略图另有一条访问记录，键为 "!" 加上缩略图的键，用于按最近最少使用的
+ * 顺序淘汰缩略图。
+ * 无法生成缩略图的文件在缩略图的键下存放一条失败记录，它和缩略图一样会被
+ * 淘汰，生成成功后被缩略图覆盖。
+ * 文件夹内的缩略图还可以按显示顺序复制到一个打包文件中，滚动浏览时顺序读取，
+ * 打包文件只是副本，缩略图有变动时直接删除它。
+ */
+typedef struct ThumbDBShardRec_ {
 	kvdb_t *db;
+	int readers;			/**< 共享锁定分片的线程数量 */
+	int waiting;			/**< 等待独占分片的线程数量 */
+	LCUI_BOOL exclusive;		/**< 分片是否已被独占 */
+	LCUI_Mutex mutex;		/**< 保护以上三个成员 */
+	LCUI_Cond cond;
+	LCUI_Mutex write_mutex;		/**< 保证同一时间只有一个线程写入 */
+	LCUI_Mutex accesses_mutex;
+	Dict *accesses;		/**< 尚未写入数据库的访问记录 */
+} ThumbDBShardRec, *ThumbDBShard;
+
+typedef struct ThumbDBRec_ {
 	LCUI_BOOL closed;
-	LCUI_Mutex mutex;
+	char *path;
+	ThumbDBShardRec shards[THUMB_DB_SHARDS];
+	Dict *packs;		/**< 已打开的打包文件，以文件夹的键索引，值为 NULL
+				     表示没有打包文件 */
+	LCUI_Mutex packs_mutex;
 } ThumbDBRec;
 
+typedef struct ThumbDBAccessRec_ {
+	uint32_t time;		/**< 最近一次访问的时间 */
+	uint32_t size;		/**< 缩略图数据的大小 */
+} ThumbDBAccessRec, *ThumbDBAccess;
+
+/** 维护时收集的缩略图信息 */
+typedef struct ThumbDBEntryRec_ {
+	char *key;
+	size_t keylen;
+	size_t shard;
+	ThumbDBAccessRec access;
+	LCUI_BOOL has_thumb;	/**< 缩略图是否存在，不存在则只需删除访问记录 */
+	LCUI_BOOL has_access;
+	LCUI_BOOL evicted;
+} ThumbDBEntryRec, *ThumbDBEntry;
+
+/** 旧版本的数据块，头部之后是未压缩的像素数据 */
 typedef struct ThumbDataBlockRec_ {
 	uint32_t width;
 	uint32_t height;
@@ -66,104 +143,1651 @@ typedef struct ThumbDataBlockRec_ {
 	uint32_t modify_time;
 } ThumbDataBlockRec, *ThumbDataBlock;
 
-ThumbDB ThumbDB_Open(const char *filepath)
+/** 数据块的头部，之后是按 encoding 编码的像素数据 */
+typedef struct ThumbBlockHeaderRec_ {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t encoding;
+	uint32_t width;
+	uint32_t height;
+	uint32_t origin_width;
+	uint32_t origin_height;
+	uint32_t modify_time;
+	int32_t color_type;
+	uint32_t data_size;	/**< 编码后的像素数据的大小 */
+} ThumbBlockHeaderRec, *ThumbBlockHeader;
+
+/**
+ * 多级缩略图数据块的头部
+ * 之后是按尺寸升序排列的各级缩略图的信息，然后是各级编码后的像素数据
+ */
+typedef struct ThumbPyramidHeaderRec_ {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t levels;	/**< 级数 */
+	uint32_t origin_width;
+	uint32_t origin_height;
+	uint32_t modify_time;
+	int32_t color_type;
+} ThumbPyramidHeaderRec, *ThumbPyramidHeader;
+
+/** 失败记录，文件的修改时间与它不同时失效 */
+typedef struct ThumbFailureRec_ {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t modify_time;
+} ThumbFailureRec;
+
+typedef struct ThumbLevelRec_ {
+	uint32_t width;
+	uint32_t height;
+	uint32_t encoding;
+	uint32_t offset;	/**< 像素数据在数据块中的偏移量 */
+	uint32_t data_size;
+} ThumbLevelRec, *ThumbLevel;
+
+/** 各级缩略图的尺寸，以最大一级的百分比表示 */
+static const int thumb_level_scales[THUMB_DB_LEVELS] = { 50, 75, 100 };
+
+static void ThumbDB_GetShardPath(char *buf, const char *path, int i)
+{
+	snprintf(buf, THUMB_KEY_MAX_LEN, "%s.%d", path, i);
+}
+
+/** 生成键，返回键的长度，路径过长时返回 0 */
+static size_t ThumbDB_GetKey(char *key, int dir_id, const char *filepath)
 {
+	int len;
+
+	len = snprintf(key, THUMB_KEY_MAX_LEN, "%d:%s", dir_id, filepath);
+	if (len < 0 || len >= THUMB_KEY_MAX_LEN) {
+		return 0;
+	}
+	return (size_t)len;
+}
+
+static size_t ThumbDB_GetShardIndex(const char *key, size_t keylen)
+{
+	return ThumbPack_Hash(0, key, keylen) % THUMB_DB_SHARDS;
+}
+
+/**
+ * 获取缩略图所在文件夹的键，即 "<源文件夹标识号>:<文件夹路径>"
+ * @returns 键的长度
+ */
+static size_t ThumbDB_GetFolderKey(char *buf, const char *key, size_t keylen)
+{
+	size_t len = keylen;
+	const char *p;
+
+	while (len > 0 && key[len - 1] != PATH_SEP) {
+		--len;
+	}
+	if (len > 0) {
+		len -= 1;
+	} else {
+		p = memchr(key, ':', keylen);
+		len = p ? (size_t)(p - key) + 1 : 0;
+	}
+	memcpy(buf, key, len);
+	buf[len] = 0;
+	return len;
+}
+
+static void ThumbDB_GetPackPath(char *buf, const char *path,
+				const char *folder_key)
+{
+	uint32_t hash;
+
+	hash = ThumbPack_Hash(0, folder_key, strlen(folder_key));
+	snprintf(buf, THUMB_KEY_MAX_LEN, "%s%s%d.%08x", path,
+		 THUMB_PACK_SUFFIX, atoi(folder_key), hash);
+}
+
+/**
+ * 遍历数据库的打包文件
+ * @param[in] dir_id 源文件夹的标识号，小于 0 时遍历所有打包文件
+ */
+static void ThumbDB_EachPackFile(const char *path, int dir_id,
+				 void (*func)(const char*, void*), void *arg)
+{
+	size_t len, prefix_len;
+	const char *name;
+	char *filename;
+	char dirpath[THUMB_KEY_MAX_LEN];
+	char prefix[THUMB_KEY_MAX_LEN];
+	char filepath[THUMB_KEY_MAX_LEN];
+	LCUI_Dir dir;
+	LCUI_DirEntry *entry;
+
+	name = strrchr(path, PATH_SEP);
+	name = name ? name + 1 : path;
+	len = (size_t)(name - path);
+	if (len >= THUMB_KEY_MAX_LEN) {
+		return;
+	}
+	memcpy(filepath, path, len);
+	if (len > 0) {
+		memcpy(dirpath, path, len - 1);
+		dirpath[len - 1] = 0;
+	} else {
+		strcpy(dirpath, ".");
+	}
+	if (dir_id >= 0) {
+		snprintf(prefix, sizeof(prefix), "%s%s%d.", name,
+			 THUMB_PACK_SUFFIX, dir_id);
+	} else {
+		snprintf(prefix, sizeof(prefix), "%s%s", name,
+			 THUMB_PACK_SUFFIX);
+	}
+	prefix_len = strlen(prefix);
+	if (LCUI_OpenDirA(dirpath, &dir) != 0) {
+		return;
+	}
+	while ((entry = LCUI_ReadDirA(&dir))) {
+		filename = LCUI_GetFileNameA(entry);
+		if (!LCUI_FileIsRegular(entry) ||
+		    strncmp(filename, prefix, prefix_len) != 0) {
+			continue;
+		}
+		snprintf(filepath + len, sizeof(filepath) - len, "%s",
+			 filename);
+		func(filepath, arg);
+	}
+	LCUI_CloseDir(&dir);
+}
+
+static void OnRemovePackFile(const char *path, void *arg)
+{
+	remove(path);
+}
+
+static void OnCountPackFileSize(const char *path, void *arg)
+{
+	struct stat buf;
+
+	if (stat(path, &buf) == 0) {
+		*(int64_t*)arg += buf.st_size;
+	}
+}
+
+static void OnDestroyPack(void *privdata, void *data)
+{
+	if (data) {
+		ThumbPack_Close(data);
+	}
+}
+
+/** 获取文件夹的打包文件，调用前需锁定打包文件表 */
+static ThumbPack ThumbDB_GetPack(ThumbDB tdb, const char *folder_key)
+{
+	DictEntry *entry;
+	ThumbPack pack;
+	char path[THUMB_KEY_MAX_LEN];
+
+	entry = Dict_Find(tdb->packs, folder_key);
+	if (entry) {
+		return DictEntry_GetVal(entry);
+	}
+	ThumbDB_GetPackPath(path, tdb->path, folder_key);
+	pack = ThumbPack_Open(path);
+	Dict_Add(tdb->packs, (void*)folder_key, pack);
+	return pack;
+}
+
+/** 删除缩略图所在文件夹的打包文件，它已经与数据库不一致 */
+static void ThumbDB_ForgetPack(ThumbDB tdb, const char *key, size_t keylen)
+{
+	DictEntry *entry;
+	char path[THUMB_KEY_MAX_LEN];
+	char folder_key[THUMB_KEY_MAX_LEN];
+
+	ThumbDB_GetFolderKey(folder_key, key, keylen);
+	LCUIMutex_Lock(&tdb->packs_mutex);
+	entry = Dict_Find(tdb->packs, folder_key);
+	if (!entry || DictEntry_GetVal(entry)) {
+		Dict_Delete(tdb->packs, folder_key);
+		ThumbDB_GetPackPath(path, tdb->path, folder_key);
+		remove(path);
+		Dict_Add(tdb->packs, folder_key, NULL);
+	}
+	LCUIMutex_Unlock(&tdb->packs_mutex);
+}
+
+/**
+ * 删除打包文件
+ * @param[in] dir_id 源文件夹的标识号，小于 0 时删除所有打包文件
+ */
+static void ThumbDB_DropPacks(ThumbDB tdb, int dir_id)
+{
+	size_t len = 0;
+	const char *key;
+	char prefix[32] = "";
+	DictEntry *entry;
+	DictIterator *iter;
+
+	if (dir_id >= 0) {
+		len = (size_t)snprintf(prefix, sizeof(prefix), "%d:", dir_id);
+	}
+	LCUIMutex_Lock(&tdb->packs_mutex);
+	iter = Dict_GetSafeIterator(tdb->packs);
+	while ((entry = Dict_Next(iter))) {
+		key = DictEntry_GetKey(entry);
+		if (strncmp(key, prefix, len) == 0) {
+			Dict_Delete(tdb->packs, key);
+		}
+	}
+	Dict_ReleaseIterator(iter);
+	ThumbDB_EachPackFile(tdb->path, dir_id, OnRemovePackFile, NULL);
+	LCUIMutex_Unlock(&tdb->packs_mutex);
+}
+
+static void ThumbDB_UnlockShared(ThumbDBShard shard)
+{
+	LCUIMutex_Lock(&shard->mutex);
+	shard->readers -= 1;
+	if (shard->readers == 0) {
+		LCUICond_Broadcast(&shard->cond);
+	}
+	LCUIMutex_Unlock(&shard->mutex);
+}
+
+/**
+ * 共享锁定分片，用于读取和写入
+ * 有线程在等待独占分片时不再接受新的共享锁定，以免维护操作一直等待
+ */
+static int ThumbDB_LockShared(ThumbDB tdb, ThumbDBShard shard)
+{
+	if (tdb->closed) {
+		return -1;
+	}
+	LCUIMutex_Lock(&shard->mutex);
+	while (shard->exclusive || shard->waiting > 0) {
+		LCUICond_Wait(&shard->cond, &shard->mutex);
+	}
+	shard->readers += 1;
+	LCUIMutex_Unlock(&shard->mutex);
+	if (tdb->closed) {
+		ThumbDB_UnlockShared(shard);
+		return -1;
+	}
+	return 0;
+}
+
+static void ThumbDB_UnlockExclusive(ThumbDBShard shard)
+{
+	LCUIMutex_Lock(&shard->mutex);
+	shard->exclusive = FALSE;
+	LCUICond_Broadcast(&shard->cond);
+	LCUIMutex_Unlock(&shard->mutex);
+}
+
+/** 独占分片，用于遍历、删除和压缩等需要数据库保持不变的操作 */
+static int ThumbDB_LockExclusive(ThumbDB tdb, ThumbDBShard shard)
+{
+	LCUIMutex_Lock(&shard->mutex);
+	shard->waiting += 1;
+	while (shard->exclusive || shard->readers > 0) {
+		LCUICond_Wait(&shard->cond, &shard->mutex);
+	}
+	shard->waiting -= 1;
+	shard->exclusive = TRUE;
+	LCUIMutex_Unlock(&shard->mutex);
+	if (tdb->closed) {
+		ThumbDB_UnlockExclusive(shard);
+		return -1;
+	}
+	return 0;
+}
+
+static void OnDestroyAccess(void *privdata, void *data)
+{
+	free(data);
+}
+
+/**
+ * 在内存中记录缩略图的访问时间，调用前需锁定分片
+ * @param[in] size 缩略图数据的大小，为 0 时表示未知，维护时再读取
+ */
+static void ThumbDB_Touch(ThumbDBShard shard, const char *key, size_t size)
+{
+	ThumbDBAccess access;
+
+	LCUIMutex_Lock(&shard->accesses_mutex);
+	access = Dict_FetchValue(shard->accesses, key);
+	if (!access) {
+		access = malloc(sizeof(ThumbDBAccessRec));
+		if (!access) {
+			LCUIMutex_Unlock(&shard->accesses_mutex);
+			return;
+		}
+		access->size = 0;
+		Dict_Add(shard->accesses, (void*)key, access);
+	}
+	access->time = (uint32_t)time(NULL);
+	if (size > 0) {
+		access->size = (uint32_t)size;
+	}
+	LCUIMutex_Unlock(&shard->accesses_mutex);
+}
+
+/** 将暂存的访问记录写入数据库，调用前需锁定分片 */
+static int ThumbDB_FlushAccesses(ThumbDBShard shard)
+{
+	int ret;
+	size_t keylen;
+	const char *key;
+	Dict *accesses;
+	DictEntry *entry;
+	DictIterator *iter;
+	kvdb_batch_t *batch;
+	char buf[THUMB_KEY_MAX_LEN + 1];
+
+	/* 换上新的字典后再写入，写入期间其它线程仍可以记录访问时间 */
+	LCUIMutex_Lock(&shard->accesses_mutex);
+	accesses = shard->accesses;
+	if (Dict_Size(accesses) < 1) {
+		LCUIMutex_Unlock(&shard->accesses_mutex);
+		return 0;
+	}
+	shard->accesses = StrDict_Create(NULL, OnDestroyAccess);
+	LCUIMutex_Unlock(&shard->accesses_mutex);
+	LCUIMutex_Lock(&shard->write_mutex);
+	batch = kvdb_batch_begin(shard->db);
+	if (!batch) {
+		LCUIMutex_Unlock(&shard->write_mutex);
+		StrDict_Release(accesses);
+		return -1;
+	}
+	buf[0] = THUMB_ACCESS_PREFIX;
+	iter = Dict_GetIterator(accesses);
+	while ((entry = Dict_Next(iter))) {
+		key = DictEntry_GetKey(entry);
+		keylen = strlen(key);
+		memcpy(buf + 1, key, keylen);
+		kvdb_batch_put(batch, buf, keylen + 1, DictEntry_GetVal(entry),
+			       sizeof(ThumbDBAccessRec));
+	}
+	Dict_ReleaseIterator(iter);
+	ret = kvdb_batch_commit(batch);
+	LCUIMutex_Unlock(&shard->write_mutex);
+	StrDict_Release(accesses);
+	return ret;
+}
+
+/** 暂存的访问记录过多时将它们写入数据库，调用前需锁定分片 */
+static void ThumbDB_CheckAccesses(ThumbDBShard shard)
+{
+	size_t n;
+
+	LCUIMutex_Lock(&shard->accesses_mutex);
+	n = Dict_Size(shard->accesses);
+	LCUIMutex_Unlock(&shard->accesses_mutex);
+	if (n > THUMB_ACCESS_MAX_PENDING) {
+		ThumbDB_FlushAccesses(shard);
+	}
+}
+
+static void ThumbDBShard_Init(ThumbDBShard shard)
+{
+	shard->readers = 0;
+	shard->waiting = 0;
+	shard->exclusive = FALSE;
+	LCUIMutex_Init(&shard->mutex);
+	LCUICond_Init(&shard->cond);
+	LCUIMutex_Init(&shard->write_mutex);
+	LCUIMutex_Init(&shard->accesses_mutex);
+	shard->accesses = StrDict_Create(NULL, OnDestroyAccess);
+}
+
+static void ThumbDBShard_Destroy(ThumbDBShard shard)
+{
+	if (shard->db) {
+		kvdb_close(shard->db);
+	}
+	StrDict_Release(shard->accesses);
+	LCUIMutex_Destroy(&shard->accesses_mutex);
+	LCUIMutex_Destroy(&shard->write_mutex);
+	LCUICond_Destroy(&shard->cond);
+	LCUIMutex_Destroy(&shard->mutex);
+}
+
+ThumbDB ThumbDB_Open(const char *path)
+{
+	int i;
 	ThumbDB tdb;
-	
+	char shard_path[THUMB_KEY_MAX_LEN];
+
 	tdb = malloc(sizeof(ThumbDBRec));
-	tdb->db = kvdb_open(filepath);
-	if (!tdb->db) {
-		printf("[thumbdb] cannot open db: %s\n", filepath);
+	if (!tdb) {
+		return NULL;
+	}
+	tdb->path = strdup(path);
+	tdb->packs = StrDict_Create(NULL, OnDestroyPack);
+	if (!tdb->path || !tdb->packs) {
+		if (tdb->packs) {
+			StrDict_Release(tdb->packs);
+		}
+		free(tdb->path);
 		free(tdb);
 		return NULL;
 	}
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		ThumbDB_GetShardPath(shard_path, path, i);
+		tdb->shards[i].db = kvdb_open(shard_path);
+		if (!tdb->shards[i].db) {
+			printf("[thumbdb] cannot open db: %s\n", shard_path);
+			while (--i >= 0) {
+				ThumbDBShard_Destroy(&tdb->shards[i]);
+			}
+			StrDict_Release(tdb->packs);
+			free(tdb->path);
+			free(tdb);
+			return NULL;
+		}
+		/* 缩略图丢失后可以重新生成，无需每次保存都等待同步到磁盘 */
+		kvdb_set_durability(tdb->shards[i].db, KVDB_DURABILITY_GROUP);
+		ThumbDBShard_Init(&tdb->shards[i]);
+	}
+	LCUIMutex_Init(&tdb->packs_mutex);
 	tdb->closed = FALSE;
-	LCUIMutex_Init(&tdb->mutex);
 	return tdb;
 }
 
 void ThumbDB_Close(ThumbDB tdb)
 {
+	int i;
+	ThumbDBShard shard;
+
+	/* 等待正在读写的线程都退出后再关闭 */
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		shard = &tdb->shards[i];
+		ThumbDB_LockExclusive(tdb, shard);
+		ThumbDB_FlushAccesses(shard);
+	}
 	tdb->closed = TRUE;
-	LCUIMutex_Lock(&tdb->mutex);
-	kvdb_close(tdb->db);
-	LCUIMutex_Unlock(&tdb->mutex);
-	LCUIMutex_Destroy(&tdb->mutex);
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		shard = &tdb->shards[i];
+		ThumbDB_UnlockExclusive(shard);
+		ThumbDBShard_Destroy(shard);
+	}
+	LCUIMutex_Lock(&tdb->packs_mutex);
+	StrDict_Release(tdb->packs);
+	LCUIMutex_Unlock(&tdb->packs_mutex);
+	LCUIMutex_Destroy(&tdb->packs_mutex);
+	free(tdb->path);
 	free(tdb);
 }
 
-int ThumbDB_GetSize(const char *filepath, int64_t *size)
+int ThumbDB_GetSize(const char *path, int64_t *size)
+{
+	int i, ret = -1;
+	int64_t shard_size;
+	char shard_path[THUMB_KEY_MAX_LEN];
+
+	*size = 0;
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		ThumbDB_GetShardPath(shard_path, path, i);
+		if (kvdb_get_db_size(shard_path, &shard_size) == 0) {
+			*size += shard_size;
+			ret = 0;
+		}
+	}
+	if (ret == 0) {
+		ThumbDB_EachPackFile(path, -1, OnCountPackFileSize, size);
+	}
+	return ret;
+}
+
+int ThumbDB_DestroyDB(const char *path)
+{
+	int i, ret = 0;
+	char shard_path[THUMB_KEY_MAX_LEN];
+
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		ThumbDB_GetShardPath(shard_path, path, i);
+		if (kvdb_destroy_db(shard_path) != 0) {
+			ret = -1;
+		}
+	}
+	ThumbDB_EachPackFile(path, -1, OnRemovePackFile, NULL);
+	return ret;
+}
+
+int ThumbDB_Clear(ThumbDB tdb)
 {
-	return kvdb_get_db_size(filepath, size);
+	int i, ret = 0;
+	ThumbDBShard shard;
+	char shard_path[THUMB_KEY_MAX_LEN];
+
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		shard = &tdb->shards[i];
+		if (ThumbDB_LockExclusive(tdb, shard) != 0) {
+			ret = -1;
+			continue;
+		}
+		LCUIMutex_Lock(&shard->accesses_mutex);
+		StrDict_Release(shard->accesses);
+		shard->accesses = StrDict_Create(NULL, OnDestroyAccess);
+		LCUIMutex_Unlock(&shard->accesses_mutex);
+		/* 删除文件才能释放磁盘空间，独占期间没有其它线程在使用句柄 */
+		ThumbDB_GetShardPath(shard_path, tdb->path, i);
+		kvdb_close(shard->db);
+		kvdb_destroy_db(shard_path);
+		shard->db = kvdb_open(shard_path);
+		if (shard->db) {
+			kvdb_set_durability(shard->db,
+					    KVDB_DURABILITY_GROUP);
+		} else {
+			/* 无法重新打开时停用整个数据库，之后的读写都会失败 */
+			printf("[thumbdb] cannot open db: %s\n", shard_path);
+			tdb->closed = TRUE;
+			ret = -1;
+		}
+		ThumbDB_UnlockExclusive(shard);
+	}
+	ThumbDB_DropPacks(tdb, -1);
+	return ret;
 }
 
-int ThumbDB_DestroyDB(const char *filepath)
+int ThumbDB_DestroyLegacyDB(const char *filepath)
 {
+	int64_t size;
+
+	if (kvdb_get_db_size(filepath, &size) != 0) {
+		return 0;
+	}
 	return kvdb_destroy_db(filepath);
 }
 
-static int ThumbDB_Lock(ThumbDB tdb)
+/** 读取旧版本的数据块 */
+static int ThumbDB_ReadLegacyBlock(const ThumbDataBlockRec *block,
+				   size_t size, ThumbData data)
 {
-	if (tdb->closed) {
+	if (size < sizeof(ThumbDataBlockRec) ||
+	    block->mem_size > size - sizeof(ThumbDataBlockRec)) {
 		return -1;
 	}
-	LCUIMutex_Lock(&tdb->mutex);
-	if (tdb->closed) {
+	data->graph.color_type = block->color_type;
+	if (Graph_Create(&data->graph, block->width, block->height) != 0) {
+		return -1;
+	}
+	if (data->graph.mem_size < block->mem_size) {
+		Graph_Free(&data->graph);
 		return -1;
 	}
+	memcpy(data->graph.bytes, block + 1, block->mem_size);
+	data->modify_time = block->modify_time;
+	data->origin_width = block->origin_width;
+	data->origin_height = block->origin_height;
 	return 0;
 }
 
-int ThumbDB_Load(ThumbDB tdb, const char *filepath, ThumbData data)
+static LCUI_BOOL ThumbDB_IsFailureBlock(const void *block, size_t size)
 {
-	size_t size;
-	size_t keylen;
-	uchar_t *bytes;
-	ThumbDataBlock block;
+	const ThumbFailureRec *failure = block;
+
+	return block && size >= sizeof(ThumbFailureRec) &&
+	       failure->magic == THUMB_BLOCK_MAGIC &&
+	       failure->version == THUMB_FAILURE_VERSION;
+}
+
+/**
+ * 解码数据块，在调用者的线程中进行，无需锁定数据库
+ * @returns 数据块是失败记录时返回 THUMB_DB_FAILURE，data 中只有修改时间有效
+ */
+static int ThumbDB_ReadBlock(const void *block, size_t size, ThumbData data)
+{
+	int ret = -1;
+	const ThumbBlockHeaderRec *header = block;
+
+	Graph_Init(&data->graph);
+	if (!block || size < sizeof(uint32_t)) {
+		return -1;
+	}
+	if (header->magic != THUMB_BLOCK_MAGIC) {
+		return ThumbDB_ReadLegacyBlock(block, size, data);
+	}
+	if (ThumbDB_IsFailureBlock(block, size)) {
+		data->modify_time = ((const ThumbFailureRec*)block)->modify_time;
+		data->origin_width = 0;
+		data->origin_height = 0;
+		return THUMB_DB_FAILURE;
+	}
+	if (size < sizeof(ThumbBlockHeaderRec) ||
+	    header->version != THUMB_BLOCK_VERSION ||
+	    header->data_size > size - sizeof(ThumbBlockHeaderRec)) {
+		return -1;
+	}
+	data->graph.color_type = header->color_type;
+	if (Graph_Create(&data->graph, header->width, header->height) != 0) {
+		return -1;
+	}
+	switch (header->encoding) {
+	case THUMB_ENCODING_RAW:
+		if (header->data_size <= data->graph.mem_size) {
+			memcpy(data->graph.bytes, header + 1,
+			       header->data_size);
+			ret = 0;
+		}
+		break;
+	case THUMB_ENCODING_QOI:
+		ret = ThumbCodec_Decode(header + 1, header->data_size,
+					&data->graph);
+		break;
+	default:
+		break;
+	}
+	if (ret != 0) {
+		Graph_Free(&data->graph);
+		return -1;
+	}
+	data->modify_time = header->modify_time;
+	data->origin_width = header->origin_width;
+	data->origin_height = header->origin_height;
+	return 0;
+}
+
+/** 从多级缩略图中选出不小于指定尺寸的最小一级，都不够大时选最大一级 */
+static const ThumbLevelRec *ThumbDB_SelectLevel(const void *block, size_t size,
+						unsigned width,
+						unsigned height)
+{
+	uint16_t i;
+	const ThumbLevelRec *levels;
+	const ThumbPyramidHeaderRec *header = block;
+
+	if (size < sizeof(ThumbPyramidHeaderRec) || header->levels < 1 ||
+	    header->levels > (size - sizeof(ThumbPyramidHeaderRec)) /
+				 sizeof(ThumbLevelRec)) {
+		return NULL;
+	}
+	levels = (const ThumbLevelRec*)(header + 1);
+	for (i = 0; i < header->levels; ++i) {
+		if (levels[i].width >= width && levels[i].height >= height) {
+			break;
+		}
+	}
+	if (i >= header->levels) {
+		i = header->levels - 1;
+	}
+	if (levels[i].offset > size ||
+	    levels[i].data_size > size - levels[i].offset) {
+		return NULL;
+	}
+	return &levels[i];
+}
+
+/**
+ * 复制数据块，以便在解锁数据库后再解码
+ * 对于多级缩略图，只复制选中的那一级，并转换成单级的数据块
+ * @param[in] width 需要的最小宽度，为 0 时不限制
+ * @param[in] height 需要的最小高度，为 0 时不限制
+ * @param[in,out] size 数据块的大小
+ */
+static void *ThumbDB_CopyBlock(const void *block, size_t *size,
+			       unsigned width, unsigned height)
+{
+	void *copy;
+	ThumbBlockHeader header;
+	const ThumbLevelRec *level;
+	const ThumbPyramidHeaderRec *pyramid = block;
 
-	ASSERT(ThumbDB_Lock(tdb) == 0);
-	keylen = strlen(filepath);
-	block = kvdb_get(tdb->db, filepath, keylen, &size);
 	if (!block) {
-		ThumbDB_Unlock(tdb);
+		return NULL;
+	}
+	if (*size < sizeof(ThumbPyramidHeaderRec) ||
+	    pyramid->magic != THUMB_BLOCK_MAGIC ||
+	    pyramid->version != THUMB_PYRAMID_VERSION) {
+		copy = malloc(*size);
+		if (copy) {
+			memcpy(copy, block, *size);
+		}
+		return copy;
+	}
+	level = ThumbDB_SelectLevel(block, *size, width, height);
+	if (!level) {
+		return NULL;
+	}
+	header = malloc(sizeof(ThumbBlockHeaderRec) + level->data_size);
+	if (!header) {
+		return NULL;
+	}
+	header->magic = THUMB_BLOCK_MAGIC;
+	header->version = THUMB_BLOCK_VERSION;
+	header->encoding = (uint16_t)level->encoding;
+	header->width = level->width;
+	header->height = level->height;
+	header->origin_width = pyramid->origin_width;
+	header->origin_height = pyramid->origin_height;
+	header->modify_time = pyramid->modify_time;
+	header->color_type = pyramid->color_type;
+	header->data_size = level->data_size;
+	memcpy(header + 1, (const char*)block + level->offset,
+	       level->data_size);
+	*size = sizeof(ThumbBlockHeaderRec) + level->data_size;
+	return header;
+}
+
+/** 判断打包的缩略图是否够大，不够大时需要到数据库中找更大的一级 */
+static LCUI_BOOL ThumbDB_BlockFits(const void *block, size_t size,
+				   unsigned width, unsigned height)
+{
+	const ThumbBlockHeaderRec *header = block;
+
+	if (size < sizeof(ThumbBlockHeaderRec) ||
+	    header->magic != THUMB_BLOCK_MAGIC) {
+		return FALSE;
+	}
+	if (header->width >= width && header->height >= height) {
+		return TRUE;
+	}
+	/* 原图本身就这么小，数据库中也不会有更大的 */
+	return header->width >= header->origin_width &&
+	       header->height >= header->origin_height;
+}
+
+/**
+ * 从打包文件中复制缩略图数据
+ * 命中的缩略图的 lens[i] 会被置为 0，表示无需再到分片中查找
+ * @returns 命中的数量
+ */
+static size_t ThumbDB_CopyFromPacks(ThumbDB tdb, size_t count,
+				    const char **keys, size_t *lens,
+				    unsigned width, unsigned height,
+				    void **copies, size_t *sizes)
+{
+	size_t i, n = 0;
+	const void *block;
+	ThumbPack pack = NULL;
+	char folder_key[THUMB_KEY_MAX_LEN];
+	char prev_folder_key[THUMB_KEY_MAX_LEN] = "";
+
+	LCUIMutex_Lock(&tdb->packs_mutex);
+	for (i = 0; i < count; ++i) {
+		copies[i] = NULL;
+		if (lens[i] < 1) {
+			continue;
+		}
+		ThumbDB_GetFolderKey(folder_key, keys[i], lens[i]);
+		if (i == 0 || strcmp(folder_key, prev_folder_key) != 0) {
+			pack = ThumbDB_GetPack(tdb, folder_key);
+			strcpy(prev_folder_key, folder_key);
+		}
+		if (!pack) {
+			continue;
+		}
+		block = ThumbPack_Find(pack, keys[i], lens[i], &sizes[i]);
+		if (!block ||
+		    !ThumbDB_BlockFits(block, sizes[i], width, height)) {
+			continue;
+		}
+		copies[i] = malloc(sizes[i]);
+		if (copies[i]) {
+			memcpy(copies[i], block, sizes[i]);
+			lens[i] = 0;
+			++n;
+		}
+	}
+	LCUIMutex_Unlock(&tdb->packs_mutex);
+	return n;
+}
+
+int ThumbDB_Load(ThumbDB tdb, int dir_id, const char *filepath,
+		 unsigned width, unsigned height, ThumbData data)
+{
+	int ret;
+	void *block;
+	const void *view;
+	size_t size, block_size, keylen;
+	kvdb_txn_t *txn;
+	ThumbDBShard shard;
+	char key[THUMB_KEY_MAX_LEN];
+
+	keylen = ThumbDB_GetKey(key, dir_id, filepath);
+	if (keylen < 1) {
 		return -1;
 	}
-	bytes = (uchar_t*)block + sizeof(ThumbDataBlockRec);
-	ThumbDB_Unlock(tdb);
-	Graph_Init(&data->graph);
-	data->graph.color_type = block->color_type;
-	Graph_Create(&data->graph, block->width, block->height);
-	memcpy(data->graph.bytes, bytes, block->mem_size);
-	data->modify_time = block->modify_time;
-	data->origin_width = block->origin_width;
-	data->origin_height = block->origin_height;
+	shard = &tdb->shards[ThumbDB_GetShardIndex(key, keylen)];
+	ASSERT(ThumbDB_LockShared(tdb, shard) == 0);
+	txn = kvdb_txn_begin(shard->db);
+	if (!txn) {
+		ThumbDB_UnlockShared(shard);
+		return -1;
+	}
+	view = kvdb_get_view(txn, key, keylen, &size);
+	block_size = size;
+	block = ThumbDB_CopyBlock(view, &block_size, width, height);
+	kvdb_txn_end(txn);
+	if (block) {
+		ThumbDB_Touch(shard, key, size);
+	}
+	ThumbDB_UnlockShared(shard);
+	ret = ThumbDB_ReadBlock(block, block_size, data);
 	free(block);
-	return 0;
+	return ret;
+}
+
+/** 在一个分片的一次读取事务中载入多个缩略图 */
+static size_t ThumbDB_LoadFromShard(ThumbDB tdb, ThumbDBShard shard,
+				    size_t count, const char **keys,
+				    const size_t *lens, unsigned width,
+				    unsigned height, ThumbDataRec **data)
+{
+	size_t i, n = 0;
+	size_t *sizes;
+	const void **blocks;
+	void **copies;
+	kvdb_txn_t *txn;
+
+	if (ThumbDB_LockShared(tdb, shard) != 0) {
+		return 0;
+	}
+	sizes = malloc(sizeof(size_t) * count);
+	blocks = malloc(sizeof(void*) * count);
+	copies = calloc(count, sizeof(void*));
+	txn = kvdb_txn_begin(shard->db);
+	if (sizes && blocks && copies && txn) {
+		kvdb_multi_get(txn, count, keys, lens, blocks, sizes);
+		for (i = 0; i < count; ++i) {
+			if (!blocks[i]) {
+				continue;
+			}
+			ThumbDB_Touch(shard, keys[i], sizes[i]);
+			copies[i] = ThumbDB_CopyBlock(blocks[i], &sizes[i],
+						      width, height);
+		}
+	}
+	if (txn) {
+		kvdb_txn_end(txn);
+	}
+	ThumbDB_CheckAccesses(shard);
+	ThumbDB_UnlockShared(shard);
+	/* 数据块已压缩，复制的开销很小，解码放在解锁之后，不阻塞其它线程 */
+	for (i = 0; copies && i < count; ++i) {
+		if (copies[i] && ThumbDB_ReadBlock(copies[i], sizes[i],
+						   data[i]) == 0) {
+			++n;
+		}
+		free(copies[i]);
+	}
+	free(copies);
+	free(blocks);
+	free(sizes);
+	return n;
+}
+
+/** 载入打包文件中的缩略图，并记录它们的访问时间 */
+static size_t ThumbDB_LoadFromPacks(ThumbDB tdb, size_t count,
+				    const char **keys, size_t *lens,
+				    const size_t *shard_ids, unsigned width,
+				    unsigned height, ThumbDataRec *data)
+{
+	size_t i, j, n = 0;
+	size_t *sizes;
+	void **copies;
+	ThumbDBShard shard;
+
+	sizes = malloc(sizeof(size_t) * count);
+	copies = malloc(sizeof(void*) * count);
+	if (!sizes || !copies ||
+	    ThumbDB_CopyFromPacks(tdb, count, keys, lens, width, height,
+				  copies, sizes) < 1) {
+		free(copies);
+		free(sizes);
+		return 0;
+	}
+	for (j = 0; j < THUMB_DB_SHARDS; ++j) {
+		shard = &tdb->shards[j];
+		for (i = 0; i < count; ++i) {
+			if (shard_ids[i] == j && copies[i]) {
+				break;
+			}
+		}
+		if (i >= count || ThumbDB_LockShared(tdb, shard) != 0) {
+			continue;
+		}
+		/* 打包的只是其中一级，大小以数据库中的为准 */
+		for (; i < count; ++i) {
+			if (shard_ids[i] == j && copies[i]) {
+				ThumbDB_Touch(shard, keys[i], 0);
+			}
+		}
+		ThumbDB_UnlockShared(shard);
+	}
+	for (i = 0; i < count; ++i) {
+		if (copies[i] && ThumbDB_ReadBlock(copies[i], sizes[i],
+						   &data[i]) == 0) {
+			++n;
+		}
+		free(copies[i]);
+	}
+	free(copies);
+	free(sizes);
+	return n;
+}
+
+size_t ThumbDB_LoadMany(ThumbDB tdb, int dir_id, unsigned width,
+			unsigned height, size_t count, const char **filepaths,
+			ThumbDataRec *data)
+{
+	size_t i, j, n = 0, total = 0;
+	size_t *lens, *shard_lens, *shard_ids;
+	char *buffer;
+	const char **keys;
+	ThumbDataRec **items;
+
+	for (i = 0; i < count; ++i) {
+		Graph_Init(&data[i].graph);
+		data[i].modify_time = 0;
+	}
+	if (count < 1) {
+		return 0;
+	}
+	lens = malloc(sizeof(size_t) * count);
+	shard_lens = malloc(sizeof(size_t) * count);
+	shard_ids = malloc(sizeof(size_t) * count);
+	keys = malloc(sizeof(char*) * count);
+	items = malloc(sizeof(ThumbDataRec*) * count);
+	buffer = malloc(THUMB_KEY_MAX_LEN * count);
+	if (!lens || !shard_lens || !shard_ids || !keys || !items || !buffer) {
+		goto exit;
+	}
+	for (i = 0; i < count; ++i) {
+		lens[i] = ThumbDB_GetKey(buffer + i * THUMB_KEY_MAX_LEN,
+					 dir_id, filepaths[i]);
+		shard_ids[i] = ThumbDB_GetShardIndex(
+		    buffer + i * THUMB_KEY_MAX_LEN, lens[i]);
+		keys[i] = buffer + i * THUMB_KEY_MAX_LEN;
+	}
+	/* 先从打包文件中顺序读取，剩下的再到各分片中查找 */
+	total = ThumbDB_LoadFromPacks(tdb, count, keys, lens, shard_ids,
+				      width, height, data);
+	/* 按分片分组，每个分片只锁定一次 */
+	for (j = 0; j < THUMB_DB_SHARDS; ++j) {
+		for (i = 0, n = 0; i < count; ++i) {
+			if (shard_ids[i] != j || lens[i] < 1) {
+				continue;
+			}
+			keys[n] = buffer + i * THUMB_KEY_MAX_LEN;
+			items[n] = &data[i];
+			shard_lens[n] = lens[i];
+			++n;
+		}
+		if (n > 0) {
+			total += ThumbDB_LoadFromShard(tdb, &tdb->shards[j], n,
+						       keys, shard_lens, width,
+						       height, items);
+		}
+	}
+
+exit:
+	free(buffer);
+	free(items);
+	free(keys);
+	free(shard_ids);
+	free(shard_lens);
+	free(lens);
+	return total;
 }
 
-int ThumbDB_Save(ThumbDB tdb, const char *filepath, ThumbData data)
+/** 编码一级缩略图，不支持压缩时保存原始像素数据 */
+static void *ThumbDB_EncodeLevel(const LCUI_Graph *graph, ThumbLevel level)
+{
+	size_t size;
+	void *data;
+
+	level->width = graph->width;
+	level->height = graph->height;
+	data = ThumbCodec_Encode(graph, &size);
+	if (data) {
+		level->encoding = THUMB_ENCODING_QOI;
+		level->data_size = (uint32_t)size;
+		return data;
+	}
+	data = malloc(graph->mem_size);
+	if (data) {
+		memcpy(data, graph->bytes, graph->mem_size);
+	}
+	level->encoding = THUMB_ENCODING_RAW;
+	level->data_size = (uint32_t)graph->mem_size;
+	return data;
+}
+
+/**
+ * 生成多级缩略图的数据块
+ * 较小的几级由 data->graph 缩小得到，尺寸与上一级相同的级别会被省略
+ */
+static void *ThumbDB_CreatePyramid(ThumbData data, size_t *size)
+{
+	int i, width, height;
+	int prev_width = 0, prev_height = 0;
+	uint16_t n = 0;
+	size_t offset;
+	char *block = NULL;
+	LCUI_Graph graph;
+	const LCUI_Graph *src = &data->graph;
+	void *levels_data[THUMB_DB_LEVELS];
+	ThumbLevelRec levels[THUMB_DB_LEVELS];
+	ThumbPyramidHeader header;
+
+	for (i = 0; i < THUMB_DB_LEVELS; ++i) {
+		width = max(1, src->width * thumb_level_scales[i] / 100);
+		height = max(1, src->height * thumb_level_scales[i] / 100);
+		if (width == prev_width && height == prev_height) {
+			continue;
+		}
+		if (width == src->width && height == src->height) {
+			levels_data[n] = ThumbDB_EncodeLevel(src, &levels[n]);
+		} else {
+			Graph_Init(&graph);
+			if (Resample_Zoom(src, &graph, RESAMPLE_FILTER_LANCZOS3,
+					  FALSE, width, height) != 0) {
+				continue;
+			}
+			levels_data[n] = ThumbDB_EncodeLevel(&graph, &levels[n]);
+			Graph_Free(&graph);
+		}
+		if (!levels_data[n]) {
+			goto exit;
+		}
+		prev_width = width;
+		prev_height = height;
+		++n;
+	}
+	if (n < 1) {
+		goto exit;
+	}
+	offset = sizeof(ThumbPyramidHeaderRec) + sizeof(ThumbLevelRec) * n;
+	for (i = 0; i < n; ++i) {
+		levels[i].offset = (uint32_t)offset;
+		offset += levels[i].data_size;
+	}
+	block = malloc(offset);
+	if (!block) {
+		goto exit;
+	}
+	header = (ThumbPyramidHeader)block;
+	header->magic = THUMB_BLOCK_MAGIC;
+	header->version = THUMB_PYRAMID_VERSION;
+	header->levels = n;
+	header->origin_width = data->origin_width;
+	header->origin_height = data->origin_height;
+	header->modify_time = data->modify_time;
+	header->color_type = src->color_type;
+	memcpy(header + 1, levels, sizeof(ThumbLevelRec) * n);
+	for (i = 0; i < n; ++i) {
+		memcpy(block + levels[i].offset, levels_data[i],
+		       levels[i].data_size);
+	}
+	*size = offset;
+
+exit:
+	for (i = 0; i < n; ++i) {
+		free(levels_data[i]);
+	}
+	return block;
+}
+
+int ThumbDB_Save(ThumbDB tdb, int dir_id, const char *filepath,
+		 ThumbData data)
 {
 	int rc;
-	uchar_t *buff;
-	ThumbDataBlock block;
-	size_t head_size = sizeof(ThumbDataBlockRec);
-	size_t size = head_size + data->graph.mem_size;
-	if (size > THUMB_MAX_SIZE) {
-		return -1;
-	}
-	ASSERT(ThumbDB_Lock(tdb) == 0);
-	block = malloc(size);
-	buff = (uchar_t*)block + head_size;
-	block->width = data->graph.width;
-	block->height = data->graph.height;
-	block->mem_size = data->graph.mem_size;
-	block->modify_time = data->modify_time;
-	block->origin_width = data->origin_width;
-	block->origin_height = data->origin_height;
-	block->color_type = data->graph.color_type;
-	memcpy(buff, data->graph.bytes, data->graph.mem_size);
-	rc = kvdb_put(tdb->db, filepath, strlen(filepath), (char*)block, size);
-	ThumbDB_Unlock(tdb);
+	size_t keylen, size;
+	void *block;
+	ThumbDBShard shard;
+	char key[THUMB_KEY_MAX_LEN];
+
+	if (data->graph.mem_size > THUMB_MAX_SIZE) {
+		return -1;
+	}
+	keylen = ThumbDB_GetKey(key, dir_id, filepath);
+	if (keylen < 1) {
+		return -1;
+	}
+	/* 缩放和编码比较耗时，在锁定数据库之前进行 */
+	block = ThumbDB_CreatePyramid(data, &size);
+	if (!block) {
+		return -1;
+	}
+	shard = &tdb->shards[ThumbDB_GetShardIndex(key, keylen)];
+	if (ThumbDB_LockShared(tdb, shard) != 0) {
+		free(block);
+		return -1;
+	}
+	/* 写入时其它线程仍可以读取，读到的是写入前或写入后的数据块 */
+	LCUIMutex_Lock(&shard->write_mutex);
+	rc = kvdb_put(shard->db, key, keylen, block, size);
+	LCUIMutex_Unlock(&shard->write_mutex);
+	if (rc == 0) {
+		ThumbDB_Touch(shard, key, size);
+	}
+	ThumbDB_CheckAccesses(shard);
+	ThumbDB_UnlockShared(shard);
 	free(block);
+	if (rc == 0) {
+		ThumbDB_ForgetPack(tdb, key, keylen);
+	}
 	return rc == 0 ? 0 : -2;
 }
+
+int ThumbDB_SaveFailure(ThumbDB tdb, int dir_id, const char *filepath,
+			uint32_t modify_time)
+{
+	int rc;
+	size_t keylen;
+	ThumbDBShard shard;
+	ThumbFailureRec failure;
+	char key[THUMB_KEY_MAX_LEN];
+
+	keylen = ThumbDB_GetKey(key, dir_id, filepath);
+	if (keylen < 1) {
+		return -1;
+	}
+	failure.magic = THUMB_BLOCK_MAGIC;
+	failure.version = THUMB_FAILURE_VERSION;
+	failure.reserved = 0;
+	failure.modify_time = modify_time;
+	shard = &tdb->shards[ThumbDB_GetShardIndex(key, keylen)];
+	ASSERT(ThumbDB_LockShared(tdb, shard) == 0);
+	LCUIMutex_Lock(&shard->write_mutex);
+	rc = kvdb_put(shard->db, key, keylen, &failure, sizeof(failure));
+	LCUIMutex_Unlock(&shard->write_mutex);
+	if (rc == 0) {
+		ThumbDB_Touch(shard, key, sizeof(failure));
+	}
+	ThumbDB_CheckAccesses(shard);
+	ThumbDB_UnlockShared(shard);
+	if (rc == 0) {
+		ThumbDB_ForgetPack(tdb, key, keylen);
+	}
+	return rc == 0 ? 0 : -2;
+}
+
+/** 遍历分片中的失败记录 */
+static size_t ThumbDB_EachShardFailure(ThumbDB tdb, ThumbDBShard shard,
+				       ThumbDBFailureHandler handler,
+				       void *data)
+{
+	size_t n = 0;
+	size_t keylen, vallen;
+	int dir_id;
+	char *end;
+	const char *key;
+	const void *val;
+	kvdb_cursor_t *cur;
+	char buf[THUMB_KEY_MAX_LEN];
+
+	if (ThumbDB_LockExclusive(tdb, shard) != 0) {
+		return 0;
+	}
+	cur = kvdb_cursor_open(shard->db);
+	if (!cur) {
+		ThumbDB_UnlockExclusive(shard);
+		return 0;
+	}
+	for (kvdb_cursor_seek(cur, NULL, 0); kvdb_cursor_valid(cur);
+	     kvdb_cursor_next(cur)) {
+		key = kvdb_cursor_key(cur, &keylen);
+		if (keylen < 1 || keylen >= THUMB_KEY_MAX_LEN ||
+		    key[0] == THUMB_ACCESS_PREFIX) {
+			continue;
+		}
+		val = kvdb_cursor_value(cur, &vallen);
+		if (!ThumbDB_IsFailureBlock(val, vallen)) {
+			continue;
+		}
+		memcpy(buf, key, keylen);
+		buf[keylen] = 0;
+		dir_id = (int)strtol(buf, &end, 10);
+		if (*end != ':') {
+			continue;
+		}
+		handler(dir_id, end + 1,
+			((const ThumbFailureRec*)val)->modify_time, data);
+		++n;
+	}
+	kvdb_cursor_close(cur);
+	ThumbDB_UnlockExclusive(shard);
+	return n;
+}
+
+size_t ThumbDB_EachFailure(ThumbDB tdb, ThumbDBFailureHandler handler,
+			   void *data)
+{
+	int i;
+	size_t n = 0;
+
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		n += ThumbDB_EachShardFailure(tdb, &tdb->shards[i],
+					      handler, data);
+	}
+	return n;
+}
+
+/** 丢弃暂存的以 prefix 开头的访问记录，调用前需锁定分片 */
+static void ThumbDB_ForgetAccesses(ThumbDBShard shard, const char *prefix,
+				   size_t len)
+{
+	const char *key;
+	DictEntry *entry;
+	DictIterator *iter;
+
+	iter = Dict_GetSafeIterator(shard->accesses);
+	while ((entry = Dict_Next(iter))) {
+		key = DictEntry_GetKey(entry);
+		if (strncmp(key, prefix, len) == 0) {
+			Dict_Delete(shard->accesses, key);
+		}
+	}
+	Dict_ReleaseIterator(iter);
+}
+
+/** 删除分片中以 prefix 开头的所有记录 */
+static int ThumbDB_DeletePrefix(ThumbDB tdb, ThumbDBShard shard,
+				const char *prefix, size_t len)
+{
+	int ret;
+	size_t keylen;
+	const char *key;
+	kvdb_batch_t *batch;
+	kvdb_cursor_t *cur;
+
+	ASSERT(ThumbDB_LockExclusive(tdb, shard) == 0);
+	batch = kvdb_batch_begin(shard->db);
+	cur = kvdb_cursor_open(shard->db);
+	if (!batch || !cur) {
+		if (batch) {
+			kvdb_batch_discard(batch);
+		}
+		if (cur) {
+			kvdb_cursor_close(cur);
+		}
+		ThumbDB_UnlockExclusive(shard);
+		return -1;
+	}
+	kvdb_cursor_set_prefix(cur, prefix, len);
+	for (kvdb_cursor_seek(cur, NULL, 0); kvdb_cursor_valid(cur);
+	     kvdb_cursor_next(cur)) {
+		key = kvdb_cursor_key(cur, &keylen);
+		kvdb_batch_delete(batch, key, keylen);
+	}
+	if (prefix[0] != THUMB_ACCESS_PREFIX) {
+		ThumbDB_ForgetAccesses(shard, prefix, len);
+	}
+	/* 游标关闭后再提交，避免边遍历边修改 */
+	kvdb_cursor_close(cur);
+	ret = kvdb_batch_commit(batch);
+	ThumbDB_UnlockExclusive(shard);
+	return ret;
+}
+
+int ThumbDB_DeleteDir(ThumbDB tdb, int dir_id)
+{
+	int i, ret = 0;
+	char prefix[32];
+	size_t len;
+
+	prefix[0] = THUMB_ACCESS_PREFIX;
+	len = (size_t)snprintf(prefix + 1, sizeof(prefix) - 1, "%d:", dir_id);
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		if (ThumbDB_DeletePrefix(tdb, &tdb->shards[i],
+					 prefix + 1, len) != 0 ||
+		    ThumbDB_DeletePrefix(tdb, &tdb->shards[i],
+					 prefix, len + 1) != 0) {
+			ret = -1;
+		}
+	}
+	ThumbDB_DropPacks(tdb, dir_id);
+	return ret;
+}
+
+static ThumbDBEntry ThumbDB_AddEntry(Dict *index, LinkedList *entries,
+				     const char *key, size_t keylen,
+				     size_t shard)
+{
+	ThumbDBEntry entry;
+	char buf[THUMB_KEY_MAX_LEN];
+
+	if (keylen >= THUMB_KEY_MAX_LEN) {
+		return NULL;
+	}
+	memcpy(buf, key, keylen);
+	buf[keylen] = 0;
+	entry = Dict_FetchValue(index, buf);
+	if (entry) {
+		return entry;
+	}
+	entry = NEW(ThumbDBEntryRec, 1);
+	if (!entry) {
+		return NULL;
+	}
+	entry->key = strdup(buf);
+	if (!entry->key) {
+		free(entry);
+		return NULL;
+	}
+	entry->keylen = keylen;
+	entry->shard = shard;
+	Dict_Add(index, entry->key, entry);
+	LinkedList_Append(entries, entry);
+	return entry;
+}
+
+/**
+ * 收集分片中的缩略图和访问记录
+ * 访问记录的键排在缩略图之前，所以遇到缩略图时已知道它是否有访问记录，
+ * 只有没有访问记录的缩略图才需要读取它的数据来获得大小
+ */
+static int ThumbDB_CollectEntries(ThumbDB tdb, size_t i, LinkedList *entries)
+{
+	Dict *index;
+	size_t keylen, vallen;
+	const char *key;
+	const ThumbDBAccessRec *val;
+	ThumbDBEntry entry;
+	ThumbDBShard shard = &tdb->shards[i];
+	kvdb_cursor_t *cur;
+
+	ASSERT(ThumbDB_LockExclusive(tdb, shard) == 0);
+	ThumbDB_FlushAccesses(shard);
+	cur = kvdb_cursor_open(shard->db);
+	if (!cur) {
+		ThumbDB_UnlockExclusive(shard);
+		return -1;
+	}
+	index = StrDict_Create(NULL, NULL);
+	for (kvdb_cursor_seek(cur, NULL, 0); kvdb_cursor_valid(cur);
+	     kvdb_cursor_next(cur)) {
+		key = kvdb_cursor_key(cur, &keylen);
+		if (keylen > 0 && key[0] == THUMB_ACCESS_PREFIX) {
+			entry = ThumbDB_AddEntry(index, entries, key + 1,
+						 keylen - 1, i);
+			val = kvdb_cursor_value(cur, &vallen);
+			if (entry && val && vallen == sizeof(ThumbDBAccessRec)) {
+				entry->access = *val;
+				entry->has_access = TRUE;
+			}
+			continue;
+		}
+		entry = ThumbDB_AddEntry(index, entries, key, keylen, i);
+		if (!entry) {
+			continue;
+		}
+		entry->has_thumb = TRUE;
+		if ((!entry->has_access || entry->access.size == 0) &&
+		    kvdb_cursor_value(cur, &vallen)) {
+			entry->access.size = (uint32_t)vallen;
+		}
+	}
+	kvdb_cursor_close(cur);
+	ThumbDB_UnlockExclusive(shard);
+	StrDict_Release(index);
+	return 0;
+}
+
+static int CompareEntryByTime(const void *a, const void *b)
+{
+	const ThumbDBEntry e1 = *(const ThumbDBEntry*)a;
+	const ThumbDBEntry e2 = *(const ThumbDBEntry*)b;
+
+	if (e1->access.time == e2->access.time) {
+		return 0;
+	}
+	return e1->access.time < e2->access.time ? -1 : 1;
+}
+
+/** 删除分片中被淘汰的缩略图和无用的访问记录 */
+static int ThumbDB_DeleteEntries(ThumbDB tdb, size_t i,
+				 ThumbDBEntry *entries, size_t count)
+{
+	int ret;
+	size_t j;
+	ThumbDBEntry entry;
+	ThumbDBShard shard = &tdb->shards[i];
+	kvdb_batch_t *batch;
+	char buf[THUMB_KEY_MAX_LEN + 1];
+
+	ASSERT(ThumbDB_LockExclusive(tdb, shard) == 0);
+	batch = kvdb_batch_begin(shard->db);
+	if (!batch) {
+		ThumbDB_UnlockExclusive(shard);
+		return -1;
+	}
+	buf[0] = THUMB_ACCESS_PREFIX;
+	for (j = 0; j < count; ++j) {
+		entry = entries[j];
+		if (entry->shard != i ||
+		    (entry->has_thumb && !entry->evicted)) {
+			continue;
+		}
+		/* 收集之后又被访问过的缩略图不再淘汰 */
+		if (Dict_FetchValue(shard->accesses, entry->key)) {
+			continue;
+		}
+		if (entry->has_thumb) {
+			kvdb_batch_delete(batch, entry->key, entry->keylen);
+		}
+		memcpy(buf + 1, entry->key, entry->keylen);
+		kvdb_batch_delete(batch, buf, entry->keylen + 1);
+	}
+	ret = kvdb_batch_commit(batch);
+	ThumbDB_UnlockExclusive(shard);
+	return ret;
+}
+
+static void OnDestroyEntry(void *data)
+{
+	ThumbDBEntry entry = data;
+
+	free(entry->key);
+	free(entry);
+}
+
+int ThumbDB_Maintain(ThumbDB tdb, int64_t max_size)
+{
+	int ret = 0;
+	size_t i, count, nevicted = 0;
+	int64_t size, total = 0, target;
+	ThumbDBEntry *entries;
+	LinkedList list;
+	LinkedListNode *node;
+
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		ASSERT(ThumbDB_LockShared(tdb, &tdb->shards[i]) == 0);
+		ThumbDB_FlushAccesses(&tdb->shards[i]);
+		ThumbDB_UnlockShared(&tdb->shards[i]);
+	}
+	/* 文件大小包含了未回收的空间，未超出上限时实际数据也不会超出 */
+	if (max_size <= 0 || ThumbDB_GetSize(tdb->path, &size) != 0 ||
+	    size <= max_size) {
+		return 0;
+	}
+	/* 打包文件只是副本，先删除它们，下次浏览时再重新打包 */
+	ThumbDB_DropPacks(tdb, -1);
+	if (ThumbDB_GetSize(tdb->path, &size) != 0 || size <= max_size) {
+		return 0;
+	}
+	LinkedList_Init(&list);
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		if (ThumbDB_CollectEntries(tdb, i, &list) != 0) {
+			LinkedList_Clear(&list, OnDestroyEntry);
+			return -1;
+		}
+	}
+	count = list.length;
+	entries = malloc(sizeof(ThumbDBEntry) * (count + 1));
+	if (!entries) {
+		LinkedList_Clear(&list, OnDestroyEntry);
+		return -1;
+	}
+	i = 0;
+	for (LinkedList_Each(node, &list)) {
+		entries[i] = node->data;
+		if (entries[i]->has_thumb) {
+			total += entries[i]->access.size;
+		}
+		++i;
+	}
+	/* 从最久未访问的缩略图开始淘汰，直到总大小低于目标 */
+	target = max_size / 100 * THUMB_EVICT_TARGET;
+	qsort(entries, count, sizeof(ThumbDBEntry), CompareEntryByTime);
+	for (i = 0; i < count && total > target; ++i) {
+		if (entries[i]->has_thumb) {
+			entries[i]->evicted = TRUE;
+			total -= entries[i]->access.size;
+			++nevicted;
+		}
+	}
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		if (ThumbDB_DeleteEntries(tdb, i, entries, count) != 0) {
+			ret = -1;
+		}
+	}
+	free(entries);
+	LinkedList_Clear(&list, OnDestroyEntry);
+	/* 回收被删除的记录占用的空间，让文件大小回到上限以下 */
+	for (i = 0; i < THUMB_DB_SHARDS; ++i) {
+		if (ThumbDB_LockExclusive(tdb, &tdb->shards[i]) != 0) {
+			return -1;
+		}
+		/* 返回 -EBUSY 时说明仍有读者，下次维护时会再次尝试压缩 */
+		kvdb_compact(tdb->shards[i].db);
+		ThumbDB_UnlockExclusive(&tdb->shards[i]);
+	}
+	if (nevicted > 0) {
+		printf("[thumbdb] evicted %d thumbnails\n", (int)nevicted);
+	}
+	return ret == 0 ? (int)nevicted : ret;
+}
+
+/** 计算文件列表的哈希值，列表、顺序或需要的尺寸变化时都需要重新打包 */
+static uint32_t ThumbDB_GetListHash(int dir_id, size_t count,
+				    const char **filepaths, unsigned width,
+				    unsigned height)
+{
+	size_t i;
+	uint32_t hash;
+	uint32_t params[3];
+
+	params[0] = (uint32_t)dir_id;
+	params[1] = width;
+	params[2] = height;
+	hash = ThumbPack_Hash(0, params, sizeof(params));
+	for (i = 0; i < count; ++i) {
+		/* 包括结尾的 0，以便区分不同的拆分方式 */
+		hash = ThumbPack_Hash(hash, filepaths[i],
+				      strlen(filepaths[i]) + 1);
+	}
+	return hash;
+}
+
+/**
+ * 判断已有的打包文件是否可以继续使用，调用前需锁定打包文件表
+ * 缺失的缩略图不影响判断，它们被保存时打包文件就会被删除，下次打开文件夹时
+ * 才需要重新打包，这样就不会在每次打开文件夹时都逐个读取全部缩略图
+ */
+static LCUI_BOOL ThumbDB_IsPackUsable(ThumbDB tdb, const char *folder_key,
+				      uint32_t list_hash)
+{
+	ThumbPack pack;
+	ThumbPackInfoRec info;
+
+	pack = ThumbDB_GetPack(tdb, folder_key);
+	if (!pack) {
+		return FALSE;
+	}
+	ThumbPack_GetInfo(pack, &info);
+	return info.list_hash == list_hash;
+}
+
+int ThumbDB_PackFolder(ThumbDB tdb, int dir_id, size_t count,
+		       const char **filepaths, unsigned width, unsigned height,
+		       const LCUI_BOOL *running)
+{
+	int ret = 0;
+	size_t i, n = 0, keylen, size;
+	uint32_t list_hash, missing = 0;
+	void *block;
+	const void *view;
+	kvdb_txn_t *txn;
+	ThumbDBShard shard;
+	ThumbPackWriter writer;
+	char path[THUMB_KEY_MAX_LEN];
+	char key[THUMB_KEY_MAX_LEN];
+	char folder_key[THUMB_KEY_MAX_LEN];
+	char key_folder[THUMB_KEY_MAX_LEN];
+
+	if (count < 1) {
+		return 0;
+	}
+	keylen = ThumbDB_GetKey(key, dir_id, filepaths[0]);
+	if (keylen < 1) {
+		return -1;
+	}
+	ThumbDB_GetFolderKey(folder_key, key, keylen);
+	list_hash = ThumbDB_GetListHash(dir_id, count, filepaths,
+					width, height);
+	LCUIMutex_Lock(&tdb->packs_mutex);
+	if (ThumbDB_IsPackUsable(tdb, folder_key, list_hash)) {
+		LCUIMutex_Unlock(&tdb->packs_mutex);
+		return 0;
+	}
+	LCUIMutex_Unlock(&tdb->packs_mutex);
+	ThumbDB_GetPackPath(path, tdb->path, folder_key);
+	writer = ThumbPackWriter_Create(path);
+	if (!writer) {
+		return -1;
+	}
+	for (i = 0; i < count && ret == 0; ++i) {
+		if (running && !*running) {
+			ThumbPackWriter_Destroy(writer);
+			return 0;
+		}
+		keylen = ThumbDB_GetKey(key, dir_id, filepaths[i]);
+		if (keylen < 1) {
+			continue;
+		}
+		ThumbDB_GetFolderKey(key_folder, key, keylen);
+		if (strcmp(key_folder, folder_key) != 0) {
+			continue;
+		}
+		shard = &tdb->shards[ThumbDB_GetShardIndex(key, keylen)];
+		if (ThumbDB_LockShared(tdb, shard) != 0) {
+			ret = -1;
+			break;
+		}
+		block = NULL;
+		txn = kvdb_txn_begin(shard->db);
+		if (txn) {
+			view = kvdb_get_view(txn, key, keylen, &size);
+			block = ThumbDB_CopyBlock(view, &size, width, height);
+			kvdb_txn_end(txn);
+		}
+		ThumbDB_UnlockShared(shard);
+		/* 失败记录没有可打包的缩略图，但也不算缺失 */
+		if (ThumbDB_IsFailureBlock(block, size)) {
+			;
+		} else if (!block || !ThumbDB_BlockFits(block, size, 0, 0)) {
+			/* 旧版本的数据块没有尺寸信息，不打包 */
+			++missing;
+		} else if (ThumbPackWriter_Add(writer, key, keylen,
+					       block, size) == 0) {
+			++n;
+		} else {
+			ret = -1;
+		}
+		free(block);
+	}
+	/* 没有可打包的缩略图时也写入打包文件，以记录这次打包的结果 */
+	if (ret == 0) {
+		/* 已打开的打包文件需先关闭，才能被替换 */
+		LCUIMutex_Lock(&tdb->packs_mutex);
+		Dict_Delete(tdb->packs, folder_key);
+		ret = ThumbPackWriter_Finish(writer, list_hash, missing);
+		LCUIMutex_Unlock(&tdb->packs_mutex);
+	}
+	ThumbPackWriter_Destroy(writer);
+	return ret == 0 ? (int)n : ret;
+}
@@ -0,0 +1,446 @@
+﻿/* ***************************************************************************
+ * thumb_pack.c -- packed thumbnail file of a folder.
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * thumb_pack.c -- 文件夹的缩略图打包文件
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#define LCFINDER_THUMB_PACK_C
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "build.h"
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include "thumb_pack.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define THUMB_PACK_MAGIC	"LCFTPAK"
+#define THUMB_PACK_VERSION	1
+#define ALIGN8(N)		(((N) + 7) & ~(size_t)7)
+
+/**
+ * 打包文件的头部
+ * 之后是按添加顺序连续存放的记录，每个记录由键和数据组成，各自按 8 字节对齐，
+ * 末尾是按键的哈希值排序的索引
+ */
+typedef struct ThumbPackHeaderRec_ {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint32_t list_hash;
+	uint32_t missing;
+	uint64_t index_offset;
+} ThumbPackHeaderRec, *ThumbPackHeader;
+
+typedef struct ThumbPackIndexRec_ {
+	uint32_t hash;
+	uint32_t keylen;
+	uint64_t key_offset;
+	uint64_t offset;	/**< 数据的偏移量 */
+	uint64_t size;		/**< 数据的大小 */
+} ThumbPackIndexRec, *ThumbPackIndex;
+
+typedef struct ThumbPackRec_ {
+	char *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+	const ThumbPackIndexRec *index;
+	const ThumbPackHeaderRec *header;
+} ThumbPackRec;
+
+typedef struct ThumbPackWriterRec_ {
+	FILE *fp;
+	char *path;
+	char *tmp_path;
+	uint64_t offset;
+	ThumbPackIndex index;
+	size_t count;
+	size_t max_count;
+	LCUI_BOOL finished;
+} ThumbPackWriterRec;
+
+uint32_t ThumbPack_Hash(uint32_t hash, const void *data, size_t len)
+{
+	size_t i;
+	const unsigned char *bytes = data;
+
+	if (hash == 0) {
+		hash = 2166136261u;
+	}
+	for (i = 0; i < len; ++i) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+#ifdef _WIN32
+
+static int ThumbPack_Map(ThumbPack pack, const char *path)
+{
+	LARGE_INTEGER size;
+#ifdef PLATFORM_WIN32_PC_APP
+	wchar_t wpath[MAX_PATH];
+
+	MultiByteToWideChar(CP_ACP, 0, path, -1, wpath, MAX_PATH);
+	pack->file = CreateFile2(wpath, GENERIC_READ, FILE_SHARE_READ,
+				 OPEN_EXISTING, NULL);
+#else
+	pack->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+				 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+#endif
+	if (pack->file == INVALID_HANDLE_VALUE) {
+		return -ENOENT;
+	}
+	if (!GetFileSizeEx(pack->file, &size) || size.QuadPart < 1) {
+		CloseHandle(pack->file);
+		return -EINVAL;
+	}
+	pack->size = (size_t)size.QuadPart;
+#ifdef PLATFORM_WIN32_PC_APP
+	pack->mapping = CreateFileMappingFromApp(pack->file, NULL,
+						 PAGE_READONLY, 0, NULL);
+#else
+	pack->mapping = CreateFileMappingA(pack->file, NULL, PAGE_READONLY,
+					   0, 0, NULL);
+#endif
+	if (!pack->mapping) {
+		CloseHandle(pack->file);
+		return -EIO;
+	}
+#ifdef PLATFORM_WIN32_PC_APP
+	pack->data = MapViewOfFileFromApp(pack->mapping, FILE_MAP_READ, 0, 0);
+#else
+	pack->data = MapViewOfFile(pack->mapping, FILE_MAP_READ, 0, 0, 0);
+#endif
+	if (!pack->data) {
+		CloseHandle(pack->mapping);
+		CloseHandle(pack->file);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void ThumbPack_Unmap(ThumbPack pack)
+{
+	UnmapViewOfFile(pack->data);
+	CloseHandle(pack->mapping);
+	CloseHandle(pack->file);
+}
+
+#else
+
+static int ThumbPack_Map(ThumbPack pack, const char *path)
+{
+	struct stat buf;
+
+	pack->fd = open(path, O_RDONLY);
+	if (pack->fd < 0) {
+		return -errno;
+	}
+	if (fstat(pack->fd, &buf) != 0 || buf.st_size < 1) {
+		close(pack->fd);
+		return -EINVAL;
+	}
+	pack->size = (size_t)buf.st_size;
+	pack->data = mmap(NULL, pack->size, PROT_READ, MAP_SHARED,
+			  pack->fd, 0);
+	if (pack->data == MAP_FAILED) {
+		close(pack->fd);
+		return -EIO;
+	}
+	/* 滚动浏览时按存放顺序读取，让系统提前读入后面的数据 */
+	madvise(pack->data, pack->size, MADV_SEQUENTIAL);
+	return 0;
+}
+
+static void ThumbPack_Unmap(ThumbPack pack)
+{
+	munmap(pack->data, pack->size);
+	close(pack->fd);
+}
+
+#endif
+
+static LCUI_BOOL ThumbPack_Verify(ThumbPack pack)
+{
+	const ThumbPackHeaderRec *header = (ThumbPackHeader)pack->data;
+
+	if (pack->size < sizeof(ThumbPackHeaderRec) ||
+	    memcmp(header->magic, THUMB_PACK_MAGIC, 8) != 0 ||
+	    header->version != THUMB_PACK_VERSION) {
+		return FALSE;
+	}
+	if (header->index_offset > pack->size ||
+	    (pack->size - header->index_offset) / sizeof(ThumbPackIndexRec) <
+		header->count) {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+ThumbPack ThumbPack_Open(const char *path)
+{
+	ThumbPack pack;
+
+	pack = NEW(ThumbPackRec, 1);
+	if (!pack) {
+		return NULL;
+	}
+	if (ThumbPack_Map(pack, path) != 0) {
+		free(pack);
+		return NULL;
+	}
+	if (!ThumbPack_Verify(pack)) {
+		LOG("[thumbpack] invalid pack file: %s\n", path);
+		ThumbPack_Unmap(pack);
+		free(pack);
+		return NULL;
+	}
+	pack->header = (ThumbPackHeader)pack->data;
+	pack->index = (const ThumbPackIndexRec*)(pack->data +
+						 pack->header->index_offset);
+	return pack;
+}
+
+void ThumbPack_Close(ThumbPack pack)
+{
+	ThumbPack_Unmap(pack);
+	free(pack);
+}
+
+void ThumbPack_GetInfo(ThumbPack pack, ThumbPackInfo info)
+{
+	info->list_hash = pack->header->list_hash;
+	info->count = pack->header->count;
+	info->missing = pack->header->missing;
+}
+
+const void *ThumbPack_Find(ThumbPack pack, const char *key, size_t keylen,
+			   size_t *size)
+{
+	size_t low = 0, high = pack->header->count, mid;
+	uint32_t hash = ThumbPack_Hash(0, key, keylen);
+	const ThumbPackIndexRec *item;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (pack->index[mid].hash < hash) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	for (; low < pack->header->count; ++low) {
+		item = &pack->index[low];
+		if (item->hash != hash) {
+			break;
+		}
+		if (item->keylen != keylen || item->key_offset > pack->size ||
+		    keylen > pack->size - item->key_offset ||
+		    memcmp(pack->data + item->key_offset, key, keylen) != 0) {
+			continue;
+		}
+		if (item->offset > pack->size ||
+		    item->size > pack->size - item->offset) {
+			return NULL;
+		}
+		*size = (size_t)item->size;
+		return pack->data + item->offset;
+	}
+	return NULL;
+}
+
+static char *StrDupWithSuffix(const char *str, const char *suffix)
+{
+	size_t len = strlen(str) + strlen(suffix) + 1;
+	char *newstr = malloc(len * sizeof(char));
+	if (newstr) {
+		snprintf(newstr, len, "%s%s", str, suffix);
+	}
+	return newstr;
+}
+
+ThumbPackWriter ThumbPackWriter_Create(const char *path)
+{
+	ThumbPackHeaderRec header = { 0 };
+	ASSIGN(w, ThumbPackWriter);
+
+	if (!w) {
+		return NULL;
+	}
+	w->path = StrDupWithSuffix(path, "");
+	w->tmp_path = StrDupWithSuffix(path, ".tmp");
+	if (!w->path || !w->tmp_path) {
+		ThumbPackWriter_Destroy(w);
+		return NULL;
+	}
+	w->fp = fopen(w->tmp_path, "wb");
+	if (!w->fp) {
+		LOG("[thumbpack] cannot open file: %s\n", w->tmp_path);
+		ThumbPackWriter_Destroy(w);
+		return NULL;
+	}
+	/* 先占位，完成时再写入真正的头部 */
+	if (fwrite(&header, sizeof(header), 1, w->fp) != 1) {
+		ThumbPackWriter_Destroy(w);
+		return NULL;
+	}
+	w->offset = sizeof(header);
+	return w;
+}
+
+void ThumbPackWriter_Destroy(ThumbPackWriter w)
+{
+	if (w->fp) {
+		fclose(w->fp);
+		w->fp = NULL;
+	}
+	if (!w->finished && w->tmp_path) {
+		remove(w->tmp_path);
+	}
+	free(w->path);
+	free(w->tmp_path);
+	free(w->index);
+	free(w);
+}
+
+/** 写入数据并补齐到 8 字节对齐 */
+static int ThumbPackWriter_Write(ThumbPackWriter w, const void *data,
+				 size_t size)
+{
+	static const char padding[8] = { 0 };
+	size_t padding_size = ALIGN8(size) - size;
+
+	if (fwrite(data, 1, size, w->fp) != size ||
+	    fwrite(padding, 1, padding_size, w->fp) != padding_size) {
+		return -EIO;
+	}
+	w->offset += size + padding_size;
+	return 0;
+}
+
+int ThumbPackWriter_Add(ThumbPackWriter w, const char *key, size_t keylen,
+			const void *data, size_t size)
+{
+	size_t max_count;
+	ThumbPackIndex index, item;
+
+	if (w->count >= w->max_count) {
+		max_count = max(w->max_count * 2, 256);
+		index = realloc(w->index, max_count * sizeof(ThumbPackIndexRec));
+		if (!index) {
+			return -ENOMEM;
+		}
+		w->index = index;
+		w->max_count = max_count;
+	}
+	item = &w->index[w->count];
+	item->hash = ThumbPack_Hash(0, key, keylen);
+	item->keylen = (uint32_t)keylen;
+	item->key_offset = w->offset;
+	if (ThumbPackWriter_Write(w, key, keylen) != 0) {
+		return -EIO;
+	}
+	item->offset = w->offset;
+	item->size = size;
+	if (ThumbPackWriter_Write(w, data, size) != 0) {
+		return -EIO;
+	}
+	w->count += 1;
+	return 0;
+}
+
+static int CompareIndex(const void *a, const void *b)
+{
+	const ThumbPackIndexRec *item1 = a;
+	const ThumbPackIndexRec *item2 = b;
+
+	if (item1->hash == item2->hash) {
+		return 0;
+	}
+	return item1->hash < item2->hash ? -1 : 1;
+}
+
+int ThumbPackWriter_Finish(ThumbPackWriter w, uint32_t list_hash,
+			   uint32_t missing)
+{
+	ThumbPackHeaderRec header = { 0 };
+
+	qsort(w->index, w->count, sizeof(ThumbPackIndexRec), CompareIndex);
+	memcpy(header.magic, THUMB_PACK_MAGIC, 8);
+	header.version = THUMB_PACK_VERSION;
+	header.count = (uint32_t)w->count;
+	header.list_hash = list_hash;
+	header.missing = missing;
+	header.index_offset = w->offset;
+	if (w->count > 0 && fwrite(w->index, sizeof(ThumbPackIndexRec),
+				   w->count, w->fp) != w->count) {
+		return -EIO;
+	}
+	if (fseek(w->fp, 0, SEEK_SET) != 0 ||
+	    fwrite(&header, sizeof(header), 1, w->fp) != 1) {
+		return -EIO;
+	}
+	/* 打包文件只是缓存，丢失后可以重新生成，无需同步到磁盘 */
+	if (fclose(w->fp) != 0) {
+		w->fp = NULL;
+		return -EIO;
+	}
+	w->fp = NULL;
+#ifdef _WIN32
+	remove(w->path);
+#endif
+	if (rename(w->tmp_path, w->path) != 0) {
+		LOG("[thumbpack] cannot rename %s to %s\n", w->tmp_path,
+		    w->path);
+		return -EIO;
+	}
+	w->finished = TRUE;
+	return 0;
+}
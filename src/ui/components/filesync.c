@@ -40,6 +40,7 @@
 #include <LCUI/gui/widget.h>
 #include <LCUI/gui/widget/textview.h>
 #include "textview_i18n.h"
+#include "i18n.h"
 #include "ui.h"
 
 #define KEY_TITLE_SCANING	"filesync.title.syncing"
@@ -47,6 +48,9 @@
 #define KEY_TEXT_SCANING	"filesync.text.scaning"
 #define KEY_TEXT_SAVING		"filesync.text.saving"
 #define KEY_TEXT_FINISHED	"filesync.text.finished"
+#define KEY_TEXT_RATE		"filesync.text.rate"
+#define KEY_TEXT_ETA		"filesync.text.eta"
+#define KEY_TEXT_OFFLINE	"filesync.text.offline"
 
 /** 当前文件同步功能所需的数据 */
 static struct SyncContextRec_ {
@@ -59,6 +63,58 @@ static struct SyncContextRec_ {
 	int cached_state;		/**< 当前缓存的同步状态 */
 } self = { 0 };
 
+/** 在状态文本后面追加处理速度和预计剩余时间 */
+static void RenderRateText(wchar_t *buf)
+{
+	int seconds;
+	size_t len;
+	const wchar_t *text;
+
+	if (self.status.rate < 1) {
+		return;
+	}
+	len = wcslen(buf);
+	text = I18n_GetText(KEY_TEXT_RATE);
+	if (!text || len + 2 >= TXTFMT_BUF_MAX_LEN) {
+		return;
+	}
+	buf[len++] = L'\n';
+	swprintf(buf + len, TXTFMT_BUF_MAX_LEN - len, text,
+		 (int)(self.status.rate + 0.5));
+	/* 扫描阶段的文件总数仍在增长，预计剩余时间没有参考价值 */
+	if (self.cached_state != STATE_SAVING || self.status.eta < 0) {
+		return;
+	}
+	len = wcslen(buf);
+	text = I18n_GetText(KEY_TEXT_ETA);
+	if (!text || len + 2 >= TXTFMT_BUF_MAX_LEN) {
+		return;
+	}
+	buf[len++] = L' ';
+	seconds = (int)((self.status.eta + 999) / 1000);
+	swprintf(buf + len, TXTFMT_BUF_MAX_LEN - len, text,
+		 seconds / 60, seconds % 60);
+}
+
+/** 在状态文本后面追加离线的源文件夹数量 */
+static void RenderOfflineText(wchar_t *buf)
+{
+	size_t len;
+	const wchar_t *text;
+
+	if (self.status.offline_dirs < 1) {
+		return;
+	}
+	len = wcslen(buf);
+	text = I18n_GetText(KEY_TEXT_OFFLINE);
+	if (!text || len + 2 >= TXTFMT_BUF_MAX_LEN) {
+		return;
+	}
+	buf[len++] = L'\n';
+	swprintf(buf + len, TXTFMT_BUF_MAX_LEN - len, text,
+		 (int)self.status.offline_dirs);
+}
+
 static void RenderStatusText(wchar_t *buf, const wchar_t *text, void *data)
 {
 	size_t count, total;
@@ -74,15 +130,18 @@ static void RenderStatusText(wchar_t *buf, const wchar_t *text, void *data)
 			total += self.status.task->deleted_files;
 		}
 		swprintf(buf, TXTFMT_BUF_MAX_LEN, text, count, total);
+		RenderRateText(buf);
 		break;
 	case STATE_FINISHED:
 		count = self.status.synced_files;
 		swprintf(buf, TXTFMT_BUF_MAX_LEN, text, count);
+		RenderOfflineText(buf);
 		break;
 	case STATE_STARTED:
 	default:
 		count = self.status.scaned_files;
 		swprintf(buf, TXTFMT_BUF_MAX_LEN, text, count);
+		RenderRateText(buf);
 		break;
 	}
 }
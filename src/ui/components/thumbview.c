@@ -67,7 +67,8 @@
 #define FOLDER_CLASS		"file-folder"
 #define PICTURE_CLASS		"file-picture"
 #define DIR_COVER_THUMB		"__dir_cover_thumb__"
-#define THUMB_MAX_WIDTH		240
+/** 文件夹内的图片达到这个数量时才打包缩略图 */
+#define THUMB_PACK_MIN_FILES	256
 
 /** 滚动加载功能的相关数据 */
 typedef struct ScrollLoadingRec_ {
@@ -112,6 +113,7 @@ typedef void (*ThumbLoaderCallback)(ThumbLoader);
 typedef struct ThumbLoaderRec_ {
 	LCUI_BOOL active;		/**< 是否处于活动状态 */
 	ThumbDB db;			/**< 缩略图缓存数据库 */
+	int dir_id;			/**< 所属源文件夹的标识号 */
 	ThumbView view;			/**< 所属缩略图视图 */
 	LCUI_Widget target;		/**< 需要缩略图的部件 */
 	LCUI_Mutex mutex;		/**< 互斥锁 */
@@ -119,6 +121,10 @@ typedef struct ThumbLoaderRec_ {
 	char path[PATH_LEN];		/**< 图片文件路径，相对于源文件夹 */
 	char fullpath[PATH_LEN];	/**< 图片文件的完整路径 */
 	wchar_t *wfullpath;		/**< 图片文件路径（宽字符版） */
+	LCUI_BOOL prefetched;		/**< 是否已预先载入缩略图数据 */
+	LCUI_BOOL validating;		/**< 是否只是校验已显示的缩略图 */
+	uint_t modify_time;		/**< 已显示的缩略图对应的文件修改时间 */
+	ThumbData thumb;		/**< 预先载入的缩略图数据 */
 	void *data;			/**< 传给回调函数的附加参数 */
 	ThumbLoaderCallback callback;	/**< 回调函数 */
 } ThumbLoaderRec;
@@ -127,13 +133,15 @@ typedef struct ThumbWorkerRec_ {
 	LCUI_BOOL active;
 	ThumbLoader loader;
 	LinkedList tasks;			/**< 缩略图加载任务队列 */
+	LinkedList validations;			/**< 待校验的缩略图，在任务队列清空后才处理 */
+	Dict *prefetched;			/**< 预先载入的缩略图数据，以文件路径索引 */
 	int timer;
 } ThumbWorkerRec, *ThumbWorker;
 
 typedef struct ThumbViewRec_ {
 	int timer;
 	int storage;				/**< 文件存储服务的连接标识符 */
-	Dict **dbs;				/**< 缩略图数据库字典，以目录路径进行索引 */
+	ThumbDB *db;				/**< 缩略图数据库 */
 	ThumbCache cache;			/**< 缩略图缓存 */
 	ThumbLinker linker;			/**< 缩略图链接器 */
 	ThumbWorkerRec worker;
@@ -398,9 +406,18 @@ static void OnRemoveThumb(void *data)
 	}
 }
 
+static void ThumbData_Destroy(ThumbData data)
+{
+	Graph_Free(&data->graph);
+	free(data);
+}
+
 static void ThumbLoader_Destroy(ThumbLoader loader)
 {
 	loader->active = FALSE;
+	if (loader->thumb) {
+		ThumbData_Destroy(loader->thumb);
+	}
 	if (loader->wfullpath) {
 		free(loader->wfullpath);
 	}
@@ -426,7 +443,8 @@ static void ThumbLoader_OnError(ThumbLoader loader)
 	}
 	item = Widget_GetData(loader->target, self.item);
 	item->loader = NULL;
-	if (!item->is_valid || item->is_dir) {
+	/* 校验失败时保留已显示的缩略图 */
+	if (!item->is_valid || item->is_dir || loader->validating) {
 		goto exit;
 	}
 	item->is_valid = FALSE;
@@ -465,6 +483,9 @@ static void ThumbLoader_OnDone(ThumbLoader loader, ThumbData data,
 		}
 	}
 	item->loader = NULL;
+	if (loader->validating) {
+		ThumbCache_Delete(loader->view->cache, item->path);
+	}
 	ThumbCache_Add(loader->view->cache, item->path, &data->graph);
 	thumb = ThumbLinker_Link(loader->view->linker, item->path,
 				 loader->target);
@@ -481,6 +502,19 @@ static void ThumbLoader_OnDone(ThumbLoader loader, ThumbData data,
 	ThumbLoader_OnError(loader);
 }
 
+/** 获取缩略图在屏幕上的尺寸，为 0 的一边不限制 */
+static void GetThumbSize(ThumbViewItem item, unsigned *width,
+			 unsigned *height)
+{
+	if (item->is_dir) {
+		*width = FOLDER_MAX_WIDTH * finder.config.scaling / 100;
+		*height = 0;
+	} else {
+		*width = 0;
+		*height = THUMB_MAX_WIDTH * finder.config.scaling / 100;
+	}
+}
+
 static void OnGetThumbnail(FileStatus *status, LCUI_Graph *thumb, void *data)
 {
 	ThumbDataRec tdata;
@@ -493,6 +527,11 @@ static void OnGetThumbnail(FileStatus *status, LCUI_Graph *thumb, void *data)
 	}
 	LCUIMutex_Unlock(&loader->mutex);
 	if (!status || !status->image || !thumb) {
+		/* 文件无法解码，在它被修改前不再尝试 */
+		if (status && !thumb) {
+			ThumbDB_SaveFailure(loader->db, loader->dir_id,
+					    loader->path, (uint_t)status->mtime);
+		}
 		ThumbLoader_OnError(loader);
 		return;
 	}
@@ -500,7 +539,7 @@ static void OnGetThumbnail(FileStatus *status, LCUI_Graph *thumb, void *data)
 	tdata.origin_height = status->image->height;
 	tdata.modify_time = (uint_t)status->mtime;
 	tdata.graph = *thumb;
-	ThumbDB_Save(loader->db, loader->path, &tdata);
+	ThumbDB_Save(loader->db, loader->dir_id, loader->path, &tdata);
 	ThumbLoader_OnDone(loader, &tdata, status);
 	/** 重置数据，避免被释放 */
 	Graph_Init(thumb);
@@ -509,6 +548,7 @@ static void OnGetThumbnail(FileStatus *status, LCUI_Graph *thumb, void *data)
 static void ThumbLoader_Load(ThumbLoader loader, FileStatus *status)
 {
 	int ret;
+	unsigned width, height;
 	ThumbDataRec tdata;
 	ThumbViewItem item;
 	LCUIMutex_Lock(&loader->mutex);
@@ -519,8 +559,27 @@ static void ThumbLoader_Load(ThumbLoader loader, FileStatus *status)
 		DEBUG_MSG("end\n");
 		return;
 	}
-	ret = ThumbDB_Load(loader->db, loader->path, &tdata);
 	item = Widget_GetData(loader->target, self.item);
+	/* 文件未被修改，已显示的缩略图仍然有效 */
+	if (loader->validating && status &&
+	    (uint_t)status->mtime == loader->modify_time) {
+		item->loader = NULL;
+		LCUIMutex_Unlock(&loader->mutex);
+		ThumbLoader_Callback(loader);
+		return;
+	}
+	if (!loader->prefetched) {
+		GetThumbSize(item, &width, &height);
+		ret = ThumbDB_Load(loader->db, loader->dir_id, loader->path,
+				   width, height, &tdata);
+	} else if (loader->thumb) {
+		tdata = *loader->thumb;
+		free(loader->thumb);
+		loader->thumb = NULL;
+		ret = Graph_IsValid(&tdata.graph) ? 0 : THUMB_DB_FAILURE;
+	} else {
+		ret = -1;
+	}
 	LCUIMutex_Unlock(&loader->mutex);
 	DEBUG_MSG("load path: %s, ret: %d, is_dir: %d\n",
 		   loader->path, ret, item->is_dir);
@@ -529,15 +588,23 @@ static void ThumbLoader_Load(ThumbLoader loader, FileStatus *status)
 			ThumbLoader_OnDone(loader, &tdata, status);
 			return;
 		}
+		Graph_Free(&tdata.graph);
+	} else if (ret == THUMB_DB_FAILURE && status &&
+		   tdata.modify_time == status->mtime) {
+		ThumbLoader_OnError(loader);
+		return;
 	}
+	/* 按最大的缩放比例生成，一次解码即可得到所有级别的缩略图 */
 	if (item->is_dir) {
 		FileStorage_GetThumbnail(loader->view->storage,
-					 loader->wfullpath, FOLDER_MAX_WIDTH, 0,
+					 loader->wfullpath,
+					 FOLDER_MAX_WIDTH * THUMB_MAX_SCALE, 0,
 					 OnGetThumbnail, loader);
 		return;
 	}
 	FileStorage_GetThumbnail(loader->view->storage, loader->wfullpath, 0,
-				 THUMB_MAX_WIDTH, OnGetThumbnail, loader);
+				 THUMB_MAX_WIDTH * THUMB_MAX_SCALE,
+				 OnGetThumbnail, loader);
 }
 
 static void OnGetFileStatus(FileStatus *status, void *data)
@@ -561,6 +628,9 @@ static ThumbLoader ThumbLoader_Create(ThumbView view, LCUI_Widget target)
 	loader = NEW(ThumbLoaderRec, 1);
 	loader->view = view;
 	loader->data = NULL;
+	loader->thumb = NULL;
+	loader->prefetched = FALSE;
+	loader->validating = FALSE;
 	loader->active = TRUE;
 	loader->target = target;
 	loader->callback = NULL;
@@ -577,10 +647,21 @@ static void ThumbLoader_SetCallback(ThumbLoader loader,
 	loader->data = data;
 }
 
+/** 获取缩略图在数据库中的键，即相对于源文件夹的路径 */
+static void GetThumbKey(ThumbViewItem item, DB_Dir dir, char *key)
+{
+	const char *path = LCFinder_GetRelativePath(dir, item->path);
+
+	if (item->is_dir) {
+		pathjoin(key, path, DIR_COVER_THUMB);
+	} else {
+		pathjoin(key, path, "");
+	}
+}
+
 /** 载入缩略图 */
 static void ThumbLoader_Start(ThumbLoader loader)
 {
-	size_t len;
 	DB_Dir dir;
 	ThumbViewItem item;
 	ThumbView view = loader->view;
@@ -590,30 +671,20 @@ static void ThumbLoader_Start(ThumbLoader loader)
 		ThumbLoader_OnError(loader);
 		return;
 	}
-	loader->db = Dict_FetchValue(*view->dbs, dir->path);
+	LCFinder_YieldThumbPregen();
+	loader->db = *view->db;
+	loader->dir_id = dir->id;
 	if (!loader->db) {
 		ThumbLoader_OnError(loader);
 		return;
 	}
-	len = strlen(dir->path);
-	if (item->is_dir) {
-		pathjoin(loader->fullpath, item->path, "");
-		if (GetDirThumbFilePath(loader->fullpath, loader->fullpath) ==
-		    0) {
-			ThumbLoader_OnError(loader);
-			return;
-		}
-		if (item->path[len] == PATH_SEP) {
-			len += 1;
-		}
-		pathjoin(loader->path, item->path + len, DIR_COVER_THUMB);
-	} else {
-		pathjoin(loader->fullpath, item->path, "");
-		if (item->path[len] == PATH_SEP) {
-			len += 1;
-		}
-		pathjoin(loader->path, item->path + len, "");
+	pathjoin(loader->fullpath, item->path, "");
+	if (item->is_dir &&
+	    GetDirThumbFilePath(loader->fullpath, loader->fullpath) == 0) {
+		ThumbLoader_OnError(loader);
+		return;
 	}
+	GetThumbKey(item, dir, loader->path);
 	loader->wfullpath = DecodeUTF8(loader->fullpath);
 	FileStorage_GetStatus(loader->view->storage, loader->wfullpath, FALSE,
 			      OnGetFileStatus, loader);
@@ -629,23 +700,31 @@ static void ThumbLoader_Stop(ThumbLoader loader)
 
 static void ThumbWorker_Run(void *arg);
 
-static LCUI_BOOL ThumbWorker_RemoveTask(ThumbWorker worker, LCUI_Widget target)
+static LCUI_BOOL RemoveWidgetFromList(LinkedList *list, LCUI_Widget target)
 {
 	LinkedListNode *node;
 
-	if (worker->tasks.length < 1) {
+	if (list->length < 1) {
 		return FALSE;
 	}
-	for (LinkedList_Each(node, &worker->tasks)) {
+	for (LinkedList_Each(node, list)) {
 		if (node->data != target) {
 			continue;
 		}
-		LinkedList_DeleteNode(&worker->tasks, node);
+		LinkedList_DeleteNode(list, node);
 		return TRUE;
 	}
 	return FALSE;
 }
 
+static LCUI_BOOL ThumbWorker_RemoveTask(ThumbWorker worker, LCUI_Widget target)
+{
+	LCUI_BOOL removed;
+
+	removed = RemoveWidgetFromList(&worker->tasks, target);
+	return RemoveWidgetFromList(&worker->validations, target) || removed;
+}
+
 static void ThumbWorker_OnThumbLoadDone(ThumbLoader loader)
 {
 	ThumbWorker worker = loader->data;
@@ -656,11 +735,180 @@ static void ThumbWorker_OnThumbLoadDone(ThumbLoader loader)
 	ThumbWorker_Run(worker);
 }
 
+static void ThumbWorker_ClearPrefetched(ThumbWorker worker)
+{
+	DictEntry *entry;
+	DictIterator *iter;
+
+	if (Dict_Size(worker->prefetched) < 1) {
+		return;
+	}
+	iter = Dict_GetIterator(worker->prefetched);
+	while ((entry = Dict_Next(iter))) {
+		if (DictEntry_GetVal(entry)) {
+			ThumbData_Destroy(DictEntry_GetVal(entry));
+		}
+	}
+	Dict_ReleaseIterator(iter);
+	Dict_Release(worker->prefetched);
+	worker->prefetched = StrDict_Create(NULL, NULL);
+}
+
+/**
+ * 载入一组缩略图，把结果记录到预载入表中，未找到的也记录下来
+ * 有失败记录的文件对应的是不含图像的缩略图数据，加载器据此跳过解码
+ */
+static void ThumbWorker_LoadMany(ThumbWorker worker, ThumbDB db, int dir_id,
+				 size_t count, ThumbViewItem *items,
+				 const char **keys)
+{
+	size_t i;
+	unsigned width, height;
+	ThumbData thumb;
+	ThumbDataRec data[THUMB_TASK_MAX];
+
+	GetThumbSize(items[0], &width, &height);
+	ThumbDB_LoadMany(db, dir_id, width, height, count, keys, data);
+	for (i = 0; i < count; ++i) {
+		thumb = NULL;
+		if (Graph_IsValid(&data[i].graph) || data[i].modify_time > 0) {
+			thumb = malloc(sizeof(ThumbDataRec));
+			if (!thumb) {
+				Graph_Free(&data[i].graph);
+				continue;
+			}
+			*thumb = data[i];
+		}
+		Dict_Add(worker->prefetched, items[i]->path, thumb);
+	}
+}
+
+/**
+ * 预载入任务队列中的缩略图
+ * 同一个源文件夹下的同类缩略图一起批量载入，一屏的缩略图只需一次批量读取，
+ * 不必为每个缩略图单独锁定数据库
+ */
+static void ThumbWorker_Prefetch(ThumbWorker worker)
+{
+	size_t count = 0;
+	int dir_id = 0;
+	DB_Dir dir;
+	ThumbDB db = NULL;
+	ThumbViewItem item;
+	LinkedListNode *node;
+	ThumbViewItem items[THUMB_TASK_MAX];
+	const char *keys[THUMB_TASK_MAX];
+	char *buffer;
+
+	buffer = malloc(THUMB_TASK_MAX * PATH_LEN);
+	if (!buffer) {
+		return;
+	}
+	for (LinkedList_Each(node, &worker->tasks)) {
+		item = Widget_GetData(node->data, self.item);
+		if (Dict_Find(worker->prefetched, item->path)) {
+			continue;
+		}
+		if (item->view->cache &&
+		    ThumbCache_Get(item->view->cache, item->path)) {
+			continue;
+		}
+		dir = LCFinder_GetSourceDir(item->path);
+		if (!dir) {
+			continue;
+		}
+		db = *item->view->db;
+		if (!db) {
+			continue;
+		}
+		if ((count > 0 && (dir->id != dir_id ||
+				   item->is_dir != items[0]->is_dir)) ||
+		    count >= THUMB_TASK_MAX) {
+			ThumbWorker_LoadMany(worker, db, dir_id, count,
+					     items, keys);
+			count = 0;
+		}
+		dir_id = dir->id;
+		items[count] = item;
+		keys[count] = buffer + count * PATH_LEN;
+		GetThumbKey(item, dir, buffer + count * PATH_LEN);
+		++count;
+	}
+	if (count > 0) {
+		ThumbWorker_LoadMany(worker, db, dir_id, count, items, keys);
+	}
+	free(buffer);
+}
+
+/**
+ * 直接显示预先载入的缩略图
+ * 如果缩略图的修改时间与内存中的文件信息一致，则无需等待获取文件状态，
+ * 先显示它，之后再在空闲时校验
+ */
+static LCUI_BOOL ThumbWorker_ShowPrefetched(ThumbWorker worker,
+					    LCUI_Widget target)
+{
+	DictEntry *entry;
+	ThumbData data;
+	LCUI_Graph *thumb;
+	ThumbViewItem item = Widget_GetData(target, self.item);
+
+	if (item->is_dir || !item->file || !item->view->cache) {
+		return FALSE;
+	}
+	entry = Dict_Find(worker->prefetched, item->path);
+	if (!entry) {
+		return FALSE;
+	}
+	data = DictEntry_GetVal(entry);
+	if (!data || !Graph_IsValid(&data->graph) ||
+	    data->modify_time != item->file->modify_time) {
+		return FALSE;
+	}
+	if (!ThumbCache_Add(item->view->cache, item->path, &data->graph)) {
+		return FALSE;
+	}
+	/* 像素数据已交给缓存，只需释放外壳 */
+	free(data);
+	Dict_Delete(worker->prefetched, item->path);
+	thumb = ThumbLinker_Link(item->view->linker, item->path, target);
+	if (thumb && item->setthumb) {
+		item->setthumb(target, thumb);
+	}
+	LinkedList_Append(&worker->validations, target);
+	return TRUE;
+}
+
+/** 校验一个已显示的缩略图，文件有变动时重新生成 */
+static LCUI_BOOL ThumbWorker_ProcessValidation(ThumbWorker worker)
+{
+	LCUI_Widget target;
+	ThumbLoader loader;
+	ThumbViewItem item;
+
+	target = LinkedList_Get(&worker->validations, 0);
+	LinkedList_Delete(&worker->validations, 0);
+	item = Widget_GetData(target, self.item);
+	loader = ThumbLoader_Create(item->view, target);
+	if (!loader) {
+		return FALSE;
+	}
+	loader->prefetched = TRUE;
+	loader->validating = TRUE;
+	loader->modify_time = item->file->modify_time;
+	worker->loader = loader;
+	worker->active = TRUE;
+	ThumbLoader_SetCallback(loader, ThumbWorker_OnThumbLoadDone, worker);
+	ThumbLoader_Start(loader);
+	return TRUE;
+}
+
 static LCUI_BOOL ThumbWorker_ProcessTask(ThumbWorker worker)
 {
 	LCUI_Graph *thumb;
 	LCUI_Widget target;
 
+	DictEntry *entry;
 	ThumbLoader loader;
 	ThumbViewItem item;
 	LinkedListNode *node;
@@ -680,10 +928,20 @@ static LCUI_BOOL ThumbWorker_ProcessTask(ThumbWorker worker)
 		}
 		return FALSE;
 	}
+	if (ThumbWorker_ShowPrefetched(worker, target)) {
+		return FALSE;
+	}
 	loader = ThumbLoader_Create(item->view, target);
 	if (!loader) {
 		return FALSE;
 	}
+	entry = Dict_Find(worker->prefetched, item->path);
+	if (entry) {
+		loader->prefetched = TRUE;
+		loader->thumb = DictEntry_GetVal(entry);
+		/* 缩略图数据已交给加载器，由它负责释放 */
+		Dict_Delete(worker->prefetched, item->path);
+	}
 	worker->loader = loader;
 	worker->active = TRUE;
 	ThumbLoader_SetCallback(loader, ThumbWorker_OnThumbLoadDone, worker);
@@ -697,7 +955,14 @@ static void ThumbWorker_Run(void *arg)
 	if (worker->active) {
 		return;
 	}
+	ThumbWorker_Prefetch(worker);
 	while (worker->tasks.length > 0 && !ThumbWorker_ProcessTask(worker));
+	if (worker->tasks.length < 1) {
+		ThumbWorker_ClearPrefetched(worker);
+	}
+	/* 校验的优先级最低，只在没有加载任务时进行 */
+	while (!worker->active && worker->validations.length > 0 &&
+	       !ThumbWorker_ProcessValidation(worker));
 }
 
 static void ThumbWorker_Activate(ThumbWorker worker)
@@ -720,6 +985,15 @@ static void ThumbWorker_Reset(ThumbWorker worker)
 	}
 	worker->timer = 0;
 	LinkedList_Clear(&worker->tasks, NULL);
+	LinkedList_Clear(&worker->validations, NULL);
+	ThumbWorker_ClearPrefetched(worker);
+}
+
+static void ThumbWorker_Destroy(ThumbWorker worker)
+{
+	ThumbWorker_Reset(worker);
+	Dict_Release(worker->prefetched);
+	worker->prefetched = NULL;
 }
 
 static void ThumbWorker_Init(ThumbWorker worker)
@@ -727,7 +1001,9 @@ static void ThumbWorker_Init(ThumbWorker worker)
 	worker->timer = 0;
 	worker->loader = NULL;
 	worker->active = FALSE;
+	worker->prefetched = StrDict_Create(NULL, NULL);
 	LinkedList_Init(&worker->tasks);
+	LinkedList_Init(&worker->validations);
 }
 
 static void ThumbWorker_AddTask(ThumbWorker worker, LCUI_Widget target)
@@ -1218,6 +1494,41 @@ void ThumbView_SetStorage(LCUI_Widget w, int storage)
 	view->storage = storage;
 }
 
+int ThumbView_PackFolder(LCUI_Widget w, DB_File *files, size_t count,
+			 const LCUI_BOOL *running)
+{
+	int ret;
+	size_t i;
+	DB_Dir dir;
+	ThumbDB db;
+	ThumbViewItemRec item = { 0 };
+	unsigned width, height;
+	const char **paths;
+	ThumbView view = Widget_GetData(w, self.main);
+
+	if (count < THUMB_PACK_MIN_FILES || !view->db || !*view->db) {
+		return 0;
+	}
+	db = *view->db;
+	dir = LCFinder_GetSourceDir(files[0]->path);
+	if (!dir) {
+		return -1;
+	}
+	paths = malloc(sizeof(char*) * count);
+	if (!paths) {
+		return -1;
+	}
+	/* 键是相对于源文件夹的路径，与 GetThumbKey() 的结果一致 */
+	for (i = 0; i < count; ++i) {
+		paths[i] = LCFinder_GetRelativePath(dir, files[i]->path);
+	}
+	GetThumbSize(&item, &width, &height);
+	ret = ThumbDB_PackFolder(db, dir->id, count, paths, width, height,
+				 running);
+	free(paths);
+	return ret;
+}
+
 static void ThumbView_AutoLoadThumb(void *arg)
 {
 	LCUI_Widget parent, w = arg;
@@ -1358,14 +1669,14 @@ static void ThumbView_FreeWorker(LCUI_Widget w)
 {
 	ThumbView view = Widget_GetData(w, self.main);
 
-	ThumbWorker_Reset(&view->worker);
+	ThumbWorker_Destroy(&view->worker);
 }
 
 static void ThumbView_OnInit(LCUI_Widget w)
 {
 	const size_t data_size = sizeof(ThumbViewRec);
 	ThumbView view = Widget_AddData(w, self.main, data_size);
-	view->dbs = &finder.thumb_dbs;
+	view->db = &finder.thumb_db;
 	view->is_loading = FALSE;
 	view->is_running = TRUE;
 	view->cache = NULL;
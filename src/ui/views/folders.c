@@ -219,6 +219,8 @@ static size_t FileScanner_ScanFiles(FileScanner scanner)
 	DB_Query query;
 	FileEntry entry;
 	size_t i, count;
+	size_t max_files = 0;
+	DB_File *files = NULL, *new_files;
 
 	view.terms.limit = 512;
 	view.terms.offset = 0;
@@ -240,6 +242,20 @@ static size_t FileScanner_ScanFiles(FileScanner scanner)
 			entry->path = file->path;
 			DEBUG_MSG("file: %s\n", file->path);
 			FileStage_AddFile(scanner->stage, entry);
+			if (count >= max_files) {
+				max_files = max(max_files * 2, 512);
+				new_files = realloc(files, max_files *
+						    sizeof(DB_File));
+				if (!new_files) {
+					/* 内存不足时放弃打包 */
+					free(files);
+					max_files = (size_t)-1;
+				}
+				files = new_files;
+			}
+			if (files) {
+				files[count] = file;
+			}
 		}
 		view.terms.offset += view.terms.limit;
 		FileStage_Commit(scanner->stage);
@@ -250,6 +266,12 @@ static size_t FileScanner_ScanFiles(FileScanner scanner)
 	}
 	FileStage_Commit(scanner->stage);
 	free(view.terms.dirpath);
+	/* 文件列表已按显示顺序排列，趁此时打包缩略图，下次浏览时可顺序读取 */
+	if (files && scanner->is_running) {
+		ThumbView_PackFolder(view.items, files, count,
+				     &scanner->is_running);
+	}
+	free(files);
 	return count;
 }
 
@@ -283,6 +305,7 @@ static void OnItemClick(LCUI_Widget w, LCUI_WidgetEvent e, void *arg)
 
 static void FoldersView_AppendFile(FileEntry entry)
 {
+	DB_Dir dir;
 	LCUI_Widget item, separator;
 
 	if (view.prev_item_type != -1 &&
@@ -298,6 +321,11 @@ static void FoldersView_AppendFile(FileEntry entry)
 						entry->path,
 						view.dir == NULL);
 		Widget_BindEvent(item, "click", OnItemClick, entry, NULL);
+		/* 离线的源文件夹仍可浏览保留下来的文件，只是显示得暗一些 */
+		dir = view.dir ? NULL : LCFinder_GetDir(entry->path);
+		if (dir && LCFinder_IsDirOffline(dir)) {
+			Widget_AddClass(item, "offline");
+		}
 	} else {
 		FileBrowser_AppendPicture(&view.browser,
 					  entry->file);
@@ -57,6 +57,7 @@
 #include "dialog.h"
 #include "i18n.h"
 #include "picture.h"
+#include "resample.h"
 
 #define MAX_SCALE	5.0
 #define SCALE_STEP	0.333
@@ -99,6 +100,8 @@ typedef struct PcitureRec_ {
 	LCUI_BOOL is_loading;		/**< 是否正在载入图片 */
 	LCUI_BOOL is_valid;		/**< 图片内容是否有效 */
 	LCUI_Graph *data;		/**< 当前已经加载的图片数据 */
+	LCUI_Graph *fit;		/**< 缩小到适应查看器尺寸的图片数据 */
+	LCUI_Graph *shown;		/**< 当前用作部件背景的图片数据 */
 	LCUI_Widget view;		/**< 视图，用于呈现该图片 */
 	LCUI_Mutex mutex;		/**< 互斥锁，用于异步加载 */
 	LCUI_Cond cond;			/**< 条件变量，用于异步加载 */
@@ -294,18 +297,36 @@ static void UpdateResetSizeButton(void)
 	}
 }
 
+/** 获取当前应呈现的图片数据，以适应查看器的比例显示时用预先缩小的图片 */
+static LCUI_Graph *GetPictureImage(Picture pic)
+{
+	if (pic->fit && pic->scale == pic->min_scale &&
+	    pic->fit->width == iround(pic->data->width * pic->scale) &&
+	    pic->fit->height == iround(pic->data->height * pic->scale)) {
+		return pic->fit;
+	}
+	return pic->data;
+}
+
 static void SetPictureView(Picture pic)
 {
+	pic->shown = GetPictureImage(pic);
 	LCUI_PostSimpleTask(TaskForSetWidgetBackground,
-			    pic->view, pic->data);
+			    pic->view, pic->shown);
 }
 
 static void ClearPictureView(Picture pic)
 {
 	LCUI_PostSimpleTask(TaskForResetWidgetBackground,
 			    pic->view, pic->data);
+	if (pic->fit) {
+		LCUI_PostSimpleTask(TaskForResetWidgetBackground,
+				    pic->view, pic->fit);
+	}
 	pic->is_valid = FALSE;
 	pic->data = NULL;
+	pic->fit = NULL;
+	pic->shown = NULL;
 }
 
 static int OpenPrevPicture(void)
@@ -575,6 +596,9 @@ static void DirectSetPictureScale(Picture pic, double scale)
 	if (!pic->data) {
 		return;
 	}
+	if (pic->shown && GetPictureImage(pic) != pic->shown) {
+		SetPictureView(pic);
+	}
 	sheet = pic->view->custom_style;
 	width = (float)(scale * pic->data->width);
 	height = (float)(scale * pic->data->height);
@@ -610,30 +634,64 @@ static void SetPictureZoomOut(Picture pic)
 	SetPictureScale(pic, pic->scale * (1.0 - SCALE_STEP));
 }
 
-/** 重置当前显示的图片的尺寸 */
-static void ResetPictureSize(Picture pic)
+/** 获取图片适应查看器尺寸时的缩放比例 */
+static double GetPictureFitScale(Picture pic)
 {
 	size_t width, height;
-	double scale_x, scale_y;
-	if (!pic->data || !Graph_IsValid(pic->data)) {
-		return;
-	}
+	double scale, scale_x, scale_y;
+
 	GetViewerSize(&width, &height);
 	/* 如果尺寸小于图片查看器尺寸 */
 	if (pic->data->width < width && pic->data->height < height) {
-		pic->scale = 1.0;
+		return 1.0;
+	}
+	scale_x = 1.0 * width / pic->data->width;
+	scale_y = 1.0 * height / pic->data->height;
+	if (scale_y < scale_x) {
+		scale = scale_y;
 	} else {
-		scale_x = 1.0 * width / pic->data->width;
-		scale_y = 1.0 * height / pic->data->height;
-		if (scale_y < scale_x) {
-			pic->scale = scale_y;
-		} else {
-			pic->scale = scale_x;
-		}
-		if (pic->scale < 0.05) {
-			pic->scale = 0.05;
-		}
+		scale = scale_x;
 	}
+	if (scale < 0.05) {
+		scale = 0.05;
+	}
+	return scale;
+}
+
+/**
+ * 预先将图片缩小到适应查看器的尺寸
+ * 由部件在绘制时缩小大图的话会有明显的锯齿，按面积取平均值缩小则不会
+ */
+static void CreatePictureFitImage(Picture pic)
+{
+	double scale;
+	LCUI_Graph *fit;
+
+	if (pic->fit || !pic->data || !Graph_IsValid(pic->data)) {
+		return;
+	}
+	scale = GetPictureFitScale(pic);
+	if (scale >= 1.0) {
+		return;
+	}
+	fit = malloc(sizeof(LCUI_Graph));
+	Graph_Init(fit);
+	if (Resample_Zoom(pic->data, fit, RESAMPLE_FILTER_BOX, FALSE,
+			  iround(pic->data->width * scale),
+			  iround(pic->data->height * scale)) != 0) {
+		free(fit);
+		return;
+	}
+	pic->fit = fit;
+}
+
+/** 重置当前显示的图片的尺寸 */
+static void ResetPictureSize(Picture pic)
+{
+	if (!pic->data || !Graph_IsValid(pic->data)) {
+		return;
+	}
+	pic->scale = GetPictureFitScale(pic);
 	pic->min_scale = pic->scale;
 	ResetOffsetPosition();
 	DirectSetPictureScale(pic, pic->scale);
@@ -976,6 +1034,8 @@ static Picture CreatePicture(void)
 	pic->is_loading = FALSE;
 	pic->file_for_load = NULL;
 	pic->data = malloc(sizeof(LCUI_Graph));
+	pic->fit = NULL;
+	pic->shown = NULL;
 	pic->view = LCUIWidget_New("picture");
 	pic->min_scale = pic->scale = 1.0;
 
@@ -1001,6 +1061,11 @@ static void DeletePicture(Picture pic)
 		free(pic->data);
 		pic->data = NULL;
 	}
+	if (pic->fit) {
+		Graph_Free(pic->fit);
+		free(pic->fit);
+		pic->fit = NULL;
+	}
 	if (pic->file_for_load) {
 		free(pic->file_for_load);
 		pic->file_for_load = NULL;
@@ -1145,6 +1210,7 @@ static void WaitPictureLoadDone(Picture pic)
 	}
 	/* 如果在加载完后没有待加载的图片，则直接呈现到部件上 */
 	if (pic->is_valid && !pic->file_for_load) {
+		CreatePictureFitImage(pic);
 		SetPictureView(pic);
 		ResetPictureSize(pic);
 	}
@@ -53,7 +53,9 @@
 
 #define KEY_CLEANING 			"button.cleaning"
 #define KEY_CLEAR			"button.clear" 
+#define KEY_THUMB_DB_UNLIMITED		"settings.thumb_cache.unlimited"
 #define KEY_DIALOG_TITLE_DEL_DIR	"settings.source_folders.removing_dialog.title"
+#define KEY_DIR_OFFLINE			"settings.source_folders.offline"
 #define KEY_DIALOG_TEXT_DEL_DIR		"settings.source_folders.removing_dialog.content"
 #define KEY_VERIFY_PASSWORD_TITLE	"settings.private_space.verify_dialog.title"
 #define KEY_VERIFY_PASSWORD_TEXT	"settings.private_space.verify_dialog.text"
@@ -69,6 +71,7 @@
 static struct SettingsViewData {
 	LCUI_Widget source_dirs;
 	LCUI_Widget thumb_db_stats;
+	LCUI_Widget btn_clear_thumb_db;
 	LCUI_Widget language;
 	Dict *dirpaths;
 } view;
@@ -94,26 +97,66 @@ static void OnBtnRemoveClick(LCUI_Widget w, LCUI_WidgetEvent e, void *arg)
 	LCFinder_DeleteDir(dir);
 }
 
+/** 离线的源文件夹会附带一行说明，它的文件仍被保留着 */
+static void UpdateDirListItem(LCUI_Widget item, DB_Dir dir)
+{
+	if (LCFinder_IsDirOffline(dir)) {
+		Widget_AddClass(item, "offline");
+	} else {
+		Widget_RemoveClass(item, "offline");
+	}
+}
+
 static LCUI_Widget NewDirListItem(DB_Dir dir)
 {
-	LCUI_Widget item, icon, text, btn;
+	LCUI_Widget item, icon, text, status, btn;
 
 	item = LCUIWidget_New(NULL);
 	icon = LCUIWidget_New("textview");
 	text = LCUIWidget_New("textview");
+	status = LCUIWidget_New("textview-i18n");
 	btn = LCUIWidget_New("textview");
 	Widget_AddClass(item, "source-list-item");
 	Widget_AddClass(icon, "icon icon-folder-outline");
 	Widget_AddClass(text, "text");
+	Widget_AddClass(status, "status");
 	Widget_AddClass(btn, "button icon icon-close");
 	TextView_SetText(text, dir->path);
+	TextViewI18n_SetKey(status, KEY_DIR_OFFLINE);
 	Widget_BindEvent(btn, "click", OnBtnRemoveClick, dir, NULL);
 	Widget_Append(item, icon);
 	Widget_Append(item, text);
+	Widget_Append(item, status);
 	Widget_Append(item, btn);
+	UpdateDirListItem(item, dir);
 	return item;
 }
 
+static void OnSyncDone(void *privdata, void *arg)
+{
+	size_t i;
+	Dict *dirpaths;
+	LCUI_Widget item;
+
+	for (i = 0; i < finder.n_dirs; ++i) {
+		if (!finder.dirs[i]) {
+			continue;
+		}
+		if (finder.dirs[i]->visible) {
+			dirpaths = view.dirpaths;
+		} else {
+			dirpaths = private_space_view.dirpaths;
+		}
+		if (!dirpaths) {
+			continue;
+		}
+		item = Dict_FetchValue(dirpaths, finder.dirs[i]->path);
+		if (item) {
+			UpdateDirListItem(item, finder.dirs[i]);
+		}
+	}
+}
+
 static void OnDelDir(void *privdata, void *arg)
 {
 	Dict *dirpaths;
@@ -241,37 +284,93 @@ static void OnBtnSettingsClick(LCUI_Widget w, LCUI_WidgetEvent e, void *arg)
 	TextViewI18n_Refresh(view.thumb_db_stats);
 }
 
-static void OnThumbDBDelDone(void *data, void *arg)
-{
-	TextViewI18n_Refresh(view.thumb_db_stats);
-}
-
-/** 在“清除”按钮被点击时 */
-static void OnBtnClearThumbDBClick(LCUI_Widget w, LCUI_WidgetEvent e, void *arg)
+/** 设置“清除”按钮的文本 */
+static void SetClearThumbDBButtonText(LCUI_Widget w, const char *key)
 {
 	LinkedListNode *node;
-	LCUI_Widget text = NULL;
 
-	if (w->disabled) {
-		return;
-	}
 	for (LinkedList_Each(node, &w->children)) {
 		LCUI_Widget child = node->data;
 		if (Widget_HasClass(child, "text")) {
-			text = child;
+			TextView_SetTextW(child, I18n_GetText(key));
 			break;
 		}
 	}
-	if (!text) {
+}
+
+/** 在后台清除缩略图数据库完成后 */
+static void OnThumbDBDelDone(void *data, void *arg)
+{
+	LCUI_Widget w = view.btn_clear_thumb_db;
+
+	TextViewI18n_Refresh(view.thumb_db_stats);
+	Widget_SetDisabled(w, FALSE);
+	Widget_RemoveClass(w, "disabled");
+	SetClearThumbDBButtonText(w, KEY_CLEAR);
+}
+
+/** 在“清除”按钮被点击时 */
+static void OnBtnClearThumbDBClick(LCUI_Widget w, LCUI_WidgetEvent e, void *arg)
+{
+	if (w->disabled) {
 		return;
 	}
 	Widget_SetDisabled(w, TRUE);
 	Widget_AddClass(w, "disabled");
-	TextView_SetTextW(text, I18n_GetText(KEY_CLEANING));
+	SetClearThumbDBButtonText(w, KEY_CLEANING);
 	LCFinder_ClearThumbDB();
-	Widget_SetDisabled(w, FALSE);
-	Widget_RemoveClass(w, "disabled");
-	TextView_SetTextW(text, I18n_GetText(KEY_CLEAR));
+}
+
+static void UI_RefreshThumbDBMaxSizeText(void)
+{
+	wchar_t str[32];
+	LCUI_Widget txt;
+	int64_t size = finder.config.thumb_db_max_size;
+
+	SelectWidget(txt, ID_TXT_CURRENT_THUMB_DB_MAX_SIZE);
+	if (size > 0) {
+		wgetsizestr(str, 31, size * 1024 * 1024);
+		TextView_SetTextW(txt, str);
+	} else {
+		TextView_SetTextW(txt, I18n_GetText(KEY_THUMB_DB_UNLIMITED));
+	}
+}
+
+static void OnChangeThumbDBMaxSize(LCUI_Widget w, LCUI_WidgetEvent e,
+				   void *arg)
+{
+	int size;
+	const char *value = Widget_GetAttribute(e->target, "value");
+
+	if (!value || sscanf(value, "%d", &size) < 1 || size < 0) {
+		return;
+	}
+	LCFinder_SetThumbDBMaxSize(size);
+	UI_RefreshThumbDBMaxSizeText();
+}
+
+static void UI_InitThumbDBMaxSize(void)
+{
+	LCUI_Widget menu;
+
+	SelectWidget(menu, ID_DROPDOWN_THUMB_DB_MAX_SIZE);
+	BindEvent(menu, "change.dropdown", OnChangeThumbDBMaxSize);
+	UI_RefreshThumbDBMaxSizeText();
+}
+
+static void OnThumbPregenSwitchChange(LCUI_Widget w, LCUI_WidgetEvent e,
+				      void *arg)
+{
+	LCFinder_SetThumbPregenEnabled(Switch_IsChecked(w));
+}
+
+static void UI_InitThumbPregen(void)
+{
+	LCUI_Widget switcher;
+
+	SelectWidget(switcher, ID_SWITCH_THUMB_PREGEN);
+	Switch_SetChecked(switcher, finder.config.thumb_pregen);
+	BindEvent(switcher, "change.switch", OnThumbPregenSwitchChange);
 }
 
 static void OnSelectLanguage(LCUI_Widget w, LCUI_WidgetEvent e, void *arg)
@@ -283,6 +382,7 @@ static void OnSelectLanguage(LCUI_Widget w, LCUI_WidgetEvent e, void *arg)
 		TextView_SetText(view.language, lang->name);
 		strcpy(finder.config.language, lang->code);
 		LCFinder_SaveConfig();
+		UI_RefreshThumbDBMaxSizeText();
 		LCFinder_TriggerEvent(EVENT_LANG_CHG, lang);
 	}
 }
@@ -482,15 +582,19 @@ void UI_InitSettingsView(void)
 	BindEvent(btn, "click", OnBtnSettingsClick);
 	SelectWidget(btn, ID_BTN_CLEAR_THUMB_DB);
 	BindEvent(btn, "click", OnBtnClearThumbDBClick);
+	view.btn_clear_thumb_db = btn;
 	LCFinder_BindEvent(EVENT_THUMBDB_DEL_DONE, OnThumbDBDelDone, NULL);
 	TextViewI18n_SetFormater(view.thumb_db_stats,
 				 RenderThumbDBSizeText, NULL);
 	TextViewI18n_Refresh(view.thumb_db_stats);
 	LCFinder_BindEvent(EVENT_DIR_ADD, OnAddDir, NULL);
 	LCFinder_BindEvent(EVENT_DIR_DEL, OnDelDir, NULL);
+	LCFinder_BindEvent(EVENT_SYNC_DONE, OnSyncDone, NULL);
 	LCFinder_BindEvent(EVENT_LICENSE_CHG, OnLicenseChange, NULL);
 	UI_InitPrivateSpaceView();
 	UI_InitDetector();
+	UI_InitThumbDBMaxSize();
+	UI_InitThumbPregen();
 	UI_InitScaling();
 	UI_InitLanguages();
 	UI_InitDirList();
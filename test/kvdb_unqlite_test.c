@@ -0,0 +1,110 @@
+﻿/* ***************************************************************************
+ * kvdb_unqlite_test.c -- tests for the UnQLite key-value database backend
+ *
+ * Copyright (C) 2018 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * kvdb_unqlite_test.c -- UnQLite 键值数据库后端的测试
+ *
+ * 版权所有 (C) 2018 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+
+#include "build.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvdb.h"
+
+#define TEST_DB_PATH "kvdb-test-unqlite.db"
+
+#define CHECK(X) \
+	if (!(X)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #X); \
+		return -1; \
+	}
+
+static int HasKey(kvdb_t *db, const char *key)
+{
+	void *val;
+	size_t len = 0;
+
+	val = kvdb_get(db, key, strlen(key), &len);
+	if (!val) {
+		return 0;
+	}
+	free(val);
+	return 1;
+}
+
+/**
+ * 批量写入失败时只应撤销这次批量写入，之前已经返回成功但还未提交的写入
+ * 不能被一起丢弃
+ */
+static int Test_BatchFailureKeepsPendingWrites(void)
+{
+	kvdb_t *db;
+	kvdb_batch_t *batch;
+
+	remove(TEST_DB_PATH);
+	db = kvdb_open(TEST_DB_PATH);
+	CHECK(db != NULL);
+	kvdb_set_durability(db, KVDB_DURABILITY_ASYNC);
+	CHECK(kvdb_put(db, "pending", 7, "1", 1) == 0);
+
+	batch = kvdb_batch_begin(db);
+	CHECK(batch != NULL);
+	CHECK(kvdb_batch_put(batch, "batched", 7, "2", 1) == 0);
+	/* UnQLite 不接受空的键，用它让批量写入在中途失败 */
+	CHECK(kvdb_batch_put(batch, "", 0, "3", 1) == 0);
+	CHECK(kvdb_batch_commit(batch) != 0);
+
+	CHECK(HasKey(db, "pending"));
+	CHECK(!HasKey(db, "batched"));
+	CHECK(kvdb_put(db, "after", 5, "4", 1) == 0);
+	CHECK(kvdb_sync(db) == 0);
+	kvdb_close(db);
+
+	db = kvdb_open(TEST_DB_PATH);
+	CHECK(db != NULL);
+	CHECK(HasKey(db, "pending"));
+	CHECK(HasKey(db, "after"));
+	CHECK(!HasKey(db, "batched"));
+	kvdb_close(db);
+	remove(TEST_DB_PATH);
+	return 0;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	ret |= Test_BatchFailureKeepsPendingWrites();
+	printf("%s\n", ret == 0 ? "OK" : "FAILED");
+	return ret == 0 ? 0 : 1;
+}
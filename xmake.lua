@@ -27,3 +27,36 @@ target("lc-finder")
     set_targetdir("app/")
     set_kind("binary")
     add_files("src/**.c")
+    add_links("jpeg", "png")
+
+-- kvdb benchmarks, one binary per backend because they share the kvdb.h API
+for _, backend in ipairs({"unqlite", "leveldb", "mmapdb"}) do
+    target("kvdb-bench-" .. backend)
+        set_kind("binary")
+        set_default(false)
+        set_targetdir("app/")
+        add_defines("LCFINDER_USE_" .. backend:upper())
+        add_files("bench/kvdb_bench.c", "src/lib/kvdb.c")
+        if backend == "unqlite" then
+            add_files("src/lib/kvdb_unqlite.c", "src/lib/unqlite.c")
+        elseif backend == "leveldb" then
+            add_files("src/lib/kvdb_leveldb.c")
+            add_links("leveldb")
+        else
+            add_files("src/lib/kvdb_mmap.c")
+        end
+end
+
+target("kvdb-bench")
+    set_kind("phony")
+    set_default(false)
+    add_deps("kvdb-bench-unqlite", "kvdb-bench-leveldb", "kvdb-bench-mmapdb")
+
+-- kvdb backend tests, run with: xmake build kvdb-test-unqlite && xmake run kvdb-test-unqlite
+target("kvdb-test-unqlite")
+    set_kind("binary")
+    set_default(false)
+    set_targetdir("app/")
+    add_defines("LCFINDER_USE_UNQLITE")
+    add_files("test/kvdb_unqlite_test.c", "src/lib/kvdb.c")
+    add_files("src/lib/kvdb_unqlite.c", "src/lib/unqlite.c")